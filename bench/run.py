@@ -0,0 +1,315 @@
+#!/usr/bin/env python3
+"""bench/run.py
+   Benchmark and regression harness for fluxc and fluxvm.
+   Usage: python3 bench/run.py [-n RUNS] [--only NAME,...] [--save FILE]
+                               [--baseline FILE] [--threshold PCT] [--no-native]
+
+   Builds fluxc, fluxvm and the C runtime from the repository root into
+   bench/out/, generates the large programs and inputs, then for every
+   benchmark reports the median of N runs of:
+     compile_ms   fluxc -O1 prog.flux prog.fluxb
+     load_ms      fluxvm reading the image      (fluxvm --timings)
+     link_ms      resolving calls and labels    (fluxvm --timings)
+     run_ms       executing main, jit on        (fluxvm --timings)
+     nojit_ms     executing main, interpreter   (fluxvm --no-jit --timings)
+     mips         million bytecode instructions per second (count from
+                  fluxvm --profile, divided by run_ms / nojit_ms)
+     rss_kb       peak resident set size of the fluxvm run (fluxvm --timings)
+     native_ms    the fluxc -C build, whole process
+   Results go to bench/out/results.json. They are compared against the
+   baseline (bench/baseline.json unless --baseline is given): a metric more
+   than --threshold percent worse is flagged and the exit status is 1.
+   --save FILE writes this run as a new baseline. Baselines are only
+   meaningful on the machine and compiler that produced them.
+"""
+import argparse
+import json
+import os
+import random
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+BENCH = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(BENCH)
+OUT = os.path.join(BENCH, "out")
+
+# name -> (higher is better, smallest change worth reporting)
+METRICS = {
+    "compile_ms": (False, 0.5),
+    "load_ms": (False, 0.1),
+    "link_ms": (False, 0.1),
+    "run_ms": (False, 0.5),
+    "nojit_ms": (False, 0.5),
+    "mips": (True, 1.0),
+    "rss_kb": (False, 256),
+    "native_ms": (False, 0.5),
+}
+
+TIMINGS = re.compile(r"fluxvm timings: load ([\d.]+) ms, link ([\d.]+) ms, run ([\d.]+) ms, peak rss (\d+) KB")
+
+
+def fail(msg):
+    print("Error: " + msg, file=sys.stderr)
+    sys.exit(2)
+
+
+# --- Generated programs and inputs ---
+# Fixed seeds, so every run and every machine benchmarks the same text.
+
+def gen_functions(path, count=2000):
+    """Many small functions, each called once: stresses compile, load and link."""
+    r = random.Random(18)
+    lines = []
+    for f in range(count):
+        lines.append("int f%d(int a, int b):" % f)
+        for v in range(8):
+            lines.append("int t%d = a %s %d" % (v, r.choice("+-*"), r.randint(1, 99)))
+            lines.append("int a = t%d + b" % v)
+        lines.append("bool big = a > %d" % r.randint(0, 5000))
+        lines.append("if(big):")
+        lines.append("int a = a % 7919")
+        lines.append("endif")
+        lines.append("return a")
+        lines.append("end")
+    lines.append("int main():")
+    lines.append("int acc = 0")
+    for f in range(count):
+        lines.append("int acc = f%d(acc, %d)" % (f, f))
+    lines.append('print(acc, "\\n")')
+    lines.append("return 0")
+    lines.append("end")
+    with open(path, "w") as out:
+        out.write("\n".join(lines) + "\n")
+
+
+def gen_straight(path, count=60000):
+    """One long main of straight-line code: a large image with little to run."""
+    r = random.Random(19)
+    lines = ["int body(int x):"]
+    for i in range(count):
+        lines.append("int v%d = x %s %d" % (i % 64, r.choice("+-*%"), r.randint(1, 999)))
+        lines.append("int x = v%d %% 1000003" % (i % 64))
+    lines += ["return x", "end", "int main():", "int x = body(1)", 'print(x, "\\n")', "return 0", "end"]
+    with open(path, "w") as out:
+        out.write("\n".join(lines) + "\n")
+
+
+def gen_parse_input(path, count=100000):
+    """Input for parse.flux: a count, then number/word line pairs."""
+    r = random.Random(20)
+    with open(path, "w") as out:
+        out.write("%d\n" % count)
+        for i in range(count):
+            out.write("%d\nword%d\n" % (r.randint(-1000, 1000), i))
+
+
+# name -> (source, stdin, run the native build too)
+def benchmarks():
+    gen = lambda name: os.path.join(OUT, name)
+    src = lambda name: os.path.join(BENCH, name)
+    return {
+        "arith": (src("arith.flux"), None, True),
+        "nested": (src("nested.flux"), src("nested.in"), True),
+        "fib": (src("fib.flux"), None, True),
+        "calls": (src("calls.flux"), None, True),
+        "strings": (src("strings.flux"), None, True),
+        "parse": (src("parse.flux"), gen("parse.in"), True),
+        # gcc takes minutes on the translations of these two, so no native run
+        "functions": (gen("functions.flux"), None, False),
+        "straight": (gen("straight.flux"), None, False),
+    }
+
+
+def generate():
+    gen_functions(os.path.join(OUT, "functions.flux"))
+    gen_straight(os.path.join(OUT, "straight.flux"))
+    gen_parse_input(os.path.join(OUT, "parse.in"))
+
+
+# --- Running ---
+
+def build(cc, cflags, native):
+    os.makedirs(OUT, exist_ok=True)
+    steps = [
+        [cc] + cflags + [os.path.join(ROOT, "main.c"), "-o", os.path.join(OUT, "fluxc")],
+        [cc] + cflags + [os.path.join(ROOT, "vm.c"), "-o", os.path.join(OUT, "fluxvm"), "-lm"],
+    ]
+    if native:
+        steps.append([cc] + cflags + ["-c", os.path.join(ROOT, "flux_rt.c"), "-o", os.path.join(OUT, "flux_rt.o")])
+    for cmd in steps:
+        print("  " + " ".join(cmd))
+        if subprocess.call(cmd) != 0:
+            fail("build failed: " + " ".join(cmd))
+
+
+def run(cmd, stdin=None, stdout=os.devnull):
+    """Runs cmd and returns (wall seconds, exit status, stderr text)."""
+    err_path = os.path.join(OUT, "stderr.txt")
+    with open(stdin or os.devnull, "rb") as fin, open(stdout, "wb") as fout, open(err_path, "wb") as ferr:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdin=fin, stdout=fout, stderr=ferr)
+        proc.wait()
+        wall = time.perf_counter() - start
+    with open(err_path, errors="replace") as f:
+        err = f.read()
+    return wall, proc.returncode, err
+
+
+def checked(cmd, stdin=None, stdout=os.devnull):
+    wall, rc, err = run(cmd, stdin, stdout)
+    if rc != 0:
+        fail("%s exited with %d:\n%s" % (" ".join(cmd), rc, err[-2000:]))
+    return wall, err
+
+
+def vm_timings(err, cmd):
+    m = TIMINGS.search(err)
+    if not m:
+        fail("no timings line from " + " ".join(cmd))
+    return [float(x) for x in m.groups()]
+
+
+def measure(name, source, stdin, native, runs, cc, cflags):
+    fluxc = os.path.join(OUT, "fluxc")
+    fluxvm = os.path.join(OUT, "fluxvm")
+    image = os.path.join(OUT, name + ".fluxb")
+    expected = os.path.join(OUT, name + ".out")
+    r = {}
+
+    r["compile_ms"] = statistics.median(checked([fluxc, source, image])[0] * 1e3 for _ in range(runs))
+
+    load, link, run_ms, rss = [], [], [], []
+    for i in range(runs):
+        cmd = [fluxvm, "--timings", image]
+        err = checked(cmd, stdin, expected if i == 0 else os.devnull)[1]
+        t = vm_timings(err, cmd)
+        load.append(t[0])
+        link.append(t[1])
+        run_ms.append(t[2])
+        rss.append(t[3])
+    r["load_ms"] = statistics.median(load)
+    r["link_ms"] = statistics.median(link)
+    r["run_ms"] = statistics.median(run_ms)
+    r["rss_kb"] = int(statistics.median(rss))
+
+    nojit = []
+    for _ in range(runs):
+        cmd = [fluxvm, "--no-jit", "--timings", image]
+        nojit.append(vm_timings(checked(cmd, stdin)[1], cmd)[2])
+    r["nojit_ms"] = statistics.median(nojit)
+
+    profile = os.path.join(OUT, name + ".profile.json")
+    checked([fluxvm, "--profile=" + profile, image], stdin)
+    with open(profile) as f:
+        r["instructions"] = json.load(f)["instructions"]
+    r["mips"] = r["instructions"] / (r["run_ms"] * 1e3) if r["run_ms"] > 0 else 0.0
+    r["mips_nojit"] = r["instructions"] / (r["nojit_ms"] * 1e3) if r["nojit_ms"] > 0 else 0.0
+
+    if native:
+        c_file = os.path.join(OUT, name + ".c")
+        exe = os.path.join(OUT, name + ".native")
+        actual = os.path.join(OUT, name + ".native.out")
+        checked([fluxc, "-C", source, c_file])
+        checked([cc] + cflags + ["-I", ROOT, c_file, os.path.join(OUT, "flux_rt.o"), "-o", exe, "-lm", "-lpthread"])
+        times = []
+        for i in range(runs):
+            times.append(checked([exe], stdin, actual if i == 0 else os.devnull)[0] * 1e3)
+        with open(expected, "rb") as a, open(actual, "rb") as b:
+            if a.read() != b.read():
+                fail("%s: the native build printed something else than fluxvm" % name)
+        r["native_ms"] = statistics.median(times)
+    # Rounded so that saved baselines diff cleanly
+    return {k: round(v, 3) if isinstance(v, float) else v for k, v in r.items()}
+
+
+# --- Reporting ---
+
+def report(results):
+    cols = ["compile_ms", "load_ms", "link_ms", "run_ms", "nojit_ms", "mips", "mips_nojit", "rss_kb", "native_ms"]
+    print("\n%-10s" % "benchmark" + "".join("%12s" % c for c in cols))
+    for name, r in results.items():
+        row = "%-10s" % name
+        for c in cols:
+            v = r.get(c)
+            row += "%12s" % ("-" if v is None else v if isinstance(v, int) else "%.2f" % v if v < 10 else "%.1f" % v)
+        print(row)
+
+
+def compare(results, baseline, threshold):
+    """Prints every metric that moved by more than threshold percent; returns the regression count."""
+    regressions = 0
+    lines = []
+    for name, r in results.items():
+        if name not in baseline:
+            continue
+        b = baseline[name]
+        if r.get("instructions") != b.get("instructions"):
+            lines.append("%-10s instructions %s -> %s" % (name, b.get("instructions"), r.get("instructions")))
+        for metric, (higher_better, floor) in METRICS.items():
+            if metric not in r or metric not in b or b[metric] <= 0:
+                continue
+            delta = r[metric] - b[metric]
+            pct = 100.0 * delta / b[metric]
+            if abs(pct) <= threshold or abs(delta) < floor:
+                continue
+            worse = (delta < 0) if higher_better else (delta > 0)
+            regressions += worse
+            lines.append("%-10s %-11s %10.1f -> %10.1f  %+6.1f%%  %s" %
+                         (name, metric, b[metric], r[metric], pct, "REGRESSION" if worse else "improved"))
+    print("\nagainst baseline (threshold %g%%):" % threshold)
+    print("\n".join(lines) if lines else "  no changes beyond the threshold")
+    return regressions
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Benchmark fluxc and fluxvm.")
+    ap.add_argument("-n", "--runs", type=int, default=5, help="runs per measurement (default 5)")
+    ap.add_argument("--only", help="comma-separated benchmark names")
+    ap.add_argument("--baseline", default=os.path.join(BENCH, "baseline.json"))
+    ap.add_argument("--save", metavar="FILE", help="write the results as a baseline")
+    ap.add_argument("--threshold", type=float, default=10.0, help="percent change to flag (default 10)")
+    ap.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+    ap.add_argument("--cflags", default="-O2")
+    ap.add_argument("--no-native", action="store_true", help="skip the fluxc -C builds")
+    args = ap.parse_args()
+    if args.runs < 1:
+        fail("-n must be at least 1")
+
+    print("building:")
+    build(args.cc, args.cflags.split(), not args.no_native)
+    generate()
+
+    all_benchmarks = benchmarks()
+    names = args.only.split(",") if args.only else list(all_benchmarks)
+    results = {}
+    for name in names:
+        if name not in all_benchmarks:
+            fail("no benchmark named '%s'" % name)
+        source, stdin, native = all_benchmarks[name]
+        print("running %s..." % name, flush=True)
+        results[name] = measure(name, source, stdin, native and not args.no_native,
+                                args.runs, args.cc, args.cflags.split())
+
+    report(results)
+    with open(os.path.join(OUT, "results.json"), "w") as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("\nsaved baseline to " + args.save)
+
+    if os.path.exists(args.baseline) and os.path.abspath(args.baseline) != os.path.abspath(args.save or ""):
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.threshold)
+        if regressions:
+            print("%d regression(s)" % regressions)
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,398 @@
+/* flux_rt.c
+   Runtime for flux programs translated to C by fluxc -C, see flux_rt.h.
+   Output buffering, line input and the error messages follow vm.c.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#include "flux_rt.h"
+
+#define DEFAULT_STACK_LIMIT (256L * 1024 * 1024) // same default as fluxvm
+
+FxString fx_empty = { FX_IMMORTAL, 0, "" };
+size_t fx_stack_used = 0;
+size_t fx_stack_limit = DEFAULT_STACK_LIMIT;
+
+void out_of_memory() {
+    fprintf(stderr, "VM Error: Out of memory.\n");
+    exit(1);
+}
+
+// --- Errors ---
+
+void fx_non_numeric(const char *name) {
+    fprintf(stderr, "VM Error: Undefined or non-numeric variable '%s'.\n", name);
+    exit(1);
+}
+
+void fx_division_by_zero(void) {
+    fprintf(stderr, "VM Error: Division by zero.\n");
+    exit(1);
+}
+
+void fx_stack_overflow(void) {
+    fprintf(stderr, "VM Error: Call stack overflow (stack limit of %zu bytes exceeded).\n", fx_stack_limit);
+    exit(1);
+}
+
+// --- Strings ---
+
+FxString *fx_string_new(const char *s, size_t len) {
+    FxString *str = malloc(sizeof(FxString) + len + 1);
+    if (!str) out_of_memory();
+    char *data = (char *)(str + 1);
+    memcpy(data, s, len);
+    data[len] = '\0';
+    str->refcount = 1;
+    str->len = len;
+    str->data = data;
+    return str;
+}
+
+void fx_string_free(FxString *s) {
+    free(s);
+}
+
+// Exact and wrapping, as int_pow() in vm.c
+long fx_pow(long a, long b) {
+    if (b < 0) {
+        if (a == 0) fx_division_by_zero();
+        return a == 1 ? 1 : a == -1 ? ((b & 1) ? -1 : 1) : 0;
+    }
+    unsigned long r = 1, x = (unsigned long)a;
+    for (; b; b >>= 1) {
+        if (b & 1) r *= x;
+        x *= x;
+    }
+    return (long)r;
+}
+
+// --- Output ---
+// Same buffering as the VM: --flush=line flushes after each fragment with a
+// newline (default on a terminal), block when the buffer fills (default
+// otherwise), exit only at exit. stderr stays line-buffered unless exit.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+    FLUSH_LINE,
+    FLUSH_BLOCK,
+    FLUSH_EXIT
+} FlushPolicy;
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+    int line_buffered;
+} OutputBuffer;
+
+OutputBuffer outputs[2] = { { 1, NULL, 0, 0, 0 }, { 2, NULL, 0, 0, 0 } };
+FlushPolicy flush_policy = FLUSH_BLOCK;
+
+void write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+#ifdef _WIN32
+        int w = _write(fd, p, (unsigned)len);
+#else
+        ssize_t w = write(fd, p, len);
+#endif
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += w;
+        len -= (size_t)w;
+    }
+}
+
+void output_flush(OutputBuffer *buf) {
+    size_t len = buf->len;
+    buf->len = 0;
+    write_all(buf->fd, buf->data, len);
+}
+
+void output_flush_all(void) {
+    output_flush(&outputs[FX_STDOUT]);
+    output_flush(&outputs[FX_STDERR]);
+}
+
+void output_init(OutputBuffer *buf, int line_buffered) {
+    buf->line_buffered = line_buffered;
+    buf->cap = OUTPUT_BUFFER_SIZE;
+    buf->data = malloc(buf->cap);
+    if (!buf->data) out_of_memory();
+    buf->len = 0;
+}
+
+void output_overflow(OutputBuffer *buf, const char *s, size_t n) {
+    if (flush_policy == FLUSH_EXIT) {
+        while (buf->len + n > buf->cap) buf->cap *= 2;
+        buf->data = realloc(buf->data, buf->cap);
+        if (!buf->data) out_of_memory();
+    } else if (n >= buf->cap / 2) {
+        // Large fragment: written together with the pending bytes
+#ifdef _WIN32
+        output_flush(buf);
+        write_all(buf->fd, s, n);
+#else
+        struct iovec iov[2] = { { buf->data, buf->len }, { (void *)s, n } };
+        ssize_t w;
+        do w = writev(buf->fd, iov, 2); while (w < 0 && errno == EINTR);
+        size_t done = w > 0 ? (size_t)w : 0;
+        if (done < buf->len) {
+            write_all(buf->fd, buf->data + done, buf->len - done);
+            done = buf->len;
+        }
+        done -= buf->len;
+        buf->len = 0;
+        write_all(buf->fd, s + done, n - done);
+#endif
+        return;
+    } else {
+        output_flush(buf);
+    }
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+}
+
+void fx_write(int stream, const char *s, size_t n) {
+    OutputBuffer *buf = &outputs[stream];
+    if (buf->len + n <= buf->cap) {
+        memcpy(buf->data + buf->len, s, n);
+        buf->len += n;
+    } else {
+        output_overflow(buf, s, n);
+    }
+    if (buf->line_buffered && memchr(s, '\n', n)) output_flush(buf);
+}
+
+void fx_write_long(int stream, long x) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (x < 0) *--p = '-';
+    fx_write(stream, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+void fx_write_value(int stream, const FxValue *v, const char *name) {
+    if (v->tag == FX_STRING) {
+        fx_write(stream, v->as.s->data, v->as.s->len);
+    } else if (v->tag == FX_INT || v->tag == FX_BOOL) {
+        fx_write_long(stream, v->as.i);
+    } else {
+        fprintf(stderr, "VM Error: Cannot print undefined variable '%s'.\n", name);
+    }
+}
+
+// --- Input ---
+// Lines come from a mapped regular file or from large read(2) blocks, as in
+// the VM.
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    char *data;
+    size_t pos;
+    size_t len;
+    size_t cap;
+    int eof;
+    int ready;
+} InputBuffer;
+
+InputBuffer in_stdin = { NULL, 0, 0, 0, 0, 0 };
+
+void input_init(InputBuffer *in) {
+    in->ready = 1;
+#ifndef _WIN32
+    struct stat st;
+    off_t offset = lseek(0, 0, SEEK_CUR);
+    if (fstat(0, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            in->data = map;
+            in->pos = (size_t)offset;
+            in->len = (size_t)st.st_size;
+            in->eof = 1;
+            return;
+        }
+    }
+#endif
+    in->cap = INPUT_BUFFER_SIZE;
+    in->data = malloc(in->cap);
+    if (!in->data) out_of_memory();
+}
+
+void input_fill(InputBuffer *in) {
+    if (in->pos > 0) {
+        memmove(in->data, in->data + in->pos, in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
+    }
+    if (in->len == in->cap) {
+        in->cap *= 2;
+        in->data = realloc(in->data, in->cap);
+        if (!in->data) out_of_memory();
+    }
+    for (;;) {
+#ifdef _WIN32
+        int n = _read(0, in->data + in->len, (unsigned)(in->cap - in->len));
+#else
+        ssize_t n = read(0, in->data + in->len, in->cap - in->len);
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) in->eof = 1;
+        else in->len += (size_t)n;
+        return;
+    }
+}
+
+const char *input_line(InputBuffer *in, size_t *len) {
+    if (!in->ready) input_init(in);
+    size_t scanned = in->pos;
+    for (;;) {
+        char *nl = memchr(in->data + scanned, '\n', in->len - scanned);
+        if (nl) {
+            const char *line = in->data + in->pos;
+            *len = (size_t)(nl - line);
+            in->pos = (size_t)(nl - in->data) + 1;
+            return line;
+        }
+        if (in->eof) {
+            if (in->pos == in->len) return NULL;
+            const char *line = in->data + in->pos;
+            *len = in->len - in->pos;
+            in->pos = in->len;
+            return line;
+        }
+        size_t seen = in->len - in->pos;
+        input_fill(in);
+        scanned = in->pos + seen;
+    }
+}
+
+// strtol-compatible whole-line integer parse, see vm.c
+int parse_long(const char *s, size_t len, long *out) {
+    const char *p = s, *end = s + len;
+    while (p < end && isspace((unsigned char)*p)) p++;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    if (p == end || !isdigit((unsigned char)*p)) {
+        *out = 0;
+        return len == 0;
+    }
+    unsigned long limit = neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+    unsigned long u = 0;
+    int overflow = 0;
+    for (; p < end && (unsigned)(*p - '0') < 10; p++) {
+        unsigned d = (unsigned)(*p - '0');
+        if (u > (limit - d) / 10) overflow = 1;
+        else u = u * 10 + d;
+    }
+    if (p != end) return 0;
+    if (overflow) u = limit;
+    *out = neg ? (long)(0UL - u) : (long)u;
+    return 1;
+}
+
+void fx_read(FxValue *dest) {
+    // Make sure a prompt is visible before waiting for input
+    if (flush_policy == FLUSH_LINE) output_flush(&outputs[FX_STDOUT]);
+    size_t len;
+    const char *line = input_line(&in_stdin, &len);
+    if (!line) {
+        fprintf(stderr, "VM Error: Failed to read input.\n");
+        exit(1);
+    }
+    if (!dest) return;
+    long num;
+    if (parse_long(line, len, &num)) {
+        fx_set_long(dest, FX_INT, num);
+    } else {
+        FxString *str = fx_string_new(line, len);
+        fx_set_string(dest, str);
+        fx_string_release(str);
+    }
+}
+
+// --- Startup ---
+
+size_t parse_size(const char *s) {
+    char *end;
+    double n = strtod(s, &end);
+    if (*end == 'K' || *end == 'k') n *= 1024.0, end++;
+    else if (*end == 'M' || *end == 'm') n *= 1024.0 * 1024.0, end++;
+    else if (*end == 'G' || *end == 'g') n *= 1024.0 * 1024.0 * 1024.0, end++;
+    if (end == s || *end != '\0' || n < 1) {
+        fprintf(stderr, "VM Error: Invalid size '%s'.\n", s);
+        exit(1);
+    }
+    return (size_t)n;
+}
+
+void fx_init(int argc, char **argv) {
+#ifdef _WIN32
+    flush_policy = _isatty(1) ? FLUSH_LINE : FLUSH_BLOCK;
+#else
+    flush_policy = isatty(1) ? FLUSH_LINE : FLUSH_BLOCK;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--stack-limit=", 14) == 0) {
+            fx_stack_limit = parse_size(argv[i] + 14);
+        } else if (strcmp(argv[i], "--flush=line") == 0) {
+            flush_policy = FLUSH_LINE;
+        } else if (strcmp(argv[i], "--flush=block") == 0) {
+            flush_policy = FLUSH_BLOCK;
+        } else if (strcmp(argv[i], "--flush=exit") == 0) {
+            flush_policy = FLUSH_EXIT;
+        } else {
+            fprintf(stderr, "Usage: %s [--stack-limit=SIZE] [--flush=line|block|exit]\n", argv[0]);
+            exit(1);
+        }
+    }
+    output_init(&outputs[FX_STDOUT], flush_policy == FLUSH_LINE);
+    output_init(&outputs[FX_STDERR], flush_policy != FLUSH_EXIT);
+    atexit(output_flush_all); // also covers exit(1) on an error
+}
+
+#ifndef _WIN32
+void *run_main(void *main_fn) {
+    ((void (*)(void))main_fn)();
+    return NULL;
+}
+#endif
+
+// Runs the translated main. Flux recursion is native C recursion, so main
+// runs on a thread whose stack is large enough for --stack-limit worth of
+// VM frames; the limit itself is enforced by fx_enter().
+int fx_run(void (*main_fn)(void)) {
+#ifndef _WIN32
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t stack = fx_stack_limit * 4 + (64u << 20);
+    if (pthread_attr_init(&attr) == 0 && pthread_attr_setstacksize(&attr, stack) == 0 &&
+        pthread_create(&thread, &attr, run_main, (void *)main_fn) == 0) {
+        pthread_join(thread, NULL);
+        return 0;
+    }
+#endif
+    main_fn();
+    return 0;
+}
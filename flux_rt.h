@@ -0,0 +1,174 @@
+/* flux_rt.h
+   Runtime for flux programs translated to C by fluxc -C. It provides the
+   value, print, input and call-stack behaviour of fluxvm, down to the
+   error messages, so a translated program prints exactly what the bytecode
+   prints under the VM.
+
+   Build a translated program with:
+     cc -O2 prog.c flux_rt.c -o prog -lm -lpthread
+   It takes the VM's --flush= and --stack-limit= options.
+*/
+#ifndef FLUX_RT_H
+#define FLUX_RT_H
+
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define FX_NORETURN __attribute__((noreturn))
+#else
+#define FX_NORETURN
+#endif
+
+// Tagged value for variables that may hold a string or be unassigned.
+// Variables fluxc proves are always numbers become plain C longs instead.
+typedef enum {
+    FX_NONE,
+    FX_INT,
+    FX_BOOL,
+    FX_STRING
+} FxTag;
+
+// Immutable, reference-counted string. Literals are static and immortal.
+#define FX_IMMORTAL -1
+
+typedef struct {
+    int refcount;
+    size_t len;
+    const char *data; // NUL-terminated
+} FxString;
+
+typedef struct {
+    FxTag tag;
+    union {
+        long i;
+        FxString *s;
+    } as;
+} FxValue;
+
+#define FX_STDOUT 0
+#define FX_STDERR 1
+
+extern FxString fx_empty;
+extern size_t fx_stack_used;
+extern size_t fx_stack_limit;
+
+void fx_init(int argc, char **argv);
+int fx_run(void (*main_fn)(void));
+
+void fx_string_free(FxString *s);
+FX_NORETURN void fx_non_numeric(const char *name);
+FX_NORETURN void fx_division_by_zero(void);
+FX_NORETURN void fx_stack_overflow(void);
+
+void fx_write(int stream, const char *s, size_t n);
+void fx_write_long(int stream, long x);
+void fx_write_value(int stream, const FxValue *v, const char *name);
+void fx_read(FxValue *dest);
+long fx_pow(long a, long b);
+
+// --- Values ---
+
+static inline void fx_retain(FxString *s) {
+    if (s->refcount != FX_IMMORTAL) s->refcount++;
+}
+
+static inline void fx_string_release(FxString *s) {
+    if (s->refcount != FX_IMMORTAL && --s->refcount == 0) fx_string_free(s);
+}
+
+static inline void fx_release(FxValue *v) {
+    if (v->tag == FX_STRING) fx_string_release(v->as.s);
+    v->tag = FX_NONE;
+}
+
+// The VM's get_long_value(): ints and bools only
+static inline long fx_long(const FxValue *v, const char *name) {
+    if (v->tag != FX_INT && v->tag != FX_BOOL) fx_non_numeric(name);
+    return v->as.i;
+}
+
+static inline void fx_set_long(FxValue *v, FxTag tag, long x) {
+    if (v->tag == FX_STRING) fx_string_release(v->as.s);
+    v->tag = tag;
+    v->as.i = x;
+}
+
+static inline void fx_set_string(FxValue *v, FxString *s) {
+    fx_retain(s);
+    if (v->tag == FX_STRING) fx_string_release(v->as.s);
+    v->tag = FX_STRING;
+    v->as.s = s;
+}
+
+// The VM's get_string_value(): anything but a string reads as ""
+static inline FxString *fx_string_of(const FxValue *v) {
+    return v->tag == FX_STRING ? v->as.s : &fx_empty;
+}
+
+static inline FxValue fx_long_value(FxTag tag, long x) {
+    FxValue v;
+    v.tag = tag;
+    v.as.i = x;
+    return v;
+}
+
+static inline FxValue fx_string_value(FxString *s) {
+    FxValue v;
+    fx_retain(s);
+    v.tag = FX_STRING;
+    v.as.s = s;
+    return v;
+}
+
+// Moves a value out of a variable, leaving it unassigned
+static inline FxValue fx_take(FxValue *v) {
+    FxValue r = *v;
+    v->tag = FX_NONE;
+    return r;
+}
+
+// return_code: the result replaces the caller's __ret, if it has one
+static inline void fx_return(FxValue *ret, FxValue result) {
+    if (ret) {
+        fx_release(ret);
+        *ret = result;
+    } else {
+        fx_release(&result);
+    }
+}
+
+// --- Arithmetic ---
+// Wrapping, like the VM's arithmetic on two's-complement targets. Division
+// by -1 is a negation, so LONG_MIN / -1 wraps to LONG_MIN and its remainder
+// is 0; dividing by 0 is a VM error for both div and mod.
+
+static inline long fx_add(long a, long b) { return (long)((unsigned long)a + (unsigned long)b); }
+static inline long fx_sub(long a, long b) { return (long)((unsigned long)a - (unsigned long)b); }
+static inline long fx_mul(long a, long b) { return (long)((unsigned long)a * (unsigned long)b); }
+
+static inline long fx_div(long a, long b) {
+    if (b == 0) fx_division_by_zero();
+    if (b == -1) return (long)(0UL - (unsigned long)a);
+    return a / b;
+}
+
+static inline long fx_mod(long a, long b) {
+    if (b == 0) fx_division_by_zero();
+    if (b == -1) return 0;
+    return a % b;
+}
+
+// --- Calls ---
+// Call depth is charged in the VM's units (a frame record plus 16 bytes per
+// local), so --stack-limit overflows at about the same depth as in fluxvm.
+
+static inline void fx_enter(size_t bytes) {
+    fx_stack_used += bytes;
+    if (fx_stack_used > fx_stack_limit) fx_stack_overflow();
+}
+
+static inline void fx_leave(size_t bytes) {
+    fx_stack_used -= bytes;
+}
+
+#endif
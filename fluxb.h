@@ -0,0 +1,98 @@
+/* fluxb.h
+   Binary .fluxb container format shared by fluxc (writer) and fluxvm (reader).
+
+   Layout (all integers little-endian, every section 4-byte aligned):
+     FluxbHeader
+     FluxbInstr    instrs[instr_count]      fixed-width instruction records
+     FluxbFunction functions[function_count]
+     FluxbLabel    labels[label_count]
+     char          pool[pool_size]          deduplicated NUL-terminated strings
+
+   Every operand is an offset into the string pool, or FLUXB_NONE when the
+   instruction does not use that field. Operand placement per opcode mirrors
+   the text form:
+     0x01 entry        arg1=type  arg2=name  dest=params
+     0x03..0x06        arg1=value/var
+     0x07 store        arg1=type  arg2=var   dest=value
+     0x08 call         arg1=signature "name(args)"
+     0x09..0x12        arg1=a     arg2=b     dest=result var
+     0x13 jz           arg1=cond             dest=label
+     0x16 jnz          arg1=cond             dest=label
+     0x14 jmp                                dest=label
+     0x15 label                              dest=label
+     0x17 array_new    arg1=length           dest=array var
+     0x18 index        arg1=array arg2=index dest=result var
+     0x19 set_index    arg1=index arg2=value dest=array var
+     0x1A..0x1D        arg1=array            dest=result var (len sum min max)
+     0x1E..0x20        arg1=value/array      dest=array var  (fill add_each mul_each)
+     0x21..0x24        arg1=array arg2=value dest=result var (count_gt lt eq ne)
+*/
+#ifndef FLUXB_H
+#define FLUXB_H
+
+#include <stdint.h>
+
+#define FLUXB_MAGIC "FLXB"
+// Raised whenever opcodes are added, so that an older fluxvm refuses a file
+// it cannot run instead of skipping what it does not know. fluxvm reads
+// every version up to its own.
+//   1  the original opcodes
+//   2  0x16 jnz (loop inversion)
+//   3  0x17..0x24 arrays
+#define FLUXB_VERSION 3
+#define FLUXB_NONE 0xFFFFFFFFu
+
+typedef struct {
+    char magic[4];          // "FLXB"
+    uint16_t version;       // FLUXB_VERSION
+    uint16_t flags;         // reserved, 0
+    uint32_t instr_count;
+    uint32_t instr_offset;
+    uint32_t function_count;
+    uint32_t function_offset;
+    uint32_t label_count;
+    uint32_t label_offset;
+    uint32_t pool_size;
+    uint32_t pool_offset;
+} FluxbHeader;
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t reserved[3];
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t dest;
+} FluxbInstr;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint32_t params;        // parameter declaration string, e.g. "int x, int y"
+    uint32_t instr_index;   // index of the 0x01 entry record
+} FluxbFunction;
+
+typedef struct {
+    uint32_t name;
+    uint32_t instr_index;   // index of the 0x15 label record
+} FluxbLabel;
+
+// Mnemonic for an opcode, as used by the text (disassembly) form.
+static inline const char *fluxb_op_name(int opcode) {
+    static const char *const names[] = {
+        NULL, "entry", "end", "stdout", "stderr", "read", "return_code",
+        "store", "call", "add", "sub", "mul", "div", "mod", "pow",
+        "gt", "lt", "eq", "ne", "jz", "jmp", "label", "jnz",
+        "array_new", "index", "set_index", "len", "sum", "min", "max",
+        "fill", "add_each", "mul_each", "count_gt", "count_lt", "count_eq", "count_ne"
+    };
+    if (opcode <= 0 || opcode >= (int)(sizeof(names) / sizeof(names[0]))) return "unknown";
+    return names[opcode];
+}
+
+// Array opcodes (0x17..0x24) all take dest (the variable they set or the
+// array they change) and arg1; this is 1 for those that take arg2 as well.
+static inline int fluxb_array_op_has_arg2(int opcode) {
+    return opcode == 0x18 || opcode == 0x19 || (opcode >= 0x21 && opcode <= 0x24);
+}
+
+#endif
@@ -0,0 +1,241 @@
+/* fluxrun.c
+   Batch runner for the Flux virtual machine: runs one program on many inputs
+   at once, on a pool of threads sharing a single loaded program (see
+   fluxvm.h).
+   Usage: gcc -O2 -o fluxrun fluxrun.c vm.c -DFLUXVM_LIBRARY -lm -lpthread
+          ./fluxrun [--threads=N] [--no-jit] [--jit-threshold=N] [--stack-limit=SIZE]
+                    [--runs=N] [--timings] program.fluxb [input...]
+   Every input file is the stdin of one run ("-" and no inputs at all mean a
+   single run on an empty input); --runs=N does each of them N times. The
+   output of the runs is written in order, whatever order they finish in, so
+   it reads as if they had run one after the other. The exit status is 1 if
+   any run ended with a VM error or an input could not be opened.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "fluxvm.h"
+
+#define THREAD_STACK_SIZE (64u << 20) // nested native and interpreted calls run on it
+
+typedef struct {
+    const char *input; // NULL: empty input
+    int done;
+    int status;
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+} Job;
+
+static const FluxProgram *program;
+static Job *jobs;
+static int job_count = 0;
+static int next_job = 0;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static size_t stack_limit = 0; // 0: the library's default
+static int jit_enabled = 1;
+static int jit_threshold = 0;
+
+static void out_of_memory() {
+    fprintf(stderr, "fluxrun: Out of memory.\n");
+    exit(1);
+}
+
+static void write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += w;
+        len -= (size_t)w;
+    }
+}
+
+static char *copy_bytes(const char *p, size_t len) {
+    char *out = malloc(len ? len : 1);
+    if (!out) out_of_memory();
+    memcpy(out, p, len);
+    return out;
+}
+
+// Runs one job on vm and keeps its output for the writer
+static void run_job(FluxVM *vm, Job *job) {
+    char message[PATH_MAX + 64];
+    int fd = -1;
+    fluxvm_clear_output(vm);
+    if (job->input) {
+        fd = open(job->input, O_RDONLY);
+        if (fd < 0) {
+            int n = snprintf(message, sizeof message, "fluxrun: Cannot open '%s': %s.\n", job->input, strerror(errno));
+            job->out = copy_bytes("", 0);
+            job->out_len = 0;
+            job->err = copy_bytes(message, (size_t)n < sizeof message ? (size_t)n : sizeof message - 1);
+            job->err_len = strlen(job->err);
+            job->status = 1;
+            return;
+        }
+        fluxvm_set_input_fd(vm, fd);
+    } else {
+        fluxvm_set_input(vm, "", 0);
+    }
+    job->status = fluxvm_run(vm);
+    // Back to a borrowed empty input before fd goes away
+    fluxvm_set_input(vm, "", 0);
+    if (fd >= 0) close(fd);
+
+    const char *p = fluxvm_output(vm, FLUXVM_STDOUT, &job->out_len);
+    job->out = copy_bytes(p, job->out_len);
+    p = fluxvm_output(vm, FLUXVM_STDERR, &job->err_len);
+    job->err = copy_bytes(p, job->err_len);
+}
+
+// One instance per thread, reused for every job it takes
+static void *worker(void *unused) {
+    (void)unused;
+    FluxVM *vm = fluxvm_new(program);
+    if (stack_limit) fluxvm_set_stack_limit(vm, stack_limit);
+    fluxvm_set_jit(vm, jit_enabled, jit_threshold);
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        int i = next_job < job_count ? next_job++ : -1;
+        pthread_mutex_unlock(&job_lock);
+        if (i < 0) break;
+        run_job(vm, &jobs[i]);
+        pthread_mutex_lock(&job_lock);
+        jobs[i].done = 1;
+        pthread_cond_broadcast(&job_done);
+        pthread_mutex_unlock(&job_lock);
+    }
+    fluxvm_free(vm);
+    return NULL;
+}
+
+// Parses a byte count with an optional K/M/G suffix (e.g. "64M")
+static size_t parse_size(const char *s) {
+    char *end;
+    double n = strtod(s, &end);
+    if (*end == 'K' || *end == 'k') n *= 1024.0, end++;
+    else if (*end == 'M' || *end == 'm') n *= 1024.0 * 1024.0, end++;
+    else if (*end == 'G' || *end == 'g') n *= 1024.0 * 1024.0 * 1024.0, end++;
+    if (end == s || *end != '\0' || n < 1) {
+        fprintf(stderr, "fluxrun: Invalid size '%s'.\n", s);
+        exit(1);
+    }
+    return (size_t)n;
+}
+
+static int parse_count(const char *s, const char *what, long max) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || n < 1 || n > max) {
+        fprintf(stderr, "fluxrun: Invalid %s '%s'.\n", what, s);
+        exit(1);
+    }
+    return (int)n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--threads=N] [--no-jit] [--jit-threshold=N] [--stack-limit=SIZE]\n"
+                    "          [--runs=N] [--timings] program.fluxb [input...]\n", prog);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = online > 0 ? (int)online : 1;
+    int runs = 1;
+    int timings = 0;
+    int argi = 1;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+        const char *arg = argv[argi];
+        if (strncmp(arg, "--threads=", 10) == 0) {
+            threads = parse_count(arg + 10, "thread count", 1024);
+        } else if (strcmp(arg, "--no-jit") == 0) {
+            jit_enabled = 0;
+        } else if (strncmp(arg, "--jit-threshold=", 16) == 0) {
+            jit_threshold = parse_count(arg + 16, "JIT threshold", INT_MAX);
+        } else if (strncmp(arg, "--stack-limit=", 14) == 0) {
+            stack_limit = parse_size(arg + 14);
+        } else if (strncmp(arg, "--runs=", 7) == 0) {
+            runs = parse_count(arg + 7, "run count", 1000000);
+        } else if (strcmp(arg, "--timings") == 0) {
+            timings = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argi >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    double t_start = now_ms();
+    program = fluxvm_load(argv[argi]);
+    if (!program) return 1;
+    double t_loaded = now_ms();
+
+    int inputs = argc - argi - 1;
+    job_count = (inputs > 0 ? inputs : 1) * runs;
+    jobs = calloc((size_t)job_count, sizeof(Job));
+    if (!jobs) out_of_memory();
+    for (int i = 0; i < job_count; i++) {
+        const char *input = inputs > 0 ? argv[argi + 1 + i % inputs] : "-";
+        jobs[i].input = strcmp(input, "-") == 0 ? NULL : input;
+    }
+    if (threads > job_count) threads = job_count;
+
+    pthread_t *pool = malloc((size_t)threads * sizeof(pthread_t));
+    if (!pool) out_of_memory();
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&pool[started], &attr, worker, NULL) != 0) break;
+    }
+    pthread_attr_destroy(&attr);
+    if (started == 0) worker(NULL); // no threads to be had: run them all here
+
+    // Write each run's output as soon as it and every run before it are done
+    int status = 0;
+    for (int i = 0; i < job_count; i++) {
+        pthread_mutex_lock(&job_lock);
+        while (!jobs[i].done) pthread_cond_wait(&job_done, &job_lock);
+        pthread_mutex_unlock(&job_lock);
+        write_all(1, jobs[i].out, jobs[i].out_len);
+        write_all(2, jobs[i].err, jobs[i].err_len);
+        free(jobs[i].out);
+        free(jobs[i].err);
+        if (jobs[i].status) status = 1;
+    }
+    for (int t = 0; t < started; t++) pthread_join(pool[t], NULL);
+    double t_done = now_ms();
+
+    if (timings) {
+        double run_ms = t_done - t_loaded;
+        fprintf(stderr, "fluxrun timings: load %.3f ms, %d runs on %d threads in %.3f ms (%.1f runs/s)\n",
+                t_loaded - t_start, job_count, started ? started : 1, run_ms,
+                run_ms > 0 ? job_count * 1000.0 / run_ms : 0.0);
+    }
+    free(pool);
+    free(jobs);
+    fluxvm_program_free((FluxProgram *)program);
+    return status;
+}
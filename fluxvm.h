@@ -0,0 +1,80 @@
+/* fluxvm.h
+   Embedding API of the Flux virtual machine (libfluxvm). A program is loaded
+   and linked once into a FluxProgram, which is never written to afterwards,
+   so any number of FluxVM instances can run it at the same time, each on its
+   own thread. An instance holds everything a run changes: call frames,
+   values, input and output buffers and its JIT code.
+
+   Build the library from vm.c without fluxvm's main():
+     cc -O2 -c -DFLUXVM_LIBRARY vm.c -o libfluxvm.o
+   and link programs using it with -lm. fluxrun.c is a batch runner built on
+   this API.
+
+   A VM error (undefined variable, division by zero, stack overflow, failed
+   read) ends the run it happened in: the message goes to that instance's
+   stderr and fluxvm_run() returns 1. Running out of memory still ends the
+   process, as it does in fluxvm.
+*/
+#ifndef FLUXVM_H
+#define FLUXVM_H
+
+#include <stddef.h>
+
+typedef struct FluxProgram FluxProgram;
+typedef struct FluxVM FluxVM;
+
+// When output written to a descriptor reaches it
+typedef enum {
+    FLUXVM_FLUSH_LINE,  // after every fragment containing a newline
+    FLUXVM_FLUSH_BLOCK, // when the buffer fills
+    FLUXVM_FLUSH_EXIT   // when the run ends
+} FluxFlush;
+
+#define FLUXVM_STDOUT 0
+#define FLUXVM_STDERR 1
+
+// Loads and links a .fluxb image or fluxc -S listing, or a .flux source
+// (compiled with fluxc and kept in the image cache, see vm.c). Returns NULL
+// after printing the reason to stderr.
+FluxProgram *fluxvm_load(const char *path);
+void fluxvm_program_free(FluxProgram *program);
+
+// A new instance of program, which must outlive it. Unless told otherwise,
+// a run reads empty input and collects its output for fluxvm_output().
+FluxVM *fluxvm_new(const FluxProgram *program);
+void fluxvm_free(FluxVM *vm);
+
+// Input for the following runs: len bytes at data (not copied; keep them
+// until the run ends), or whatever can be read from fd.
+void fluxvm_set_input(FluxVM *vm, const char *data, size_t len);
+void fluxvm_set_input_fd(FluxVM *vm, int fd);
+
+// Writes stdout and stderr to descriptors instead of collecting them.
+void fluxvm_set_output_fds(FluxVM *vm, int out_fd, int err_fd, FluxFlush flush);
+
+// Bytes of frames plus locals a run may use (256M by default).
+void fluxvm_set_stack_limit(FluxVM *vm, size_t bytes);
+
+// Turns the JIT on or off where it is available, and sets how many calls
+// and loop back edges make a function hot (0 keeps the current threshold).
+void fluxvm_set_jit(FluxVM *vm, int enabled, int threshold);
+
+// Runs main from the start, or from a restored snapshot. Returns 0, or 1 if
+// the run ended with a VM error.
+int fluxvm_run(FluxVM *vm);
+
+// Makes the next run write a snapshot of its state to path when it first
+// reads input (path is not copied). The run then goes on as usual.
+void fluxvm_set_snapshot(FluxVM *vm, const char *path);
+
+// Loads a snapshot taken from the same program; the next run resumes at the
+// read it was taken at, after writing the output that came before it again.
+// Returns 1 after reporting why if it cannot.
+int fluxvm_restore(FluxVM *vm, const char *path);
+
+// Output collected on FLUXVM_STDOUT or FLUXVM_STDERR, accumulated over runs.
+// Valid until the next run, fluxvm_clear_output() or fluxvm_free().
+const char *fluxvm_output(const FluxVM *vm, int stream, size_t *len);
+void fluxvm_clear_output(FluxVM *vm);
+
+#endif
@@ -0,0 +1,274 @@
+/* interpret.h
+   The fluxvm interpreter loop, included by vm.c three times: as interpret(),
+   as interpret_profiled(), which also counts and samples every instruction
+   for --profile, and as interpret_sampled(), which the --sample timer can
+   stop at the next instruction. Keeping the profilers in their own copies
+   of the loop leaves the normal one exactly as fast as it is without them.
+
+   Before each inclusion vm.c defines INTERPRET (the function's name),
+   INTERPRET_PROFILED (0 for the plain copy, 1 for the others),
+   INTERPRET_SAMPLED, PROFILE_STEP (run before every instruction under the
+   switch) and the dispatch macros TARGET, DISPATCH, NEXT, JUMP and
+   JUMP_BACK. Under threaded dispatch the plain copy's handler addresses
+   are stored in code[] when the program is linked (interpret() called with
+   a negative pc does only that); the other copies dispatch through their
+   own tables instead, and the --sample timer points every entry of
+   interpret_sampled()'s at op_sample until it has run. The plain copy also
+   has the quickened handlers (see Quickening in vm.c), which only linking
+   stores in code[].
+*/
+
+// Runs vm's program from pc in the innermost frame until main returns (-1)
+// or a frame opened by native code returns (JIT_RETURN_TO_NATIVE).
+FLUX_INTERNAL int INTERPRET(FluxVM *vm, int pc) {
+    Instruction *code = vm->program->code;
+    Instruction *instr;
+    long op1_val, op2_val;
+
+    Value *locals;
+
+#ifdef FLUX_THREADED
+    static const void *const handlers[256] = {
+        [0x00] = &&op_unknown,
+        [0x01] = &&op_entry,   [0x02] = &&op_end,
+        [0x03] = &&op_stdout,  [0x04] = &&op_stderr,
+        [0x05] = &&op_read,    [0x06] = &&op_return_code,
+        [0x07] = &&op_store,   [0x08] = &&op_call,
+        [0x09] = &&op_add,     [0x0A] = &&op_sub,
+        [0x0B] = &&op_mul,     [0x0C] = &&op_div,
+        [0x0D] = &&op_mod,     [0x0E] = &&op_pow,
+        [0x0F] = &&op_gt,      [0x10] = &&op_lt,
+        [0x11] = &&op_eq,      [0x12] = &&op_ne,
+        [0x13] = &&op_jz,      [0x14] = &&op_jmp,
+        [0x15] = &&op_unknown, [0x16] = &&op_jnz,
+        [0x17] = &&op_array_new, [0x18] = &&op_index,
+        [0x19] = &&op_set_index, [0x1A] = &&op_len,
+        [0x1B] = &&op_sum,     [0x1C] = &&op_min,
+        [0x1D] = &&op_max,     [0x1E] = &&op_fill,
+        [0x1F] = &&op_add_each, [0x20] = &&op_mul_each,
+        [0x21] = &&op_count_gt, [0x22] = &&op_count_lt,
+        [0x23] = &&op_count_eq, [0x24] = &&op_count_ne,
+        [0x25 ... 0xFF] = &&op_unknown,
+    };
+#if defined(FLUX_QUICKEN) && !INTERPRET_PROFILED
+    // By quick_form(): slot/slot, slot/literal, literal/slot, then the same
+    // followed by jz and by jnz
+#define QUICK_FORMS(name) &&op_##name##_ss, &&op_##name##_si, &&op_##name##_is
+    static const void *const quick_handlers[0x13][3 * QUICK_SHAPES] = {
+        [0x09] = { QUICK_FORMS(add) },
+        [0x0A] = { QUICK_FORMS(sub) },
+        [0x0B] = { QUICK_FORMS(mul) },
+        [0x0F] = { QUICK_FORMS(gt), QUICK_FORMS(gt_jz), QUICK_FORMS(gt_jnz) },
+        [0x10] = { QUICK_FORMS(lt), QUICK_FORMS(lt_jz), QUICK_FORMS(lt_jnz) },
+        [0x11] = { QUICK_FORMS(eq), QUICK_FORMS(eq_jz), QUICK_FORMS(eq_jnz) },
+        [0x12] = { QUICK_FORMS(ne), QUICK_FORMS(ne_jz), QUICK_FORMS(ne_jnz) },
+    };
+#undef QUICK_FORMS
+#endif
+#if !INTERPRET_PROFILED
+    if (pc < 0) { // link time: only store the handlers
+        for (int i = 0; i <= vm->program->code_count; i++) {
+            code[i].handler = handlers[code[i].opcode & 0xFF];
+#ifdef FLUX_QUICKEN
+            int form = i < vm->program->code_count ? quick_form(code, i) : -1;
+            if (form >= 0) code[i].handler = quick_handlers[code[i].opcode][form];
+#endif
+        }
+        return pc;
+    }
+#endif
+#if INTERPRET_SAMPLED
+    if (!sample_handlers) {
+        for (int i = 0; i < 256; i++) sample_dispatch[i] = handlers[i];
+        sample_handlers = handlers;
+        sample_trap = &&op_sample;
+    }
+#endif
+#else
+#if !INTERPRET_PROFILED
+    if (pc < 0) return pc; // nothing to set up for the switch
+#endif
+#endif
+
+    // 'locals' always points at the innermost frame's slots and is
+    // re-derived whenever frames change.
+    locals = frame_locals(vm);
+
+#ifdef FLUX_THREADED
+    DISPATCH();
+#else
+    // Execution loop: every handler ends by dispatching the next instruction
+dispatch:
+    instr = &code[pc];
+    PROFILE_STEP(pc);
+    switch (instr->opcode) {
+#endif
+
+            TARGET(0x02, end) // end: falling off a function returns without a value
+                pc = end_frame(vm);
+                if (pc < 0) return pc;
+                locals = frame_locals(vm);
+                DISPATCH();
+
+            TARGET(0x03, stdout) // stdout <value>
+                output_operand(vm, &vm->out_stdout, locals, &instr->a);
+                NEXT();
+
+            TARGET(0x04, stderr) // stderr <value> (Same logic as stdout, but uses stderr)
+                output_operand(vm, &vm->out_stderr, locals, &instr->a);
+                NEXT();
+
+            TARGET(0x05, read) { // read <var>
+                if (vm->snapshot_path) snapshot_take(vm, pc); // see --- Snapshots ---
+                // Make sure a prompt is visible before waiting for input
+                if (vm->flush_policy == FLUXVM_FLUSH_LINE) output_flush(&vm->out_stdout);
+                size_t len;
+                const char *line = input_line(&vm->in_stdin, &len);
+                if (!line) vm_error(vm, "VM Error: Failed to read input.\n");
+
+                if (instr->dest_slot >= 0) {
+                    long num;
+                    if (parse_long(line, len, &num)) {
+                        // Pure integer input
+                        value_set_long(&locals[instr->dest_slot], VAL_INT, num);
+                    } else {
+                        // String input (a float is kept as text)
+                        FluxString *str = string_new(line, len);
+                        value_set_string(&locals[instr->dest_slot], str);
+                        string_release(str);
+                    }
+                }
+                NEXT();
+            }
+
+            TARGET(0x06, return_code) // return_code <var>
+                pc = return_value(vm, &instr->a);
+                if (pc < 0) return pc;
+                locals = frame_locals(vm);
+                DISPATCH();
+
+            TARGET(0x07, store) // store <type> <var> <value>
+                // The value is converted to the declared type, resolved at link time
+                load_operand(vm, &locals[instr->dest_slot], instr->type, locals, &instr->a);
+                NEXT();
+
+            TARGET(0x08, call) { // call <name>(<params>)
+                // The call site was decoded at link time (callee, arity, operands, types)
+                const CallSite *site = instr->call;
+                push_call(vm, site, pc + 1);
+                if (vm->jit_enabled && jit_hot(vm, site->func)) {
+                    pc = jit_run(vm, site->entry_pc);
+                    if (pc < 0) return pc;
+                    locals = frame_locals(vm);
+                    DISPATCH();
+                }
+                // Continue past the callee's 'entry'
+                locals = frame_locals(vm);
+                JUMP(site->entry_pc);
+            }
+
+            // Binary Arithmetic Operations (0x09 - 0x0E)
+            TARGET(0x09, add) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_INT, wrap_add(op1_val, op2_val)); NEXT();
+            TARGET(0x0A, sub) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_INT, wrap_sub(op1_val, op2_val)); NEXT();
+            TARGET(0x0B, mul) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_INT, wrap_mul(op1_val, op2_val)); NEXT();
+            // Dividing by -1 negates, wrapping LONG_MIN / -1 to LONG_MIN (remainder 0)
+            TARGET(0x0C, div) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b);
+                if (op2_val == 0) vm_error(vm, "VM Error: Division by zero.\n");
+                value_set_long(&locals[instr->dest_slot], VAL_INT, op2_val == -1 ? (long)(0UL - (unsigned long)op1_val) : op1_val / op2_val); NEXT();
+            TARGET(0x0D, mod) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b);
+                if (op2_val == 0) vm_error(vm, "VM Error: Division by zero.\n");
+                value_set_long(&locals[instr->dest_slot], VAL_INT, op2_val == -1 ? 0 : op1_val % op2_val); NEXT();
+            TARGET(0x0E, pow) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_INT, int_pow(vm, op1_val, op2_val)); NEXT();
+
+            // Comparison Operations (0x0F - 0x12). Result is 1 (true) or 0 (false).
+            TARGET(0x0F, gt) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_BOOL, (op1_val > op2_val) ? 1 : 0); NEXT();
+            TARGET(0x10, lt) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_BOOL, (op1_val < op2_val) ? 1 : 0); NEXT();
+            TARGET(0x11, eq) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_BOOL, (op1_val == op2_val) ? 1 : 0); NEXT();
+            TARGET(0x12, ne) op1_val = get_long_value(vm, locals, &instr->a); op2_val = get_long_value(vm, locals, &instr->b); value_set_long(&locals[instr->dest_slot], VAL_BOOL, (op1_val != op2_val) ? 1 : 0); NEXT();
+
+            // Control Flow Jumps (targets resolved at link time)
+            TARGET(0x13, jz) // jz <cond_var> <label> (Jump if Zero/False)
+                if (get_long_value(vm, locals, &instr->a) == 0) JUMP(instr->target);
+                NEXT();
+            TARGET(0x16, jnz) // jnz <cond_var> <label> (Jump if Non-Zero/True)
+                if (get_long_value(vm, locals, &instr->a) != 0) JUMP_BACK(instr->target);
+                NEXT();
+            TARGET(0x14, jmp) // jmp <label> (Unconditional Jump)
+                JUMP_BACK(instr->target);
+
+            TARGET(0x01, entry) // entry: Already handled by finding the jump target.
+                NEXT();
+
+            // Arrays (0x17 - 0x24): elements are read and written here, the
+            // rest runs a whole-array kernel, see --- Arrays ---
+            TARGET(0x18, index) array_index(vm, locals, instr); NEXT();
+            TARGET(0x19, set_index) array_set_index(vm, locals, instr); NEXT();
+            TARGET(0x17, array_new)
+            TARGET(0x1A, len)
+            TARGET(0x1B, sum)
+            TARGET(0x1C, min)
+            TARGET(0x1D, max)
+            TARGET(0x1E, fill)
+            TARGET(0x1F, add_each)
+            TARGET(0x20, mul_each)
+            TARGET(0x21, count_gt)
+            TARGET(0x22, count_lt)
+            TARGET(0x23, count_eq)
+            TARGET(0x24, count_ne)
+                array_op(vm, locals, instr);
+                NEXT();
+
+#if defined(FLUX_QUICKEN) && !INTERPRET_PROFILED
+            // Quickened forms of 0x09 - 0x12. A slot operand that does not
+            // hold a number sends the instruction to its generic handler.
+#define QUICK_SLOT(op, into) do { \
+                const Value *v_ = &locals[instr->op.slot]; \
+                if (v_->tag != VAL_INT && v_->tag != VAL_BOOL) goto *handlers[instr->opcode]; \
+                into = v_->as.i; \
+            } while (0)
+#define QUICK_OP(label, load_a, load_b, tag, expr, then) \
+            label: load_a; load_b; value_set_long(&locals[instr->dest_slot], tag, expr); then
+#define QUICK_OPS(name, tag, expr, then) \
+            QUICK_OP(op_##name##_ss, QUICK_SLOT(a, op1_val), QUICK_SLOT(b, op2_val), tag, expr, then) \
+            QUICK_OP(op_##name##_si, QUICK_SLOT(a, op1_val), op2_val = instr->b.value, tag, expr, then) \
+            QUICK_OP(op_##name##_is, op1_val = instr->a.value, QUICK_SLOT(b, op2_val), tag, expr, then)
+// The branch of the jz or jnz after the comparison, on its result
+#define QUICK_JZ(cond) do { if (!(cond)) JUMP(instr[1].target); pc += 2; DISPATCH(); } while (0)
+#define QUICK_JNZ(cond) do { if (cond) JUMP_BACK(instr[1].target); pc += 2; DISPATCH(); } while (0)
+#define QUICK_COMPARE(name, expr) \
+            QUICK_OPS(name, VAL_BOOL, (expr) ? 1 : 0, NEXT();) \
+            QUICK_OPS(name##_jz, VAL_BOOL, (expr) ? 1 : 0, QUICK_JZ(expr);) \
+            QUICK_OPS(name##_jnz, VAL_BOOL, (expr) ? 1 : 0, QUICK_JNZ(expr);)
+
+            QUICK_OPS(add, VAL_INT, wrap_add(op1_val, op2_val), NEXT();)
+            QUICK_OPS(sub, VAL_INT, wrap_sub(op1_val, op2_val), NEXT();)
+            QUICK_OPS(mul, VAL_INT, wrap_mul(op1_val, op2_val), NEXT();)
+            QUICK_COMPARE(gt, op1_val > op2_val)
+            QUICK_COMPARE(lt, op1_val < op2_val)
+            QUICK_COMPARE(eq, op1_val == op2_val)
+            QUICK_COMPARE(ne, op1_val != op2_val)
+#undef QUICK_SLOT
+#undef QUICK_OP
+#undef QUICK_OPS
+#undef QUICK_JZ
+#undef QUICK_JNZ
+#undef QUICK_COMPARE
+#endif
+
+#if defined(FLUX_THREADED) && INTERPRET_SAMPLED
+        op_sample: // the --sample timer fired: record this pc, then run the instruction
+            sample_take(pc);
+            goto *handlers[instr->opcode & 0xFF];
+#endif
+
+#ifdef FLUX_THREADED
+        op_unknown:
+#else
+            default:
+#endif
+                vm_message(vm, "VM Warning: Unhandled opcode 0x%X at instruction %d.\n", instr->opcode, pc);
+                NEXT();
+#ifndef FLUX_THREADED
+    }
+#endif
+}
@@ -0,0 +1,123 @@
+/* kernels.h
+   The vector kernels behind fluxvm's bulk array opcodes, included by vm.c
+   once per instruction set (SSE2, AVX2). Each kernel runs over whole
+   vectors of longs and finishes the last few elements one at a time;
+   arithmetic wraps like the interpreter's add and mul.
+
+   Before each inclusion vm.c defines KERNEL(name) (the function's name for
+   this set), KERNEL_TARGET (attributes letting the compiler use the set)
+   and the primitives on VEC, a vector of VEC_LANES longs: VEC_LOAD(p),
+   VEC_STORE(p, v), VEC_SET1(x), VEC_ZERO(), VEC_ADD, VEC_SUB, VEC_MUL,
+   VEC_GT and VEC_EQ (all lanes of a lane set where true) and
+   VEC_SELECT(mask, a, b) (a where mask is set, b elsewhere).
+*/
+
+// Adds up the lanes of v plus s
+KERNEL_TARGET static inline unsigned long KERNEL(lanes_sum)(VEC v, unsigned long s) {
+    long lanes[VEC_LANES];
+    VEC_STORE(lanes, v);
+    for (int k = 0; k < VEC_LANES; k++) s += (unsigned long)lanes[k];
+    return s;
+}
+
+FLUX_INTERNAL KERNEL_TARGET long KERNEL(sum)(const long *p, size_t n) {
+    VEC s0 = VEC_ZERO(), s1 = VEC_ZERO();
+    size_t i = 0;
+    for (; i + 2 * VEC_LANES <= n; i += 2 * VEC_LANES) {
+        s0 = VEC_ADD(s0, VEC_LOAD(p + i));
+        s1 = VEC_ADD(s1, VEC_LOAD(p + i + VEC_LANES));
+    }
+    unsigned long s = KERNEL(lanes_sum)(VEC_ADD(s0, s1), 0);
+    for (; i < n; i++) s += (unsigned long)p[i];
+    return (long)s;
+}
+
+// min (want_max 0) or max of n > 0 elements
+KERNEL_TARGET static inline long KERNEL(extreme)(const long *p, size_t n, int want_max) {
+    long m = p[0];
+    size_t i = 0;
+    if (n >= VEC_LANES) {
+        VEC v = VEC_LOAD(p);
+        for (i = VEC_LANES; i + VEC_LANES <= n; i += VEC_LANES) {
+            VEC x = VEC_LOAD(p + i);
+            v = want_max ? VEC_SELECT(VEC_GT(x, v), x, v) : VEC_SELECT(VEC_GT(v, x), x, v);
+        }
+        long lanes[VEC_LANES];
+        VEC_STORE(lanes, v);
+        for (int k = 0; k < VEC_LANES; k++) {
+            if (want_max ? lanes[k] > m : lanes[k] < m) m = lanes[k];
+        }
+    }
+    for (; i < n; i++) {
+        if (want_max ? p[i] > m : p[i] < m) m = p[i];
+    }
+    return m;
+}
+
+FLUX_INTERNAL KERNEL_TARGET long KERNEL(min)(const long *p, size_t n) {
+    return KERNEL(extreme)(p, n, 0);
+}
+
+FLUX_INTERNAL KERNEL_TARGET long KERNEL(max)(const long *p, size_t n) {
+    return KERNEL(extreme)(p, n, 1);
+}
+
+FLUX_INTERNAL KERNEL_TARGET void KERNEL(fill)(long *p, size_t n, long x) {
+    VEC v = VEC_SET1(x);
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) VEC_STORE(p + i, v);
+    for (; i < n; i++) p[i] = x;
+}
+
+FLUX_INTERNAL KERNEL_TARGET void KERNEL(add)(long *p, size_t n, long x) {
+    VEC v = VEC_SET1(x);
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) VEC_STORE(p + i, VEC_ADD(VEC_LOAD(p + i), v));
+    for (; i < n; i++) p[i] = (long)((unsigned long)p[i] + (unsigned long)x);
+}
+
+FLUX_INTERNAL KERNEL_TARGET void KERNEL(mul)(long *p, size_t n, long x) {
+    VEC v = VEC_SET1(x);
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) VEC_STORE(p + i, VEC_MUL(VEC_LOAD(p + i), v));
+    for (; i < n; i++) p[i] = (long)((unsigned long)p[i] * (unsigned long)x);
+}
+
+// p[i] += q[i]; q may be p itself
+FLUX_INTERNAL KERNEL_TARGET void KERNEL(add_array)(long *p, const long *q, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) VEC_STORE(p + i, VEC_ADD(VEC_LOAD(p + i), VEC_LOAD(q + i)));
+    for (; i < n; i++) p[i] = (long)((unsigned long)p[i] + (unsigned long)q[i]);
+}
+
+FLUX_INTERNAL KERNEL_TARGET void KERNEL(mul_array)(long *p, const long *q, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) VEC_STORE(p + i, VEC_MUL(VEC_LOAD(p + i), VEC_LOAD(q + i)));
+    for (; i < n; i++) p[i] = (long)((unsigned long)p[i] * (unsigned long)q[i]);
+}
+
+// Elements e with e > x (cmp 0), e < x (1) or e == x (2). A true lane is
+// -1, so subtracting the mask counts it.
+KERNEL_TARGET static inline size_t KERNEL(count)(const long *p, size_t n, long x, int cmp) {
+    VEC v = VEC_SET1(x), counts = VEC_ZERO();
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        VEC e = VEC_LOAD(p + i);
+        counts = VEC_SUB(counts, cmp == 0 ? VEC_GT(e, v) : cmp == 1 ? VEC_GT(v, e) : VEC_EQ(e, v));
+    }
+    size_t count = (size_t)KERNEL(lanes_sum)(counts, 0);
+    for (; i < n; i++) count += cmp == 0 ? p[i] > x : cmp == 1 ? p[i] < x : p[i] == x;
+    return count;
+}
+
+FLUX_INTERNAL KERNEL_TARGET size_t KERNEL(count_gt)(const long *p, size_t n, long x) {
+    return KERNEL(count)(p, n, x, 0);
+}
+
+FLUX_INTERNAL KERNEL_TARGET size_t KERNEL(count_lt)(const long *p, size_t n, long x) {
+    return KERNEL(count)(p, n, x, 1);
+}
+
+FLUX_INTERNAL KERNEL_TARGET size_t KERNEL(count_eq)(const long *p, size_t n, long x) {
+    return KERNEL(count)(p, n, x, 2);
+}
@@ -1,448 +1,2725 @@
 /* compiler.c
    flux -> fluxb compiler.
    Usage: gcc -o compiler compiler.c
-          ./compiler source.flux out.fluxb
+          ./compiler [-S|-C] [-O0|-O1] source.flux out.fluxb
+   By default a binary .fluxb image is written (see fluxb.h); -S writes the
+   human-readable text listing instead, which fluxvm also accepts, and -C a
+   C translation unit to build with flux_rt.c (see flux_rt.h).
+   -O1 (the default) runs the optimizer: constant propagation, folding and
+   dead-code removal on the AST, a peephole pass over the lowered code (jump
+   threading, loop inversion) and the loop optimizer (loop-invariant code
+   motion, strength reduction of induction variable products). -O0 runs
+   none of them.
+
+   The source is read through one buffer (mapped where the platform allows),
+   tokenized on demand, parsed by recursive descent into an AST and then
+   lowered into the instruction buffer. Each stage is a single linear pass.
 */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "fluxb.h"
 
-// Global state for IF block tracking
-// We use a stack to handle nested if blocks.
-// The stack stores the unique ID of the current if block.
+// Block IDs used to name generated labels, one counter per construct.
 int if_counter = 0;
-int if_stack[32]; // Max 32 nested if blocks
-int if_stack_top = -1;
-
-// --- NEW: Global state for LOOP block tracking ---
 int while_counter = 0;
-int while_stack[32]; // Max 32 nested while blocks
-int while_stack_top = -1;
-
 int for_counter = 0;
-int for_stack[32]; // Max 32 nested for blocks
-int for_stack_top = -1;
 
+// Declared return type of the function being compiled, used for the
+// store into __ret emitted by 'return'.
+const char *current_return_type = "int";
+
+const char *src_path = "";
 
-void trim(char *s) {
-    // trim leading/trailing whitespace in-place
-    char *p = s;
-    while(*p && isspace((unsigned char)*p)) p++;
-    if (p != s) memmove(s, p, strlen(p)+1);
-    int n = strlen(s);
-    while(n>0 && isspace((unsigned char)s[n-1])) s[--n] = '\0';
+void out_of_memory() {
+    fprintf(stderr, "Error: Out of memory.\n");
+    exit(1);
 }
 
-int starts_with(const char *s, const char *pref) {
-    return strncmp(s, pref, strlen(pref)) == 0;
+// Reports a source error and stops; there is no recovery.
+void error_at(int line, const char *fmt, ...) {
+    va_list ap;
+    fprintf(stderr, "Error: %s:%d: ", src_path, line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
 }
 
-// split comma-separated args into tokens (naive)
-void split_commas(char *s, char out[][256], int *count) {
-    *count = 0;
-    char *p = s;
-    while (*p) {
-        while (*p && isspace((unsigned char)*p)) p++;
-        char *start = p;
-        int in_str = 0;
-        while (*p) {
-            if (*p == '"' ) in_str = !in_str;
-            if (!in_str && *p == ',') break;
-            p++;
-        }
-        int len = p - start;
-        if (len > 0 && *count < 32) {
-            strncpy(out[*count], start, len);
-            out[*count][len] = '\0';
-            trim(out[*count]);
-            (*count)++;
+// --- Arena ---
+// AST nodes and operand strings live until the output is written, so they
+// are bump-allocated from large blocks instead of one malloc each.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+char *arena_block = NULL;
+size_t arena_used = 0;
+size_t arena_size = 0;
+
+void *arena_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7; // keep every allocation 8-byte aligned
+    if (arena_used + size > arena_size) {
+        arena_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block = malloc(arena_size);
+        if (!arena_block) out_of_memory();
+        arena_used = 0;
+    }
+    char *p = arena_block + arena_used;
+    arena_used += size;
+    return p;
+}
+
+char *arena_strndup(const char *s, size_t len) {
+    char *out = arena_alloc(len + 1);
+    memcpy(out, s, len);
+    out[len] = '\0';
+    return out;
+}
+
+// FNV-1a, used by NameIndex and the string pool
+uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+// Open-addressing hash table from names to ints
+typedef struct {
+    const char *key;
+    int value;
+} NameIndexEntry;
+
+typedef struct {
+    NameIndexEntry *entries;
+    int cap;   // power of two
+    int count;
+} NameIndex;
+
+// Returns the value stored for key, or -1.
+int name_index_get(const NameIndex *ix, const char *key) {
+    if (!ix->cap) return -1;
+    uint32_t h = hash_string(key) & (ix->cap - 1);
+    while (ix->entries[h].key) {
+        if (strcmp(ix->entries[h].key, key) == 0) return ix->entries[h].value;
+        h = (h + 1) & (ix->cap - 1);
+    }
+    return -1;
+}
+
+// Adds key -> value unless key is already present (the first definition wins).
+void name_index_put(NameIndex *ix, const char *key, int value) {
+    if ((ix->count + 1) * 2 > ix->cap) {
+        NameIndexEntry *old = ix->entries;
+        int old_cap = ix->cap;
+        ix->cap = old_cap ? old_cap * 2 : 64;
+        ix->entries = calloc(ix->cap, sizeof(NameIndexEntry));
+        if (!ix->entries) out_of_memory();
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i].key) continue;
+            uint32_t h = hash_string(old[i].key) & (ix->cap - 1);
+            while (ix->entries[h].key) h = (h + 1) & (ix->cap - 1);
+            ix->entries[h] = old[i];
         }
-        if (*p == ',') p++;
+        free(old);
+    }
+    uint32_t h = hash_string(key) & (ix->cap - 1);
+    while (ix->entries[h].key) {
+        if (strcmp(ix->entries[h].key, key) == 0) return;
+        h = (h + 1) & (ix->cap - 1);
     }
+    ix->entries[h].key = key;
+    ix->entries[h].value = value;
+    ix->count++;
 }
 
-// Helper to push an if block ID onto the stack
-void push_if_id(int id) {
-    if (if_stack_top < 31) {
-        if_stack[++if_stack_top] = id;
-    } else {
-        fprintf(stderr, "Error: Too many nested if blocks.\n");
+void name_index_clear(NameIndex *ix) {
+    if (ix->entries) memset(ix->entries, 0, ix->cap * sizeof(NameIndexEntry));
+    ix->count = 0;
+}
+
+// --- Source ---
+
+// Returns the whole source file as one read-only buffer (not NUL-terminated).
+const char *map_source(const char *path, size_t *size) {
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror("open source"); exit(1); }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(len > 0 ? len : 1);
+    if (!data || fread(data, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "Error: Failed to read '%s'.\n", path);
         exit(1);
     }
+    fclose(f);
+    *size = (size_t)len;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror("open source"); exit(1); }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { perror("stat source"); exit(1); }
+    *size = (size_t)st.st_size;
+    if (*size == 0) { close(fd); return ""; }
+    void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { perror("map source"); exit(1); }
+    return data;
+#endif
 }
 
-// Helper to pop an if block ID from the stack
-int pop_if_id() {
-    if (if_stack_top >= 0) {
-        return if_stack[if_stack_top--];
+// --- Lexer ---
+// Statements are line based, so newlines are tokens. '#' starts a comment
+// that runs to the end of the line.
+
+typedef enum {
+    TOK_EOF,
+    TOK_NEWLINE,
+    TOK_IDENT,
+    TOK_NUMBER,
+    TOK_STRING,  // text includes the quotes
+    TOK_OP,      // + - * / % ^ > < == !=
+    TOK_ASSIGN,  // =
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_COMMA,
+    TOK_COLON,
+    TOK_LBRACKET,
+    TOK_RBRACKET
+} TokenKind;
+
+typedef struct {
+    TokenKind kind;
+    const char *start;
+    int len;
+    int line;
+} Token;
+
+const char *src_cur = NULL;
+const char *src_end = NULL;
+int src_line = 1;
+Token tok; // current token
+
+void next_token() {
+    const char *p = src_cur;
+    while (p < src_end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p < src_end && *p == '#') {
+        while (p < src_end && *p != '\n') p++;
+    }
+    tok.start = p;
+    tok.line = src_line;
+    if (p == src_end) {
+        tok.kind = TOK_EOF;
+        tok.len = 0;
+        src_cur = p;
+        return;
+    }
+
+    char c = *p++;
+    if (isalpha((unsigned char)c) || c == '_') {
+        while (p < src_end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+        tok.kind = TOK_IDENT;
+    } else if (isdigit((unsigned char)c)) {
+        while (p < src_end && isdigit((unsigned char)*p)) p++;
+        tok.kind = TOK_NUMBER;
+    } else if (c == '"') {
+        // Runs to the next unescaped quote; escapes are left for the VM
+        while (p < src_end && *p != '"' && *p != '\n') {
+            if (*p == '\\' && p + 1 < src_end && p[1] != '\n') p++;
+            p++;
+        }
+        if (p == src_end || *p != '"') error_at(src_line, "unterminated string literal.");
+        p++;
+        tok.kind = TOK_STRING;
     } else {
-        fprintf(stderr, "Error: 'else' or 'endif' without a preceding 'if'.\n");
-        exit(1);
+        switch (c) {
+            case '\n': tok.kind = TOK_NEWLINE; src_line++; break;
+            case '(': tok.kind = TOK_LPAREN; break;
+            case ')': tok.kind = TOK_RPAREN; break;
+            case ',': tok.kind = TOK_COMMA; break;
+            case ':': tok.kind = TOK_COLON; break;
+            case '[': tok.kind = TOK_LBRACKET; break;
+            case ']': tok.kind = TOK_RBRACKET; break;
+            case '=':
+                if (p < src_end && *p == '=') { p++; tok.kind = TOK_OP; }
+                else tok.kind = TOK_ASSIGN;
+                break;
+            case '!':
+                if (p == src_end || *p != '=') error_at(src_line, "unexpected character '!'.");
+                p++;
+                tok.kind = TOK_OP;
+                break;
+            case '+': case '-': case '*': case '/': case '%': case '^': case '>': case '<':
+                tok.kind = TOK_OP;
+                break;
+            default:
+                error_at(src_line, "unexpected character '%c'.", c);
+        }
     }
+    tok.len = (int)(p - tok.start);
+    src_cur = p;
 }
 
-// --- NEW LOOP STACK HELPERS ---
+int tok_is(const char *word) {
+    return tok.kind == TOK_IDENT && (size_t)tok.len == strlen(word) && memcmp(tok.start, word, tok.len) == 0;
+}
 
-void push_while_id(int id) {
-    if (while_stack_top < 31) {
-        while_stack[++while_stack_top] = id;
-    } else {
-        fprintf(stderr, "Error: Too many nested while blocks.\n");
-        exit(1);
+int tok_is_op(const char *op) {
+    return tok.kind == TOK_OP && (size_t)tok.len == strlen(op) && memcmp(tok.start, op, tok.len) == 0;
+}
+
+void error_expected(const char *what) {
+    if (tok.kind == TOK_NEWLINE) error_at(tok.line, "expected %s at end of line.", what);
+    if (tok.kind == TOK_EOF) error_at(tok.line, "expected %s at end of file.", what);
+    error_at(tok.line, "expected %s, found '%.*s'.", what, tok.len, tok.start);
+}
+
+// Consumes a token of the given kind and returns its text
+const char *expect(TokenKind kind, const char *what) {
+    if (tok.kind != kind) error_expected(what);
+    const char *text = arena_strndup(tok.start, tok.len);
+    next_token();
+    return text;
+}
+
+// Every statement ends at a newline (or the end of the file)
+void expect_end_of_statement() {
+    if (tok.kind == TOK_EOF) return;
+    if (tok.kind != TOK_NEWLINE) error_expected("end of line");
+    next_token();
+}
+
+// --- AST ---
+
+typedef enum {
+    EXPR_OPERAND, // a
+    EXPR_BINARY,  // a op b
+    EXPR_CALL,    // a(args)
+    EXPR_INDEX,   // a[b]
+    EXPR_BUILTIN  // a(args) for an array builtin, see resolve_builtins()
+} ExprKind;
+
+// Operands are kept as the text the VM expects: a variable name, a number
+// (possibly negative) or a string literal with its quotes.
+typedef struct {
+    ExprKind kind;
+    int opcode;       // EXPR_BINARY: 0x09..0x12, EXPR_BUILTIN: 0x17..0x24
+    const char *a;    // operand text, EXPR_CALL/EXPR_BUILTIN: function name
+    const char *b;
+    const char **args; // EXPR_CALL/EXPR_BUILTIN
+    int arg_count;
+    const char *type; // set by the optimizer when the value's type differs
+                      // from the declared one, e.g. a folded comparison
+} Expr;
+
+typedef enum {
+    STMT_FUNCTION,
+    STMT_IF,
+    STMT_WHILE,
+    STMT_FOR,
+    STMT_STORE,
+    STMT_PRINT,
+    STMT_ERROR,
+    STMT_INPUT,
+    STMT_RETURN,
+    STMT_CALL,
+    STMT_SET_INDEX
+} StmtKind;
+
+typedef struct Stmt {
+    StmtKind kind;
+    int line;
+    struct Stmt *next;
+    const char *type;       // function: return type; store: declared type
+    const char *name;       // function name, store/input variable, loop/if condition, array
+    const char *params;     // function: "int x, int y"
+    Expr expr;              // store/return/call
+    const char **args;      // print/error operands, set-index: index and value
+    int arg_count;
+    struct Stmt *body;      // function/loop body, if-branch
+    struct Stmt *else_body; // if: else-branch or NULL
+} Stmt;
+
+Stmt *new_stmt(StmtKind kind, int line) {
+    Stmt *s = arena_alloc(sizeof(Stmt));
+    memset(s, 0, sizeof(Stmt));
+    s->kind = kind;
+    s->line = line;
+    return s;
+}
+
+// --- Parser ---
+// program   := { function | statement }
+// function  := type name '(' [type name {',' type name}] ')' ':' block 'end'
+// statement := 'if' '(' operand ')' ':' block ['else' ':' block] 'endif'
+//            | 'while' '(' operand ')' ':' block 'endwhile'
+//            | 'for' '(' operand ')' ':' block 'endfor'
+//            | 'print' '(' [operand {',' operand}] ')'
+//            | 'error' '(' [operand {',' operand}] ')'
+//            | 'input' '(' name ')'
+//            | 'return' expr
+//            | type name '=' expr
+//            | name '[' operand ']' '=' operand
+//            | name '(' [operand {',' operand}] ')'
+// expr      := name '(' [operand {',' operand}] ')' | name '[' operand ']'
+//            | operand [op operand]
+// operand   := name | ['-'] number | string
+
+// Maps an arithmetic/comparison operator token to its opcode, 0 if unknown.
+int binop_opcode(const char *op, int len) {
+    if (len == 1) {
+        switch (op[0]) {
+            case '+': return 0x09;
+            case '-': return 0x0A;
+            case '*': return 0x0B;
+            case '/': return 0x0C;
+            case '%': return 0x0D;
+            case '^': return 0x0E;
+            case '>': return 0x0F;
+            case '<': return 0x10;
+        }
+    } else if (len == 2 && op[1] == '=') {
+        if (op[0] == '=') return 0x11;
+        if (op[0] == '!') return 0x12;
     }
+    return 0;
 }
 
-int pop_while_id() {
-    if (while_stack_top >= 0) {
-        return while_stack[while_stack_top--];
-    } else {
-        fprintf(stderr, "Error: 'endwhile' without a preceding 'while'.\n");
-        exit(1);
+const char *parse_operand() {
+    if (tok.kind == TOK_IDENT || tok.kind == TOK_NUMBER || tok.kind == TOK_STRING) {
+        return expect(tok.kind, "a value");
+    }
+    if (tok_is_op("-")) {
+        // Negative literal: kept as one token, e.g. "-5"
+        const char *start = tok.start;
+        next_token();
+        if (tok.kind != TOK_NUMBER || tok.start != start + 1) error_expected("a number after '-'");
+        const char *text = arena_strndup(start, tok.len + 1);
+        next_token();
+        return text;
+    }
+    error_expected("a value");
+    return NULL;
+}
+
+// Parses '(' [operand {',' operand}] ')' into an operand array
+const char **parse_operand_list(int *count) {
+    expect(TOK_LPAREN, "'('");
+    const char **items = NULL;
+    int cap = 0;
+    *count = 0;
+    if (tok.kind != TOK_RPAREN) {
+        for (;;) {
+            if (*count == cap) {
+                const char **old = items;
+                cap = cap ? cap * 2 : 4;
+                items = arena_alloc(cap * sizeof(const char *));
+                if (old) memcpy(items, old, *count * sizeof(const char *));
+            }
+            items[(*count)++] = parse_operand();
+            if (tok.kind != TOK_COMMA) break;
+            next_token();
+        }
     }
+    expect(TOK_RPAREN, "')'");
+    return items;
 }
 
-void push_for_id(int id) {
-    if (for_stack_top < 31) {
-        for_stack[++for_stack_top] = id;
+// Parses the argument list of a call to 'name'
+Expr parse_call(const char *name) {
+    Expr e;
+    memset(&e, 0, sizeof(e));
+    e.kind = EXPR_CALL;
+    e.a = name;
+    e.args = parse_operand_list(&e.arg_count);
+    return e;
+}
+
+Expr parse_expr() {
+    Expr e;
+    memset(&e, 0, sizeof(e));
+    if (tok.kind == TOK_IDENT) {
+        const char *name = expect(TOK_IDENT, "a value");
+        if (tok.kind == TOK_LPAREN) return parse_call(name);
+        e.a = name;
+        if (tok.kind == TOK_LBRACKET) {
+            next_token();
+            e.kind = EXPR_INDEX;
+            e.b = parse_operand();
+            expect(TOK_RBRACKET, "']' after the index");
+            return e;
+        }
     } else {
-        fprintf(stderr, "Error: Too many nested for blocks.\n");
-        exit(1);
+        e.a = parse_operand();
     }
+    e.kind = EXPR_OPERAND;
+    if (tok.kind == TOK_OP) {
+        e.kind = EXPR_BINARY;
+        e.opcode = binop_opcode(tok.start, tok.len);
+        next_token();
+        e.b = parse_operand();
+    }
+    return e;
+}
+
+// '(' operand ')' ':' newline, the head of if/while/for
+const char *parse_condition() {
+    expect(TOK_LPAREN, "'(' before the condition");
+    const char *cond = parse_operand();
+    expect(TOK_RPAREN, "')' after the condition");
+    expect(TOK_COLON, "':'");
+    expect_end_of_statement();
+    return cond;
 }
 
-int pop_for_id() {
-    if (for_stack_top >= 0) {
-        return for_stack[for_stack_top--];
+Stmt *parse_statement(int toplevel);
+
+// Parses statements up to one of the closing keywords (closer2 may be NULL)
+// and leaves that keyword as the current token.
+Stmt *parse_block(const char *opener, int opener_line, const char *closer, const char *closer2) {
+    Stmt *head = NULL, **tail = &head;
+    for (;;) {
+        while (tok.kind == TOK_NEWLINE) next_token();
+        if (tok.kind == TOK_EOF) error_at(opener_line, "'%s' is missing its '%s'.", opener, closer);
+        if (tok_is(closer) || (closer2 && tok_is(closer2))) return head;
+        if (tok_is("end") || tok_is("endif") || tok_is("endwhile") || tok_is("endfor") || tok_is("else")) {
+            error_at(opener_line, "'%s' is missing its '%s' (found '%.*s' on line %d).",
+                     opener, closer, tok.len, tok.start, tok.line);
+        }
+        Stmt *s = parse_statement(0);
+        *tail = s;
+        tail = &s->next;
+    }
+}
+
+// Consumes a closing keyword such as 'endif' and the end of its line
+void parse_closer() {
+    next_token();
+    expect_end_of_statement();
+}
+
+Stmt *parse_if(int line) {
+    Stmt *s = new_stmt(STMT_IF, line);
+    s->name = parse_condition();
+    s->body = parse_block("if", line, "endif", "else");
+    if (tok_is("else")) {
+        next_token();
+        expect(TOK_COLON, "':' after 'else'");
+        expect_end_of_statement();
+        s->else_body = parse_block("if", line, "endif", NULL);
+    }
+    parse_closer();
+    return s;
+}
+
+Stmt *parse_loop(StmtKind kind, const char *opener, const char *closer, int line) {
+    Stmt *s = new_stmt(kind, line);
+    s->name = parse_condition();
+    s->body = parse_block(opener, line, closer, NULL);
+    parse_closer();
+    return s;
+}
+
+// type name '(' params ')' ':' block 'end', with type and name already read
+Stmt *parse_function(const char *type, const char *name, int line) {
+    Stmt *s = new_stmt(STMT_FUNCTION, line);
+    s->type = type;
+    s->name = name;
+
+    // Parameters are passed on as "int x, int y"
+    expect(TOK_LPAREN, "'('");
+    const char *start = tok.start;
+    const char *end = start;
+    while (tok.kind != TOK_RPAREN) {
+        expect(TOK_IDENT, "a parameter type");
+        end = tok.start + tok.len;
+        expect(TOK_IDENT, "a parameter name");
+        if (tok.kind != TOK_COMMA) break;
+        next_token();
+    }
+    s->params = arena_strndup(start, end - start);
+    expect(TOK_RPAREN, "')' after the parameters");
+    expect(TOK_COLON, "':' after the function header");
+    expect_end_of_statement();
+
+    s->body = parse_block("function", line, "end", NULL);
+    parse_closer();
+    return s;
+}
+
+Stmt *parse_statement(int toplevel) {
+    int line = tok.line;
+    if (tok.kind != TOK_IDENT) error_expected("a statement");
+
+    if (tok_is("if")) {
+        next_token();
+        return parse_if(line);
+    }
+    if (tok_is("while")) {
+        next_token();
+        return parse_loop(STMT_WHILE, "while", "endwhile", line);
+    }
+    if (tok_is("for")) {
+        next_token();
+        return parse_loop(STMT_FOR, "for", "endfor", line);
+    }
+    if (tok_is("else") || tok_is("endif") || tok_is("endwhile") || tok_is("endfor") || tok_is("end")) {
+        error_at(line, "'%.*s' without a matching block.", tok.len, tok.start);
+    }
+
+    Stmt *s;
+    if (tok_is("print") || tok_is("error")) {
+        s = new_stmt(tok_is("print") ? STMT_PRINT : STMT_ERROR, line);
+        next_token();
+        s->args = parse_operand_list(&s->arg_count);
+    } else if (tok_is("input")) {
+        s = new_stmt(STMT_INPUT, line);
+        next_token();
+        expect(TOK_LPAREN, "'('");
+        s->name = expect(TOK_IDENT, "a variable name");
+        expect(TOK_RPAREN, "')'");
+    } else if (tok_is("return")) {
+        s = new_stmt(STMT_RETURN, line);
+        next_token();
+        s->expr = parse_expr();
     } else {
-        fprintf(stderr, "Error: 'endfor' without a preceding 'for'.\n");
-        exit(1);
+        const char *first = expect(TOK_IDENT, "a statement");
+        if (tok.kind == TOK_LPAREN) {
+            // Call statement
+            s = new_stmt(STMT_CALL, line);
+            s->expr = parse_call(first);
+        } else if (tok.kind == TOK_LBRACKET) {
+            // Element store: a[i] = value
+            s = new_stmt(STMT_SET_INDEX, line);
+            s->name = first;
+            s->arg_count = 2;
+            s->args = arena_alloc(2 * sizeof(const char *));
+            next_token();
+            s->args[0] = parse_operand();
+            expect(TOK_RBRACKET, "']' after the index");
+            expect(TOK_ASSIGN, "'='");
+            s->args[1] = parse_operand();
+        } else {
+            const char *name = expect(TOK_IDENT, "a statement");
+            if (tok.kind == TOK_LPAREN) {
+                if (!toplevel) error_at(line, "function '%s' is defined inside another block.", name);
+                return parse_function(first, name, line);
+            }
+            s = new_stmt(STMT_STORE, line);
+            s->type = first;
+            s->name = name;
+            expect(TOK_ASSIGN, "'='");
+            s->expr = parse_expr();
+        }
     }
+    if (s->expr.kind == EXPR_BINARY && !s->expr.opcode) error_at(line, "unsupported operator.");
+    expect_end_of_statement();
+    return s;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s source.flux out.fluxb\n", argv[0]);
+Stmt *parse_program(const char *src, size_t size) {
+    src_cur = src;
+    src_end = src + size;
+    src_line = 1;
+    next_token();
+    Stmt *head = NULL, **tail = &head;
+    for (;;) {
+        while (tok.kind == TOK_NEWLINE) next_token();
+        if (tok.kind == TOK_EOF) return head;
+        Stmt *s = parse_statement(1);
+        *tail = s;
+        tail = &s->next;
+    }
+}
+
+// --- Array builtins ---
+// array(n) makes an array of n zeros; the others work on a whole array in
+// one instruction (see the array opcodes in fluxb.h). They are ordinary
+// call syntax, so a function of the program with the same name is called
+// instead. Arrays are passed by reference: a[i] = x changes the array every
+// variable holding it sees.
+
+typedef struct {
+    const char *name;
+    int opcode;
+    int arg_count;
+    const char *result; // type of the value it gives, NULL: changes its array
+} Builtin;
+
+const Builtin builtins[] = {
+    { "array", 0x17, 1, "array" },
+    { "len", 0x1A, 1, "int" },
+    { "sum", 0x1B, 1, "int" },
+    { "min", 0x1C, 1, "int" },
+    { "max", 0x1D, 1, "int" },
+    { "fill", 0x1E, 2, NULL },     // fill(a, x): every element becomes x
+    { "add_each", 0x1F, 2, NULL }, // add_each(a, x): x added to every element,
+    { "mul_each", 0x20, 2, NULL }, // or x[i] to a[i] when x is an array too
+    { "count_gt", 0x21, 2, "int" }, // count_gt(a, x): elements > x
+    { "count_lt", 0x22, 2, "int" },
+    { "count_eq", 0x23, 2, "int" },
+    { "count_ne", 0x24, 2, "int" },
+};
+
+NameIndex user_functions = { NULL, 0, 0 };
+
+int is_var_operand(const char *t);
+
+const Builtin *find_builtin(const char *name) {
+    if (name_index_get(&user_functions, name) >= 0) return NULL;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
+// Turns a call of a builtin into EXPR_BUILTIN after checking its use
+void resolve_call(Expr *e, int line, int used) {
+    const Builtin *b = e->kind == EXPR_CALL ? find_builtin(e->a) : NULL;
+    if (!b) return;
+    if (e->arg_count != b->arg_count)
+        error_at(line, "'%s' takes %d argument%s.", b->name, b->arg_count, b->arg_count == 1 ? "" : "s");
+    if (b->opcode != 0x17 && !is_var_operand(e->args[0]))
+        error_at(line, "the first argument of '%s' must be an array variable.", b->name);
+    if (used && !b->result) error_at(line, "'%s' does not give a value.", b->name);
+    if (!used && b->result) error_at(line, "the value of '%s' is not used.", b->name);
+    e->kind = EXPR_BUILTIN;
+    e->opcode = b->opcode;
+}
+
+void resolve_block(Stmt *s) {
+    for (; s; s = s->next) {
+        if (s->kind == STMT_STORE || s->kind == STMT_RETURN) resolve_call(&s->expr, s->line, 1);
+        if (s->kind == STMT_CALL) resolve_call(&s->expr, s->line, 0);
+        resolve_block(s->body);
+        resolve_block(s->else_body);
+    }
+}
+
+// Run once the whole program is parsed, as functions may be defined after
+// their first call
+void resolve_builtins(Stmt *program) {
+    for (Stmt *s = program; s; s = s->next) {
+        if (s->kind == STMT_FUNCTION) name_index_put(&user_functions, s->name, 0);
+    }
+    resolve_block(program);
+}
+
+// --- Optimizer ---
+// Runs on the AST of each function (-O1, the default; -O0 turns it off):
+//   - variables holding a known constant are replaced by the constant,
+//   - arithmetic and comparisons on constants are folded into stores,
+//   - if and loop statements with a constant condition keep only the
+//     live arm, and statements after a 'return' in the same block go,
+//   - stores of constants to variables that are never read are removed.
+// Constants follow the VM's conversions exactly (load_operand() and the
+// arithmetic handlers in vm.c). Anything that could fail at run time, such
+// as a division by zero or a string used as a number, is left alone so the
+// VM still reports it.
+
+int opt_level = 1;
+
+typedef enum {
+    CONST_UNKNOWN,
+    CONST_NUM,   // int or bool, the VM treats both as numbers
+    CONST_STR    // string, kept as literal text with quotes
+} ConstKind;
+
+typedef struct {
+    ConstKind kind;
+    long num;
+    const char *str;
+} ConstValue;
+
+// Variable name -> index into the constant environment of one function
+NameIndex opt_vars = { NULL, 0, 0 };
+
+int var_id(const char *name) {
+    int id = name_index_get(&opt_vars, name);
+    if (id < 0) {
+        id = opt_vars.count;
+        name_index_put(&opt_vars, name, id);
+    }
+    return id;
+}
+
+int is_var_operand(const char *t) {
+    return isalpha((unsigned char)t[0]) || t[0] == '_';
+}
+
+const char *num_text(long x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%ld", x);
+    return arena_strndup(buf, len);
+}
+
+// Numeric value of an operand as get_long_value() in the VM would see it;
+// 0 if it is not known at compile time.
+int const_num(const char *t, const ConstValue *env, long *out) {
+    if (is_var_operand(t)) {
+        const ConstValue *c = &env[var_id(t)];
+        if (c->kind != CONST_NUM) return 0;
+        *out = c->num;
         return 1;
     }
-    FILE *fin = fopen(argv[1], "r");
-    if (!fin) { perror("open source"); return 1; }
-    FILE *fout = fopen(argv[2], "w");
-    if (!fout) { perror("open out"); fclose(fin); return 1; }
-
-    char line[1024];
-    while (fgets(line, sizeof(line), fin)) {
-        trim(line);
-        if (line[0] == '\0' || line[0] == '#') continue; // Skip comments starting with #
-
-        // --- CONTROL FLOW STATEMENTS (if/else/endif) ---
-
-        // if(condition_var):
-        if (line[strlen(line)-1] == ':') {
-            char *if_start = strstr(line, "if"); // Find "if"
-            if (if_start == line) { // Must start with 'if'
-                char *p_open = strchr(line, '(');
-                char *p_close = strchr(line, ')');
-
-                if (p_open && p_close && p_close > p_open) {
-                    char cond_var[128];
-                    char *start = p_open + 1;
-                    int len = p_close - start;
-                    strncpy(cond_var, start, len);
-                    cond_var[len] = '\0';
-                    trim(cond_var);
-
-                    // Ensure there's actual content in the condition
-                    if (strlen(cond_var) > 0 && (*(p_close + 1) == ':' || *(p_close + 2) == ':')) {
-                        int current_if_id = if_counter++;
-                        push_if_id(current_if_id);
-
-                        // If condition_var is 0 (false), jump to the else/end block
-                        fprintf(fout, "[0x13] jz %s L_ELSE_%d\n", cond_var, current_if_id);
-                        continue;
-                    }
+    *out = t[0] == '"' ? 0 : strtol(t, NULL, 10);
+    return 1;
+}
+
+// Replaces a variable holding a known number by the number
+const char *subst_num(const char *t, const ConstValue *env) {
+    long x;
+    if (is_var_operand(t) && const_num(t, env, &x)) return num_text(x);
+    return t;
+}
+
+// Value of 'store <type> <var> t', or CONST_UNKNOWN
+ConstValue convert_store(const char *type, const char *t, const ConstValue *env) {
+    ConstValue c = { CONST_UNKNOWN, 0, NULL };
+    if (strcmp(type, "string") == 0) {
+        // Anything but a string reads as "" (get_string_value)
+        const ConstValue *v = is_var_operand(t) ? &env[var_id(t)] : NULL;
+        if (v && v->kind == CONST_UNKNOWN) return c;
+        c.kind = CONST_STR;
+        if (v) c.str = v->kind == CONST_STR ? v->str : "\"\"";
+        else c.str = t[0] == '"' ? t : "\"\"";
+    } else if (strcmp(type, "int") == 0 || strcmp(type, "bool") == 0) {
+        if (const_num(t, env, &c.num)) c.kind = CONST_NUM;
+    }
+    return c;
+}
+
+const char *const_text(const ConstValue *c) {
+    return c->kind == CONST_STR ? c->str : num_text(c->num);
+}
+
+// Evaluates a binary operation the way the VM does; 0 if it must be left
+// to run time.
+int fold_binop(int opcode, long x, long y, long *out) {
+    unsigned long ux = (unsigned long)x, uy = (unsigned long)y;
+    switch (opcode) {
+        case 0x09: *out = (long)(ux + uy); return 1;
+        case 0x0A: *out = (long)(ux - uy); return 1;
+        case 0x0B: *out = (long)(ux * uy); return 1;
+        case 0x0C:
+        case 0x0D:
+            if (y == 0 || (x == LONG_MIN && y == -1)) return 0;
+            *out = opcode == 0x0C ? x / y : x % y;
+            return 1;
+        case 0x0E: {
+            // Exact and wrapping like the VM; x ^ -e with x = 0 fails at run time
+            if (y < 0) {
+                if (x == 0) return 0;
+                *out = x == 1 ? 1 : x == -1 ? ((y & 1) ? -1 : 1) : 0;
+                return 1;
+            }
+            unsigned long r = 1;
+            for (; y; y >>= 1) {
+                if (y & 1) r *= ux;
+                ux *= ux;
+            }
+            *out = (long)r;
+            return 1;
+        }
+        case 0x0F: *out = x > y; return 1;
+        case 0x10: *out = x < y; return 1;
+        case 0x11: *out = x == y; return 1;
+        case 0x12: *out = x != y; return 1;
+    }
+    return 0;
+}
+
+// Propagates constants into e and folds it. Returns what the store of e to
+// a variable of the given type leaves there.
+ConstValue opt_expr(Expr *e, const char *type, const ConstValue *env) {
+    ConstValue unknown = { CONST_UNKNOWN, 0, NULL };
+    if (e->kind == EXPR_CALL || e->kind == EXPR_BUILTIN) {
+        // Only numbers are substituted: they convert to a parameter of any
+        // type exactly as the variable would. A builtin's array stays named.
+        int first = e->kind == EXPR_BUILTIN && e->opcode != 0x17;
+        for (int i = first; i < e->arg_count; i++) e->args[i] = subst_num(e->args[i], env);
+        return unknown;
+    }
+    if (e->kind == EXPR_INDEX) {
+        e->b = subst_num(e->b, env);
+        return unknown;
+    }
+    if (e->kind == EXPR_BINARY) {
+        long x, y, r;
+        e->a = subst_num(e->a, env);
+        e->b = subst_num(e->b, env);
+        if (!const_num(e->a, env, &x) || !const_num(e->b, env, &y) || !fold_binop(e->opcode, x, y, &r)) return unknown;
+        // A folded operation keeps the type the VM would have given it
+        e->kind = EXPR_OPERAND;
+        e->type = e->opcode >= 0x0F ? "bool" : "int";
+        e->a = num_text(r);
+        e->b = NULL;
+        ConstValue c = { CONST_NUM, r, NULL };
+        return c;
+    }
+    ConstValue c = convert_store(type, e->a, env);
+    if (c.kind != CONST_UNKNOWN) e->a = const_text(&c);
+    return c;
+}
+
+// Marks every variable the statements may assign
+void collect_assigned(const Stmt *s, char *assigned) {
+    for (; s; s = s->next) {
+        if (s->kind == STMT_STORE || s->kind == STMT_INPUT) assigned[var_id(s->name)] = 1;
+        collect_assigned(s->body, assigned);
+        collect_assigned(s->else_body, assigned);
+    }
+}
+
+// Interns every variable the statements mention so environments can be
+// sized up front
+void collect_vars(const Stmt *s) {
+    for (; s; s = s->next) {
+        if (s->name) var_id(s->name);
+        const Expr *e = &s->expr;
+        if (e->kind != EXPR_CALL && e->kind != EXPR_BUILTIN && e->a && is_var_operand(e->a)) var_id(e->a);
+        if (e->b && is_var_operand(e->b)) var_id(e->b);
+        for (int i = 0; i < e->arg_count; i++) if (is_var_operand(e->args[i])) var_id(e->args[i]);
+        for (int i = 0; i < s->arg_count; i++) if (is_var_operand(s->args[i])) var_id(s->args[i]);
+        collect_vars(s->body);
+        collect_vars(s->else_body);
+    }
+}
+
+ConstValue *env_copy(const ConstValue *env, int n) {
+    ConstValue *copy = malloc((n ? n : 1) * sizeof(ConstValue));
+    if (!copy) out_of_memory();
+    memcpy(copy, env, n * sizeof(ConstValue));
+    return copy;
+}
+
+// Keeps in env only the constants 'other' agrees on
+void env_merge(ConstValue *env, const ConstValue *other, int n) {
+    for (int i = 0; i < n; i++) {
+        if (env[i].kind != other[i].kind ||
+            (env[i].kind == CONST_NUM && env[i].num != other[i].num) ||
+            (env[i].kind == CONST_STR && strcmp(env[i].str, other[i].str) != 0)) {
+            env[i].kind = CONST_UNKNOWN;
+        }
+    }
+}
+
+const char *opt_return_type = "int";
+
+// Optimizes a statement list in place with env describing the state on
+// entry (updated to the state on exit). Sets *returned if the list always
+// ends in a 'return'.
+Stmt *opt_block(Stmt *list, ConstValue *env, int *returned) {
+    int n = opt_vars.count;
+    Stmt *head = NULL, **tail = &head;
+    *returned = 0;
+    for (Stmt *s = list, *next; s && !*returned; s = next) {
+        next = s->next;
+        s->next = NULL;
+        switch (s->kind) {
+            case STMT_STORE:
+                env[var_id(s->name)] = opt_expr(&s->expr, s->type, env);
+                break;
+            case STMT_INPUT:
+                env[var_id(s->name)].kind = CONST_UNKNOWN;
+                break;
+            case STMT_RETURN:
+                opt_expr(&s->expr, opt_return_type, env);
+                *returned = 1;
+                break;
+            case STMT_CALL:
+                opt_expr(&s->expr, "int", env);
+                break;
+            case STMT_SET_INDEX:
+                for (int i = 0; i < s->arg_count; i++) s->args[i] = subst_num(s->args[i], env);
+                break;
+            case STMT_PRINT:
+            case STMT_ERROR:
+                for (int i = 0; i < s->arg_count; i++) {
+                    const char *t = s->args[i];
+                    if (!is_var_operand(t)) continue;
+                    const ConstValue *c = &env[var_id(t)];
+                    if (c->kind != CONST_UNKNOWN) s->args[i] = const_text(c);
                 }
+                break;
+            case STMT_IF: {
+                long cond;
+                s->name = subst_num(s->name, env);
+                if (const_num(s->name, env, &cond)) {
+                    // Only one arm can run: splice it in place of the if
+                    Stmt *arm = opt_block(cond ? s->body : s->else_body, env, returned);
+                    *tail = arm;
+                    while (*tail) tail = &(*tail)->next;
+                    continue;
+                }
+                ConstValue *else_env = env_copy(env, n);
+                int then_returned, else_returned;
+                s->body = opt_block(s->body, env, &then_returned);
+                s->else_body = opt_block(s->else_body, else_env, &else_returned);
+                if (then_returned) memcpy(env, else_env, n * sizeof(ConstValue));
+                else if (!else_returned) env_merge(env, else_env, n);
+                *returned = then_returned && else_returned;
+                free(else_env);
+                break;
             }
+            case STMT_WHILE:
+            case STMT_FOR: {
+                // Nothing the body assigns is known at the loop head
+                char *assigned = calloc(n ? n : 1, 1);
+                if (!assigned) out_of_memory();
+                collect_assigned(s->body, assigned);
+                for (int i = 0; i < n; i++) if (assigned[i]) env[i].kind = CONST_UNKNOWN;
+                free(assigned);
+                long cond;
+                s->name = subst_num(s->name, env);
+                if (const_num(s->name, env, &cond) && cond == 0) continue; // never entered
+                ConstValue *body_env = env_copy(env, n);
+                int body_returned;
+                s->body = opt_block(s->body, body_env, &body_returned);
+                free(body_env);
+                break;
+            }
+            case STMT_FUNCTION:
+                break;
         }
+        *tail = s;
+        tail = &s->next;
+    }
+    return head;
+}
 
-        // else:
-        if (strcmp(line, "else:") == 0) {
-            int current_if_id = pop_if_id();
-            push_if_id(current_if_id); // Push back, as we're still in the scope
+void count_reads(const Stmt *s, int *reads) {
+    for (; s; s = s->next) {
+        const Expr *e = &s->expr;
+        if (s->kind == STMT_STORE || s->kind == STMT_RETURN) {
+            if (e->kind != EXPR_CALL && e->kind != EXPR_BUILTIN && is_var_operand(e->a)) reads[var_id(e->a)]++;
+            if ((e->kind == EXPR_BINARY || e->kind == EXPR_INDEX) && is_var_operand(e->b)) reads[var_id(e->b)]++;
+        }
+        if (s->kind == STMT_SET_INDEX) reads[var_id(s->name)]++;
+        for (int i = 0; i < e->arg_count; i++) if (is_var_operand(e->args[i])) reads[var_id(e->args[i])]++;
+        for (int i = 0; i < s->arg_count; i++) if (is_var_operand(s->args[i])) reads[var_id(s->args[i])]++;
+        if ((s->kind == STMT_IF || s->kind == STMT_WHILE || s->kind == STMT_FOR) && is_var_operand(s->name))
+            reads[var_id(s->name)]++;
+        count_reads(s->body, reads);
+        count_reads(s->else_body, reads);
+    }
+}
 
-            // Unconditional jump over the else block to the end
-            fprintf(fout, "[0x14] jmp L_ENDIF_%d\n", current_if_id);
-            // Define the jump target for the preceding 'if' condition
-            fprintf(fout, "[0x15] label L_ELSE_%d\n", current_if_id);
+// Drops stores of constants to variables nobody reads
+Stmt *remove_dead_stores(Stmt *list, const int *reads) {
+    Stmt *head = NULL, **tail = &head;
+    for (Stmt *s = list, *next; s; s = next) {
+        next = s->next;
+        if (s->kind == STMT_STORE && s->expr.kind == EXPR_OPERAND &&
+            !is_var_operand(s->expr.a) && reads[var_id(s->name)] == 0) {
             continue;
         }
+        s->body = remove_dead_stores(s->body, reads);
+        s->else_body = remove_dead_stores(s->else_body, reads);
+        *tail = s;
+        tail = &s->next;
+    }
+    *tail = NULL;
+    return head;
+}
 
-        // endif
-        if (strcmp(line, "endif") == 0) {
-            int current_if_id = pop_if_id();
-            // Define the end of the IF block.
-            fprintf(fout, "[0x15] label L_ELSE_%d\n", current_if_id);
-            fprintf(fout, "[0x15] label L_ENDIF_%d\n", current_if_id);
-            continue;
+void optimize_function(Stmt *func) {
+    name_index_clear(&opt_vars);
+    collect_vars(func->body);
+    int n = opt_vars.count;
+
+    opt_return_type = strcmp(func->type, "bool") == 0 || strcmp(func->type, "string") == 0 ||
+                      strcmp(func->type, "array") == 0 ? func->type : "int";
+    ConstValue *env = calloc(n ? n : 1, sizeof(ConstValue));
+    if (!env) out_of_memory();
+    int returned;
+    func->body = opt_block(func->body, env, &returned);
+    free(env);
+
+    int *reads = calloc(n ? n : 1, sizeof(int));
+    if (!reads) out_of_memory();
+    count_reads(func->body, reads);
+    func->body = remove_dead_stores(func->body, reads);
+    free(reads);
+}
+
+// Statements outside functions are never run by the VM and are left as is
+void optimize_program(Stmt *program) {
+    for (Stmt *s = program; s; s = s->next) {
+        if (s->kind == STMT_FUNCTION) optimize_function(s);
+    }
+}
+
+// --- Instruction buffer ---
+// Instructions are collected in memory and written out once the whole source
+// has been compiled, either as a binary image or as the text listing.
+// Operand placement follows fluxb.h. Operand strings are not copied: they
+// live in the arena (or are string constants) until the output is written.
+typedef struct {
+    int opcode;
+    const char *arg1;
+    const char *arg2;
+    const char *dest;
+} IRInstr;
+
+IRInstr *ir = NULL;
+int ir_count = 0;
+int ir_cap = 0;
+
+void emit(int opcode, const char *arg1, const char *arg2, const char *dest) {
+    if (ir_count == ir_cap) {
+        ir_cap = ir_cap ? ir_cap * 2 : 256;
+        ir = realloc(ir, ir_cap * sizeof(IRInstr));
+        if (!ir) out_of_memory();
+    }
+    IRInstr *in = &ir[ir_count++];
+    in->opcode = opcode;
+    in->arg1 = arg1;
+    in->arg2 = arg2;
+    in->dest = dest;
+}
+
+// Builds a generated label name such as "L_ELSE_3"
+const char *label_name(const char *kind, int id) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "L_%s_%d", kind, id);
+    return arena_strndup(buf, len);
+}
+
+// --- Lowering ---
+
+// Builds the "name(a, b)" text the VM decodes at link time
+const char *call_signature(const Expr *e) {
+    size_t len = strlen(e->a) + 3;
+    for (int i = 0; i < e->arg_count; i++) len += strlen(e->args[i]) + 2;
+    char *sig = arena_alloc(len);
+    char *p = sig;
+    p += sprintf(p, "%s(", e->a);
+    for (int i = 0; i < e->arg_count; i++) p += sprintf(p, i ? ", %s" : "%s", e->args[i]);
+    strcpy(p, ")");
+    return sig;
+}
+
+// Evaluates e into variable dest of the given type
+void gen_expr(const Expr *e, const char *type, const char *dest) {
+    if (e->type) type = e->type;
+    switch (e->kind) {
+        case EXPR_CALL:
+            // The callee returns through the caller's __ret
+            emit(0x08, call_signature(e), NULL, NULL);
+            if (strcmp(dest, "__ret") != 0) emit(0x07, type, dest, "__ret");
+            break;
+        case EXPR_BINARY:
+            emit(e->opcode, e->a, e->b, dest);
+            break;
+        case EXPR_OPERAND:
+            emit(0x07, type, dest, e->a);
+            break;
+        case EXPR_INDEX:
+        case EXPR_BUILTIN: {
+            int opcode = e->kind == EXPR_INDEX ? 0x18 : e->opcode;
+            if (e->kind == EXPR_INDEX) emit(0x18, e->a, e->b, dest);
+            else emit(opcode, e->args[0], e->arg_count > 1 ? e->args[1] : NULL, dest);
+            // Elements and counts are ints, array() an array; anything else
+            // is converted like a store
+            if (strcmp(type, opcode == 0x17 ? "array" : "int") != 0) emit(0x07, type, dest, dest);
+            break;
+        }
+    }
+}
+
+void gen_block(const Stmt *s);
+
+void gen_loop(const Stmt *s, const char *kind, int id) {
+    char start_kind[16], end_kind[16];
+    snprintf(start_kind, sizeof(start_kind), "%s_START", kind);
+    snprintf(end_kind, sizeof(end_kind), "%s_END", kind);
+    const char *start = label_name(start_kind, id);
+    const char *end = label_name(end_kind, id);
+    emit(0x15, NULL, NULL, start);
+    // If the condition is 0 (false), leave the loop
+    emit(0x13, s->name, NULL, end);
+    gen_block(s->body);
+    emit(0x14, NULL, NULL, start);
+    emit(0x15, NULL, NULL, end);
+}
+
+void gen_stmt(const Stmt *s) {
+    switch (s->kind) {
+        case STMT_FUNCTION:
+            emit(0x01, s->type, s->name, s->params);
+            // Only int/bool/string/array values can be returned; others return an int
+            if (strcmp(s->type, "bool") == 0 || strcmp(s->type, "string") == 0 || strcmp(s->type, "array") == 0)
+                current_return_type = s->type;
+            else
+                current_return_type = "int";
+            gen_block(s->body);
+            emit(0x02, NULL, NULL, NULL);
+            break;
+        case STMT_IF: {
+            int id = if_counter++;
+            const char *else_label = label_name("ELSE", id);
+            // If the condition is 0 (false), jump to the else/end block
+            emit(0x13, s->name, NULL, else_label);
+            gen_block(s->body);
+            if (s->else_body) {
+                const char *end_label = label_name("ENDIF", id);
+                emit(0x14, NULL, NULL, end_label);
+                emit(0x15, NULL, NULL, else_label);
+                gen_block(s->else_body);
+                emit(0x15, NULL, NULL, end_label);
+            } else {
+                emit(0x15, NULL, NULL, else_label);
+            }
+            break;
+        }
+        case STMT_WHILE:
+            gen_loop(s, "while", while_counter++);
+            break;
+        case STMT_FOR:
+            gen_loop(s, "for", for_counter++);
+            break;
+        case STMT_STORE:
+            gen_expr(&s->expr, s->type, s->name);
+            break;
+        case STMT_PRINT:
+        case STMT_ERROR:
+            for (int i = 0; i < s->arg_count; i++)
+                emit(s->kind == STMT_PRINT ? 0x03 : 0x04, s->args[i], NULL, NULL);
+            break;
+        case STMT_INPUT:
+            emit(0x05, s->name, NULL, NULL);
+            break;
+        case STMT_RETURN:
+            gen_expr(&s->expr, current_return_type, "__ret");
+            emit(0x06, "__ret", NULL, NULL);
+            break;
+        case STMT_CALL:
+            if (s->expr.kind == EXPR_BUILTIN) emit(s->expr.opcode, s->expr.args[1], NULL, s->expr.args[0]);
+            else emit(0x08, call_signature(&s->expr), NULL, NULL);
+            break;
+        case STMT_SET_INDEX:
+            emit(0x19, s->args[0], s->args[1], s->name);
+            break;
+    }
+}
+
+void gen_block(const Stmt *s) {
+    for (; s; s = s->next) gen_stmt(s);
+}
+
+// --- Peephole ---
+// Cleans up the lowered control flow (-O1):
+//   - a run of adjacent labels is merged into its first label,
+//   - a jump to a label followed by 'jmp X' goes straight to X,
+//   - a loop's closing 'jmp START', where START holds 'jz c END' and END
+//     follows the jmp, becomes 'jnz c BODY' with BODY just after the jz, so
+//     an iteration costs one conditional branch instead of a jmp plus a jz,
+//   - jmps to the next instruction, code after an unconditional jmp or a
+//     return up to the next label, and labels no jump uses are dropped.
+
+int peephole_labels = 0;
+NameIndex label_index = { NULL, 0, 0 }; // label name -> IR index
+
+int is_jump(int opcode) {
+    return opcode == 0x13 || opcode == 0x14 || opcode == 0x16;
+}
+
+// Index of the first instruction at or after i that is not a label
+int skip_labels(int i) {
+    while (i < ir_count && ir[i].opcode == 0x15) i++;
+    return i;
+}
+
+// Where a jump to 'name' really lands: follows jmp chains (a bounded number
+// of hops, so jmp cycles stay put) and returns the first label of the run
+// that holds the final target.
+const char *thread_target(const char *name) {
+    int pos = name_index_get(&label_index, name);
+    for (int hops = 0; pos >= 0 && hops < 64; hops++) {
+        int next = skip_labels(pos);
+        if (next == ir_count || ir[next].opcode != 0x14) break;
+        int to = name_index_get(&label_index, ir[next].dest);
+        if (to < 0 || to == pos) break;
+        pos = to;
+    }
+    if (pos < 0) return name;
+    while (pos > 0 && ir[pos - 1].opcode == 0x15) pos--;
+    return ir[pos].dest;
+}
+
+// True if a jump to 'name' from instruction i lands on i + 1
+int jumps_to_next(int i, const char *name) {
+    int pos = name_index_get(&label_index, name);
+    return pos > i && pos < skip_labels(i + 1);
+}
+
+void peephole() {
+    name_index_clear(&label_index);
+    for (int i = 0; i < ir_count; i++) {
+        if (ir[i].opcode == 0x15) name_index_put(&label_index, ir[i].dest, i);
+    }
+    for (int i = 0; i < ir_count; i++) {
+        if (is_jump(ir[i].opcode)) ir[i].dest = thread_target(ir[i].dest);
+    }
+
+    // Loop inversion; body_label[j] names the label inserted after a jz
+    const char **body_label = calloc((size_t)ir_count + 1, sizeof(const char *));
+    if (!body_label) out_of_memory();
+    for (int i = 0; i < ir_count; i++) {
+        if (ir[i].opcode != 0x14) continue;
+        int start = name_index_get(&label_index, ir[i].dest);
+        if (start < 0 || start > i) continue;
+        int test = skip_labels(start);
+        if (test >= i || ir[test].opcode != 0x13 || !jumps_to_next(i, ir[test].dest)) continue;
+        if (!body_label[test]) body_label[test] = label_name("BODY", peephole_labels++);
+        ir[i].opcode = 0x16;
+        ir[i].arg1 = ir[test].arg1;
+        ir[i].dest = body_label[test];
+    }
+
+    // Drop unreachable code and jumps to the next instruction
+    char *live = malloc((size_t)ir_count + 1);
+    if (!live) out_of_memory();
+    int reachable = 1;
+    for (int i = 0; i < ir_count; i++) {
+        int op = ir[i].opcode;
+        if (op == 0x15 || op == 0x01 || op == 0x02) reachable = 1;
+        live[i] = reachable || op == 0x02;
+        if (!live[i]) continue;
+        if (op == 0x14 && jumps_to_next(i, ir[i].dest)) live[i] = 0;
+        else if (op == 0x14 || op == 0x06) reachable = 0;
+    }
+
+    // Keep only labels some live jump uses
+    NameIndex used = { NULL, 0, 0 };
+    for (int i = 0; i < ir_count; i++) {
+        if (live[i] && is_jump(ir[i].opcode)) name_index_put(&used, ir[i].dest, 1);
+    }
+    int n = 0;
+    IRInstr *out = malloc(((size_t)ir_count * 2 + 1) * sizeof(IRInstr));
+    if (!out) out_of_memory();
+    for (int i = 0; i < ir_count; i++) {
+        if (!live[i]) continue;
+        if (ir[i].opcode == 0x15 && name_index_get(&used, ir[i].dest) < 0) continue;
+        out[n++] = ir[i];
+        if (body_label[i]) {
+            IRInstr label = { 0x15, NULL, NULL, body_label[i] };
+            out[n++] = label;
+        }
+    }
+    free(ir);
+    ir = out;
+    ir_count = n;
+    ir_cap = ir_count * 2 + 1;
+    free(used.entries);
+    free(live);
+    free(body_label);
+}
+
+// --- Loop optimizer ---
+// Works on the control-flow graph of each function after the peephole pass
+// (-O1). Loops are found from back edges in the dominator tree. In the
+// inverted form left by the peephole pass a loop header is its BODY label,
+// and the point just above it runs once each time the loop is entered: that
+// is the preheader.
+//   - computations giving the same value on every iteration are moved into
+//     the preheader,
+//   - 'mul i c t' on an induction variable i (changed only by 'add i k i')
+//     becomes a running 'add t c*k t' placed next to the update of i, when
+//     both run on every iteration and t is not read after the loop.
+//   - pow with a literal exponent of 2 or 3 becomes multiplication.
+// Only instructions that cannot fail are hoisted, so a program that stops
+// with a VM error still stops in the same place with the same output.
+
+typedef struct {
+    int start, end;   // IR range [start, end)
+    int succ[2];
+    int succ_count;
+    int *preds;
+    int pred_count;
+    int pred_cap;
+    int idom;         // immediate dominator, -1 for the entry
+    int order;        // reverse postorder number, -1 if unreachable
+    int dom_pre;      // numbering of the dominator tree, for dominates()
+    int dom_post;
+    int claimed;      // changed by a loop transformed this round
+} Block;
+
+Block *blocks = NULL;
+int block_count = 0;
+int block_cap = 0;
+int *block_of = NULL;   // IR index - function start -> block
+
+// Edits collected during a round and applied by rebuild_ir()
+typedef struct {
+    IRInstr *items;
+    int count;
+    int cap;
+} IRList;
+
+IRList *insert_before = NULL;
+IRList *insert_after = NULL;
+char *deleted = NULL;
+
+void ir_list_add(IRList *list, IRInstr in) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 4;
+        list->items = realloc(list->items, list->cap * sizeof(IRInstr));
+        if (!list->items) out_of_memory();
+    }
+    list->items[list->count++] = in;
+}
+
+int is_binop(int opcode) {
+    return opcode >= 0x09 && opcode <= 0x12;
+}
+
+int is_array_op(int opcode) {
+    return opcode >= 0x17 && opcode <= 0x24;
+}
+
+// An array opcode that sets its dest variable, rather than changing the
+// array dest holds
+int array_op_sets_dest(int opcode) {
+    return is_array_op(opcode) && opcode != 0x19 && (opcode < 0x1E || opcode > 0x20);
+}
+
+// Splits a call signature "name(a, b)" like the VM's link_call(): commas
+// inside string literals do not separate arguments, and each argument is
+// trimmed. Returns the argument count; the pieces live in the arena.
+int split_call(const char *sig, const char **name, const char ***args) {
+    const char *open = strchr(sig, '(');
+    const char *close = strrchr(sig, ')');
+    if (!open || !close || close < open) open = close = sig + strlen(sig);
+    const char *end = open;
+    while (end > sig && isspace((unsigned char)end[-1])) end--;
+    *name = arena_strndup(sig, end - sig);
+
+    int count = 0, cap = 4;
+    const char **out = arena_alloc(cap * sizeof(const char *));
+    const char *p = open < close ? open + 1 : close;
+    while (p < close) {
+        while (p < close && isspace((unsigned char)*p)) p++;
+        const char *start = p;
+        int in_str = 0;
+        while (p < close && (in_str || *p != ',')) {
+            if (*p == '"') in_str = !in_str;
+            p++;
         }
+        const char *stop = p;
+        while (stop > start && isspace((unsigned char)stop[-1])) stop--;
+        if (stop > start) {
+            if (count == cap) {
+                const char **grown = arena_alloc(cap * 2 * sizeof(const char *));
+                memcpy(grown, out, cap * sizeof(const char *));
+                out = grown;
+                cap *= 2;
+            }
+            out[count++] = arena_strndup(start, stop - start);
+        }
+        if (p < close) p++;
+    }
+    *args = out;
+    return count;
+}
 
-        // --- NEW: LOOP STATEMENTS (while/endwhile & for/endfor) ---
-
-        if (line[strlen(line)-1] == ':') {
-            char *p_open = strchr(line, '(');
-            char *p_close = strchr(line, ')');
-
-            if (p_open && p_close && p_close > p_open) {
-                
-                // Extract condition variable
-                char cond_var[128];
-                char *start = p_open + 1;
-                int len = p_close - start;
-                strncpy(cond_var, start, len);
-                cond_var[len] = '\0';
-                trim(cond_var);
-
-                if (strlen(cond_var) > 0 && (*(p_close + 1) == ':' || *(p_close + 2) == ':')) {
-                    
-                    // while(condition_var):
-                    char *while_start = strstr(line, "while"); 
-                    if (while_start == line) {
-                        int current_id = while_counter++;
-                        push_while_id(current_id);
-
-                        // 1. Define the start label
-                        fprintf(fout, "[0x15] label L_while_START_%d\n", current_id);
-                        
-                        // 2. Conditional jump: If condition_var is 0 (false), jump to the end
-                        fprintf(fout, "[0x13] jz %s L_while_END_%d\n", cond_var, current_id);
-                        
-                        continue;
-                    }
-
-                    // for(condition_var):
-                    char *for_start = strstr(line, "for"); 
-                    if (for_start == line) {
-                        int current_id = for_counter++;
-                        push_for_id(current_id);
-
-                        // 1. Define the start label
-                        fprintf(fout, "[0x15] label L_for_START_%d\n", current_id);
-                        
-                        // 2. Conditional jump: If condition_var is 0 (false), jump to the end
-                        fprintf(fout, "[0x13] jz %s L_for_END_%d\n", cond_var, current_id);
-                        
-                        continue;
-                    }
+// Splits a parameter list "int x, string s" into types and names
+int split_params(const char *decl, const char ***types, const char ***names) {
+    int count = 0;
+    for (const char *p = decl; p && *p; p++) count += *p == ',';
+    count += decl && *decl;
+    *types = arena_alloc((count + 1) * sizeof(const char *));
+    *names = arena_alloc((count + 1) * sizeof(const char *));
+    int n = 0;
+    const char *p = decl ? decl : "";
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        const char *type = p;
+        while (*p && *p != ' ' && *p != ',') p++;
+        const char *type_end = p;
+        while (*p == ' ') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ' ') p++;
+        if (p > name) {
+            (*types)[n] = arena_strndup(type, type_end - type);
+            (*names)[n] = arena_strndup(name, p - name);
+            n++;
+        }
+        while (*p && *p != ',') p++;
+    }
+    return n;
+}
+
+// Variable an instruction assigns, or NULL
+const char *instr_def(const IRInstr *in) {
+    if (in->opcode == 0x07) return in->arg2;
+    if (is_binop(in->opcode) || array_op_sets_dest(in->opcode)) return in->dest;
+    if (in->opcode == 0x05) return in->arg1;
+    if (in->opcode == 0x08) return "__ret";
+    return NULL;
+}
+
+// Variables an instruction reads, left in use_names[0..count)
+const char **use_names = NULL;
+int use_cap = 0;
+
+int instr_uses(const IRInstr *in) {
+    int count = 0;
+    const char *ops[3] = { NULL, NULL, NULL };
+    switch (in->opcode) {
+        case 0x07: ops[0] = in->dest; break;
+        case 0x03: case 0x04: case 0x06: case 0x13: case 0x16: ops[0] = in->arg1; break;
+        case 0x08: {
+            const char *name, **args;
+            int n = split_call(in->arg1, &name, &args);
+            for (int k = 0; k < n; k++) {
+                if (!is_var_operand(args[k])) continue;
+                if (count == use_cap) {
+                    use_cap = use_cap ? use_cap * 2 : 16;
+                    use_names = realloc(use_names, use_cap * sizeof(const char *));
+                    if (!use_names) out_of_memory();
                 }
+                use_names[count++] = args[k];
             }
+            return count;
         }
+        default:
+            if (is_binop(in->opcode)) { ops[0] = in->arg1; ops[1] = in->arg2; }
+            if (is_array_op(in->opcode)) {
+                ops[0] = in->arg1;
+                if (fluxb_array_op_has_arg2(in->opcode)) ops[1] = in->arg2;
+                if (!array_op_sets_dest(in->opcode)) ops[2] = in->dest;
+            }
+    }
+    if (use_cap < 3) {
+        use_cap = 16;
+        use_names = realloc(use_names, use_cap * sizeof(const char *));
+        if (!use_names) out_of_memory();
+    }
+    for (int k = 0; k < 3; k++) {
+        if (ops[k] && is_var_operand(ops[k])) use_names[count++] = ops[k];
+    }
+    return count;
+}
 
-        // endwhile
-        if (strcmp(line, "endwhile") == 0) {
-            int current_id = pop_while_id();
-            
-            // 1. Unconditional jump back to the start label
-            fprintf(fout, "[0x14] jmp L_while_START_%d\n", current_id);
-            
-            // 2. Define the end label (jump target for jz)
-            fprintf(fout, "[0x15] label L_while_END_%d\n", current_id); 
-            continue;
+// True for a numeric literal (string literals read as 0 but are left alone)
+int is_num_literal(const char *t) {
+    return t && !is_var_operand(t) && t[0] != '"';
+}
+
+int dominates(int a, int b) {
+    return blocks[b].order >= 0 && blocks[a].dom_pre <= blocks[b].dom_pre && blocks[b].dom_post <= blocks[a].dom_post;
+}
+
+void add_edge(int from, int to) {
+    Block *b = &blocks[to];
+    blocks[from].succ[blocks[from].succ_count++] = to;
+    if (b->pred_count == b->pred_cap) {
+        b->pred_cap = b->pred_cap ? b->pred_cap * 2 : 4;
+        b->preds = realloc(b->preds, b->pred_cap * sizeof(int));
+        if (!b->preds) out_of_memory();
+    }
+    b->preds[b->pred_count++] = from;
+}
+
+// Splits IR [lo, hi) into basic blocks and computes dominators
+void build_cfg(int lo, int hi) {
+    for (int b = 0; b < block_count; b++) free(blocks[b].preds);
+    block_count = 0;
+    free(block_of);
+    block_of = malloc(((size_t)(hi - lo) + 1) * sizeof(int));
+    if (!block_of) out_of_memory();
+    for (int i = lo; i < hi; i++) {
+        int op = ir[i].opcode;
+        int prev = i > lo ? ir[i - 1].opcode : 0;
+        if (i == lo || op == 0x15 || is_jump(prev) || prev == 0x06 || prev == 0x02) {
+            if (block_count == block_cap) {
+                block_cap = block_cap ? block_cap * 2 : 64;
+                blocks = realloc(blocks, block_cap * sizeof(Block));
+                if (!blocks) out_of_memory();
+            }
+            memset(&blocks[block_count], 0, sizeof(Block));
+            blocks[block_count].start = i;
+            blocks[block_count].idom = -1;
+            blocks[block_count].order = -1;
+            if (block_count) blocks[block_count - 1].end = i;
+            block_count++;
         }
+        block_of[i - lo] = block_count - 1;
+    }
+    blocks[block_count - 1].end = hi;
 
-        // endfor
-        if (strcmp(line, "endfor") == 0) {
-            int current_id = pop_for_id();
-            
-            // 1. Unconditional jump back to the start label
-            fprintf(fout, "[0x14] jmp L_for_START_%d\n", current_id);
-            
-            // 2. Define the end label (jump target for jz)
-            fprintf(fout, "[0x15] label L_for_END_%d\n", current_id); 
-            continue;
+    for (int b = 0; b < block_count; b++) {
+        const IRInstr *last = &ir[blocks[b].end - 1];
+        if (is_jump(last->opcode)) {
+            int target = name_index_get(&label_index, last->dest);
+            if (target >= lo && target < hi) add_edge(b, block_of[target - lo]);
         }
+        if (last->opcode != 0x14 && last->opcode != 0x06 && last->opcode != 0x02 && b + 1 < block_count)
+            add_edge(b, b + 1);
+    }
 
-        // --- EXISTING FUNCTIONALITY ---
-
-        // function entry: "<type> name(params):"
-        // e.g. int add(int x, int y):
-        char type[64], rest[256];
-        if (sscanf(line, "%63s %255[^\n]", type, rest) >= 2) {
-            size_t L = strlen(line);
-            if (line[L-1] == ':' && strchr(rest, '(') && strchr(rest, ')')) {
-                // extract name and params inside parentheses
-                char name[128];
-                char params[256];
-                char *popen = strchr(rest, '(');
-                char *pclose = strrchr(rest, ')');
-                if (popen && pclose && pclose > popen) {
-                    int namelen = popen - rest;
-                    while (namelen>0 && isspace((unsigned char)rest[namelen-1])) namelen--;
-                    strncpy(name, rest, namelen);
-                    name[namelen] = '\0';
-                    int plen = pclose - popen - 1;
-                    if (plen > 0) {
-                        strncpy(params, popen+1, plen);
-                        params[plen] = '\0';
-                        trim(params);
-                    } else params[0] = '\0';
-                    trim(name);
-                    // write entry with params preserved
-                    if (params[0])
-                        fprintf(fout, "[0x01] entry %s %s(%s)\n", type, name, params);
-                    else
-                        fprintf(fout, "[0x01] entry %s %s()\n", type, name);
-                    continue;
+    // Reverse postorder by an explicit-stack DFS from the entry
+    int *rpo = malloc(block_count * sizeof(int));
+    int *stack = malloc(block_count * sizeof(int));
+    int *next_succ = calloc(block_count, sizeof(int));
+    char *seen = calloc(block_count, 1);
+    if (!rpo || !stack || !next_succ || !seen) out_of_memory();
+    int sp = 0, post = block_count;
+    stack[sp++] = 0;
+    seen[0] = 1;
+    while (sp > 0) {
+        int b = stack[sp - 1];
+        if (next_succ[b] < blocks[b].succ_count) {
+            int s = blocks[b].succ[next_succ[b]++];
+            if (!seen[s]) { seen[s] = 1; stack[sp++] = s; }
+        } else {
+            rpo[--post] = b;
+            sp--;
+        }
+    }
+    int reachable = block_count - post;
+    for (int k = 0; k < reachable; k++) blocks[rpo[post + k]].order = k;
+
+    // Iterative dominators (Cooper, Harvey and Kennedy)
+    int *idom = malloc(block_count * sizeof(int));
+    if (!idom) out_of_memory();
+    for (int b = 0; b < block_count; b++) idom[b] = -1;
+    idom[0] = 0;
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int k = 1; k < reachable; k++) {
+            int b = rpo[post + k];
+            int new_idom = -1;
+            for (int p = 0; p < blocks[b].pred_count; p++) {
+                int pred = blocks[b].preds[p];
+                if (idom[pred] < 0) continue;
+                if (new_idom < 0) { new_idom = pred; continue; }
+                int x = pred, y = new_idom;
+                while (x != y) {
+                    while (blocks[x].order > blocks[y].order) x = idom[x];
+                    while (blocks[y].order > blocks[x].order) y = idom[y];
                 }
+                new_idom = x;
             }
+            if (new_idom != idom[b]) { idom[b] = new_idom; changed = 1; }
         }
+    }
+    for (int b = 1; b < block_count; b++) blocks[b].idom = idom[b];
 
-        // end
-        if (strcmp(line, "end") == 0) {
-            fprintf(fout, "[0x02] end\n");
-            continue;
+    // Pre/post numbers of the dominator tree: a dominates b when b's
+    // interval nests inside a's. Children are linked through first/sibling.
+    int *first = malloc(block_count * sizeof(int));
+    int *sibling = malloc(block_count * sizeof(int));
+    if (!first || !sibling) out_of_memory();
+    for (int b = 0; b < block_count; b++) first[b] = -1;
+    for (int b = block_count - 1; b > 0; b--) {
+        if (idom[b] < 0) continue;
+        sibling[b] = first[idom[b]];
+        first[idom[b]] = b;
+    }
+    int clock = 0;
+    sp = 0;
+    stack[sp++] = 0;
+    blocks[0].dom_pre = clock++;
+    while (sp > 0) {
+        int b = stack[sp - 1];
+        if (first[b] >= 0) {
+            int child = first[b];
+            first[b] = sibling[child];
+            blocks[child].dom_pre = clock++;
+            stack[sp++] = child;
+        } else {
+            blocks[b].dom_post = clock++;
+            sp--;
+        }
+    }
+    free(first);
+    free(sibling);
+    free(idom);
+    free(rpo);
+    free(stack);
+    free(next_succ);
+    free(seen);
+}
+
+// numeric_out[b * var_count + v]: v certainly holds an int/bool at the end
+// of block b (a forward "must" analysis, intersecting over predecessors)
+unsigned char *numeric_out = NULL;
+int var_count = 0;
+
+void numeric_transfer(unsigned char *state, const IRInstr *in) {
+    const char *def = instr_def(in);
+    if (!def) return;
+    int numeric = is_binop(in->opcode) || (array_op_sets_dest(in->opcode) && in->opcode != 0x17) ||
+                  (in->opcode == 0x07 && (strcmp(in->arg1, "int") == 0 || strcmp(in->arg1, "bool") == 0));
+    state[var_id(def)] = (unsigned char)numeric;
+}
+
+// Numbers every variable of the function at IR [lo, hi), parameters
+// included, through var_id()
+void collect_function_vars(int lo, int hi) {
+    name_index_clear(&opt_vars);
+    const char **types, **names;
+    int n = split_params(ir[lo].dest, &types, &names);
+    for (int k = 0; k < n; k++) var_id(names[k]);
+    for (int i = lo; i < hi; i++) {
+        const char *def = instr_def(&ir[i]);
+        if (def) var_id(def);
+        int uses = instr_uses(&ir[i]);
+        for (int u = 0; u < uses; u++) var_id(use_names[u]);
+    }
+    var_count = opt_vars.count;
+}
+
+// State on entry to block b: parameters declared int or bool are numbers
+// on entry to the function (except main's, which the VM leaves unassigned),
+// other blocks intersect their predecessors
+void numeric_in(int b, int lo, unsigned char *state) {
+    if (b == 0) {
+        memset(state, 0, var_count);
+        if (strcmp(ir[lo].arg2, "main") == 0) return;
+        const char **types, **names;
+        int n = split_params(ir[lo].dest, &types, &names);
+        for (int k = 0; k < n; k++) {
+            if (strcmp(types[k], "int") == 0 || strcmp(types[k], "bool") == 0) state[var_id(names[k])] = 1;
         }
+        return;
+    }
+    memset(state, 1, var_count);
+    for (int k = 0; k < blocks[b].pred_count; k++) {
+        int pred = blocks[b].preds[k];
+        if (blocks[pred].order < 0) continue;
+        const unsigned char *out = &numeric_out[(size_t)pred * var_count];
+        for (int v = 0; v < var_count; v++) state[v] &= out[v];
+    }
+}
+
+// Returns 0 if the function is too large to analyse
+int analyse_numeric(int lo) {
+    size_t size = (size_t)block_count * var_count;
+    if (size > (16u << 20)) return 0;
+    free(numeric_out);
+    numeric_out = malloc(size ? size : 1);
+    unsigned char *in_state = malloc(var_count ? var_count : 1);
+    if (!numeric_out || !in_state) out_of_memory();
+    memset(numeric_out, 1, size);
 
-        // print(...) supports multiple args separated by comma
-        if (starts_with(line, "print(") && line[strlen(line)-1] == ')') {
-            char inside[900];
-            strncpy(inside, line + 6, sizeof(inside)-1);
-            inside[sizeof(inside)-1] = '\0';
-            inside[strlen(inside)-1] = '\0'; // remove trailing ')'
-            trim(inside);
-            // split by commas
-            char parts[16][256];
-            int pc = 0;
-            split_commas(inside, parts, &pc);
-            for (int i=0;i<pc;i++) {
-                fprintf(fout, "[0x03] stdout %s\n", parts[i]);
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int b = 0; b < block_count; b++) {
+            if (blocks[b].order < 0) continue;
+            numeric_in(b, lo, in_state);
+            for (int i = blocks[b].start; i < blocks[b].end; i++) numeric_transfer(in_state, &ir[i]);
+            unsigned char *out = &numeric_out[(size_t)b * var_count];
+            if (memcmp(out, in_state, var_count) != 0) {
+                memcpy(out, in_state, var_count);
+                changed = 1;
             }
-            continue;
         }
+    }
+    free(in_state);
+    return 1;
+}
+
+// Per-loop facts, indexed by variable
+int *def_count = NULL;
+int *def_at = NULL;       // IR index of the only definition when def_count == 1
+char *uses_ok = NULL;     // every use in the loop comes after the definition
+char *hoisted = NULL;     // defined by an instruction moved to the preheader
+
+// One natural loop: its blocks, latches and preheader block
+int *loop_blocks = NULL;
+int loop_size = 0;
+char *in_loop = NULL;
+
+int loop_dominates_latches(int b, int header) {
+    for (int k = 0; k < blocks[header].pred_count; k++) {
+        int latch = blocks[header].preds[k];
+        if (in_loop[latch] && !dominates(b, latch)) return 0;
+    }
+    return 1;
+}
+
+// An operand that has the same value everywhere in the loop
+int loop_invariant(const char *t) {
+    return !is_var_operand(t) || def_count[var_id(t)] == 0 || hoisted[var_id(t)];
+}
+
+// An operand get_long_value() reads without failing at the preheader
+int numeric_at(const char *t, int pre) {
+    if (!is_var_operand(t)) return 1;
+    int v = var_id(t);
+    if (def_count[v] == 0) return numeric_out[(size_t)pre * var_count + v];
+    return hoisted[v] == 2;
+}
+
+// Does any instruction of IR [lo, hi) outside the loop read variable v?
+int used_outside_loop(int v, int lo, int hi) {
+    for (int i = lo; i < hi; i++) {
+        if (in_loop[block_of[i - lo]]) continue;
+        int n = instr_uses(&ir[i]);
+        for (int u = 0; u < n; u++) {
+            if (var_id(use_names[u]) == v) return 1;
+        }
+    }
+    return 0;
+}
 
-        // error("...")
-        if (starts_with(line, "error(") && line[strlen(line)-1] == ')') {
-            char inside[900];
-            strncpy(inside, line + 6, sizeof(inside)-1);
-            inside[sizeof(inside)-1] = '\0';
-            inside[strlen(inside)-1] = '\0';
-            trim(inside);
-            fprintf(fout, "[0x04] stderr %s\n", inside);
-            continue;
+// Can instruction i, whose block dominates the latches, run in the preheader?
+int can_hoist(const IRInstr *in, int pre) {
+    const char *def = instr_def(in);
+    if (!def || strcmp(def, "__ret") == 0) return 0;
+    int v = var_id(def);
+    if (def_count[v] != 1 || !uses_ok[v]) return 0;
+    if (in->opcode == 0x07) {
+        if (!loop_invariant(in->dest)) return 0;
+        if (strcmp(in->arg1, "string") == 0) return 1;
+        if (strcmp(in->arg1, "int") != 0 && strcmp(in->arg1, "bool") != 0) return 0;
+        return numeric_at(in->dest, pre);
+    }
+    if (!is_binop(in->opcode)) return 0;
+    if (!loop_invariant(in->arg1) || !loop_invariant(in->arg2)) return 0;
+    if (!numeric_at(in->arg1, pre) || !numeric_at(in->arg2, pre)) return 0;
+    if (in->opcode == 0x0C || in->opcode == 0x0D) {
+        // Only a literal divisor that can never trap
+        if (!is_num_literal(in->arg2)) return 0;
+        long d = strtol(in->arg2, NULL, 10);
+        if (d == 0 || d == -1) return 0;
+    }
+    return 1;
+}
+
+// Collects the natural loop of header h: the blocks that reach a latch
+// without passing through the header
+void collect_loop(int h) {
+    loop_size = 0;
+    in_loop[h] = 1;
+    loop_blocks[loop_size++] = h;
+    for (int k = 0; k < blocks[h].pred_count; k++) {
+        int latch = blocks[h].preds[k];
+        if (!dominates(h, latch) || in_loop[latch]) continue;
+        in_loop[latch] = 1;
+        loop_blocks[loop_size++] = latch;
+        for (int w = loop_size - 1; w < loop_size; w++) {
+            int b = loop_blocks[w];
+            for (int p = 0; p < blocks[b].pred_count; p++) {
+                int pred = blocks[b].preds[p];
+                if (in_loop[pred] || blocks[pred].order < 0) continue;
+                in_loop[pred] = 1;
+                loop_blocks[loop_size++] = pred;
+            }
         }
+    }
+}
 
-        // input(var)
-        if (starts_with(line, "input(") && line[strlen(line)-1] == ')') {
-            char var[128];
-            strncpy(var, line + 6, sizeof(var)-1);
-            var[sizeof(var)-1] = '\0';
-            var[strlen(var)-1] = '\0';
-            trim(var);
-            fprintf(fout, "[0x05] read %s\n", var);
-            continue;
+// Transforms the loop collected in loop_blocks. Returns 1 if the IR was
+// changed.
+int optimize_loop(int h, int lo) {
+    for (int k = 0; k < loop_size; k++) if (blocks[loop_blocks[k]].claimed) return 0;
+
+    // The preheader point: the loop is entered only by falling into h from
+    // the block just above it
+    int pre = -1;
+    for (int k = 0; k < blocks[h].pred_count; k++) {
+        int pred = blocks[h].preds[k];
+        if (in_loop[pred]) continue;
+        if (pre >= 0) return 0;
+        pre = pred;
+    }
+    if (pre < 0 || blocks[pre].end != blocks[h].start) return 0;
+    const IRInstr *entry_jump = &ir[blocks[pre].end - 1];
+    if (is_jump(entry_jump->opcode) && name_index_get(&label_index, entry_jump->dest) >= blocks[h].start &&
+        name_index_get(&label_index, entry_jump->dest) < blocks[h].end) return 0;
+
+    memset(def_count, 0, var_count * sizeof(int));
+    memset(hoisted, 0, var_count);
+    memset(uses_ok, 1, var_count);
+    for (int k = 0; k < loop_size; k++) {
+        const Block *b = &blocks[loop_blocks[k]];
+        for (int i = b->start; i < b->end; i++) {
+            const char *def = instr_def(&ir[i]);
+            if (!def) continue;
+            int v = var_id(def);
+            def_count[v]++;
+            def_at[v] = i;
         }
+    }
+    for (int k = 0; k < loop_size; k++) {
+        int bi = loop_blocks[k];
+        for (int i = blocks[bi].start; i < blocks[bi].end; i++) {
+            int n = instr_uses(&ir[i]);
+            for (int u = 0; u < n; u++) {
+                int v = var_id(use_names[u]);
+                if (def_count[v] != 1) continue;
+                int d = def_at[v], db = block_of[d - lo];
+                if (db == bi ? i <= d : !dominates(db, bi)) uses_ok[v] = 0;
+            }
+        }
+    }
 
-        // return <expr>
-        if (starts_with(line, "return ")) {
-            char val[512];
-            strncpy(val, line + 7, sizeof(val)-1);
-            val[sizeof(val)-1] = '\0';
-            trim(val);
-            // We reuse the arithmetic/comparison parsing logic here for return value calculation
-            char a[256], b[256], op[8];
-            if (sscanf(val, "%255s %7s %255s", a, op, b) == 3) {
-                if (strcmp(op, "+")==0) fprintf(fout, "[0x09] add %s %s __ret\n", a, b);
-                else if (strcmp(op, "-")==0) fprintf(fout, "[0x0A] sub %s %s __ret\n", a, b);
-                else if (strcmp(op, "*")==0) fprintf(fout, "[0x0B] mul %s %s __ret\n", a, b);
-                else if (strcmp(op, "/")==0) fprintf(fout, "[0x0C] div %s %s __ret\n", a, b);
-                else if (strcmp(op, "%")==0) fprintf(fout, "[0x0D] mod %s %s __ret\n", a, b);
-                else if (strcmp(op, "^")==0) fprintf(fout, "[0x0E] pow %s %s __ret\n", a, b);
-                // Comparison operators (less likely for return, but supported for consistency)
-                else if (strcmp(op, ">")==0) fprintf(fout, "[0x0F] gt %s %s __ret\n", a, b);
-                else if (strcmp(op, "<")==0) fprintf(fout, "[0x10] lt %s %s __ret\n", a, b);
-                else if (strcmp(op, "==")==0) fprintf(fout, "[0x11] eq %s %s __ret\n", a, b);
-                else if (strcmp(op, "!=")==0) fprintf(fout, "[0x12] ne %s %s __ret\n", a, b);
-                else fprintf(fout, "[0x07] store int __ret %s\n", val); // Fallback for unhandled operator
-                fprintf(fout, "[0x06] return_code __ret\n");
-            } else {
-                fprintf(fout, "[0x07] store int __ret %s\n", val);
-                fprintf(fout, "[0x06] return_code __ret\n");
+    int changed = 0;
+    int at = blocks[h].start;
+
+    // Invariant code motion, repeated so chains of invariants move together
+    for (int progress = 1; progress;) {
+        progress = 0;
+        for (int k = 0; k < loop_size; k++) {
+            int bi = loop_blocks[k];
+            if (!loop_dominates_latches(bi, h)) continue;
+            for (int i = blocks[bi].start; i < blocks[bi].end; i++) {
+                if (deleted[i] || !can_hoist(&ir[i], pre)) continue;
+                const IRInstr *in = &ir[i];
+                int numeric = is_binop(in->opcode) || strcmp(in->arg1, "string") != 0;
+                hoisted[var_id(instr_def(in))] = numeric ? 2 : 1;
+                ir_list_add(&insert_before[at], *in);
+                deleted[i] = 1;
+                progress = changed = 1;
             }
-            continue;
         }
+    }
+
+    // Strength reduction of i * c on a basic induction variable i. The mul
+    // sits in the same block as the update of i, and that block runs on
+    // every iteration, so t can be advanced by c*k in place of the mul. The
+    // preheader seeds t even if the loop leaves before reaching the block,
+    // so t must not be read once the loop is done.
+    int hi = blocks[block_count - 1].end;
+    for (int k = 0; k < loop_size; k++) {
+        int bi = loop_blocks[k];
+        if (!loop_dominates_latches(bi, h)) continue;
+        for (int i = blocks[bi].start; i < blocks[bi].end; i++) {
+            IRInstr *in = &ir[i];
+            if (deleted[i] || in->opcode != 0x0B) continue;
+            const char *iv = NULL, *c = NULL;
+            if (is_num_literal(in->arg2)) { iv = in->arg1; c = in->arg2; }
+            else if (is_num_literal(in->arg1)) { iv = in->arg2; c = in->arg1; }
+            if (!iv || !is_var_operand(iv) || strcmp(in->dest, "__ret") == 0 || strcmp(in->dest, iv) == 0) continue;
+            int v = var_id(iv), t = var_id(in->dest);
+            if (def_count[v] != 1 || def_count[t] != 1 || !uses_ok[t]) continue;
+            if (!numeric_out[(size_t)pre * var_count + v]) continue;
+            int d = def_at[v];
+            const IRInstr *upd = &ir[d];
+            if (block_of[d - lo] != bi || used_outside_loop(t, lo, hi)) continue;
+            long step;
+            if (upd->opcode == 0x09 && strcmp(upd->arg1, iv) == 0 && is_num_literal(upd->arg2)) step = strtol(upd->arg2, NULL, 10);
+            else if (upd->opcode == 0x09 && strcmp(upd->arg2, iv) == 0 && is_num_literal(upd->arg1)) step = strtol(upd->arg1, NULL, 10);
+            else if (upd->opcode == 0x0A && strcmp(upd->arg1, iv) == 0 && is_num_literal(upd->arg2)) step = (long)(0UL - (unsigned long)strtol(upd->arg2, NULL, 10));
+            else continue;
+
+            // t = i0 * c on entry, one step less if the mul comes before the
+            // update of i. Arithmetic wraps like the VM's.
+            long delta = (long)((unsigned long)step * (unsigned long)strtol(c, NULL, 10));
+            ir_list_add(&insert_before[at], *in);
+            if (i < d) {
+                IRInstr back = { 0x09, in->dest, num_text((long)(0UL - (unsigned long)delta)), in->dest };
+                ir_list_add(&insert_before[at], back);
+            }
+            in->opcode = 0x09;
+            in->arg1 = in->dest;
+            in->arg2 = num_text(delta);
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+// pow with a literal exponent of 2 or 3 -> mul
+void reduce_pow() {
+    for (int i = 0; i < ir_count; i++) {
+        IRInstr *in = &ir[i];
+        if (in->opcode != 0x0E || !is_num_literal(in->arg2)) continue;
+        long e = strtol(in->arg2, NULL, 10);
+        if (e == 2) {
+            in->opcode = 0x0B;
+            in->arg2 = in->arg1;
+        } else if (e == 3 && strcmp(in->dest, in->arg1) != 0) {
+            IRInstr cube = { 0x0B, in->dest, in->arg1, in->dest };
+            in->opcode = 0x0B;
+            in->arg2 = in->arg1;
+            ir_list_add(&insert_after[i], cube);
+        }
+    }
+}
+
+// Applies the edits collected in insert_before/insert_after/deleted
+void rebuild_ir() {
+    int n = ir_count;
+    for (int i = 0; i < ir_count; i++) n += insert_before[i].count + insert_after[i].count;
+    IRInstr *out = malloc(((size_t)n + 1) * sizeof(IRInstr));
+    if (!out) out_of_memory();
+    int k = 0;
+    for (int i = 0; i < ir_count; i++) {
+        for (int j = 0; j < insert_before[i].count; j++) out[k++] = insert_before[i].items[j];
+        if (!deleted[i]) out[k++] = ir[i];
+        for (int j = 0; j < insert_after[i].count; j++) out[k++] = insert_after[i].items[j];
+        free(insert_before[i].items);
+        free(insert_after[i].items);
+    }
+    free(ir);
+    ir = out;
+    ir_count = k;
+    ir_cap = n + 1;
+}
+
+void reset_edits() {
+    insert_before = calloc((size_t)ir_count + 1, sizeof(IRList));
+    insert_after = calloc((size_t)ir_count + 1, sizeof(IRList));
+    deleted = calloc((size_t)ir_count + 1, 1);
+    if (!insert_before || !insert_after || !deleted) out_of_memory();
+}
+
+void free_edits() {
+    free(insert_before);
+    free(insert_after);
+    free(deleted);
+}
+
+// Transforms the loops of IR [lo, hi), innermost first. Returns 1 if
+// anything changed.
+int optimize_function_loops(int lo, int hi) {
+    build_cfg(lo, hi);
+
+    // Loop headers: targets of back edges
+    int any = 0;
+    for (int b = 0; b < block_count && !any; b++) {
+        for (int k = 0; k < blocks[b].pred_count; k++) {
+            if (dominates(b, blocks[b].preds[k])) any = 1;
+        }
+    }
+    if (!any) return 0;
+
+    collect_function_vars(lo, hi);
+    if (!analyse_numeric(lo)) return 0;
+
+    def_count = realloc(def_count, ((size_t)var_count + 1) * sizeof(int));
+    def_at = realloc(def_at, ((size_t)var_count + 1) * sizeof(int));
+    uses_ok = realloc(uses_ok, (size_t)var_count + 1);
+    hoisted = realloc(hoisted, (size_t)var_count + 1);
+    loop_blocks = realloc(loop_blocks, ((size_t)block_count + 1) * sizeof(int));
+    free(in_loop);
+    in_loop = calloc((size_t)block_count + 1, 1);
+    if (!def_count || !def_at || !uses_ok || !hoisted || !loop_blocks || !in_loop) out_of_memory();
 
-        // store: "<type> var = value" or "<type> var = a op b"
-        {
-            char t[64], var[128], eq[4], val[256];
-            // Check for assignment pattern: type var = expression
-            if (sscanf(line, "%63s %127s %3s %255[^\n]", t, var, eq, val) == 4 && strcmp(eq, "=") == 0) {
-                trim(val);
-                // check for arithmetic/comparison "a op b"
-                char a[256], b[256], op[8];
-                if (sscanf(val, "%255s %7s %255s", a, op, b) == 3) {
-                    // Arithmetic operators
-                    if (strcmp(op, "+")==0) fprintf(fout, "[0x09] add %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "-")==0) fprintf(fout, "[0x0A] sub %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "*")==0) fprintf(fout, "[0x0B] mul %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "/")==0) fprintf(fout, "[0x0C] div %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "%")==0) fprintf(fout, "[0x0D] mod %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "^")==0) fprintf(fout, "[0x0E] pow %s %s %s\n", a, b, var);
-                    // --- COMPARISON OPERATORS ---
-                    else if (strcmp(op, ">")==0) fprintf(fout, "[0x0F] gt %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "<")==0) fprintf(fout, "[0x10] lt %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "==")==0) fprintf(fout, "[0x11] eq %s %s %s\n", a, b, var);
-                    else if (strcmp(op, "!=")==0) fprintf(fout, "[0x12] ne %s %s %s\n", a, b, var);
-                    // Fallback to simple store if operator is unknown
-                    else fprintf(fout, "[0x07] store %s %s %s\n", t, var, val);
+    // Inner loops come later in the layout than their outer loop's header,
+    // so visiting headers from last to first handles inner loops first
+    int changed = 0;
+    for (int b = block_count - 1; b > 0; b--) {
+        if (blocks[b].order < 0) continue;
+        int header = 0;
+        for (int k = 0; k < blocks[b].pred_count; k++) {
+            if (dominates(b, blocks[b].preds[k])) header = 1;
+        }
+        if (!header) continue;
+        collect_loop(b);
+        int done = optimize_loop(b, lo);
+        for (int k = 0; k < loop_size; k++) {
+            if (done) blocks[loop_blocks[k]].claimed = 1;
+            in_loop[loop_blocks[k]] = 0;
+        }
+        changed |= done;
+    }
+    return changed;
+}
+
+void optimize_loops() {
+    reset_edits();
+    reduce_pow();
+    rebuild_ir();
+    free_edits();
+
+    // Each round moves code out by one loop level
+    for (int round = 0; round < 16; round++) {
+        name_index_clear(&label_index);
+        for (int i = 0; i < ir_count; i++) {
+            if (ir[i].opcode == 0x15) name_index_put(&label_index, ir[i].dest, i);
+        }
+        reset_edits();
+        int changed = 0;
+        for (int lo = 0; lo < ir_count; lo++) {
+            if (ir[lo].opcode != 0x01) continue;
+            int hi = lo + 1;
+            while (hi < ir_count && ir[hi].opcode != 0x01) hi++;
+            if (optimize_function_loops(lo, hi)) changed = 1;
+        }
+        rebuild_ir();
+        free_edits();
+        if (!changed) break;
+    }
+}
+
+// --- Text output ---
+
+void write_text(FILE *f) {
+    for (int i = 0; i < ir_count; i++) {
+        IRInstr *in = &ir[i];
+        const char *name = fluxb_op_name(in->opcode);
+        switch (in->opcode) {
+            case 0x01:
+                fprintf(f, "[0x01] entry %s %s(%s)\n", in->arg1, in->arg2, in->dest ? in->dest : "");
+                break;
+            case 0x02:
+                fprintf(f, "[0x02] end\n");
+                break;
+            case 0x07:
+                fprintf(f, "[0x07] store %s %s %s\n", in->arg1, in->arg2, in->dest);
+                break;
+            case 0x13:
+            case 0x16:
+                fprintf(f, "[0x%02X] %s %s %s\n", in->opcode, name, in->arg1, in->dest);
+                break;
+            case 0x14:
+            case 0x15:
+                fprintf(f, "[0x%02X] %s %s\n", in->opcode, name, in->dest);
+                break;
+            default:
+                if (is_binop(in->opcode) || fluxb_array_op_has_arg2(in->opcode))
+                    fprintf(f, "[0x%02X] %s %s %s %s\n", in->opcode, name, in->arg1, in->arg2, in->dest);
+                else if (is_array_op(in->opcode))
+                    fprintf(f, "[0x%02X] %s %s %s\n", in->opcode, name, in->arg1, in->dest);
+                else
+                    fprintf(f, "[0x%02X] %s %s\n", in->opcode, name, in->arg1);
+        }
+    }
+}
+
+// --- Binary output ---
+// The string pool deduplicates every operand through an open-addressing hash
+// table of pool offsets (stored +1 so that 0 marks an empty slot).
+
+char *pool_data = NULL;
+uint32_t pool_size = 0;
+uint32_t pool_cap = 0;
+uint32_t *pool_index = NULL;
+uint32_t pool_index_cap = 0;
+uint32_t pool_strings = 0;
+
+void pool_rehash(void) {
+    uint32_t old_cap = pool_index_cap;
+    uint32_t *old = pool_index;
+    pool_index_cap = old_cap ? old_cap * 2 : 1024;
+    pool_index = calloc(pool_index_cap, sizeof(uint32_t));
+    if (!pool_index) { fprintf(stderr, "Error: Out of memory.\n"); exit(1); }
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (!old[i]) continue;
+        uint32_t h = hash_string(pool_data + old[i] - 1) & (pool_index_cap - 1);
+        while (pool_index[h]) h = (h + 1) & (pool_index_cap - 1);
+        pool_index[h] = old[i];
+    }
+    free(old);
+}
+
+uint32_t pool_intern(const char *s) {
+    if (!s) return FLUXB_NONE;
+    if ((pool_strings + 1) * 2 > pool_index_cap) pool_rehash();
+    uint32_t h = hash_string(s) & (pool_index_cap - 1);
+    while (pool_index[h]) {
+        if (strcmp(pool_data + pool_index[h] - 1, s) == 0) return pool_index[h] - 1;
+        h = (h + 1) & (pool_index_cap - 1);
+    }
+    size_t len = strlen(s) + 1;
+    while (pool_size + len > pool_cap) {
+        pool_cap = pool_cap ? pool_cap * 2 : 4096;
+        pool_data = realloc(pool_data, pool_cap);
+        if (!pool_data) { fprintf(stderr, "Error: Out of memory.\n"); exit(1); }
+    }
+    uint32_t off = pool_size;
+    memcpy(pool_data + off, s, len);
+    pool_size += len;
+    pool_index[h] = off + 1;
+    pool_strings++;
+    return off;
+}
+
+void write_binary(FILE *f) {
+    FluxbInstr *instrs = calloc(ir_count ? ir_count : 1, sizeof(FluxbInstr));
+    FluxbFunction *funcs = calloc(ir_count ? ir_count : 1, sizeof(FluxbFunction));
+    FluxbLabel *labels = calloc(ir_count ? ir_count : 1, sizeof(FluxbLabel));
+    if (!instrs || !funcs || !labels) { fprintf(stderr, "Error: Out of memory.\n"); exit(1); }
+    uint32_t n = 0, nfuncs = 0, nlabels = 0;
+
+    for (int i = 0; i < ir_count; i++) {
+        IRInstr *in = &ir[i];
+        FluxbInstr *out = &instrs[n];
+        out->opcode = (uint8_t)in->opcode;
+        out->arg1 = pool_intern(in->arg1);
+        out->arg2 = pool_intern(in->arg2);
+        out->dest = pool_intern(in->dest);
+        if (in->opcode == 0x01) {
+            funcs[nfuncs].type = out->arg1;
+            funcs[nfuncs].name = out->arg2;
+            funcs[nfuncs].params = out->dest;
+            funcs[nfuncs].instr_index = n;
+            nfuncs++;
+        } else if (in->opcode == 0x15) {
+            labels[nlabels].name = out->dest;
+            labels[nlabels].instr_index = n;
+            nlabels++;
+        }
+        n++;
+    }
+
+    FluxbHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FLUXB_MAGIC, 4);
+    h.version = FLUXB_VERSION;
+    h.instr_count = n;
+    h.instr_offset = sizeof(FluxbHeader);
+    h.function_count = nfuncs;
+    h.function_offset = h.instr_offset + n * sizeof(FluxbInstr);
+    h.label_count = nlabels;
+    h.label_offset = h.function_offset + nfuncs * sizeof(FluxbFunction);
+    h.pool_size = pool_size;
+    h.pool_offset = h.label_offset + nlabels * sizeof(FluxbLabel);
+
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(instrs, sizeof(FluxbInstr), n, f);
+    fwrite(funcs, sizeof(FluxbFunction), nfuncs, f);
+    fwrite(labels, sizeof(FluxbLabel), nlabels, f);
+    fwrite(pool_data, 1, pool_size, f);
+
+    free(instrs);
+    free(funcs);
+    free(labels);
+}
+
+// --- C output ---
+// -C translates the program into one C translation unit to be linked with
+// flux_rt.c (see flux_rt.h). Each function becomes a C function taking its
+// parameters by value plus a pointer to the caller's __ret (NULL when the
+// caller never names __ret), labels and jumps become gotos, and string
+// literals become static immortal strings. A variable that only ever holds
+// numbers and is certainly assigned before every read is a C long, any
+// other variable a tagged FxValue checked where the VM would check it.
+// Operands are read in the VM's order, so a failing program reports the
+// same error after the same output.
+
+typedef struct {
+    const char *name;
+    int lo, hi;               // IR range, lo is the entry
+    int param_count;
+    const char **param_types;
+    const char **param_names;
+    char *param_long;         // parameter passed as a long
+    int has_ret;              // the body names __ret, so calls store into it
+    int frame_bytes;          // VM frame size, charged against --stack-limit
+} CFunction;
+
+CFunction *c_funcs = NULL;
+int c_func_count = 0;
+NameIndex c_func_index = { NULL, 0, 0 };
+NameIndex c_literals = { NULL, 0, 0 }; // literal operand -> fx_str_N
+char *c_long = NULL;                   // var_id -> held in a long
+char *c_read = NULL;                   // var_id -> read somewhere
+const char **c_names = NULL;           // var_id -> name
+
+// sizeof(Frame) and sizeof(Value) in the VM
+#define VM_FRAME_BYTES 16
+#define VM_VALUE_BYTES 16
+
+void c_error(const char *fmt, const char *a, const char *b) {
+    fprintf(stderr, "Error: %s: ", src_path);
+    fprintf(stderr, fmt, a, b);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int is_string_literal(const char *t) {
+    return t && t[0] == '"';
+}
+
+// Text of a string literal as the VM links it: quotes stripped, \n applied
+const char *literal_text(const char *t, size_t *len) {
+    size_t n = strlen(t + 1);
+    if (n > 0 && t[n] == '"') n--;
+    char *out = arena_alloc(n + 1);
+    size_t k = 0;
+    for (size_t i = 1; i <= n; i++) {
+        if (t[i] == '\\' && i < n && t[i + 1] == 'n') {
+            out[k++] = '\n';
+            i++;
+        } else {
+            out[k++] = t[i];
+        }
+    }
+    out[k] = '\0';
+    *len = k;
+    return out;
+}
+
+void c_quoted(FILE *f, const char *s, size_t len) {
+    fputc('"', f);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c == '\n') fputs("\\n", f);
+        else if (c < 32 || c >= 127 || c == '?') fprintf(f, "\\%03o", c); // '?' avoids trigraphs
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+void c_long_literal(FILE *f, long x) {
+    if (x == LONG_MIN) fprintf(f, "(-%ldL - 1)", LONG_MAX);
+    else fprintf(f, "%ldL", x);
+}
+
+int c_is_long(const char *t) {
+    return c_long[var_id(t)];
+}
+
+// An operand read as a number, like get_long_value()
+void c_long_operand(FILE *f, const char *t) {
+    if (!t || !t[0] || is_string_literal(t)) {
+        fputs("0L", f);
+    } else if (!is_var_operand(t)) {
+        c_long_literal(f, strtol(t, NULL, 10));
+    } else if (c_is_long(t)) {
+        fprintf(f, "v_%s", t);
+    } else {
+        fprintf(f, "fx_long(&v_%s, ", t);
+        c_quoted(f, t, strlen(t));
+        fputc(')', f);
+    }
+}
+
+// An operand read as a string, like get_string_value(): an FxString *
+void c_string_operand(FILE *f, const char *t) {
+    if (is_string_literal(t)) fprintf(f, "&fx_str_%d", name_index_get(&c_literals, t));
+    else if (t && is_var_operand(t) && !c_is_long(t)) fprintf(f, "fx_string_of(&v_%s)", t);
+    else fputs("&fx_empty", f);
+}
+
+// An operand whose read can fail (a variable that is not a long)
+int c_checked(const char *t) {
+    return t && is_var_operand(t) && !c_is_long(t);
+}
+
+// Assignment of a long to variable d: the value goes between the two halves
+void c_assign_begin(FILE *f, const char *d, const char *tag) {
+    if (c_is_long(d)) fprintf(f, "v_%s = ", d);
+    else fprintf(f, "fx_set_long(&v_%s, %s, ", d, tag);
+}
+
+void c_assign_end(FILE *f, const char *d) {
+    fputs(c_is_long(d) ? ";\n" : ");\n", f);
+}
+
+// Chooses a representation for each variable of fn, numbering them in
+// opt_vars. A variable is a long when every assignment gives a number and
+// every reachable read comes after one.
+void c_analyse(const CFunction *fn) {
+    build_cfg(fn->lo, fn->hi);
+    collect_function_vars(fn->lo, fn->hi);
+    free(c_long);
+    free(c_read);
+    free(c_names);
+    c_long = malloc((size_t)var_count + 1);
+    c_read = calloc((size_t)var_count + 1, 1);
+    c_names = malloc(((size_t)var_count + 1) * sizeof(const char *));
+    if (!c_long || !c_read || !c_names) out_of_memory();
+    for (int i = fn->lo; i < fn->hi; i++) {
+        int uses = instr_uses(&ir[i]);
+        for (int u = 0; u < uses; u++) c_read[var_id(use_names[u])] = 1;
+    }
+    for (int e = 0; e < opt_vars.cap; e++) {
+        if (opt_vars.entries[e].key) c_names[opt_vars.entries[e].value] = opt_vars.entries[e].key;
+    }
+    if (!analyse_numeric(fn->lo)) {
+        memset(c_long, 0, (size_t)var_count + 1);
+        return;
+    }
+    memset(c_long, 1, (size_t)var_count + 1);
+
+    int is_main = strcmp(fn->name, "main") == 0;
+    for (int k = 0; k < fn->param_count; k++) {
+        const char *type = fn->param_types[k];
+        if (is_main || (strcmp(type, "int") != 0 && strcmp(type, "bool") != 0)) c_long[var_id(fn->param_names[k])] = 0;
+    }
+    unsigned char *state = malloc((size_t)var_count + 1);
+    if (!state) out_of_memory();
+    for (int b = 0; b < block_count; b++) {
+        if (blocks[b].order < 0) continue;
+        numeric_in(b, fn->lo, state);
+        for (int i = blocks[b].start; i < blocks[b].end; i++) {
+            int uses = instr_uses(&ir[i]);
+            for (int u = 0; u < uses; u++) {
+                if (!state[var_id(use_names[u])]) c_long[var_id(use_names[u])] = 0;
+            }
+            numeric_transfer(state, &ir[i]);
+            const char *def = instr_def(&ir[i]);
+            if (def && !state[var_id(def)]) c_long[var_id(def)] = 0;
+        }
+    }
+    free(state);
+}
+
+// call: the arguments are evaluated and converted in order, then passed
+void c_call(FILE *f, const CFunction *caller, const IRInstr *in) {
+    const char *name, **args;
+    int n = split_call(in->arg1, &name, &args);
+    const CFunction *callee = &c_funcs[name_index_get(&c_func_index, name)];
+    fputs("    {\n", f);
+    for (int k = 0; k < n; k++) {
+        if (strcmp(callee->param_types[k], "string") == 0) {
+            fprintf(f, "        FxString *a%d = ", k);
+            c_string_operand(f, args[k]);
+        } else {
+            fprintf(f, "        long a%d = ", k);
+            c_long_operand(f, args[k]);
+        }
+        fputs(";\n", f);
+    }
+    fprintf(f, "        fx_fn_%s(%s", name, caller->has_ret ? "&v___ret" : "NULL");
+    for (int k = 0; k < n; k++) {
+        const char *type = callee->param_types[k];
+        if (strcmp(type, "string") == 0) fprintf(f, ", fx_string_value(a%d)", k);
+        else if (callee->param_long[k]) fprintf(f, ", a%d", k);
+        else fprintf(f, ", fx_long_value(%s, a%d)", strcmp(type, "bool") == 0 ? "FX_BOOL" : "FX_INT", k);
+    }
+    fputs(");\n    }\n", f);
+}
+
+void c_print(FILE *f, const char *stream, const char *t) {
+    if (!t || !t[0]) return;
+    if (is_string_literal(t)) {
+        size_t len;
+        const char *s = literal_text(t, &len);
+        if (!len) return;
+        fprintf(f, "    fx_write(%s, ", stream);
+        c_quoted(f, s, len);
+        fprintf(f, ", %zu);\n", len);
+    } else if (!is_var_operand(t)) {
+        // A numeric literal prints as written
+        fprintf(f, "    fx_write(%s, ", stream);
+        c_quoted(f, t, strlen(t));
+        fprintf(f, ", %zu);\n", strlen(t));
+    } else if (c_is_long(t)) {
+        fprintf(f, "    fx_write_long(%s, v_%s);\n", stream, t);
+    } else {
+        fprintf(f, "    fx_write_value(%s, &v_%s, ", stream, t);
+        c_quoted(f, t, strlen(t));
+        fputs(");\n", f);
+    }
+}
+
+void c_signature(FILE *f, const CFunction *fn) {
+    fprintf(f, "static void fx_fn_%s(FxValue *ret", fn->name);
+    for (int k = 0; k < fn->param_count; k++) {
+        fprintf(f, ", %s v_%s", fn->param_long[k] ? "long" : "FxValue", fn->param_names[k]);
+    }
+    fputc(')', f);
+}
+
+void c_function(FILE *f, const CFunction *fn) {
+    static const char *const binop_ops[] = {
+        "fx_add", "fx_sub", "fx_mul", "fx_div", "fx_mod", "fx_pow", ">", "<", "==", "!="
+    };
+    c_analyse(fn);
+    c_signature(f, fn);
+    fputs(" {\n", f);
+
+    // Locals other than the parameters, unassigned (or 0) on entry
+    for (int v = fn->param_count; v < var_count; v++) {
+        const char *name = c_names[v];
+        if (!is_var_operand(name) || (strcmp(name, "__ret") == 0 && !fn->has_ret)) continue;
+        if (c_long[v]) fprintf(f, "    long v_%s = 0;\n", name);
+        else fprintf(f, "    FxValue v_%s = { FX_NONE, { 0 } };\n", name);
+        if (c_long[v] && !c_read[v]) fprintf(f, "    (void)v_%s;\n", name);
+    }
+    fprintf(f, "    fx_enter(%d);\n", fn->frame_bytes);
+
+    char *used = calloc((size_t)(fn->hi - fn->lo) + 1, 1);
+    if (!used) out_of_memory();
+    for (int i = fn->lo; i < fn->hi; i++) {
+        if (is_jump(ir[i].opcode)) used[name_index_get(&label_index, ir[i].dest) - fn->lo] = 1;
+    }
+
+    for (int i = fn->lo + 1; i < fn->hi; i++) {
+        const IRInstr *in = &ir[i];
+        switch (in->opcode) {
+            case 0x15: // label
+                if (used[i - fn->lo]) fprintf(f, "L_%s:;\n", in->dest);
+                break;
+            case 0x02: // end
+                fputs("    goto fx_exit;\n", f);
+                break;
+            case 0x03:
+                c_print(f, "FX_STDOUT", in->arg1);
+                break;
+            case 0x04:
+                c_print(f, "FX_STDERR", in->arg1);
+                break;
+            case 0x05: // read
+                if (in->arg1 && is_var_operand(in->arg1)) fprintf(f, "    fx_read(&v_%s);\n", in->arg1);
+                else fputs("    fx_read(NULL);\n", f);
+                break;
+            case 0x06: { // return_code
+                const char *t = in->arg1;
+                fputs("    fx_return(ret, ", f);
+                if (t && is_var_operand(t) && c_is_long(t)) {
+                    fprintf(f, "fx_long_value(FX_INT, v_%s)", t);
+                } else if (t && is_var_operand(t)) {
+                    fprintf(f, "fx_take(&v_%s)", t);
+                } else if (is_num_literal(t) && t[0]) {
+                    fputs("fx_long_value(FX_INT, ", f);
+                    c_long_literal(f, strtol(t, NULL, 10));
+                    fputc(')', f);
+                } else {
+                    fputs("fx_long_value(FX_NONE, 0)", f);
+                }
+                fputs(");\n    goto fx_exit;\n", f);
+                break;
+            }
+            case 0x07: // store
+                if (strcmp(in->arg1, "string") == 0) {
+                    fprintf(f, "    fx_set_string(&v_%s, ", in->arg2);
+                    c_string_operand(f, in->dest);
+                    fputs(");\n", f);
                 } else {
-                    // simple store
-                    fprintf(fout, "[0x07] store %s %s %s\n", t, var, val);
+                    fputs("    ", f);
+                    c_assign_begin(f, in->arg2, strcmp(in->arg1, "bool") == 0 ? "FX_BOOL" : "FX_INT");
+                    c_long_operand(f, in->dest);
+                    c_assign_end(f, in->arg2);
                 }
-                continue;
+                break;
+            case 0x08:
+                c_call(f, fn, in);
+                break;
+            case 0x13: case 0x16: // jz, jnz
+                fputs("    if (", f);
+                c_long_operand(f, in->arg1);
+                fprintf(f, " %s 0) goto L_%s;\n", in->opcode == 0x13 ? "==" : "!=", in->dest);
+                break;
+            case 0x14:
+                fprintf(f, "    goto L_%s;\n", in->dest);
+                break;
+            default: {
+                if (!is_binop(in->opcode)) break;
+                const char *tag = in->opcode >= 0x0F ? "FX_BOOL" : "FX_INT";
+                const char *op = binop_ops[in->opcode - 0x09];
+                if (c_checked(in->arg1) && c_checked(in->arg2)) {
+                    // Both reads can fail: make the first one fail first
+                    fputs("    {\n        long a = ", f);
+                    c_long_operand(f, in->arg1);
+                    fputs(";\n        ", f);
+                    c_assign_begin(f, in->dest, tag);
+                    if (op[0] == 'f') fprintf(f, "%s(a, ", op);
+                    else fprintf(f, "(a %s ", op);
+                    c_long_operand(f, in->arg2);
+                    fputc(')', f);
+                    c_assign_end(f, in->dest);
+                    fputs("    }\n", f);
+                    break;
+                }
+                fputs("    ", f);
+                c_assign_begin(f, in->dest, tag);
+                fprintf(f, op[0] == 'f' ? "%s(" : "(", op);
+                c_long_operand(f, in->arg1);
+                fprintf(f, op[0] == 'f' ? ", " : " %s ", op);
+                c_long_operand(f, in->arg2);
+                fputc(')', f);
+                c_assign_end(f, in->dest);
             }
         }
+    }
+
+    // Every way out releases the frame, like pop_frame()
+    fputs("fx_exit:\n", f);
+    for (int v = 0; v < var_count; v++) {
+        const char *name = c_names[v];
+        if (c_long[v] || !is_var_operand(name) || (strcmp(name, "__ret") == 0 && !fn->has_ret)) continue;
+        fprintf(f, "    fx_release(&v_%s);\n", name);
+    }
+    fprintf(f, "    fx_leave(%d);\n}\n\n", fn->frame_bytes);
+    free(used);
+}
 
-        // call: "func(...)" or "func()" as top-level expression / statement
-        {
-            char callname[128];
-            if (sscanf(line, "%127[^(\n]", callname) == 1) {
-                trim(callname);
-                size_t l = strlen(line);
-                if (l > 1 && line[l-1] == ')' && strchr(line, '(')) {
-                    // take whole content inside parentheses as params (naive)
-                    char params[512];
-                    char *p = strchr(line, '(');
-                    if (p) {
-                        strncpy(params, p+1, sizeof(params)-1);
-                        params[sizeof(params)-1] = '\0';
-                        params[strlen(params)-1] = '\0'; // remove trailing ')'
-                        trim(params);
-                        if (strlen(params) == 0)
-                            fprintf(fout, "[0x08] call %s()\n", callname);
-                        else
-                            fprintf(fout, "[0x08] call %s(%s)\n", callname, params);
-                        continue;
-                    }
+// Finds the functions and checks what the VM checks when linking: callees
+// and their arity, types, and jump targets, which must also lie in the
+// jumping function as a C goto cannot leave it
+void c_link() {
+    name_index_clear(&label_index);
+    for (int i = 0; i < ir_count; i++) {
+        if (ir[i].opcode == 0x15) name_index_put(&label_index, ir[i].dest, i);
+    }
+    c_funcs = malloc(((size_t)ir_count + 1) * sizeof(CFunction));
+    if (!c_funcs) out_of_memory();
+    for (int lo = 0; lo < ir_count; lo++) {
+        if (ir[lo].opcode != 0x01) continue;
+        int hi = lo + 1;
+        while (hi < ir_count && ir[hi].opcode != 0x01) hi++;
+        // When a name is defined twice the first definition wins
+        if (name_index_get(&c_func_index, ir[lo].arg2) >= 0) continue;
+        CFunction *fn = &c_funcs[c_func_count];
+        fn->name = ir[lo].arg2;
+        fn->lo = lo;
+        fn->hi = hi;
+        fn->param_count = split_params(ir[lo].dest, &fn->param_types, &fn->param_names);
+        for (int k = 0; k < fn->param_count; k++) {
+            const char *type = fn->param_types[k];
+            if (strcmp(type, "array") == 0) c_error("Arrays are not supported by -C (function '%s').%s", fn->name, "");
+            if (strcmp(type, "int") != 0 && strcmp(type, "bool") != 0 && strcmp(type, "string") != 0)
+                c_error("Unknown type '%s' in function '%s'.", type, fn->name);
+        }
+        name_index_put(&c_func_index, fn->name, c_func_count++);
+    }
+
+    for (int fi = 0; fi < c_func_count; fi++) {
+        CFunction *fn = &c_funcs[fi];
+        int calls = 0;
+        fn->has_ret = 0;
+        for (int i = fn->lo + 1; i < fn->hi; i++) {
+            const IRInstr *in = &ir[i];
+            if (is_array_op(in->opcode) || (in->opcode == 0x07 && strcmp(in->arg1, "array") == 0))
+                c_error("Arrays are not supported by -C (function '%s').%s", fn->name, "");
+            if (in->opcode == 0x07 && strcmp(in->arg1, "int") != 0 && strcmp(in->arg1, "bool") != 0 &&
+                strcmp(in->arg1, "string") != 0)
+                c_error("Unknown type '%s' in function '%s'.", in->arg1, fn->name);
+            if (is_jump(in->opcode)) {
+                int target = name_index_get(&label_index, in->dest);
+                if (target < fn->lo || target >= fn->hi)
+                    c_error("Jump to label '%s' outside function '%s'.", in->dest, fn->name);
+            }
+            if (in->opcode == 0x08) {
+                const char *name, **args;
+                int n = split_call(in->arg1, &name, &args);
+                int callee = name_index_get(&c_func_index, name);
+                if (callee < 0) c_error("Function '%s' not found.%s", name, "");
+                if (n != c_funcs[callee].param_count) {
+                    char counts[64];
+                    snprintf(counts, sizeof(counts), "%d arguments, expected %d", n, c_funcs[callee].param_count);
+                    c_error("Function '%s' called with %s.", name, counts);
                 }
+                calls = 1;
+            } else {
+                const char *def = instr_def(in);
+                if (def && strcmp(def, "__ret") == 0) fn->has_ret = 1;
+            }
+            int uses = instr_uses(in);
+            for (int u = 0; u < uses; u++) {
+                if (strcmp(use_names[u], "__ret") == 0) fn->has_ret = 1;
+            }
+        }
+
+        c_analyse(fn);
+        fn->param_long = arena_alloc(fn->param_count + 1);
+        for (int k = 0; k < fn->param_count; k++) fn->param_long[k] = c_long[var_id(fn->param_names[k])];
+        // The VM gives a slot to every name in the code, and a call alone
+        // does not name __ret
+        int slots = 0;
+        for (int v = 0; v < var_count; v++) slots += is_var_operand(c_names[v]);
+        if (calls && !fn->has_ret) slots--;
+        fn->frame_bytes = VM_FRAME_BYTES + VM_VALUE_BYTES * slots;
+    }
+}
+
+void write_c(FILE *f) {
+    c_link();
+    fprintf(f, "// Translated from %s by fluxc -C. Build with:\n", src_path);
+    fputs("//   cc -O2 this.c flux_rt.c -lm -lpthread\n#include \"flux_rt.h\"\n\n", f);
+
+    // String literals that are stored or passed; printed ones are written
+    // straight from the instruction
+    int literal_count = 0;
+    for (int fi = 0; fi < c_func_count; fi++) {
+        for (int i = c_funcs[fi].lo; i < c_funcs[fi].hi; i++) {
+            const IRInstr *in = &ir[i];
+            const char *store_value = in->dest, **ops = &store_value, *name;
+            int n = in->opcode == 0x07 ? 1 : 0;
+            if (in->opcode == 0x08) n = split_call(in->arg1, &name, &ops);
+            for (int k = 0; k < n; k++) {
+                if (!is_string_literal(ops[k]) || name_index_get(&c_literals, ops[k]) >= 0) continue;
+                size_t len;
+                const char *s = literal_text(ops[k], &len);
+                fprintf(f, "static FxString fx_str_%d = { FX_IMMORTAL, %zu, ", literal_count, len);
+                c_quoted(f, s, len);
+                fputs(" };\n", f);
+                name_index_put(&c_literals, ops[k], literal_count++);
             }
         }
+    }
+    if (literal_count) fputc('\n', f);
 
-        // fallback: comment
-        fprintf(fout, "# unknown: %s\n", line);
+    for (int fi = 0; fi < c_func_count; fi++) {
+        c_signature(f, &c_funcs[fi]);
+        fputs(";\n", f);
     }
+    fputc('\n', f);
+    for (int fi = 0; fi < c_func_count; fi++) c_function(f, &c_funcs[fi]);
 
-    // Check for open blocks
-    if (if_stack_top != -1) {
-        fprintf(stderr, "Error: Missing 'endif' for one or more 'if' blocks.\n");
+    // main starts with its parameters unassigned, as in the VM
+    int main_index = name_index_get(&c_func_index, "main");
+    fputs("static void fx_start(void) {\n", f);
+    if (main_index >= 0) {
+        fputs("    fx_fn_main(NULL", f);
+        for (int k = 0; k < c_funcs[main_index].param_count; k++) fputs(", fx_long_value(FX_NONE, 0)", f);
+        fputs(");\n", f);
+    } else {
+        fputs("    static const char msg[] = \"VM Error: Program does not contain an 'int main()' entry point.\\n\";\n", f);
+        fputs("    fx_write(FX_STDERR, msg, sizeof(msg) - 1);\n", f);
     }
-    if (while_stack_top != -1) {
-        fprintf(stderr, "Error: Missing 'endwhile' for one or more 'while' blocks.\n");
+    fputs("}\n\nint main(int argc, char **argv) {\n    fx_init(argc, argv);\n    return fx_run(fx_start);\n}\n", f);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-S|-C] [-O0|-O1] source.flux out.fluxb\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int text_output = 0;
+    int c_output = 0;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-S") == 0) {
+            text_output = 1;
+        } else if (strcmp(argv[argi], "-C") == 0) {
+            c_output = 1;
+        } else if (strcmp(argv[argi], "-O0") == 0 || strcmp(argv[argi], "-O1") == 0) {
+            opt_level = argv[argi][2] - '0';
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
     }
-    if (for_stack_top != -1) {
-        fprintf(stderr, "Error: Missing 'endfor' for one or more 'for' blocks.\n");
+    if (argc - argi < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    src_path = argv[argi];
+    const char *out_path = argv[argi + 1];
+
+    size_t src_size;
+    const char *src = map_source(src_path, &src_size);
+    Stmt *program = parse_program(src, src_size);
+    resolve_builtins(program);
+    if (opt_level > 0) optimize_program(program);
+    gen_block(program);
+    if (opt_level > 0) {
+        peephole();
+        optimize_loops();
     }
 
-    fclose(fin);
+    FILE *fout = fopen(out_path, text_output || c_output ? "w" : "wb");
+    if (!fout) { perror("open out"); return 1; }
+    if (c_output) write_c(fout);
+    else if (text_output) write_text(fout);
+    else write_binary(fout);
     fclose(fout);
-    printf("Compiled %s -> %s\n", argv[1], argv[2]);
+    printf("Compiled %s -> %s\n", src_path, out_path);
     return 0;
 }
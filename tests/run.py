@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""tests/run.py
+   Regression tests for fluxc, fluxvm and the C backend.
+   Usage: python3 tests/run.py [--only NAME,...] [--modes MODE,...]
+                               [--cc CC] [--cflags FLAGS] [--save]
+
+   Builds fluxc, fluxvm and the C runtime from the repository root into
+   tests/out/, then runs every tests/NAME.flux compiled with fluxc -O0 and
+   with -O1, in each of these modes:
+     nojit   fluxvm --no-jit
+     jit     fluxvm (default jit threshold)
+     jit1    fluxvm --jit-threshold=1
+     jit3    fluxvm --jit-threshold=3
+     c       fluxc -C, built against flux_rt.c
+   and compares what it does with the files next to it:
+     NAME.in      stdin (empty if there is none)
+     NAME.out     expected stdout
+     NAME.err     expected stderr (empty if there is none)
+     NAME.status  expected exit status (0 if there is none)
+   A line "# skip: MODE,..." in the program leaves those modes out.
+   --save writes the expected files of the selected tests from their -O0
+   --no-jit run instead; check them before committing.
+   --cflags also reaches the build, e.g. --cflags="-O2 -DFLUX_NO_THREADED".
+   Every failing run is listed; the exit status is 1 if there was one.
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(TESTS)
+OUT = os.path.join(TESTS, "out")
+
+MODES = {
+    "nojit": ["--no-jit"],
+    "jit": [],
+    "jit1": ["--jit-threshold=1"],
+    "jit3": ["--jit-threshold=3"],
+    "c": None,
+}
+LEVELS = ["-O0", "-O1"]
+TIMEOUT = 60
+
+SKIP = re.compile(r"^#\s*skip:\s*(.*)$", re.M)
+
+
+def fail(msg):
+    print("Error: " + msg, file=sys.stderr)
+    sys.exit(2)
+
+
+def build(cc, cflags):
+    os.makedirs(OUT, exist_ok=True)
+    steps = [
+        [cc] + cflags + [os.path.join(ROOT, "main.c"), "-o", os.path.join(OUT, "fluxc")],
+        [cc] + cflags + [os.path.join(ROOT, "vm.c"), "-o", os.path.join(OUT, "fluxvm"), "-lm"],
+        [cc] + cflags + ["-c", os.path.join(ROOT, "flux_rt.c"), "-o", os.path.join(OUT, "flux_rt.o")],
+    ]
+    for cmd in steps:
+        print("  " + " ".join(cmd))
+        if subprocess.call(cmd) != 0:
+            fail("build failed: " + " ".join(cmd))
+
+
+def read(path, default=b""):
+    if not os.path.exists(path):
+        return default
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def run(cmd, stdin):
+    """Runs cmd on the bytes stdin; returns (stdout, stderr, exit status)."""
+    try:
+        proc = subprocess.run(cmd, input=stdin, stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=TIMEOUT)
+    except subprocess.TimeoutExpired:
+        return b"", b"timed out after %d s\n" % TIMEOUT, None
+    return proc.stdout, proc.stderr, proc.returncode
+
+
+def compile_step(cmd):
+    """Runs a fluxc or cc step; returns its error text, or None if it worked."""
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    return None if proc.returncode == 0 else proc.stdout.decode(errors="replace")
+
+
+def save(name):
+    """Records the -O0 --no-jit run of a test as its expected output."""
+    source = os.path.join(TESTS, name + ".flux")
+    image = os.path.join(OUT, name + ".fluxb")
+    err = compile_step([os.path.join(OUT, "fluxc"), "-O0", source, image])
+    if err:
+        fail("fluxc failed on %s:\n%s" % (name, err))
+    out, err, status = run([os.path.join(OUT, "fluxvm"), "--no-jit", image], read(os.path.join(TESTS, name + ".in")))
+    for ext, data, keep in ((".out", out, True), (".err", err, err), (".status", b"%d\n" % status, status)):
+        path = os.path.join(TESTS, name + ext)
+        if keep:
+            with open(path, "wb") as f:
+                f.write(data)
+        elif os.path.exists(path):
+            os.remove(path)
+
+
+def check(name, modes, cc, cflags):
+    """Runs one test in every mode it takes; returns the failures."""
+    source = os.path.join(TESTS, name + ".flux")
+    stdin = read(os.path.join(TESTS, name + ".in"))
+    want = (read(os.path.join(TESTS, name + ".out")),
+            read(os.path.join(TESTS, name + ".err")),
+            int(read(os.path.join(TESTS, name + ".status"), b"0")))
+    with open(source) as f:
+        skip = set(m.strip() for line in SKIP.findall(f.read()) for m in line.split(","))
+    fluxc = os.path.join(OUT, "fluxc")
+    failures = []
+    for level in LEVELS:
+        base = os.path.join(OUT, name + level)
+        err = compile_step([fluxc, level, source, base + ".fluxb"])
+        if err:
+            failures.append("%s %s: fluxc failed:\n%s" % (name, level, err))
+            continue
+        for mode in modes:
+            if mode in skip:
+                continue
+            if mode == "c":
+                err = (compile_step([fluxc, "-C", level, source, base + ".c"]) or
+                       compile_step([cc] + cflags + ["-I", ROOT, base + ".c", os.path.join(OUT, "flux_rt.o"),
+                                                    "-o", base + ".native", "-lm", "-lpthread"]))
+                if err:
+                    failures.append("%s %s c: build failed:\n%s" % (name, level, err))
+                    continue
+                cmd = [base + ".native"]
+            else:
+                cmd = [os.path.join(OUT, "fluxvm")] + MODES[mode] + [base + ".fluxb"]
+            got = run(cmd, stdin)
+            if got != want:
+                what = [part for part, g, w in zip(("stdout", "stderr", "status"), got, want) if g != w]
+                failures.append("%s %s %s: %s differ\n  stderr: %s" % (
+                    name, level, mode, ", ".join(what), got[1].decode(errors="replace").strip()[:300]))
+    return failures
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Run the fluxc/fluxvm regression tests.")
+    ap.add_argument("--only", help="comma-separated test names")
+    ap.add_argument("--modes", default=",".join(MODES), help="comma-separated modes (default all)")
+    ap.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+    ap.add_argument("--cflags", default="-O2")
+    ap.add_argument("--save", action="store_true", help="record the expected output instead of checking it")
+    args = ap.parse_args()
+    modes = args.modes.split(",")
+    for mode in modes:
+        if mode not in MODES:
+            fail("no mode named '%s'" % mode)
+
+    print("building:")
+    build(args.cc, args.cflags.split())
+
+    names = sorted(f[:-5] for f in os.listdir(TESTS) if f.endswith(".flux"))
+    if args.only:
+        for name in args.only.split(","):
+            if name not in names:
+                fail("no test named '%s'" % name)
+        names = args.only.split(",")
+    if args.save:
+        for name in names:
+            save(name)
+            print("saved " + name)
+        return 0
+    failures = []
+    for name in names:
+        failed = check(name, modes, args.cc, args.cflags.split())
+        print("%-20s %s" % (name, "FAIL" if failed else "ok"), flush=True)
+        failures += failed
+
+    print()
+    for f in failures:
+        print(f)
+    print("%d test(s), %d failure(s)" % (len(names), len(failures)))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,77 +1,436 @@
 /* vm.c
    Flux Bytecode Virtual Machine.
    Usage: gcc -o vm vm.c -lm
-          ./vm program.fluxb
+          ./vm [--disasm] [--stack-limit=SIZE] [--flush=line|block|exit] program.fluxb
+   Accepts both the binary .fluxb image written by fluxc and the text listing
+   written by fluxc -S, and runs .flux sources through fluxc and a cache of
+   linked images (--cache-dir=DIR, see --- Image cache ---). --disasm prints
+   the loaded program in text form; --profile reports where a run spent its
+   instructions and time, --sample writes sampled call stacks for
+   flamegraphs; --timings prints how long loading, linking and running took.
+   --snapshot=FILE saves the state of a run when it first reads input, and
+   --restore=FILE starts a later run from there (see --- Snapshots ---).
+
+   Built with -DFLUXVM_LIBRARY it leaves out main() and the server and is
+   libfluxvm, see fluxvm.h.
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
-#include <math.h> // For pow()
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <spawn.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FLUX_SIMD_X86 1
+#include <immintrin.h>
+#endif
+#include "fluxb.h"
+#include "fluxvm.h"
+
+#define DEFAULT_STACK_LIMIT (256L * 1024 * 1024) // Bytes of frames + locals, see --stack-limit
 
-#define MAX_INSTRUCTIONS 1024
-#define MAX_SYMBOLS 128
-#define MAX_LABELS 64
-#define MAX_OPERAND_LEN 256
-#define MAX_LINE_LEN 1024
-#define MAX_CALL_STACK 32 // For function return addresses
+#if defined(__GNUC__)
+#define NORETURN __attribute__((noreturn))
+#define COLD __attribute__((cold))
+#else
+#define NORETURN
+#define COLD
+#endif
+
+// Everything but the fluxvm_* functions of fluxvm.h is internal to the
+// library build, so a program linking libfluxvm sees only that API.
+#ifdef FLUXVM_LIBRARY
+#define FLUX_INTERNAL static
+#else
+#define FLUX_INTERNAL
+#endif
 
 // --- Data Structures for the VM ---
 
-// Simple structure for variable storage (Symbol Table Entry)
+// Tagged runtime value, used for variables, temporaries and call arguments.
+// 16 bytes on 64-bit targets. VAL_NONE marks a variable not yet assigned.
+typedef enum {
+    VAL_NONE,
+    VAL_INT,
+    VAL_BOOL,
+    VAL_STRING,
+    VAL_ARRAY  // every tag from VAL_STRING on holds a reference, see value_unref()
+} ValueTag;
+
+// Strings are immutable and reference-counted, so copying a string value is
+// a pointer copy plus a count bump. Literals live in the constant pool built
+// at link time and are immortal (refcount STRING_IMMORTAL, never freed).
+#define STRING_IMMORTAL -1
+
+typedef struct {
+    int refcount;
+    size_t len;
+    char data[]; // NUL-terminated
+} FluxString;
+
+// Arrays are mutable and shared: every variable holding one sees a change
+// made through any of them. The elements are longs in one block, so the
+// bulk opcodes can run vector kernels over them (see --- Arrays ---).
+typedef struct {
+    int refcount;
+    size_t len;
+    long data[];
+} FluxArray;
+
+typedef struct {
+    ValueTag tag;
+    union {
+        long i;          // VAL_INT / VAL_BOOL
+        FluxString *s;   // VAL_STRING (holds one reference)
+        FluxArray *arr;  // VAL_ARRAY (holds one reference)
+    } as;
+} Value;
+
+// A linked operand: a variable slot or a literal parsed once at link time.
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_SLOT,   // variable, slot in the current frame
+    OPERAND_INT,    // numeric literal, value pre-parsed
+    OPERAND_STRING  // string literal, quotes stripped
+} OperandKind;
+
 typedef struct {
-    char name[64];
-    long value; // Stores int/bool value
-    char *s_value; // Stores string value (dynamically allocated)
-    char type[16]; // "int", "bool", "string"
-    int active;
-} SymbolTableEntry;
+    OperandKind kind;
+    int slot;
+    long value;      // OPERAND_INT value (0 for string literals, as strtol gave)
+    const char *str; // OPERAND_INT: literal as written; OPERAND_STRING: contents
+    FluxString *sval; // OPERAND_STRING: interned constant; the empty string otherwise
+} Operand;
 
 // Instruction structure
+// The text operands point either into the mapped string pool of a binary
+// image or into strings owned by the text loader; unused operands are "".
+// link_program() fills in the resolved fields used by interpret().
 typedef struct {
     int opcode;
-    char op_name[16];
-    char arg1[MAX_OPERAND_LEN];
-    char arg2[MAX_OPERAND_LEN];
-    char dest[MAX_OPERAND_LEN]; // Destination variable or label
+    const char *arg1;
+    const char *arg2;
+    const char *dest; // Destination variable or label
+
+    Operand a;        // first source operand
+    Operand b;        // second source operand
+    int dest_slot;    // destination variable slot, -1 if none
+    int target;       // jz/jnz/jmp: instruction index of the target label
+    ValueTag type;    // store: declared type
+    struct CallSite *call; // call: descriptor decoded at link time
+    const void *handler; // threaded dispatch: address of the opcode's handler
 } Instruction;
 
+// Open-addressing hash index from names to table positions. Keys point at
+// strings owned by the loaded program.
+typedef struct {
+    const char *key;
+    int value;
+} NameIndexEntry;
+
+typedef struct {
+    NameIndexEntry *entries; // NULL key = empty
+    int cap;                 // power of two
+    int count;
+} NameIndex;
+
+// A call site decoded once at link time: everything a call needs except the
+// argument values themselves.
+typedef struct CallSite {
+    const char *callee;       // function name, for diagnostics
+    int func;                 // function_map index
+    int arg_count;            // equals the callee's parameter count (checked at link time)
+    Operand *args;            // argument operands, resolved in the caller's frame
+    const ValueTag *param_types; // declared type of each parameter; parameter i is slot i
+    int local_count;          // callee frame size
+    int entry_pc;             // code[] index of the callee's first instruction
+} CallSite;
+
 // Label mapping
 typedef struct {
-    char name[64];
+    const char *name;
     int instr_index; // Index into instructions array
 } LabelMap;
 
 // Function mapping structure
 typedef struct {
-    char name[64];
+    const char *name;
     int instr_index; // Instruction index of the [0x01] entry
-    char params[MAX_OPERAND_LEN]; // Parameter declaration string (e.g., "int x, int y")
+    int code_index; // Index of the entry in the executed code[] stream
+    const char *params; // Parameter declaration string (e.g., "int x, int y")
+
+    // Frame layout, filled in by link_program(): parameters take slots
+    // 0..param_count-1, the function's other variables follow.
+    int param_count;
+    ValueTag *param_types;
+    const char **local_names;
+    int local_count;
+    int local_cap;
+    NameIndex local_index;
+    int ret_slot; // slot of __ret, which receives callees' return values; -1 if unused
 } FunctionMapEntry;
 
+// Activation record. Locals live on the shared value stack at [base, base + local_count).
+typedef struct {
+    int func;      // function_map index
+    int return_pc; // code[] index to resume the caller at
+    size_t base;   // value_stack index of slot 0
+} Frame;
+
+
+// Strings created while loading and linking live as long as the program, so
+// they are bump-allocated from large blocks instead of one malloc each.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+// A loaded and linked program. Nothing writes to it once link_program() has
+// run, so instances on any number of threads can execute it at once.
+// Every table grows geometrically, so appends are amortized O(1) and program
+// size is limited only by memory.
+struct FluxProgram {
+    Instruction *instructions;
+    int instr_count;
+    int instr_cap;
+
+    // The executed stream: instructions[] with labels removed and jump targets
+    // remapped, followed by a sentinel 'end'. Built by link_program().
+    Instruction *code;
+    int code_count;
+    int main_code_entry; // code[] index of main's entry
+    int main_entry_point;
+    int main_func;       // function_map index of main
+
+    LabelMap *label_map;
+    int label_count;
+    int label_cap;
+    NameIndex label_index;
+
+    FunctionMapEntry *function_map;
+    int function_count;
+    int function_cap;
+    NameIndex function_index;
+
+    // Constant pool: one immortal string per distinct literal, escapes applied
+    NameIndex literal_index;
+    FluxString **literals;
+    int literal_count;
+    int literal_cap;
+    FluxString *empty_string; // interned "", set up by link_program()
+
+    ArenaBlock *arena;
+    const char *image;  // the mapped file of a binary image or cached linked image
+    size_t image_size;
+    int linked;
+    int cached;         // the tables live in image, see --- Image cache ---
+
+    // Scope whose locals link_operand() currently resolves names against;
+    // code before the first function is linked against toplevel
+    FunctionMapEntry *link_scope;
+    FunctionMapEntry toplevel;
+
+    jmp_buf error; // where load and link errors go, see load_failed()
+};
+
+// Per-instance state of a function for the JIT tier, see --- JIT ---
+typedef struct {
+    int hotness;      // calls plus loop back edges taken while interpreted
+    int failed;       // uses an opcode the JIT has no template for
+    void *code;       // native code, NULL until compiled
+    size_t code_size;
+} JitFunctionState;
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+    int line_buffered; // flush after a fragment containing '\n'
+    int unbounded;     // grow instead of flushing: FLUXVM_FLUSH_EXIT, or collected (fd -1)
+    FluxVM *hold;      // set while a snapshot holds back what would reach fd, see --- Snapshots ---
+} OutputBuffer;
+
+// A piece of output held back for a snapshot, see --- Snapshots ---
+typedef struct {
+    int32_t stream;    // FLUXVM_STDOUT or FLUXVM_STDERR
+    int32_t written;   // 1: written out before the read, 0: still buffered at the read
+    uint64_t len;
+} SnapshotWrite;
+
+typedef struct {
+    int fd;        // -1: only what is in data
+    char *data;
+    size_t pos;    // start of the next unread line
+    size_t len;    // bytes available in data
+    size_t cap;    // allocated size of data (0 when mapped or borrowed)
+    size_t mapped; // size of the mapping of a regular file, 0 if none
+    int eof;       // no more bytes will arrive after data[len]
+    int ready;
+} InputBuffer;
+
+// One instance of a program: everything a run changes.
+struct FluxVM {
+    const FluxProgram *program;
+
+    // Call stack: frames plus the contiguous value stack holding every frame's
+    // locals. Both grow on demand up to stack_limit bytes combined.
+    Frame *frames;
+    int frame_count;
+    int frame_cap;
+    Value *value_stack;
+    size_t value_stack_top;
+    size_t value_stack_cap;
+    size_t stack_limit;
+
+    OutputBuffer out_stdout;
+    OutputBuffer out_stderr;
+    FluxFlush flush_policy;
+    InputBuffer in_stdin;
+
+    // The interpreter loop in use (see interpret.h); native code calls back into it
+    int (*loop)(FluxVM *vm, int pc);
+
+    int jit_enabled;
+    int jit_threshold;
+    int jit_depth;
+    JitFunctionState *jit_funcs;
+    struct Jit *jit; // compiler state and entry points, NULL until something is compiled
+
+    // Read by the --sample signal handler, see --- Sampler ---
+    volatile sig_atomic_t frames_moving; // set while frames[] is reallocated
+    volatile sig_atomic_t sample_native; // set while JIT code (not an interpreter) runs
+
+    jmp_buf *error; // where VM errors of the current run go, see vm_error()
+
+    const struct ArrayKernels *kernels; // for the bulk array opcodes, see --- Arrays ---
+
+    // See --- Snapshots ---
+    const char *snapshot_path; // write a snapshot at the next run's first read, NULL if none
+    int snapshot_armed;        // this run's output is held back for the snapshot
+    size_t snapshot_start[2];  // stdout and stderr bytes collected before the run
+    OutputBuffer snapshot_output; // the bytes held back, in the order they were written
+    SnapshotWrite *snapshot_writes; // and which stream each piece of them went to
+    size_t snapshot_write_count;
+    size_t snapshot_write_cap;
+    int resume_pc;             // where the next run starts, -1: main's entry
+};
 
-// Global state
-Instruction instructions[MAX_INSTRUCTIONS];
-int instr_count = 0;
+// --- Storage ---
 
-SymbolTableEntry symbol_table[MAX_SYMBOLS];
-int symbol_count = 0;
+FLUX_INTERNAL void out_of_memory() {
+    fprintf(stderr, "VM Error: Out of memory.\n");
+    exit(1);
+}
+
+// Abandons a load or link whose error has been printed
+FLUX_INTERNAL NORETURN void load_failed(FluxProgram *prog) {
+    longjmp(prog->error, 1);
+}
+
+// Errors and warnings of a run, see --- Output ---
+FLUX_INTERNAL NORETURN void vm_error(FluxVM *vm, const char *fmt, ...);
+FLUX_INTERNAL void vm_message(FluxVM *vm, const char *fmt, ...);
 
-LabelMap label_map[MAX_LABELS];
-int label_count = 0;
+// Makes room for at least 'need' elements, doubling the capacity.
+FLUX_INTERNAL void *grow_array(void *array, int *cap, int need, size_t elem_size) {
+    if (need <= *cap) return array;
+    int new_cap = *cap ? *cap : 16;
+    while (new_cap < need) new_cap *= 2;
+    array = realloc(array, (size_t)new_cap * elem_size);
+    if (!array) out_of_memory();
+    *cap = new_cap;
+    return array;
+}
+
+FLUX_INTERNAL char *arena_alloc(FluxProgram *prog, size_t size) {
+    size = (size + 7) & ~(size_t)7; // keep every allocation 8-byte aligned
+    ArenaBlock *block = prog->arena;
+    if (!block || block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (!block) out_of_memory();
+        block->prev = prog->arena;
+        block->used = 0;
+        block->size = block_size;
+        prog->arena = block;
+    }
+    char *out = block->data + block->used;
+    block->used += size;
+    return out;
+}
 
-FunctionMapEntry function_map[64];
-int function_count = 0;
+FLUX_INTERNAL uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
 
-int call_stack[MAX_CALL_STACK];
-int stack_top = -1; // Call stack pointer
+// Returns the value stored for key, or -1.
+FLUX_INTERNAL int name_index_get(const NameIndex *ix, const char *key) {
+    if (!ix->cap) return -1;
+    uint32_t h = hash_name(key) & (ix->cap - 1);
+    while (ix->entries[h].key) {
+        if (strcmp(ix->entries[h].key, key) == 0) return ix->entries[h].value;
+        h = (h + 1) & (ix->cap - 1);
+    }
+    return -1;
+}
 
-int main_entry_point = -1;
+// Adds key -> value unless key is already present (the first definition wins).
+FLUX_INTERNAL void name_index_put(NameIndex *ix, const char *key, int value) {
+    if ((ix->count + 1) * 2 > ix->cap) {
+        NameIndexEntry *old = ix->entries;
+        int old_cap = ix->cap;
+        ix->cap = old_cap ? old_cap * 2 : 16;
+        ix->entries = calloc(ix->cap, sizeof(NameIndexEntry));
+        if (!ix->entries) out_of_memory();
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i].key) continue;
+            uint32_t h = hash_name(old[i].key) & (ix->cap - 1);
+            while (ix->entries[h].key) h = (h + 1) & (ix->cap - 1);
+            ix->entries[h] = old[i];
+        }
+        free(old);
+    }
+    uint32_t h = hash_name(key) & (ix->cap - 1);
+    while (ix->entries[h].key) {
+        if (strcmp(ix->entries[h].key, key) == 0) return;
+        h = (h + 1) & (ix->cap - 1);
+    }
+    ix->entries[h].key = key;
+    ix->entries[h].value = value;
+    ix->count++;
+}
 
 // --- Utility Functions ---
 // --- NEW UTILITY FUNCTION ---
 // Replaces only the '\n' escape sequence in a string
-void unescape_newline(char *s) {
+FLUX_INTERNAL void unescape_newline(char *s) {
     char *p = s;
     char *q = s;
     while (*p) {
@@ -85,7 +444,7 @@ void unescape_newline(char *s) {
     *q = '\0'; // Null-terminate the new string
 }
 
-void trim(char *s) {
+FLUX_INTERNAL void trim(char *s) {
     char *p = s;
     while(*p && isspace((unsigned char)*p)) p++;
     if (p != s) memmove(s, p, strlen(p)+1);
@@ -93,526 +452,4610 @@ void trim(char *s) {
     while(n>0 && isspace((unsigned char)s[n-1])) s[--n] = '\0';
 }
 
-// Check if a string is a variable name (starts with a letter and not a quoted string)
-int is_variable(const char *s) {
+// Check if a string is a variable name (starts with a letter or '_' and is not a quoted string)
+FLUX_INTERNAL int is_variable(const char *s) {
     if (!s || s[0] == '\0') return 0;
     if (s[0] == '"') return 0; // It's a string literal
-    return isalpha((unsigned char)s[0]);
+    return isalpha((unsigned char)s[0]) || s[0] == '_';
 }
 
-// Find a variable by name in the symbol table
-SymbolTableEntry* get_symbol(const char *name) {
-    for (int i = 0; i < symbol_count; i++) {
-        if (symbol_table[i].active && strcmp(symbol_table[i].name, name) == 0) {
-            return &symbol_table[i];
-        }
-    }
-    return NULL;
+// Find a variable slot by name in a function's frame layout
+FLUX_INTERNAL int find_slot(const FunctionMapEntry *func, const char *name) {
+    return name_index_get(&func->local_index, name);
 }
 
-// Get the numerical value of an operand (either literal or variable)
-long get_long_value(const char *operand) {
-    if (is_variable(operand)) {
-        SymbolTableEntry *s = get_symbol(operand);
-        if (s && (strcmp(s->type, "int") == 0 || strcmp(s->type, "bool") == 0)) {
-            return s->value;
-        }
-        fprintf(stderr, "VM Error: Undefined or non-numeric variable '%s'.\n", operand);
-        exit(1);
-    }
-    // Assume it's a numeric literal
-    return strtol(operand, NULL, 10);
+// Find or allocate the frame slot for a variable name in the current link scope
+FLUX_INTERNAL int intern_slot(FluxProgram *prog, const char *name) {
+    FunctionMapEntry *func = prog->link_scope;
+    int slot = find_slot(func, name);
+    if (slot >= 0) return slot;
+    func->local_names = grow_array(func->local_names, &func->local_cap, func->local_count + 1, sizeof(const char *));
+    func->local_names[func->local_count] = name;
+    name_index_put(&func->local_index, name, func->local_count);
+    return func->local_count++;
 }
 
-// Get the string value of an operand (either literal or variable)
-char* get_string_value(const char *operand) {
-    if (operand[0] == '"') {
-        // String literal: remove quotes
-        char *str = strdup(operand + 1);
-        if (str[strlen(str) - 1] == '"') str[strlen(str) - 1] = '\0';
-        return str;
-    }
+// Maps a declared type name to its value tag
+FLUX_INTERNAL ValueTag parse_type(FluxProgram *prog, const char *type) {
+    if (strcmp(type, "int") == 0) return VAL_INT;
+    if (strcmp(type, "bool") == 0) return VAL_BOOL;
+    if (strcmp(type, "string") == 0) return VAL_STRING;
+    if (strcmp(type, "array") == 0) return VAL_ARRAY;
+    fprintf(stderr, "VM Error: Unknown type '%s'.\n", type);
+    load_failed(prog);
+}
 
-    if (is_variable(operand)) {
-        SymbolTableEntry *s = get_symbol(operand);
-        if (s && strcmp(s->type, "string") == 0 && s->s_value) {
-            return strdup(s->s_value); // Return a copy
-        }
-    }
+// --- Strings ---
 
-    // Not a string variable or literal
-    return strdup("");
+// Creates a string with one reference, copying len bytes of s
+FLUX_INTERNAL FluxString *string_new(const char *s, size_t len) {
+    FluxString *str = malloc(sizeof(FluxString) + len + 1);
+    if (!str) out_of_memory();
+    str->refcount = 1;
+    str->len = len;
+    memcpy(str->data, s, len);
+    str->data[len] = '\0';
+    return str;
 }
 
+static inline FluxString *string_retain(FluxString *str) {
+    if (str->refcount != STRING_IMMORTAL) str->refcount++;
+    return str;
+}
 
-// Set the value of a destination variable
-void set_symbol_value(const char *name, const char *type, long val, const char *s_val) {
-    SymbolTableEntry *s = get_symbol(name);
+static inline void string_release(FluxString *str) {
+    if (str->refcount != STRING_IMMORTAL && --str->refcount == 0) free(str);
+}
 
-    // If symbol doesn't exist, create it
-    if (!s) {
-        if (symbol_count >= MAX_SYMBOLS) {
-            fprintf(stderr, "VM Error: Symbol table overflow.\n");
-            exit(1);
-        }
-        s = &symbol_table[symbol_count++];
-        strncpy(s->name, name, sizeof(s->name) - 1);
-        s->active = 1;
-        s->s_value = NULL;
-    }
+// Returns the program's constant for a literal, adding it to the pool
+FLUX_INTERNAL FluxString *intern_literal(FluxProgram *prog, const char *text) {
+    int id = name_index_get(&prog->literal_index, text);
+    if (id >= 0) return prog->literals[id];
+    size_t len = strlen(text);
+    FluxString *str = (FluxString *)arena_alloc(prog, sizeof(FluxString) + len + 1);
+    str->refcount = STRING_IMMORTAL;
+    str->len = len;
+    memcpy(str->data, text, len + 1);
+    prog->literals = grow_array(prog->literals, &prog->literal_cap, prog->literal_count + 1, sizeof(FluxString *));
+    prog->literals[prog->literal_count] = str;
+    name_index_put(&prog->literal_index, str->data, prog->literal_count);
+    return prog->literals[prog->literal_count++];
+}
 
-    // Set type and value
-    strncpy(s->type, type, sizeof(s->type) - 1);
-    s->value = val;
+// --- Values ---
 
-    // Handle string values
-    if (s_val && strcmp(type, "string") == 0) {
-        if (s->s_value) free(s->s_value);
-        s->s_value = strdup(s_val);
-    } else if (s->s_value) {
-        free(s->s_value);
-        s->s_value = NULL;
-    }
+static inline FluxArray *array_retain(FluxArray *arr) {
+    arr->refcount++;
+    return arr;
 }
 
-// Find instruction index for a label
-int find_label(const char *name) {
-    for (int i = 0; i < label_count; i++) {
-        if (strcmp(label_map[i].name, name) == 0) {
-            return label_map[i].instr_index;
-        }
-    }
-    fprintf(stderr, "VM Error: Label '%s' not found.\n", name);
-    return -1;
+static inline void array_release(FluxArray *arr) {
+    if (--arr->refcount == 0) free(arr);
 }
 
-// Find function entry by name
-FunctionMapEntry* find_function(const char *name) {
-    for (int i = 0; i < function_count; i++) {
-        if (strcmp(function_map[i].name, name) == 0) {
-            return &function_map[i];
-        }
-    }
-    return NULL;
+// Gives up the reference a string or array value holds
+FLUX_INTERNAL void value_unref(Value *v) {
+    if (v->tag == VAL_STRING) string_release(v->as.s);
+    else array_release(v->as.arr);
 }
 
+FLUX_INTERNAL void value_release(Value *v) {
+    if (v->tag >= VAL_STRING) value_unref(v);
+    v->tag = VAL_NONE;
+}
 
-// --- Bytecode Loading ---
-
-void load_bytecode(const char *filepath) {
-    FILE *f = fopen(filepath, "r");
-    if (!f) { perror("open bytecode file"); exit(1); }
-
-    char line[MAX_LINE_LEN];
-    while (fgets(line, sizeof(line), f)) {
-        trim(line);
-        if (line[0] == '\0' || line[0] == '#') continue;
-
-        if (instr_count >= MAX_INSTRUCTIONS) {
-            fprintf(stderr, "VM Error: Instruction buffer overflow.\n");
-            break;
-        }
+// Stores an int or bool into v
+FLUX_INTERNAL void value_set_long(Value *v, ValueTag tag, long x) {
+    if (v->tag >= VAL_STRING) value_unref(v);
+    v->tag = tag;
+    v->as.i = x;
+}
 
-        Instruction *instr = &instructions[instr_count];
+// Stores a new reference to str into v
+FLUX_INTERNAL void value_set_string(Value *v, FluxString *str) {
+    string_retain(str);
+    if (v->tag >= VAL_STRING) value_unref(v);
+    v->tag = VAL_STRING;
+    v->as.s = str;
+}
 
-        // Parse Opcode ID and Name
-        int n_parsed = sscanf(line, "[%x] %15s", &instr->opcode, instr->op_name);
-        if (n_parsed != 2) continue;
+// Stores a new reference to arr into v
+FLUX_INTERNAL void value_set_array(Value *v, FluxArray *arr) {
+    array_retain(arr);
+    if (v->tag >= VAL_STRING) value_unref(v);
+    v->tag = VAL_ARRAY;
+    v->as.arr = arr;
+}
 
-        // Skip the Opcode part to get to operands
-        char *op_start = strchr(line, ']');
-        if (!op_start) continue;
+FLUX_INTERNAL NORETURN COLD void operand_error(FluxVM *vm, const Operand *op) {
+    vm_error(vm, "VM Error: Undefined or non-numeric variable '%s'.\n", op->str);
+}
 
-        // Find the start of the operand string (after the opcode name and space)
-        char *arg_start = op_start + strlen(instr->op_name) + 3;
-        if (arg_start >= line + strlen(line)) arg_start = "";
+FLUX_INTERNAL NORETURN COLD void array_error(FluxVM *vm, const char *name) {
+    vm_error(vm, "VM Error: '%s' is not an array.\n", name);
+}
 
-        // Copy arguments based on opcode type
-        instr->arg1[0] = instr->arg2[0] = instr->dest[0] = '\0';
+// The array an operand holds (borrowed, like get_string_value())
+static inline FluxArray *get_array(FluxVM *vm, const Value *locals, const Operand *op) {
+    if (op->kind != OPERAND_SLOT || locals[op->slot].tag != VAL_ARRAY) array_error(vm, op->str);
+    return locals[op->slot].as.arr;
+}
 
-        switch (instr->opcode) {
-            case 0x01: { // entry <type> <name>(<params>)
-                // Example: int add(int x, int y)
-                char func_type[16], func_name_paren[64];
-                if (sscanf(arg_start, "%15s %63[^\n]", func_type, func_name_paren) == 2) {
-                    char *popen = strchr(func_name_paren, '(');
-                    char *pclose = strrchr(func_name_paren, ')');
-
-                    if (popen && pclose && pclose > popen) {
-                        int name_len = popen - func_name_paren;
-                        // Extract function name
-                        strncpy(function_map[function_count].name, func_name_paren, name_len);
-                        function_map[function_count].name[name_len] = '\0';
-                        trim(function_map[function_count].name);
-
-                        // Extract parameter declaration string
-                        int param_len = pclose - popen - 1;
-                        if (param_len > 0) {
-                            strncpy(function_map[function_count].params, popen + 1, param_len);
-                            function_map[function_count].params[param_len] = '\0';
-                            trim(function_map[function_count].params);
-                        } else {
-                            function_map[function_count].params[0] = '\0';
-                        }
-                        
-                        function_map[function_count].instr_index = instr_count;
-                        
-                        // Check for main entry point
-                        if (strcmp(function_map[function_count].name, "main") == 0) {
-                            main_entry_point = instr_count;
-                        }
-
-                        function_count++;
-                    }
-                }
-                break;
-            }
-            case 0x03: // stdout <value>
-            case 0x04: // stderr <value>
-            case 0x05: // read <var>
-            case 0x06: // return_code <var>
-            case 0x08: // call <name>(<params>)
-                // For call, arg1 stores the full call signature: func(a,b)
-                strncpy(instr->arg1, arg_start, sizeof(instr->arg1)-1);
-                trim(instr->arg1);
-                break;
-            case 0x07: // store <type> <var> <value>
-                // We need custom parsing to handle string literals in <value>
-                char type_buf[16], var_buf[64];
-                if (sscanf(arg_start, "%15s %63s", type_buf, var_buf) == 2) {
-                    strncpy(instr->arg1, type_buf, sizeof(instr->arg1) - 1); // type
-                    strncpy(instr->arg2, var_buf, sizeof(instr->arg2) - 1); // var
-                    char *val_start = strstr(arg_start, var_buf) + strlen(var_buf);
-                    if (val_start) {
-                        // Advance past whitespace
-                        while (*val_start && isspace((unsigned char)*val_start)) val_start++;
-                        strncpy(instr->dest, val_start, sizeof(instr->dest) - 1); // value
-                        trim(instr->dest);
-                    }
-                }
-                break;
-            case 0x13: // jz <cond_var> <label>
-                sscanf(arg_start, "%s %s", instr->arg1, instr->dest);
-                break;
-            case 0x14: // jmp <label>
-                sscanf(arg_start, "%s", instr->dest);
-                break;
-            case 0x15: { // label <name>
-                char label_name[64];
-                if (sscanf(arg_start, "%s", label_name) == 1) {
-                    if (label_count >= MAX_LABELS) {
-                        fprintf(stderr, "VM Error: Label map overflow.\n");
-                        exit(1);
-                    }
-                    strncpy(label_map[label_count].name, label_name, sizeof(label_map[label_count].name) - 1);
-                    label_map[label_count].instr_index = instr_count;
-                    label_count++;
-                }
-                break;
-            }
-            // All binary operators (add, sub, mul, div, mod, pow, gt, lt, eq, ne)
-            case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D: case 0x0E:
-            case 0x0F: case 0x10: case 0x11: case 0x12:
-                sscanf(arg_start, "%s %s %s", instr->arg1, instr->arg2, instr->dest);
-                break;
+// Get the numerical value of an operand (either literal or a variable in locals)
+static inline long get_long_value(FluxVM *vm, const Value *locals, const Operand *op) {
+    if (op->kind == OPERAND_SLOT) {
+        const Value *v = &locals[op->slot];
+        if (v->tag == VAL_INT || v->tag == VAL_BOOL) {
+            return v->as.i;
         }
-        instr_count++;
+        operand_error(vm, op);
     }
-    fclose(f);
+    // Numeric literal, already parsed
+    return op->value;
 }
 
-// Splits a comma-separated string of variable declarations (e.g., "int x, string s")
-// or argument values (e.g., "a, "hello", 5") into an array of tokens.
-void split_commas(const char *s, char out[][MAX_OPERAND_LEN], int *count) {
-    *count = 0;
-    const char *p = s;
-    while (*p) {
-        while (*p && isspace((unsigned char)*p)) p++;
-        const char *start = p;
-        int in_str = 0;
-        while (*p) {
-            if (*p == '"') in_str = !in_str;
-            if (!in_str && *p == ',') break;
-            p++;
-        }
-        int len = p - start;
-        if (len > 0 && *count < 32) {
-            strncpy(out[*count], start, len);
-            out[*count][len] = '\0';
-            trim(out[*count]);
-            (*count)++;
+// Get the string value of an operand (either literal or variable). The result
+// is borrowed: retain it to keep it past the variable's next assignment.
+FLUX_INTERNAL FluxString *get_string_value(const Value *locals, const Operand *op) {
+    if (op->kind == OPERAND_SLOT) {
+        const Value *v = &locals[op->slot];
+        if (v->tag == VAL_STRING) {
+            return v->as.s;
         }
-        if (*p == ',') p++;
     }
+
+    // A string literal's constant; "" for anything else
+    return op->sval;
 }
 
+// Evaluates an operand into v, converted to the declared type
+FLUX_INTERNAL void load_operand(FluxVM *vm, Value *v, ValueTag type, const Value *locals, const Operand *op) {
+    if (type == VAL_STRING) {
+        value_set_string(v, get_string_value(locals, op));
+    } else if (type == VAL_ARRAY) {
+        value_set_array(v, get_array(vm, locals, op));
+    } else {
+        value_set_long(v, type, get_long_value(vm, locals, op));
+    }
+}
 
-// --- VM Execution ---
+// Integer arithmetic wraps on overflow, as the JIT's add/sub/imul do; done in
+// unsigned long because signed overflow is undefined in C.
+static inline long wrap_add(long a, long b) { return (long)((unsigned long)a + (unsigned long)b); }
+static inline long wrap_sub(long a, long b) { return (long)((unsigned long)a - (unsigned long)b); }
+static inline long wrap_mul(long a, long b) { return (long)((unsigned long)a * (unsigned long)b); }
 
-void execute_vm() {
-    if (main_entry_point == -1) {
-        fprintf(stderr, "VM Error: Program does not contain an 'int main()' entry point.\n");
-        return;
+// x ^ e by repeated squaring, wrapping like mul. A negative exponent means
+// 1 / x^-e rounded toward zero, like div: 1 for x = 1, +-1 for x = -1, 0 for
+// the rest and a division by zero for x = 0.
+FLUX_INTERNAL long int_pow(FluxVM *vm, long x, long e) {
+    if (e < 0) {
+        if (x == 0) vm_error(vm, "VM Error: Division by zero.\n");
+        return x == 1 ? 1 : x == -1 ? ((e & 1) ? -1 : 1) : 0;
+    }
+    unsigned long r = 1, b = (unsigned long)x;
+    for (; e; e >>= 1) {
+        if (e & 1) r *= b;
+        b *= b;
     }
+    return (long)r;
+}
 
-    int pc = main_entry_point + 1; // Program Counter starts after 'entry'
-    long ret_val = 0;
+// --- Arrays ---
+// array_new allocates n zeroed longs in one block, indexed with a bounds
+// check. The bulk opcodes (sum, min, max, fill, add_each, mul_each and the
+// count_* comparisons) each make one pass over the block with a kernel: on
+// x86-64 the SSE2 or AVX2 versions from kernels.h, chosen when an instance
+// is made from what the CPU supports, and plain loops elsewhere.
+// FLUX_SIMD=scalar|sse2|avx2 in the environment caps the choice, to compare
+// them. Every kernel gives the same results; arithmetic wraps like add's.
 
-    // Execution loop
-    while (pc < instr_count) {
-        Instruction *instr = &instructions[pc];
+typedef struct ArrayKernels {
+    const char *name;
+    long (*sum)(const long *p, size_t n);
+    long (*min)(const long *p, size_t n); // n > 0
+    long (*max)(const long *p, size_t n);
+    void (*fill)(long *p, size_t n, long x);
+    void (*add)(long *p, size_t n, long x);
+    void (*mul)(long *p, size_t n, long x);
+    void (*add_array)(long *p, const long *q, size_t n);
+    void (*mul_array)(long *p, const long *q, size_t n);
+    size_t (*count_gt)(const long *p, size_t n, long x);
+    size_t (*count_lt)(const long *p, size_t n, long x);
+    size_t (*count_eq)(const long *p, size_t n, long x);
+} ArrayKernels;
 
-        // Skip 'label' instructions, they are only targets
-        if (instr->opcode == 0x15) {
-            pc++;
-            continue;
-        }
+FLUX_INTERNAL long scalar_sum(const long *p, size_t n) {
+    unsigned long s = 0;
+    for (size_t i = 0; i < n; i++) s += (unsigned long)p[i];
+    return (long)s;
+}
 
-        long op1_val, op2_val;
-        SymbolTableEntry *dest_sym;
+FLUX_INTERNAL long scalar_min(const long *p, size_t n) {
+    long m = p[0];
+    for (size_t i = 1; i < n; i++) if (p[i] < m) m = p[i];
+    return m;
+}
 
-        switch (instr->opcode) {
-            case 0x02: // end (Only reached if returning from main)
-                
-                return;
+FLUX_INTERNAL long scalar_max(const long *p, size_t n) {
+    long m = p[0];
+    for (size_t i = 1; i < n; i++) if (p[i] > m) m = p[i];
+    return m;
+}
 
-            
-case 0x03: { // stdout <value>
-    char *s_val = NULL;
-    if (instr->arg1[0] == '"') {
-        // Handle string literal:
-        s_val = get_string_value(instr->arg1);
-        
-        // VITAL CHANGE: Unescape ONLY the newline sequence
-        unescape_newline(s_val); 
-        
-        printf("%s", s_val);
-        free(s_val);
-    } else if (is_variable(instr->arg1)) {
-        // Handle variable printing (no change)
-        SymbolTableEntry *s = get_symbol(instr->arg1);
-        if (s) {
-            if (strcmp(s->type, "string") == 0 && s->s_value) {
-                printf("%s", s->s_value);
-            } else if (strcmp(s->type, "int") == 0 || strcmp(s->type, "bool") == 0) {
-                printf("%ld", s->value);
-            } else {
-                printf("<unsupported type>");
-            }
-        } else {
-            fprintf(stderr, "VM Error: Cannot print undefined variable '%s'.\n", instr->arg1);
-        }
-    } else {
-        // Numeric literal
-        printf("%s", instr->arg1);
-    }
-    break;
+FLUX_INTERNAL void scalar_fill(long *p, size_t n, long x) {
+    for (size_t i = 0; i < n; i++) p[i] = x;
 }
 
+FLUX_INTERNAL void scalar_add(long *p, size_t n, long x) {
+    for (size_t i = 0; i < n; i++) p[i] = (long)((unsigned long)p[i] + (unsigned long)x);
+}
 
-            case 0x04: // stderr <value> (Same logic as stdout, but uses stderr)
-                if (instr->arg1[0] == '"') {
-                    fprintf(stderr, "%s", instr->arg1 + 1);
-                } else {
-                    fprintf(stderr, "%s", instr->arg1);
-                }
-                break;
+FLUX_INTERNAL void scalar_mul(long *p, size_t n, long x) {
+    for (size_t i = 0; i < n; i++) p[i] = (long)((unsigned long)p[i] * (unsigned long)x);
+}
 
-            
-            case 0x05: { // read <var>
-    			char input_buffer[256];
-    if (fgets(input_buffer, sizeof(input_buffer), stdin)) {
-        input_buffer[strcspn(input_buffer, "\n")] = '\0'; // remove newline
+FLUX_INTERNAL void scalar_add_array(long *p, const long *q, size_t n) {
+    for (size_t i = 0; i < n; i++) p[i] = (long)((unsigned long)p[i] + (unsigned long)q[i]);
+}
 
-        char *endptr;
-        long num = strtol(input_buffer, &endptr, 10); // Use strtol for long
+FLUX_INTERNAL void scalar_mul_array(long *p, const long *q, size_t n) {
+    for (size_t i = 0; i < n; i++) p[i] = (long)((unsigned long)p[i] * (unsigned long)q[i]);
+}
 
-        if (*endptr == '\0') {
-            // Pure integer input
-            set_symbol_value(instr->arg1, "int", num, NULL);
-        } else {
-            // String input (or float/malformed if using strtol)
-            // Note: If the user enters a float, it will be truncated by strtol
-            set_symbol_value(instr->arg1, "string", 0, input_buffer);
-        }
-    } else {
-        fprintf(stderr, "VM Error: Failed to read input.\n");
-        exit(1);
-    }
-    break;
+FLUX_INTERNAL size_t scalar_count_gt(const long *p, size_t n, long x) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) count += p[i] > x;
+    return count;
 }
 
-            case 0x06: { // return_code <var>
-                dest_sym = get_symbol(instr->arg1);
-                if (dest_sym) {
-                    ret_val = dest_sym->value;
-                }
+FLUX_INTERNAL size_t scalar_count_lt(const long *p, size_t n, long x) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) count += p[i] < x;
+    return count;
+}
 
-                if (stack_top >= 0) {
-                    // Function return: Pop return address and jump
-                    pc = call_stack[stack_top--];
-                    continue; // Skip pc++ below
-                } else {
-                    
-                    return; 
-                }
-                break;
-            }
+FLUX_INTERNAL size_t scalar_count_eq(const long *p, size_t n, long x) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) count += p[i] == x;
+    return count;
+}
 
-            case 0x07: { // store <type> <var> <value>
-                // Handle string literals, e.g., "hello"
-                if (instr->dest[0] == '"') {
-                    char *str_val = get_string_value(instr->dest);
-                    set_symbol_value(instr->arg2, instr->arg1, 0, str_val);
-                    free(str_val);
-                } else {
-                    // Numeric literal or variable copy (only works for int/bool)
-                    long val = get_long_value(instr->dest);
-                    set_symbol_value(instr->arg2, instr->arg1, val, NULL);
-                }
-                break;
-            }
-            
-            case 0x08: { // call <name>(<params>)
-                if (stack_top >= MAX_CALL_STACK - 1) {
-                    fprintf(stderr, "VM Error: Call stack overflow.\n");
-                    exit(1);
-                }
+FLUX_INTERNAL const ArrayKernels scalar_kernels = {
+    "scalar", scalar_sum, scalar_min, scalar_max, scalar_fill, scalar_add, scalar_mul,
+    scalar_add_array, scalar_mul_array, scalar_count_gt, scalar_count_lt, scalar_count_eq
+};
 
-                // 1. Extract function name and arguments passed
-                char call_signature[MAX_OPERAND_LEN];
-                strncpy(call_signature, instr->arg1, sizeof(call_signature)-1);
+#ifdef FLUX_SIMD_X86
+// SSE2 has neither a 64-bit multiply nor a 64-bit compare; both are built
+// from the 32-bit ones. AVX2 has the compare.
 
-                char *popen = strchr(call_signature, '(');
-                char *pclose = strrchr(call_signature, ')');
+// Low 64 bits of a * b: lo*lo plus the cross products shifted up
+static inline __m128i sse2_mul64(__m128i a, __m128i b) {
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b), _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+}
 
-                if (!popen || !pclose || pclose <= popen) {
-                    fprintf(stderr, "VM Error: Malformed call signature: %s\n", call_signature);
-                    exit(1);
-                }
+// Signed a > b: the high halves compare signed, the low halves unsigned
+// (flipping their sign bits makes a signed compare do that)
+static inline __m128i sse2_cmpgt64(__m128i a, __m128i b) {
+    const __m128i low_sign = _mm_set_epi32(0, INT_MIN, 0, INT_MIN);
+    __m128i x = _mm_xor_si128(a, low_sign), y = _mm_xor_si128(b, low_sign);
+    __m128i gt = _mm_cmpgt_epi32(x, y), eq = _mm_cmpeq_epi32(x, y);
+    __m128i gt_low = _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128i gt_high = _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128i eq_high = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+    return _mm_or_si128(gt_high, _mm_and_si128(eq_high, gt_low));
+}
 
-                int name_len = popen - call_signature;
-                char func_name[64];
-                strncpy(func_name, call_signature, name_len);
-                func_name[name_len] = '\0';
-                trim(func_name);
-
-                // Arguments passed in the call (e.g., "a, 5, "test"")
-                char arg_values_str[MAX_OPERAND_LEN];
-                int arg_len = pclose - popen - 1;
-                strncpy(arg_values_str, popen + 1, arg_len);
-                arg_values_str[arg_len] = '\0';
-                trim(arg_values_str);
-
-                FunctionMapEntry *func_entry = find_function(func_name);
-                if (!func_entry) {
-                    fprintf(stderr, "VM Error: Function '%s' not found.\n", func_name);
-                    exit(1);
-                }
+static inline __m128i sse2_cmpeq64(__m128i a, __m128i b) {
+    __m128i eq = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+}
 
-                // 2. Parse arguments and parameters for passing
-                char arg_values[32][MAX_OPERAND_LEN];
-                int arg_count = 0;
-                split_commas(arg_values_str, arg_values, &arg_count);
-
-                // Parameters declared in the function entry (e.g., "int x, int y")
-                char param_tokens[32][MAX_OPERAND_LEN];
-                int param_count = 0;
-                split_commas(func_entry->params, param_tokens, &param_count);
-                
-                if (arg_count != param_count) {
-                    fprintf(stderr, "VM Error: Function '%s' called with %d arguments, expected %d.\n", func_name, arg_count, param_count);
-                    exit(1);
-                }
+#define KERNEL(name) sse2_##name
+#define KERNEL_TARGET
+#define VEC __m128i
+#define VEC_LANES 2
+#define VEC_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VEC_STORE(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define VEC_SET1(x) _mm_set1_epi64x(x)
+#define VEC_ZERO() _mm_setzero_si128()
+#define VEC_ADD(a, b) _mm_add_epi64((a), (b))
+#define VEC_SUB(a, b) _mm_sub_epi64((a), (b))
+#define VEC_MUL(a, b) sse2_mul64((a), (b))
+#define VEC_GT(a, b) sse2_cmpgt64((a), (b))
+#define VEC_EQ(a, b) sse2_cmpeq64((a), (b))
+#define VEC_SELECT(mask, a, b) _mm_or_si128(_mm_and_si128((mask), (a)), _mm_andnot_si128((mask), (b)))
+#include "kernels.h"
+#undef KERNEL
+#undef KERNEL_TARGET
+#undef VEC
+#undef VEC_LANES
+#undef VEC_LOAD
+#undef VEC_STORE
+#undef VEC_SET1
+#undef VEC_ZERO
+#undef VEC_ADD
+#undef VEC_SUB
+#undef VEC_MUL
+#undef VEC_GT
+#undef VEC_EQ
+#undef VEC_SELECT
 
-                // 3. Parameter assignment (pass by value)
-                for (int i = 0; i < param_count; i++) {
-                    char type[16], param_name[64];
-                    // Parse declared parameter (e.g., "int x" -> type="int", name="x")
-                    if (sscanf(param_tokens[i], "%15s %63s", type, param_name) == 2) {
-                        const char *arg_val_token = arg_values[i];
-                        
-                        // Pass value into the parameter variable
-                        if (strcmp(type, "string") == 0) {
-                            char *s_val = get_string_value(arg_val_token);
-                            set_symbol_value(param_name, type, 0, s_val);
-                            free(s_val);
-                        } else {
-                            long val = get_long_value(arg_val_token);
-                            set_symbol_value(param_name, type, val, NULL);
-                        }
-                    } else {
-                        fprintf(stderr, "VM Error: Malformed parameter declaration in function '%s'.\n", func_name);
-                        exit(1);
-                    }
-                }
+#define AVX2 __attribute__((target("avx2")))
 
-                // 4. Save return address and jump
-                call_stack[++stack_top] = pc + 1;
-                pc = func_entry->instr_index + 1; // Jump after the 'entry' instruction
-                continue; // Skip pc++
-            }
+AVX2 static inline __m256i avx2_mul64(__m256i a, __m256i b) {
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+}
 
-			// Binary Arithmetic Operations (0x09 - 0x0E)
-case 0x09: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "int", op1_val + op2_val, NULL); break; // ADD
-case 0x0A: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "int", op1_val - op2_val, NULL); break; // SUB
-case 0x0B: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "int", op1_val * op2_val, NULL); break; // MUL
-case 0x0C: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); 
-           if (op2_val == 0) { fprintf(stderr, "VM Error: Division by zero.\n"); exit(1); }
-           set_symbol_value(instr->dest, "int", op1_val / op2_val, NULL); break; // DIV
-case 0x0D: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "int", op1_val % op2_val, NULL); break; // MOD
-case 0x0E: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "int", (long)round(pow((double)op1_val, (double)op2_val)), NULL); break; // POW
-
-            // Comparison Operations (0x0F - 0x12). Result is 1 (true) or 0 (false).
-            case 0x0F: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "bool", (op1_val > op2_val) ? 1 : 0, NULL); break;
-            case 0x10: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "bool", (op1_val < op2_val) ? 1 : 0, NULL); break;
-            case 0x11: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "bool", (op1_val == op2_val) ? 1 : 0, NULL); break;
-            case 0x12: op1_val = get_long_value(instr->arg1); op2_val = get_long_value(instr->arg2); set_symbol_value(instr->dest, "bool", (op1_val != op2_val) ? 1 : 0, NULL); break;
-
-            // Control Flow Jumps
-            case 0x13: { // jz <cond_var> <label> (Jump if Zero/False)
-                long condition = get_long_value(instr->arg1);
-                if (condition == 0) {
-                    int target_pc = find_label(instr->dest);
-                    if (target_pc != -1) pc = target_pc;
-                    continue; // Skip pc++ below
-                }
-                break;
-            }
-            case 0x14: { // jmp <label> (Unconditional Jump)
-                int target_pc = find_label(instr->dest);
-                if (target_pc != -1) pc = target_pc;
-                continue; // Skip pc++ below
-            }
+#define KERNEL(name) avx2_##name
+#define KERNEL_TARGET AVX2
+#define VEC __m256i
+#define VEC_LANES 4
+#define VEC_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VEC_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define VEC_SET1(x) _mm256_set1_epi64x(x)
+#define VEC_ZERO() _mm256_setzero_si256()
+#define VEC_ADD(a, b) _mm256_add_epi64((a), (b))
+#define VEC_SUB(a, b) _mm256_sub_epi64((a), (b))
+#define VEC_MUL(a, b) avx2_mul64((a), (b))
+#define VEC_GT(a, b) _mm256_cmpgt_epi64((a), (b))
+#define VEC_EQ(a, b) _mm256_cmpeq_epi64((a), (b))
+#define VEC_SELECT(mask, a, b) _mm256_blendv_epi8((b), (a), (mask))
+#include "kernels.h"
+#undef KERNEL
+#undef KERNEL_TARGET
+#undef VEC
+#undef VEC_LANES
+#undef VEC_LOAD
+#undef VEC_STORE
+#undef VEC_SET1
+#undef VEC_ZERO
+#undef VEC_ADD
+#undef VEC_SUB
+#undef VEC_MUL
+#undef VEC_GT
+#undef VEC_EQ
+#undef VEC_SELECT
 
-            case 0x01: // entry: Already handled by finding the jump target.
-                break;
+FLUX_INTERNAL const ArrayKernels sse2_kernels = {
+    "sse2", sse2_sum, sse2_min, sse2_max, sse2_fill, sse2_add, sse2_mul,
+    sse2_add_array, sse2_mul_array, sse2_count_gt, sse2_count_lt, sse2_count_eq
+};
 
-            default:
-                fprintf(stderr, "VM Warning: Unhandled opcode 0x%X at instruction %d.\n", instr->opcode, pc);
-        }
+FLUX_INTERNAL const ArrayKernels avx2_kernels = {
+    "avx2", avx2_sum, avx2_min, avx2_max, avx2_fill, avx2_add, avx2_mul,
+    avx2_add_array, avx2_mul_array, avx2_count_gt, avx2_count_lt, avx2_count_eq
+};
+#endif
 
-        pc++; // Advance Program Counter
+// The best kernels this CPU runs, or those FLUX_SIMD names if it is lower
+FLUX_INTERNAL const ArrayKernels *array_kernels(void) {
+    const ArrayKernels *levels[3] = { &scalar_kernels, NULL, NULL };
+    int best = 0;
+#ifdef FLUX_SIMD_X86
+    levels[1] = &sse2_kernels; // part of x86-64
+    levels[2] = &avx2_kernels;
+    best = __builtin_cpu_supports("avx2") ? 2 : 1;
+#endif
+    const char *cap = getenv("FLUX_SIMD");
+    if (cap) {
+        for (int i = 0; i < best; i++) {
+            if (strcmp(cap, levels[i]->name) == 0) best = i;
+        }
     }
-    
+    return levels[best];
 }
 
-// Main VM execution logic
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s program.fluxb\n", argv[0]);
-        return 1;
+FLUX_INTERNAL FluxArray *array_new(FluxVM *vm, long n) {
+    if (n < 0 || (unsigned long)n > (SIZE_MAX - sizeof(FluxArray)) / sizeof(long))
+        vm_error(vm, "VM Error: Invalid array length %ld.\n", n);
+    FluxArray *arr = calloc(1, sizeof(FluxArray) + (size_t)n * sizeof(long));
+    if (!arr) vm_error(vm, "VM Error: Out of memory for an array of %ld elements.\n", n);
+    arr->refcount = 1;
+    arr->len = (size_t)n;
+    return arr;
+}
+
+FLUX_INTERNAL NORETURN COLD void index_error(FluxVM *vm, const char *name, long i, size_t len) {
+    vm_error(vm, "VM Error: Index %ld is out of range for array '%s' of length %zu.\n", i, name, len);
+}
+
+// The array in an instruction's dest, which the opcode changes
+static inline FluxArray *dest_array(FluxVM *vm, const Value *locals, const Instruction *instr) {
+    const Value *v = &locals[instr->dest_slot];
+    if (v->tag != VAL_ARRAY) array_error(vm, instr->dest);
+    return v->as.arr;
+}
+
+// index <array> <i> <var>
+static inline void array_index(FluxVM *vm, Value *locals, const Instruction *instr) {
+    const FluxArray *arr = get_array(vm, locals, &instr->a);
+    long i = get_long_value(vm, locals, &instr->b);
+    if ((unsigned long)i >= arr->len) index_error(vm, instr->a.str, i, arr->len);
+    value_set_long(&locals[instr->dest_slot], VAL_INT, arr->data[i]);
+}
+
+// set_index <i> <value> <array>
+static inline void array_set_index(FluxVM *vm, Value *locals, const Instruction *instr) {
+    FluxArray *arr = dest_array(vm, locals, instr);
+    long i = get_long_value(vm, locals, &instr->a);
+    long x = get_long_value(vm, locals, &instr->b);
+    if ((unsigned long)i >= arr->len) index_error(vm, instr->dest, i, arr->len);
+    arr->data[i] = x;
+}
+
+// Runs any array opcode (0x17..0x24) in the frame at locals
+FLUX_INTERNAL void array_op(FluxVM *vm, Value *locals, const Instruction *instr) {
+    const ArrayKernels *k = vm->kernels;
+    switch (instr->opcode) {
+        case 0x17: { // array_new <length> <var>
+            FluxArray *arr = array_new(vm, get_long_value(vm, locals, &instr->a));
+            value_set_array(&locals[instr->dest_slot], arr);
+            array_release(arr);
+            return;
+        }
+        case 0x18:
+            array_index(vm, locals, instr);
+            return;
+        case 0x19:
+            array_set_index(vm, locals, instr);
+            return;
+        case 0x1A: case 0x1B: case 0x1C: case 0x1D: { // len/sum/min/max <array> <var>
+            const FluxArray *arr = get_array(vm, locals, &instr->a);
+            long x;
+            if (instr->opcode == 0x1A) {
+                x = (long)arr->len;
+            } else if (instr->opcode == 0x1B) {
+                x = k->sum(arr->data, arr->len);
+            } else {
+                if (arr->len == 0) vm_error(vm, "VM Error: %s of the empty array '%s'.\n", fluxb_op_name(instr->opcode), instr->a.str);
+                x = instr->opcode == 0x1C ? k->min(arr->data, arr->len) : k->max(arr->data, arr->len);
+            }
+            value_set_long(&locals[instr->dest_slot], VAL_INT, x);
+            return;
+        }
+        case 0x1E: case 0x1F: case 0x20: { // fill/add_each/mul_each <value> <array>
+            FluxArray *arr = dest_array(vm, locals, instr);
+            const Operand *op = &instr->a;
+            if (instr->opcode != 0x1E && op->kind == OPERAND_SLOT && locals[op->slot].tag == VAL_ARRAY) {
+                // Element by element
+                const FluxArray *other = locals[op->slot].as.arr;
+                if (other->len != arr->len) {
+                    vm_error(vm, "VM Error: %s of arrays of different lengths ('%s' has %zu elements, '%s' %zu).\n",
+                             fluxb_op_name(instr->opcode), instr->dest, arr->len, op->str, other->len);
+                }
+                if (instr->opcode == 0x1F) k->add_array(arr->data, other->data, arr->len);
+                else k->mul_array(arr->data, other->data, arr->len);
+                return;
+            }
+            long x = get_long_value(vm, locals, op);
+            if (instr->opcode == 0x1E) k->fill(arr->data, arr->len, x);
+            else if (instr->opcode == 0x1F) k->add(arr->data, arr->len, x);
+            else k->mul(arr->data, arr->len, x);
+            return;
+        }
+        case 0x21: case 0x22: case 0x23: case 0x24: { // count_gt/lt/eq/ne <array> <value> <var>
+            const FluxArray *arr = get_array(vm, locals, &instr->a);
+            long x = get_long_value(vm, locals, &instr->b);
+            size_t count;
+            if (instr->opcode == 0x21) count = k->count_gt(arr->data, arr->len, x);
+            else if (instr->opcode == 0x22) count = k->count_lt(arr->data, arr->len, x);
+            else {
+                count = k->count_eq(arr->data, arr->len, x);
+                if (instr->opcode == 0x24) count = arr->len - count;
+            }
+            value_set_long(&locals[instr->dest_slot], VAL_INT, (long)count);
+            return;
+        }
     }
+}
 
-    load_bytecode(argv[1]);
-    execute_vm();
+// --- Output ---
+// The stdout/stderr opcodes append to buffers of the instance that reach the
+// kernel in large write(2)/writev(2) calls; stdio is not used while a program
+// runs. --flush chooses when a buffer is written out:
+//   line  - after every fragment containing a newline (default on a terminal)
+//   block - when the buffer fills (default otherwise)
+//   exit  - only at exit, the buffer grows to hold all output
+// stderr stays line-buffered under both line and block so that diagnostics
+// show up promptly. An instance without descriptors (see fluxvm.h) keeps all
+// of its output in the buffers instead.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
 
-    // Clean up allocated strings
-    for (int i = 0; i < symbol_count; i++) {
-        if (symbol_table[i].s_value) {
-            free(symbol_table[i].s_value);
+FLUX_INTERNAL void write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+#ifdef _WIN32
+        int w = _write(fd, p, (unsigned)len);
+#else
+        ssize_t w = write(fd, p, len);
+#endif
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            // Nothing sensible to report to; drop the rest like stdio would
+            return;
         }
+        p += w;
+        len -= (size_t)w;
     }
+}
 
-    return 0;
+FLUX_INTERNAL void snapshot_hold(FluxVM *vm, const OutputBuffer *buf, const char *p, size_t len);
+
+// Writes p to buf's descriptor now, unless a snapshot holds it back
+FLUX_INTERNAL void output_send(OutputBuffer *buf, const char *p, size_t len) {
+    if (buf->hold) snapshot_hold(buf->hold, buf, p, len);
+    else write_all(buf->fd, p, len);
+}
+
+FLUX_INTERNAL void output_flush(OutputBuffer *buf) {
+    if (buf->fd < 0) return; // collected
+    size_t len = buf->len;
+    buf->len = 0;
+    output_send(buf, buf->data, len);
 }
+
+FLUX_INTERNAL void output_flush_all(FluxVM *vm) {
+    output_flush(&vm->out_stdout);
+    output_flush(&vm->out_stderr);
+}
+
+// Sends buf to fd, or collects it when fd is -1
+FLUX_INTERNAL void output_init(OutputBuffer *buf, int fd, int line_buffered, int unbounded) {
+    buf->fd = fd;
+    buf->line_buffered = line_buffered;
+    buf->unbounded = unbounded || fd < 0;
+    if (!buf->data) {
+        buf->cap = OUTPUT_BUFFER_SIZE;
+        buf->data = malloc(buf->cap);
+        if (!buf->data) out_of_memory();
+        buf->len = 0;
+    }
+}
+
+// Slow path of output_write(): s does not fit in the space left
+FLUX_INTERNAL void output_overflow(OutputBuffer *buf, const char *s, size_t n) {
+    if (buf->unbounded) {
+        while (buf->len + n > buf->cap) buf->cap *= 2;
+        buf->data = realloc(buf->data, buf->cap);
+        if (!buf->data) out_of_memory();
+    } else if (n >= buf->cap / 2) {
+        // Large fragment: hand it to the kernel together with the pending
+        // bytes instead of copying it through the buffer
+#ifndef _WIN32
+        if (!buf->hold) {
+            struct iovec iov[2] = { { buf->data, buf->len }, { (void *)s, n } };
+            ssize_t w;
+            do w = writev(buf->fd, iov, 2); while (w < 0 && errno == EINTR);
+            size_t done = w > 0 ? (size_t)w : 0;
+            if (done < buf->len) {
+                write_all(buf->fd, buf->data + done, buf->len - done);
+                done = buf->len;
+            }
+            done -= buf->len;
+            buf->len = 0;
+            write_all(buf->fd, s + done, n - done);
+            return;
+        }
+#endif
+        output_flush(buf);
+        output_send(buf, s, n);
+        return;
+    } else {
+        output_flush(buf);
+    }
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+}
+
+static inline void output_write(OutputBuffer *buf, const char *s, size_t n) {
+    if (buf->len + n <= buf->cap) {
+        memcpy(buf->data + buf->len, s, n);
+        buf->len += n;
+    } else {
+        output_overflow(buf, s, n);
+    }
+    if (buf->line_buffered && memchr(s, '\n', n)) output_flush(buf);
+}
+
+// Writes a diagnostic to the instance's stderr: straight to its descriptor,
+// as stdio's unbuffered stderr would, or into the collected output.
+FLUX_INTERNAL void vm_report(FluxVM *vm, const char *fmt, va_list ap) {
+    char small[256];
+    char *text = small;
+    va_list again;
+    va_copy(again, ap);
+    int n = vsnprintf(small, sizeof small, fmt, ap);
+    if (n >= (int)sizeof small) {
+        text = malloc((size_t)n + 1);
+        if (!text) out_of_memory();
+        vsnprintf(text, (size_t)n + 1, fmt, again);
+    }
+    va_end(again);
+    if (n > 0) {
+        if (vm->out_stderr.fd >= 0) output_send(&vm->out_stderr, text, (size_t)n);
+        else output_write(&vm->out_stderr, text, (size_t)n);
+    }
+    if (text != small) free(text);
+}
+
+FLUX_INTERNAL void vm_message(FluxVM *vm, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vm_report(vm, fmt, ap);
+    va_end(ap);
+}
+
+// Reports an error and ends the run: fluxvm_run() returns 1
+FLUX_INTERNAL void vm_error(FluxVM *vm, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vm_report(vm, fmt, ap);
+    va_end(ap);
+    longjmp(*vm->error, 1);
+}
+
+// Formats x in decimal, two digits per division
+FLUX_INTERNAL void output_long(OutputBuffer *buf, long x) {
+    static const char digit_pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+    while (u >= 100) {
+        unsigned long d = (u % 100) * 2;
+        u /= 100;
+        *--p = digit_pairs[d + 1];
+        *--p = digit_pairs[d];
+    }
+    if (u >= 10) {
+        *--p = digit_pairs[u * 2 + 1];
+        *--p = digit_pairs[u * 2];
+    } else {
+        *--p = (char)('0' + u);
+    }
+    if (x < 0) *--p = '-';
+    output_write(buf, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+// Writes an operand of stdout/stderr in its printed form
+FLUX_INTERNAL void output_operand(FluxVM *vm, OutputBuffer *buf, const Value *locals, const Operand *op) {
+    if (op->kind == OPERAND_STRING) {
+        // String literal, newline escapes already applied at link time
+        output_write(buf, op->sval->data, op->sval->len);
+    } else if (op->kind == OPERAND_SLOT) {
+        const Value *v = &locals[op->slot];
+        if (v->tag == VAL_STRING) {
+            output_write(buf, v->as.s->data, v->as.s->len);
+        } else if (v->tag == VAL_INT || v->tag == VAL_BOOL) {
+            output_long(buf, v->as.i);
+        } else if (v->tag == VAL_ARRAY) {
+            // [1, 2, 3]
+            const FluxArray *arr = v->as.arr;
+            output_write(buf, "[", 1);
+            for (size_t i = 0; i < arr->len; i++) {
+                if (i) output_write(buf, ", ", 2);
+                output_long(buf, arr->data[i]);
+            }
+            output_write(buf, "]", 1);
+        } else {
+            vm_message(vm, "VM Error: Cannot print undefined variable '%s'.\n", op->str);
+        }
+    } else {
+        // Numeric literal, printed as written
+        output_write(buf, op->str, strlen(op->str));
+    }
+}
+
+// --- Input ---
+// The read opcode takes lines from an instance-owned view of its input
+// descriptor (stdin for fluxvm). A regular file is mapped whole; anything
+// else (pipes, terminals) is read in large blocks. Either way a read is a
+// scan for the next newline plus a pointer bump, and lines have no length
+// limit. An embedder can also hand an instance its input in memory.
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+
+FLUX_INTERNAL void input_release(InputBuffer *in) {
+#ifndef _WIN32
+    if (in->mapped) munmap(in->data, in->mapped);
+#endif
+    if (in->cap) free(in->data);
+    in->data = NULL;
+    in->mapped = in->cap = 0;
+}
+
+// Reads from fd, set up on the first read
+FLUX_INTERNAL void input_use_fd(InputBuffer *in, int fd) {
+    input_release(in);
+    in->fd = fd;
+    in->pos = in->len = 0;
+    in->eof = in->ready = 0;
+}
+
+// Reads the len bytes at data, which the caller keeps alive
+FLUX_INTERNAL void input_use_memory(InputBuffer *in, const char *data, size_t len) {
+    input_release(in);
+    in->fd = -1;
+    in->data = (char *)data;
+    in->pos = 0;
+    in->len = len;
+    in->eof = in->ready = 1;
+}
+
+FLUX_INTERNAL void input_init(InputBuffer *in) {
+    in->ready = 1;
+#ifndef _WIN32
+    struct stat st;
+    off_t offset = lseek(in->fd, 0, SEEK_CUR);
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            in->data = map;
+            in->mapped = (size_t)st.st_size;
+            in->pos = (size_t)offset;
+            in->len = (size_t)st.st_size;
+            in->eof = 1;
+            return;
+        }
+    }
+#endif
+    in->cap = INPUT_BUFFER_SIZE;
+    in->data = malloc(in->cap);
+    if (!in->data) out_of_memory();
+}
+
+// Moves the unread tail to the front (growing the buffer if it is all one
+// line) and reads more. Only used in block mode.
+FLUX_INTERNAL void input_fill(InputBuffer *in) {
+    if (in->pos > 0) {
+        memmove(in->data, in->data + in->pos, in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
+    }
+    if (in->len == in->cap) {
+        in->cap *= 2;
+        in->data = realloc(in->data, in->cap);
+        if (!in->data) out_of_memory();
+    }
+    for (;;) {
+#ifdef _WIN32
+        int n = _read(in->fd, in->data + in->len, (unsigned)(in->cap - in->len));
+#else
+        ssize_t n = read(in->fd, in->data + in->len, in->cap - in->len);
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) in->eof = 1;
+        else in->len += (size_t)n;
+        return;
+    }
+}
+
+// Returns the next line without its '\n' and stores its length in *len, or
+// NULL at end of input. The line stays valid until the next call.
+FLUX_INTERNAL const char *input_line(InputBuffer *in, size_t *len) {
+    if (!in->ready) input_init(in);
+    size_t scanned = in->pos;
+    for (;;) {
+        char *nl = memchr(in->data + scanned, '\n', in->len - scanned);
+        if (nl) {
+            const char *line = in->data + in->pos;
+            *len = (size_t)(nl - line);
+            in->pos = (size_t)(nl - in->data) + 1;
+            return line;
+        }
+        if (in->eof) {
+            if (in->pos == in->len) return NULL;
+            // Last line without a trailing newline
+            const char *line = in->data + in->pos;
+            *len = in->len - in->pos;
+            in->pos = in->len;
+            return line;
+        }
+        size_t seen = in->len - in->pos;
+        input_fill(in);
+        scanned = in->pos + seen;
+    }
+}
+
+// Parses s[0..len) as a whole decimal integer with the same acceptance rules
+// as strtol() followed by a check for trailing characters: optional leading
+// whitespace and sign, saturating on overflow. An empty line counts as 0.
+FLUX_INTERNAL int parse_long(const char *s, size_t len, long *out) {
+    const char *p = s, *end = s + len;
+    while (p < end && isspace((unsigned char)*p)) p++;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    if (p == end || !isdigit((unsigned char)*p)) {
+        *out = 0;
+        return len == 0;
+    }
+    unsigned long limit = neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+    unsigned long u = 0;
+    int overflow = 0;
+    for (; p < end && (unsigned)(*p - '0') < 10; p++) {
+        unsigned d = (unsigned)(*p - '0');
+        if (u > (limit - d) / 10) overflow = 1;
+        else u = u * 10 + d;
+    }
+    if (p != end) return 0;
+    if (overflow) u = limit;
+    *out = neg ? (long)(0UL - u) : (long)u;
+    return 1;
+}
+
+// --- Call Frames ---
+
+FLUX_INTERNAL NORETURN void stack_overflow(FluxVM *vm) {
+    vm_error(vm, "VM Error: Call stack overflow (stack limit of %zu bytes exceeded).\n", vm->stack_limit);
+}
+
+// Makes room for one more frame of 'locals' slots. May move value_stack, so
+// callers must re-derive their locals pointer.
+FLUX_INTERNAL void reserve_frame(FluxVM *vm, int locals) {
+    if (vm->frame_count == vm->frame_cap || vm->value_stack_top + locals > vm->value_stack_cap) {
+        int frame_cap = vm->frame_cap;
+        size_t value_stack_cap = vm->value_stack_cap;
+        int new_frame_cap = vm->frame_count == frame_cap ? (frame_cap ? frame_cap * 2 : 64) : frame_cap;
+        size_t new_value_cap = value_stack_cap ? value_stack_cap : 1024;
+        while (vm->value_stack_top + locals > new_value_cap) new_value_cap *= 2;
+        if ((size_t)new_frame_cap * sizeof(Frame) + new_value_cap * sizeof(Value) > vm->stack_limit) {
+            // Growing geometrically would pass the limit: try the exact need
+            new_frame_cap = vm->frame_count + 1 > frame_cap ? vm->frame_count + 1 : frame_cap;
+            if (vm->value_stack_top + locals > value_stack_cap) new_value_cap = vm->value_stack_top + locals;
+            else new_value_cap = value_stack_cap;
+            if ((size_t)new_frame_cap * sizeof(Frame) + new_value_cap * sizeof(Value) > vm->stack_limit) stack_overflow(vm);
+        }
+        if (new_frame_cap != frame_cap) {
+            vm->frames_moving = 1;
+            Frame *frames = realloc(vm->frames, new_frame_cap * sizeof(Frame));
+            if (frames) {
+                vm->frames = frames;
+                vm->frame_cap = new_frame_cap;
+            }
+            vm->frames_moving = 0;
+            if (!frames) vm_error(vm, "VM Error: Out of memory.\n");
+        }
+        if (new_value_cap != value_stack_cap) {
+            Value *value_stack = realloc(vm->value_stack, new_value_cap * sizeof(Value));
+            if (!value_stack) vm_error(vm, "VM Error: Out of memory.\n");
+            vm->value_stack = value_stack;
+            vm->value_stack_cap = new_value_cap;
+        }
+    }
+}
+
+// Slots of the innermost frame
+static inline Value *frame_locals(const FluxVM *vm) {
+    return vm->value_stack + vm->frames[vm->frame_count - 1].base;
+}
+
+// Opens a frame at the top of the value stack, whose first 'initialized'
+// slots already hold values. Space must have been reserved.
+FLUX_INTERNAL Frame *enter_frame(FluxVM *vm, int func, int return_pc, int locals, int initialized) {
+    Frame *frame = &vm->frames[vm->frame_count++];
+    frame->func = func;
+    frame->return_pc = return_pc;
+    frame->base = vm->value_stack_top;
+    for (int i = initialized; i < locals; i++) vm->value_stack[vm->value_stack_top + i].tag = VAL_NONE;
+    vm->value_stack_top += locals;
+    return frame;
+}
+
+// Pushes a frame for function_map[func] with every local unassigned.
+FLUX_INTERNAL Frame *push_frame(FluxVM *vm, int func, int return_pc) {
+    int locals = vm->program->function_map[func].local_count;
+    reserve_frame(vm, locals);
+    return enter_frame(vm, func, return_pc, locals, 0);
+}
+
+// Pops the innermost frame, releasing its locals, and returns its return pc.
+FLUX_INTERNAL int pop_frame(FluxVM *vm) {
+    Frame *frame = &vm->frames[--vm->frame_count];
+    while (vm->value_stack_top > frame->base) value_release(&vm->value_stack[--vm->value_stack_top]);
+    return frame->return_pc;
+}
+
+// Opens the callee frame of a call site, with the arguments evaluated in the
+// current frame and converted to the parameter types.
+static inline void push_call(FluxVM *vm, const CallSite *site, int return_pc) {
+    // Reserve first: arguments go straight into the callee's parameter
+    // slots, and reserving may move the value stack.
+    reserve_frame(vm, site->local_count);
+    const Value *locals = frame_locals(vm);
+    Value *params = vm->value_stack + vm->value_stack_top;
+    for (int i = 0; i < site->arg_count; i++) {
+        params[i].tag = VAL_NONE;
+        load_operand(vm, &params[i], site->param_types[i], locals, &site->args[i]);
+    }
+    enter_frame(vm, site->func, return_pc, site->local_count, site->arg_count);
+}
+
+// return_code: pops the innermost frame and hands the value of operand a to
+// the caller's __ret. Returns the pc to resume at, or -1 when main returns.
+FLUX_INTERNAL int return_value(FluxVM *vm, const Operand *a) {
+    // Move the result out of the frame before it is released
+    Value *locals = frame_locals(vm);
+    Value result;
+    result.tag = VAL_NONE;
+    if (a->kind == OPERAND_SLOT) {
+        result = locals[a->slot];
+        locals[a->slot].tag = VAL_NONE;
+    } else if (a->kind == OPERAND_INT) {
+        value_set_long(&result, VAL_INT, a->value);
+    }
+
+    if (vm->frame_count == 1) {
+        value_release(&result);
+        return -1;
+    }
+
+    int pc = pop_frame(vm);
+    locals = frame_locals(vm);
+    int ret_slot = vm->program->function_map[vm->frames[vm->frame_count - 1].func].ret_slot;
+    if (ret_slot >= 0) {
+        value_release(&locals[ret_slot]);
+        locals[ret_slot] = result;
+    } else {
+        value_release(&result);
+    }
+    return pc;
+}
+
+// end: falling off a function returns without a value; -1 ends the program
+FLUX_INTERNAL int end_frame(FluxVM *vm) {
+    if (vm->frame_count == 1) return -1;
+    return pop_frame(vm);
+}
+
+// Find instruction index for a label
+FLUX_INTERNAL int find_label(const FluxProgram *prog, const char *name) {
+    int i = name_index_get(&prog->label_index, name);
+    return i >= 0 ? prog->label_map[i].instr_index : -1;
+}
+
+// Find function entry by name
+FLUX_INTERNAL FunctionMapEntry* find_function(const FluxProgram *prog, const char *name) {
+    int i = name_index_get(&prog->function_index, name);
+    return i >= 0 ? &prog->function_map[i] : NULL;
+}
+
+
+// --- Bytecode Loading ---
+
+// Registers a function_map entry for the [0x01] record at instr_index.
+// If a name is defined more than once, the first definition wins.
+FLUX_INTERNAL void add_function(FluxProgram *prog, const char *name, const char *params, int instr_index) {
+    prog->function_map = grow_array(prog->function_map, &prog->function_cap, prog->function_count + 1, sizeof(FunctionMapEntry));
+    FunctionMapEntry *func = &prog->function_map[prog->function_count];
+    memset(func, 0, sizeof(*func));
+    func->name = name;
+    func->params = params;
+    func->instr_index = instr_index;
+    func->code_index = -1;
+    func->ret_slot = -1;
+    if (strcmp(name, "main") == 0 && prog->main_entry_point == -1) {
+        prog->main_entry_point = instr_index;
+        prog->main_func = prog->function_count;
+    }
+    name_index_put(&prog->function_index, name, prog->function_count);
+    prog->function_count++;
+}
+
+FLUX_INTERNAL void add_label(FluxProgram *prog, const char *name, int instr_index) {
+    prog->label_map = grow_array(prog->label_map, &prog->label_cap, prog->label_count + 1, sizeof(LabelMap));
+    prog->label_map[prog->label_count].name = name;
+    prog->label_map[prog->label_count].instr_index = instr_index;
+    name_index_put(&prog->label_index, name, prog->label_count);
+    prog->label_count++;
+}
+
+// Copies s[0..len) into a new string owned by the loaded program.
+FLUX_INTERNAL char *dup_range(FluxProgram *prog, const char *s, size_t len) {
+    char *out = arena_alloc(prog, len + 1);
+    memcpy(out, s, len);
+    out[len] = '\0';
+    return out;
+}
+
+// Reads one line of any length into *buf (grown as needed). Returns 0 at EOF.
+FLUX_INTERNAL int read_line(FILE *f, char **buf, int *cap) {
+    int len = 0;
+    for (;;) {
+        *buf = grow_array(*buf, cap, len + 256, 1);
+        if (!fgets(*buf + len, *cap - len, f)) return len > 0;
+        len += strlen(*buf + len);
+        if (len > 0 && (*buf)[len - 1] == '\n') return 1;
+    }
+}
+
+// Returns the next whitespace-delimited token of *p as a new string.
+FLUX_INTERNAL char *next_token(FluxProgram *prog, const char **p) {
+    const char *s = *p;
+    while (*s && isspace((unsigned char)*s)) s++;
+    const char *start = s;
+    while (*s && !isspace((unsigned char)*s)) s++;
+    *p = s;
+    return dup_range(prog, start, s - start);
+}
+
+// Parses the text listing written by fluxc -S (one "[0xNN] name args" per line).
+FLUX_INTERNAL void load_text_bytecode(FluxProgram *prog, FILE *f) {
+    char *line = NULL;
+    int line_cap = 0;
+    while (read_line(f, &line, &line_cap)) {
+        trim(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        prog->instructions = grow_array(prog->instructions, &prog->instr_cap, prog->instr_count + 1, sizeof(Instruction));
+        Instruction *instr = &prog->instructions[prog->instr_count];
+
+        // Parse Opcode ID and Name
+        char op_name[16];
+        int n_parsed = sscanf(line, "[%x] %15s", &instr->opcode, op_name);
+        if (n_parsed != 2) continue;
+
+        // Skip the Opcode part to get to operands
+        char *op_start = strchr(line, ']');
+        if (!op_start) continue;
+
+        // Find the start of the operand string (after the opcode name and space)
+        const char *arg_start = op_start + strlen(op_name) + 3;
+        if (arg_start >= line + strlen(line)) arg_start = "";
+
+        instr->arg1 = instr->arg2 = instr->dest = "";
+
+        switch (instr->opcode) {
+            case 0x01: { // entry <type> <name>(<params>)
+                // Example: int add(int x, int y)
+                const char *p = arg_start;
+                char *func_type = next_token(prog, &p);
+                const char *popen = strchr(p, '(');
+                const char *pclose = strrchr(p, ')');
+                if (popen && pclose && pclose > popen) {
+                    char *name = dup_range(prog, p, popen - p);
+                    trim(name);
+                    char *params = dup_range(prog, popen + 1, pclose - popen - 1);
+                    trim(params);
+                    instr->arg1 = func_type;
+                    instr->arg2 = name;
+                    instr->dest = params;
+                    add_function(prog, name, params, prog->instr_count);
+                }
+                break;
+            }
+            case 0x03: // stdout <value>
+            case 0x04: // stderr <value>
+            case 0x05: // read <var>
+            case 0x06: // return_code <var>
+            case 0x08: // call <name>(<params>)
+                // For call, arg1 stores the full call signature: func(a,b)
+                instr->arg1 = dup_range(prog, arg_start, strlen(arg_start));
+                break;
+            case 0x07: { // store <type> <var> <value>
+                // The value is the rest of the line so string literals keep their spaces
+                const char *p = arg_start;
+                instr->arg1 = next_token(prog, &p); // type
+                instr->arg2 = next_token(prog, &p); // var
+                while (*p && isspace((unsigned char)*p)) p++;
+                instr->dest = dup_range(prog, p, strlen(p)); // value
+                break;
+            }
+            case 0x13:   // jz <cond_var> <label>
+            case 0x16: { // jnz <cond_var> <label>
+                const char *p = arg_start;
+                instr->arg1 = next_token(prog, &p);
+                instr->dest = next_token(prog, &p);
+                break;
+            }
+            case 0x14: { // jmp <label>
+                const char *p = arg_start;
+                instr->dest = next_token(prog, &p);
+                break;
+            }
+            case 0x15: { // label <name>
+                const char *p = arg_start;
+                instr->dest = next_token(prog, &p);
+                if (instr->dest[0]) add_label(prog, instr->dest, prog->instr_count);
+                break;
+            }
+            // All binary operators (add, sub, mul, div, mod, pow, gt, lt, eq, ne)
+            case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D: case 0x0E:
+            case 0x0F: case 0x10: case 0x11: case 0x12: {
+                const char *p = arg_start;
+                instr->arg1 = next_token(prog, &p);
+                instr->arg2 = next_token(prog, &p);
+                instr->dest = next_token(prog, &p);
+                break;
+            }
+            // Array opcodes: <arg1> [<arg2>] <dest>
+            case 0x17: case 0x18: case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D:
+            case 0x1E: case 0x1F: case 0x20: case 0x21: case 0x22: case 0x23: case 0x24: {
+                const char *p = arg_start;
+                instr->arg1 = next_token(prog, &p);
+                if (fluxb_array_op_has_arg2(instr->opcode)) instr->arg2 = next_token(prog, &p);
+                instr->dest = next_token(prog, &p);
+                break;
+            }
+        }
+        prog->instr_count++;
+    }
+    free(line);
+}
+
+// Maps the whole file read-only. Binary images are executed straight out of
+// this mapping: instruction operands point into its string pool.
+FLUX_INTERNAL const char *map_file(FluxProgram *prog, const char *filepath, size_t *size) {
+#ifdef _WIN32
+    FILE *f = fopen(filepath, "rb");
+    if (!f) { perror("open bytecode file"); load_failed(prog); }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(len > 0 ? len : 1);
+    if (!data || fread(data, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "VM Error: Failed to read '%s'.\n", filepath);
+        load_failed(prog);
+    }
+    fclose(f);
+    *size = (size_t)len;
+    return data;
+#else
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) { perror("open bytecode file"); load_failed(prog); }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { perror("stat bytecode file"); close(fd); load_failed(prog); }
+    *size = (size_t)st.st_size;
+    if (*size == 0) { close(fd); return ""; }
+    void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { perror("mmap bytecode file"); load_failed(prog); }
+    return data;
+#endif
+}
+
+FLUX_INTERNAL void unmap_file(const char *data, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    free((void *)data);
+#else
+    if (size > 0) munmap((void *)data, size);
+#endif
+}
+
+FLUX_INTERNAL NORETURN void corrupt_bytecode(FluxProgram *prog, const char *filepath) {
+    fprintf(stderr, "VM Error: Corrupt bytecode file '%s'.\n", filepath);
+    load_failed(prog);
+}
+
+// Resolves a string pool offset; FLUXB_NONE becomes "".
+FLUX_INTERNAL const char *pool_string(FluxProgram *prog, const char *pool, uint32_t pool_size, uint32_t off, const char *filepath) {
+    if (off == FLUXB_NONE) return "";
+    if (off >= pool_size) corrupt_bytecode(prog, filepath);
+    return pool + off;
+}
+
+// Sets up the program tables from a binary .fluxb image. No text is parsed:
+// records are fixed width and every operand is a pointer into the pool.
+FLUX_INTERNAL void load_binary_bytecode(FluxProgram *prog, const char *data, size_t size, const char *filepath) {
+    FluxbHeader h;
+    if (size < sizeof(h)) corrupt_bytecode(prog, filepath);
+    memcpy(&h, data, sizeof(h));
+    if (h.version < 1 || h.version > FLUXB_VERSION) {
+        fprintf(stderr, "VM Error: Unsupported bytecode version %u (expected at most %u).\n", h.version, FLUXB_VERSION);
+        load_failed(prog);
+    }
+    if ((uint64_t)h.instr_offset + (uint64_t)h.instr_count * sizeof(FluxbInstr) > size ||
+        (uint64_t)h.function_offset + (uint64_t)h.function_count * sizeof(FluxbFunction) > size ||
+        (uint64_t)h.label_offset + (uint64_t)h.label_count * sizeof(FluxbLabel) > size ||
+        (uint64_t)h.pool_offset + h.pool_size > size ||
+        (h.pool_size > 0 && data[h.pool_offset + h.pool_size - 1] != '\0')) {
+        corrupt_bytecode(prog, filepath);
+    }
+    prog->instructions = grow_array(prog->instructions, &prog->instr_cap, (int)h.instr_count, sizeof(Instruction));
+
+    const char *pool = data + h.pool_offset;
+    const FluxbInstr *recs = (const FluxbInstr *)(data + h.instr_offset);
+    for (uint32_t i = 0; i < h.instr_count; i++) {
+        Instruction *instr = &prog->instructions[i];
+        instr->opcode = recs[i].opcode;
+        instr->arg1 = pool_string(prog, pool, h.pool_size, recs[i].arg1, filepath);
+        instr->arg2 = pool_string(prog, pool, h.pool_size, recs[i].arg2, filepath);
+        instr->dest = pool_string(prog, pool, h.pool_size, recs[i].dest, filepath);
+    }
+    prog->instr_count = h.instr_count;
+
+    const FluxbFunction *funcs = (const FluxbFunction *)(data + h.function_offset);
+    for (uint32_t i = 0; i < h.function_count; i++) {
+        if (funcs[i].instr_index >= h.instr_count) corrupt_bytecode(prog, filepath);
+        add_function(prog, pool_string(prog, pool, h.pool_size, funcs[i].name, filepath),
+                     pool_string(prog, pool, h.pool_size, funcs[i].params, filepath),
+                     funcs[i].instr_index);
+    }
+
+    const FluxbLabel *labels = (const FluxbLabel *)(data + h.label_offset);
+    for (uint32_t i = 0; i < h.label_count; i++) {
+        if (labels[i].instr_index >= h.instr_count) corrupt_bytecode(prog, filepath);
+        add_label(prog, pool_string(prog, pool, h.pool_size, labels[i].name, filepath), labels[i].instr_index);
+    }
+}
+
+FLUX_INTERNAL void load_source(FluxProgram *prog, const char *filepath);
+
+FLUX_INTERNAL void load_bytecode(FluxProgram *prog, const char *filepath) {
+    size_t len = strlen(filepath);
+    if (len > 5 && strcmp(filepath + len - 5, ".flux") == 0) {
+        load_source(prog, filepath); // see --- Image cache ---
+        return;
+    }
+    size_t size;
+    const char *data = map_file(prog, filepath, &size);
+    if (size >= 4 && memcmp(data, FLUXB_MAGIC, 4) == 0) {
+        prog->image = data;
+        prog->image_size = size;
+        load_binary_bytecode(prog, data, size, filepath);
+        return;
+    }
+    unmap_file(data, size);
+
+    // Not a binary image: fall back to the text listing.
+    FILE *f = fopen(filepath, "r");
+    if (!f) { perror("open bytecode file"); load_failed(prog); }
+    load_text_bytecode(prog, f);
+    fclose(f);
+}
+
+#ifndef FLUXVM_LIBRARY
+// Prints the loaded program in the text form accepted by load_text_bytecode().
+FLUX_INTERNAL void disassemble(const FluxProgram *prog, FILE *f) {
+    for (int i = 0; i < prog->instr_count; i++) {
+        const Instruction *instr = &prog->instructions[i];
+        const char *name = fluxb_op_name(instr->opcode);
+        switch (instr->opcode) {
+            case 0x01:
+                fprintf(f, "[0x01] entry %s %s(%s)\n", instr->arg1, instr->arg2, instr->dest);
+                break;
+            case 0x02:
+                fprintf(f, "[0x02] end\n");
+                break;
+            case 0x07:
+                fprintf(f, "[0x07] store %s %s %s\n", instr->arg1, instr->arg2, instr->dest);
+                break;
+            case 0x13:
+            case 0x16:
+                fprintf(f, "[0x%02X] %s %s %s\n", instr->opcode, name, instr->arg1, instr->dest);
+                break;
+            case 0x14:
+            case 0x15:
+                fprintf(f, "[0x%02X] %s %s\n", instr->opcode, name, instr->dest);
+                break;
+            default:
+                if ((instr->opcode >= 0x09 && instr->opcode <= 0x12) || fluxb_array_op_has_arg2(instr->opcode))
+                    fprintf(f, "[0x%02X] %s %s %s %s\n", instr->opcode, name, instr->arg1, instr->arg2, instr->dest);
+                else if (instr->opcode >= 0x17 && instr->opcode <= 0x24)
+                    fprintf(f, "[0x%02X] %s %s %s\n", instr->opcode, name, instr->arg1, instr->dest);
+                else
+                    fprintf(f, "[0x%02X] %s %s\n", instr->opcode, name, instr->arg1);
+        }
+    }
+}
+#endif // FLUXVM_LIBRARY
+
+// Splits a comma-separated string of variable declarations (e.g., "int x, string s")
+// or argument values (e.g., "a, "hello", 5") into a new array of trimmed tokens.
+// The tokens live in the arena; the caller frees the array.
+FLUX_INTERNAL char **split_commas(FluxProgram *prog, const char *s, int *count) {
+    char **out = NULL;
+    int cap = 0;
+    *count = 0;
+    const char *p = s;
+    while (*p) {
+        while (*p && isspace((unsigned char)*p)) p++;
+        const char *start = p;
+        int in_str = 0;
+        while (*p) {
+            if (*p == '"') in_str = !in_str;
+            if (!in_str && *p == ',') break;
+            p++;
+        }
+        int len = p - start;
+        if (len > 0) {
+            out = grow_array(out, &cap, *count + 1, sizeof(char *));
+            out[*count] = dup_range(prog, start, len);
+            trim(out[*count]);
+            (*count)++;
+        }
+        if (*p == ',') p++;
+    }
+    return out;
+}
+
+
+// --- Linking ---
+// Resolves every operand once after loading so that interpret() never looks
+// up a name: variables become symbol slots, literals are parsed and
+// jump labels become instruction indices. Nothing in the program is written
+// after this, which is what lets instances share it.
+
+// String literals are interned into the constant pool with the '\n' escape
+// already applied.
+FLUX_INTERNAL Operand link_operand(FluxProgram *prog, const char *text) {
+    Operand op;
+    op.kind = OPERAND_NONE;
+    op.slot = -1;
+    op.value = 0;
+    op.str = text ? text : "";
+    op.sval = prog->empty_string;
+    if (!text || text[0] == '\0') return op;
+
+    if (is_variable(text)) {
+        op.kind = OPERAND_SLOT;
+        op.slot = intern_slot(prog, text);
+    } else if (text[0] == '"') {
+        // String literal: remove quotes
+        size_t len = strlen(text + 1);
+        char *str = dup_range(prog, text + 1, len);
+        if (len > 0 && str[len - 1] == '"') str[len - 1] = '\0';
+        unescape_newline(str);
+        op.kind = OPERAND_STRING;
+        op.sval = intern_literal(prog, str);
+        op.str = op.sval->data;
+    } else {
+        // Numeric literal
+        op.kind = OPERAND_INT;
+        op.value = strtol(text, NULL, 10);
+    }
+    return op;
+}
+
+FLUX_INTERNAL int link_target(FluxProgram *prog, const char *label) {
+    int target = find_label(prog, label);
+    if (target == -1) {
+        fprintf(stderr, "VM Error: Label '%s' not found.\n", label);
+        load_failed(prog);
+    }
+    return target;
+}
+
+// Decodes "name(a, b)" into a CallSite: the callee is resolved and its arity
+// checked here, and the arguments are linked in the caller's frame.
+FLUX_INTERNAL void link_call(FluxProgram *prog, Instruction *instr) {
+    const char *popen = strchr(instr->arg1, '(');
+    const char *pclose = strrchr(instr->arg1, ')');
+    if (!popen || !pclose || pclose <= popen) {
+        fprintf(stderr, "VM Error: Malformed call signature: %s\n", instr->arg1);
+        load_failed(prog);
+    }
+    char *name = dup_range(prog, instr->arg1, popen - instr->arg1);
+    trim(name);
+    FunctionMapEntry *func = find_function(prog, name);
+    if (!func) {
+        fprintf(stderr, "VM Error: Function '%s' not found.\n", name);
+        load_failed(prog);
+    }
+
+    char *arg_values_str = dup_range(prog, popen + 1, pclose - popen - 1);
+    int arg_count = 0;
+    char **arg_values = split_commas(prog, arg_values_str, &arg_count);
+    if (arg_count != func->param_count) {
+        fprintf(stderr, "VM Error: Function '%s' called with %d arguments, expected %d.\n", name, arg_count, func->param_count);
+        free(arg_values);
+        load_failed(prog);
+    }
+
+    CallSite *site = (CallSite *)arena_alloc(prog, sizeof(CallSite));
+    site->callee = name;
+    site->func = func - prog->function_map;
+    site->arg_count = arg_count;
+    site->args = arg_count ? (Operand *)arena_alloc(prog, arg_count * sizeof(Operand)) : NULL;
+    for (int i = 0; i < arg_count; i++) {
+        site->args[i] = link_operand(prog, arg_values[i]);
+    }
+    site->param_types = func->param_types;
+    site->local_count = -1; // known once every function is linked, see compact_code()
+    site->entry_pc = -1;
+    instr->call = site;
+    free(arg_values);
+}
+
+// Builds code[] from instructions[] without the labels, so jumps land directly
+// on the first real instruction after their label and labels never cost a
+// dispatch.
+FLUX_INTERNAL void compact_code(FluxProgram *prog) {
+    int instr_count = prog->instr_count;
+    const Instruction *instructions = prog->instructions;
+    FunctionMapEntry *function_map = prog->function_map;
+    int *code_map = malloc((instr_count + 1) * sizeof(int));
+    if (!code_map) out_of_memory();
+    int code_count = 0;
+    for (int i = 0; i < instr_count; i++) {
+        code_map[i] = code_count; // a label maps to the next real instruction
+        if (instructions[i].opcode != 0x15) code_count++;
+    }
+    code_map[instr_count] = code_count;
+
+    Instruction *code = malloc((code_count + 1) * sizeof(Instruction));
+    if (!code) out_of_memory();
+    for (int i = 0; i < instr_count; i++) {
+        if (instructions[i].opcode == 0x15) continue;
+        Instruction *c = &code[code_map[i]];
+        *c = instructions[i];
+        if (c->target >= 0) c->target = code_map[c->target];
+    }
+    // Running off the end of the program behaves like 'end'
+    memset(&code[code_count], 0, sizeof(Instruction));
+    code[code_count].opcode = 0x02;
+    code[code_count].dest_slot = code[code_count].target = -1;
+
+    for (int f = 0; f < prog->function_count; f++) {
+        function_map[f].code_index = code_map[function_map[f].instr_index];
+    }
+    for (int i = 0; i < code_count; i++) {
+        CallSite *site = code[i].call;
+        if (!site) continue;
+        site->local_count = function_map[site->func].local_count;
+        site->entry_pc = function_map[site->func].code_index + 1; // after the 'entry'
+    }
+    if (prog->main_entry_point != -1) prog->main_code_entry = code_map[prog->main_entry_point];
+    prog->code = code;
+    prog->code_count = code_count;
+    free(code_map);
+}
+
+// Reads the parameter declarations of a function ("int x, string s")
+// into the first frame slots and their declared types.
+FLUX_INTERNAL void link_params(FluxProgram *prog, FunctionMapEntry *func) {
+    int param_count = 0;
+    char **param_tokens = split_commas(prog, func->params, &param_count);
+    func->param_types = param_count ? (ValueTag *)arena_alloc(prog, param_count * sizeof(ValueTag)) : NULL;
+    for (int i = 0; i < param_count; i++) {
+        // e.g. "int x" -> type="int", name="x"
+        const char *p = param_tokens[i];
+        char *type = next_token(prog, &p);
+        char *param_name = next_token(prog, &p);
+        if (!type[0] || !param_name[0]) {
+            fprintf(stderr, "VM Error: Malformed parameter declaration in function '%s'.\n", func->name);
+            free(param_tokens);
+            load_failed(prog);
+        }
+        if (find_slot(func, param_name) >= 0) {
+            fprintf(stderr, "VM Error: Duplicate parameter '%s' in function '%s'.\n", param_name, func->name);
+            free(param_tokens);
+            load_failed(prog);
+        }
+        func->param_types[i] = parse_type(prog, type);
+        intern_slot(prog, param_name);
+    }
+    func->param_count = func->local_count;
+    free(param_tokens);
+}
+
+FLUX_INTERNAL int interpret(FluxVM *vm, int pc);
+
+// Under threaded dispatch every instruction carries its handler's address;
+// filling them in before any run means no run ever writes to code[]
+FLUX_INTERNAL void link_handlers(FluxProgram *prog) {
+    FluxVM setup;
+    memset(&setup, 0, sizeof setup);
+    setup.program = prog;
+    interpret(&setup, -1);
+}
+
+FLUX_INTERNAL void link_program(FluxProgram *prog) {
+    if (prog->linked) return; // an image from the cache
+    // Code before the first function is never entered; it is linked against
+    // a scope of its own so every instruction has a frame layout.
+    FunctionMapEntry *function_map = prog->function_map;
+    int function_count = prog->function_count;
+    prog->link_scope = &prog->toplevel;
+    prog->empty_string = intern_literal(prog, "");
+
+    for (int f = 0; f < function_count; f++) {
+        prog->link_scope = &function_map[f];
+        link_params(prog, &function_map[f]);
+    }
+    prog->link_scope = &prog->toplevel;
+
+    int next_func = 0;
+    for (int pc = 0; pc < prog->instr_count; pc++) {
+        Instruction *instr = &prog->instructions[pc];
+        // Each instruction belongs to the function whose entry precedes it
+        if (next_func < function_count && function_map[next_func].instr_index == pc) {
+            prog->link_scope = &function_map[next_func++];
+        }
+        instr->a = link_operand(prog, NULL);
+        instr->b = link_operand(prog, NULL);
+        instr->dest_slot = -1;
+        instr->target = -1;
+        instr->type = VAL_NONE;
+        instr->call = NULL;
+
+        switch (instr->opcode) {
+            case 0x03: // stdout <value>
+            case 0x04: // stderr <value>
+                instr->a = link_operand(prog, instr->arg1);
+                break;
+            case 0x05: // read <var>
+                if (is_variable(instr->arg1)) instr->dest_slot = intern_slot(prog, instr->arg1);
+                break;
+            case 0x06: // return_code <var>
+                instr->a = link_operand(prog, instr->arg1);
+                break;
+            case 0x07: // store <type> <var> <value>
+                instr->dest_slot = intern_slot(prog, instr->arg2);
+                instr->type = parse_type(prog, instr->arg1);
+                instr->a = link_operand(prog, instr->dest);
+                break;
+            case 0x08: // call <name>(<params>)
+                link_call(prog, instr);
+                break;
+            case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D: case 0x0E:
+            case 0x0F: case 0x10: case 0x11: case 0x12:
+                instr->a = link_operand(prog, instr->arg1);
+                instr->b = link_operand(prog, instr->arg2);
+                instr->dest_slot = intern_slot(prog, instr->dest);
+                break;
+            case 0x13: // jz <cond_var> <label>
+            case 0x16: // jnz <cond_var> <label>
+                instr->a = link_operand(prog, instr->arg1);
+                instr->target = link_target(prog, instr->dest);
+                break;
+            case 0x14: // jmp <label>
+                instr->target = link_target(prog, instr->dest);
+                break;
+            case 0x17: case 0x18: case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D:
+            case 0x1E: case 0x1F: case 0x20: case 0x21: case 0x22: case 0x23: case 0x24:
+                // <arg1> [<arg2>] <dest>: dest is the result, or the array changed
+                instr->a = link_operand(prog, instr->arg1);
+                if (fluxb_array_op_has_arg2(instr->opcode)) instr->b = link_operand(prog, instr->arg2);
+                instr->dest_slot = intern_slot(prog, instr->dest);
+                break;
+        }
+    }
+
+    for (int f = 0; f < function_count; f++) {
+        function_map[f].ret_slot = find_slot(&function_map[f], "__ret");
+    }
+
+    compact_code(prog);
+    link_handlers(prog);
+    prog->linked = 1;
+}
+
+
+// --- Image cache ---
+// fluxvm also runs .flux sources. A source is compiled by fluxc and linked
+// once; the linked program is then saved in a cache directory, named by a
+// hash of the source, the compiler binary and the fluxvm executable. A later
+// run of the same source maps the saved image: no compiler, no bytecode
+// parsing and no linking.
+//
+// An image holds the linked tables exactly as they are in memory, with
+// pointers prelinked for an address picked from the hash. Mapped there, as
+// it nearly always is, the image is used as it is; elsewhere one pass over
+// the instructions and functions moves its pointers. Only the handler
+// addresses of threaded dispatch, which move with the executable, are
+// written at load time. Images are written to a temporary file and renamed
+// into place, so processes compiling the same source at once never see a
+// partial image. A truncated image fails the size check, and one damaged in
+// any other way fails the hash of its contents kept in the header. Either
+// way it is rebuilt.
+//
+// The directory is --cache-dir=DIR, else $FLUX_CACHE_DIR, else
+// $XDG_CACHE_HOME/fluxvm, else ~/.cache/fluxvm. The compiler is $FLUXC,
+// else the fluxc next to the running executable, else fluxc on $PATH.
+
+#define IMAGE_MAGIC "FLXL"
+#define IMAGE_VERSION 1
+#define IMAGE_LAYOUT ((uint32_t)(sizeof(Instruction) | sizeof(Operand) << 8 | \
+                      sizeof(CallSite) << 16 | sizeof(FunctionMapEntry) << 24))
+#define IMAGE_OPT_FLAG "-O1" // how fluxc compiles cached sources
+
+FLUX_INTERNAL const char *image_cache_dir = NULL; // --cache-dir
+
+typedef struct {
+    char magic[4];         // "FLXL"
+    uint32_t version;      // IMAGE_VERSION
+    uint32_t layout;       // IMAGE_LAYOUT of the build that wrote it
+    uint32_t reserved;
+    uint64_t base;         // address the pointers are prelinked for
+    uint64_t size;         // bytes in the file
+    uint64_t check[2];     // hash of everything after the header
+    uint64_t instructions; // offsets of the tables
+    uint64_t code;
+    uint64_t functions;
+    uint64_t empty_string;
+    int32_t instr_count;
+    int32_t code_count;
+    int32_t function_count;
+    int32_t main_code_entry;
+    int32_t main_entry_point;
+    int32_t main_func;
+} ImageHeader;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    return x ^ (x >> 33);
+}
+
+// Adds n bytes to a 128-bit key, eight at a time in two independent lanes
+FLUX_INTERNAL void hash_absorb(uint64_t key[2], const void *data, size_t n) {
+    const unsigned char *p = data;
+    uint64_t a = key[0] ^ ((uint64_t)n * 0x9E3779B97F4A7C15ull);
+    uint64_t b = key[1] + (uint64_t)n;
+    uint64_t w;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        a = rotl64(a + w * 0xC2B2AE3D27D4EB4Full, 31) * 0x9E3779B185EBCA87ull;
+        b = rotl64(b ^ (w * 0x165667B19E3779F9ull), 27) * 0x85EBCA77C2B2AE63ull;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    a = rotl64(a + w * 0xC2B2AE3D27D4EB4Full, 31) * 0x9E3779B185EBCA87ull;
+    b = rotl64(b ^ (w * 0x165667B19E3779F9ull), 27) * 0x85EBCA77C2B2AE63ull;
+    key[0] = mix64(a);
+    key[1] = mix64(b ^ a);
+}
+
+// Builds an image in memory; pointers are rebased to base as they are written
+typedef struct {
+    uintptr_t base;
+    char *data;
+    size_t len;
+    size_t cap;
+    NameIndex strings;   // contents -> offset, so each string is stored once
+    NameIndex literals;  // contents -> offset of the FluxString
+} ImageWriter;
+
+// Reserves size zeroed bytes, 8-byte aligned, and returns their offset
+FLUX_INTERNAL size_t image_reserve(ImageWriter *w, size_t size) {
+    size_t at = (w->len + 7) & ~(size_t)7;
+    if (at + size > w->cap) {
+        while (at + size > w->cap) w->cap = w->cap ? w->cap * 2 : 64 * 1024;
+        w->data = realloc(w->data, w->cap);
+        if (!w->data) out_of_memory();
+    }
+    memset(w->data + w->len, 0, at + size - w->len);
+    w->len = at + size;
+    return at;
+}
+
+// The pointer stored for an offset into the image, 0 meaning NULL
+#define IMAGE_REF(offset) ((offset) ? (void *)(w->base + (offset)) : NULL)
+
+FLUX_INTERNAL size_t image_string(ImageWriter *w, const char *s) {
+    if (!s) return 0;
+    int at = name_index_get(&w->strings, s);
+    if (at >= 0) return (size_t)at;
+    size_t len = strlen(s);
+    size_t out = image_reserve(w, len + 1);
+    memcpy(w->data + out, s, len + 1);
+    name_index_put(&w->strings, s, (int)out);
+    return out;
+}
+
+FLUX_INTERNAL size_t image_literal(ImageWriter *w, const FluxString *str) {
+    if (!str) return 0;
+    int at = name_index_get(&w->literals, str->data);
+    if (at >= 0) return (size_t)at;
+    size_t out = image_reserve(w, sizeof(FluxString) + str->len + 1);
+    memcpy(w->data + out, str, sizeof(FluxString) + str->len + 1);
+    name_index_put(&w->literals, str->data, (int)out);
+    // Operands' str of a string literal is the literal's own data
+    name_index_put(&w->strings, str->data, (int)(out + offsetof(FluxString, data)));
+    return out;
+}
+
+FLUX_INTERNAL Operand image_operand(ImageWriter *w, const Operand *op) {
+    Operand out = *op;
+    out.sval = IMAGE_REF(image_literal(w, op->sval)); // first: str may be its data
+    out.str = IMAGE_REF(image_string(w, op->str));
+    return out;
+}
+
+// Writes instr at offset at. call_sites is set for code[], whose call
+// sites are written too; instructions[] keeps only the text operands.
+FLUX_INTERNAL void image_instruction(ImageWriter *w, size_t at, const Instruction *instr, const size_t *param_types, int call_sites) {
+    Instruction out = *instr;
+    out.arg1 = IMAGE_REF(image_string(w, instr->arg1));
+    out.arg2 = IMAGE_REF(image_string(w, instr->arg2));
+    out.dest = IMAGE_REF(image_string(w, instr->dest));
+    out.handler = NULL;
+    if (call_sites) {
+        out.a = image_operand(w, &instr->a);
+        out.b = image_operand(w, &instr->b);
+        if (instr->call) {
+            const CallSite *site = instr->call;
+            CallSite s = *site;
+            size_t site_at = image_reserve(w, sizeof(CallSite));
+            size_t args_at = site->arg_count ? image_reserve(w, site->arg_count * sizeof(Operand)) : 0;
+            for (int i = 0; i < site->arg_count; i++) {
+                Operand arg = image_operand(w, &site->args[i]);
+                memcpy(w->data + args_at + i * sizeof(Operand), &arg, sizeof arg);
+            }
+            s.callee = IMAGE_REF(image_string(w, site->callee));
+            s.args = IMAGE_REF(args_at);
+            s.param_types = IMAGE_REF(param_types[site->func]);
+            memcpy(w->data + site_at, &s, sizeof s);
+            out.call = IMAGE_REF(site_at);
+        }
+    } else {
+        memset(&out.a, 0, sizeof out.a);
+        memset(&out.b, 0, sizeof out.b);
+        out.call = NULL;
+    }
+    memcpy(w->data + at, &out, sizeof out);
+}
+
+// Serializes a linked program. Returns 0 if it is too large for an image.
+FLUX_INTERNAL int image_build(const FluxProgram *prog, ImageWriter *w) {
+    image_reserve(w, sizeof(ImageHeader));
+    size_t instr_at = image_reserve(w, (size_t)prog->instr_count * sizeof(Instruction));
+    size_t code_at = image_reserve(w, ((size_t)prog->code_count + 1) * sizeof(Instruction));
+    size_t func_at = image_reserve(w, (size_t)prog->function_count * sizeof(FunctionMapEntry));
+
+    size_t *param_types = calloc((size_t)prog->function_count + 1, sizeof(size_t));
+    if (!param_types) out_of_memory();
+    for (int f = 0; f < prog->function_count; f++) {
+        const FunctionMapEntry *func = &prog->function_map[f];
+        FunctionMapEntry out = *func;
+        if (func->param_count) {
+            param_types[f] = image_reserve(w, func->param_count * sizeof(ValueTag));
+            memcpy(w->data + param_types[f], func->param_types, func->param_count * sizeof(ValueTag));
+        }
+        out.name = IMAGE_REF(image_string(w, func->name));
+        out.params = IMAGE_REF(image_string(w, func->params));
+        out.param_types = IMAGE_REF(param_types[f]);
+        // Names of locals are only needed while linking
+        out.local_names = NULL;
+        out.local_cap = 0;
+        memset(&out.local_index, 0, sizeof out.local_index);
+        memcpy(w->data + func_at + f * sizeof(FunctionMapEntry), &out, sizeof out);
+    }
+    for (int i = 0; i < prog->instr_count; i++) {
+        image_instruction(w, instr_at + i * sizeof(Instruction), &prog->instructions[i], param_types, 0);
+    }
+    for (int i = 0; i <= prog->code_count; i++) {
+        image_instruction(w, code_at + i * sizeof(Instruction), &prog->code[i], param_types, 1);
+    }
+    free(param_types);
+
+    ImageHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, IMAGE_MAGIC, 4);
+    h.version = IMAGE_VERSION;
+    h.layout = IMAGE_LAYOUT;
+    h.base = w->base;
+    h.empty_string = image_literal(w, prog->empty_string);
+    h.size = w->len;
+    h.instructions = instr_at;
+    h.code = code_at;
+    h.functions = func_at;
+    h.instr_count = prog->instr_count;
+    h.code_count = prog->code_count;
+    h.function_count = prog->function_count;
+    h.main_code_entry = prog->main_code_entry;
+    h.main_entry_point = prog->main_entry_point;
+    h.main_func = prog->main_func;
+    hash_absorb(h.check, w->data + sizeof h, w->len - sizeof h);
+    memcpy(w->data, &h, sizeof h);
+    return w->len <= INT_MAX; // string offsets went through NameIndex ints
+}
+
+// Moves a pointer prelinked for from to the image mapped at to, failing
+// the relocation if it points outside the image
+#define IMAGE_FIX(field) do { \
+        uintptr_t at_ = (uintptr_t)(field); \
+        if (at_) { \
+            if (at_ - from >= size) return 0; \
+            (field) = (void *)(to + (at_ - from)); \
+        } \
+    } while (0)
+
+FLUX_INTERNAL int relocate_operand(uintptr_t from, char *to, size_t size, Operand *op) {
+    IMAGE_FIX(op->str);
+    IMAGE_FIX(op->sval);
+    return 1;
+}
+
+FLUX_INTERNAL int relocate_instruction(uintptr_t from, char *to, size_t size, Instruction *instr) {
+    IMAGE_FIX(instr->arg1);
+    IMAGE_FIX(instr->arg2);
+    IMAGE_FIX(instr->dest);
+    if (!relocate_operand(from, to, size, &instr->a) || !relocate_operand(from, to, size, &instr->b)) return 0;
+    IMAGE_FIX(instr->call);
+    CallSite *site = instr->call;
+    if (!site) return 1;
+    if ((size_t)((char *)site - to) + sizeof(CallSite) > size) return 0;
+    IMAGE_FIX(site->callee);
+    IMAGE_FIX(site->args);
+    IMAGE_FIX(site->param_types);
+    if (site->arg_count < 0 || (size_t)site->arg_count > (size - ((char *)site->args - to)) / sizeof(Operand)) return 0;
+    for (int i = 0; i < site->arg_count; i++) {
+        if (!relocate_operand(from, to, size, &site->args[i])) return 0;
+    }
+    return 1;
+}
+
+FLUX_INTERNAL int relocate_function(uintptr_t from, char *to, size_t size, FunctionMapEntry *func) {
+    IMAGE_FIX(func->name);
+    IMAGE_FIX(func->params);
+    IMAGE_FIX(func->param_types);
+    return func->param_count >= 0 &&
+           (size_t)func->param_count <= (size - ((char *)func->param_types - to)) / sizeof(ValueTag);
+}
+
+// A table of count records of elem bytes at offset at lies inside the image
+FLUX_INTERNAL int image_table_fits(const ImageHeader *h, uint64_t at, int32_t count, size_t elem) {
+    return count >= 0 && at <= h->size && (uint64_t)count <= (h->size - at) / elem;
+}
+
+// Writes len bytes to path through a temporary file in the same directory,
+// renamed into place: readers see the old file or the new one, never part of
+// one. Returns 0 on failure.
+FLUX_INTERNAL int write_file_atomic(const char *path, const void *data, size_t len) {
+#ifdef _WIN32
+    FILE *f = fopen(path, "wb");
+    if (!f) return 0;
+    int ok = fwrite(data, 1, len, f) == len;
+    return fclose(f) == 0 && ok;
+#else
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof tmp, "%s.%ld.%p.tmp", path, (long)getpid(), data) >= (int)sizeof tmp) return 0;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return 0;
+    FILE *f = fdopen(fd, "wb");
+    int ok = f && fwrite(data, 1, len, f) == len;
+    if (f) ok = fclose(f) == 0 && ok;
+    else close(fd);
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+#endif
+}
+
+// Where the image with this key is prelinked for: one of 2^20 slots 16M
+// apart, well clear of where the system puts anything
+FLUX_INTERNAL uintptr_t image_base(const uint64_t key[2]) {
+#if UINTPTR_MAX > 0xFFFFFFFFu
+    return (uintptr_t)0x200000000000ull + (uintptr_t)(key[1] & 0xFFFFF) * (16u << 20);
+#else
+    (void)key;
+    return 0; // no room to spare: images are always relocated
+#endif
+}
+
+#ifndef _WIN32
+
+// Maps the image at path into prog, at base if that is free. Returns 0 if
+// there is none or it is unusable, leaving prog untouched.
+FLUX_INTERNAL int image_load(FluxProgram *prog, const char *path, uintptr_t base) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    // Private and writable: the handlers, and relocation if it is needed,
+    // copy only the pages they touch
+    char *to = mmap((void *)base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (to == MAP_FAILED) return 0;
+    const ImageHeader *h = (const ImageHeader *)to;
+    int ok = memcmp(h->magic, IMAGE_MAGIC, 4) == 0 && h->version == IMAGE_VERSION &&
+             h->layout == IMAGE_LAYOUT && h->size == size;
+    if (ok) {
+        uint64_t check[2] = { 0, 0 };
+        hash_absorb(check, to + sizeof *h, size - sizeof *h);
+        ok = h->check[0] == check[0] && h->check[1] == check[1];
+    }
+    ok = ok && image_table_fits(h, h->instructions, h->instr_count, sizeof(Instruction)) &&
+         h->code_count >= 0 && image_table_fits(h, h->code, h->code_count + 1, sizeof(Instruction)) &&
+         image_table_fits(h, h->functions, h->function_count, sizeof(FunctionMapEntry)) &&
+         h->empty_string > 0 && h->empty_string < size &&
+         (h->main_func == -1 ? h->main_entry_point == -1 && h->main_code_entry == -1
+                             : h->main_func >= 0 && h->main_func < h->function_count &&
+                               h->main_entry_point >= 0 && h->main_entry_point < h->instr_count &&
+                               h->main_code_entry >= 0 && h->main_code_entry < h->code_count);
+    Instruction *instructions = (Instruction *)(to + h->instructions);
+    Instruction *code = (Instruction *)(to + h->code);
+    FunctionMapEntry *functions = (FunctionMapEntry *)(to + h->functions);
+    uintptr_t from = (uintptr_t)h->base;
+    if (ok && (uintptr_t)to != from) {
+        for (int i = 0; ok && i < h->instr_count; i++) ok = relocate_instruction(from, to, size, &instructions[i]);
+        for (int i = 0; ok && i <= h->code_count; i++) ok = relocate_instruction(from, to, size, &code[i]);
+        for (int f = 0; ok && f < h->function_count; f++) ok = relocate_function(from, to, size, &functions[f]);
+    }
+    if (!ok) {
+        munmap(to, size);
+        return 0;
+    }
+    prog->instructions = instructions;
+    prog->instr_count = h->instr_count;
+    prog->code = code;
+    prog->code_count = h->code_count;
+    prog->function_map = functions;
+    prog->function_count = h->function_count;
+    prog->main_code_entry = h->main_code_entry;
+    prog->main_entry_point = h->main_entry_point;
+    prog->main_func = h->main_func;
+    prog->empty_string = (FluxString *)(to + h->empty_string);
+    prog->image = to;
+    prog->image_size = size;
+    prog->cached = 1;
+    link_handlers(prog);
+    prog->linked = 1;
+    return 1;
+}
+
+// Writes prog's image, prelinked for base, to path. Failing to is not an
+// error: the run goes on uncached.
+FLUX_INTERNAL void image_save(const FluxProgram *prog, const char *path, uintptr_t base) {
+    ImageWriter w;
+    memset(&w, 0, sizeof w);
+    w.base = base;
+    if (!image_build(prog, &w) || !write_file_atomic(path, w.data, w.len)) {
+        fprintf(stderr, "VM Warning: Cannot write '%s' to the image cache.\n", path);
+    }
+    free(w.data);
+    free(w.strings.entries);
+    free(w.literals.entries);
+}
+
+// Creates dir and any missing parents
+FLUX_INTERNAL int make_dirs(const char *dir) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof path, "%s", dir) >= (int)sizeof path) return 0;
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(path, 0700) != 0 && errno != EEXIST) return 0;
+        *p = '/';
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+// The cache directory, see the top of this section. 0 if there is none.
+FLUX_INTERNAL int cache_dir(char *out, size_t cap) {
+    const char *dir = image_cache_dir ? image_cache_dir : getenv("FLUX_CACHE_DIR");
+    if (dir && dir[0]) return snprintf(out, cap, "%s", dir) < (int)cap;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && xdg[0]) return snprintf(out, cap, "%s/fluxvm", xdg) < (int)cap;
+    const char *home = getenv("HOME");
+    if (home && home[0]) return snprintf(out, cap, "%s/.cache/fluxvm", home) < (int)cap;
+    return 0;
+}
+
+// The compiler binary, see the top of this section
+FLUX_INTERNAL int find_compiler(char *out, size_t cap) {
+    const char *env = getenv("FLUXC");
+    if (env && env[0]) return snprintf(out, cap, "%s", env) < (int)cap;
+#ifdef __linux__
+    char self[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof self - 1);
+    if (n > 0) {
+        self[n] = '\0';
+        char *slash = strrchr(self, '/');
+        if (slash) {
+            *slash = '\0';
+            if (snprintf(out, cap, "%s/fluxc", self) < (int)cap && access(out, X_OK) == 0) return 1;
+        }
+    }
+#endif
+    const char *path = getenv("PATH");
+    while (path && *path) {
+        const char *end = strchr(path, ':');
+        int len = end ? (int)(end - path) : (int)strlen(path);
+        if (len > 0 && snprintf(out, cap, "%.*s/fluxc", len, path) < (int)cap && access(out, X_OK) == 0) return 1;
+        path = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+extern char **environ;
+
+// Runs fluxc on source, writing the .fluxb to out. Its own messages (syntax
+// errors) go to stderr; its progress line is dropped.
+FLUX_INTERNAL int run_compiler(const char *compiler, const char *source, const char *out) {
+    char *args[] = { (char *)compiler, IMAGE_OPT_FLAG, (char *)source, (char *)out, NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int err = posix_spawn(&pid, compiler, &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        fprintf(stderr, "VM Error: Cannot run the compiler '%s': %s.\n", compiler, strerror(err));
+        return 0;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return 0;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "VM Error: Cannot run the compiler '%s'.\n", compiler);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Adds the identity of a file (which one, and which version of it) to a key
+FLUX_INTERNAL void hash_file_id(uint64_t key[2], const struct stat *st) {
+    int64_t id[4] = { (int64_t)st->st_dev, (int64_t)st->st_ino, (int64_t)st->st_size, (int64_t)st->st_mtime };
+    hash_absorb(key, id, sizeof id);
+}
+
+#endif
+
+// Loads a .flux source: its cached image, or else compiles, links and
+// caches it
+FLUX_INTERNAL void load_source(FluxProgram *prog, const char *filepath) {
+#ifdef _WIN32
+    fprintf(stderr, "VM Error: Running .flux sources is not available on this platform; compile '%s' with fluxc.\n", filepath);
+    load_failed(prog);
+#else
+    char compiler[PATH_MAX], dir[PATH_MAX], image[PATH_MAX], fluxb[PATH_MAX];
+    if (!find_compiler(compiler, sizeof compiler)) {
+        fprintf(stderr, "VM Error: Cannot find fluxc to compile '%s' (set FLUXC).\n", filepath);
+        load_failed(prog);
+    }
+    struct stat cst;
+    if (stat(compiler, &cst) != 0) {
+        fprintf(stderr, "VM Error: Cannot run the compiler '%s': %s.\n", compiler, strerror(errno));
+        load_failed(prog);
+    }
+
+    // The key: the image format, this executable (whose linker made the
+    // image), the compiler binary and the source
+    uint64_t key[2] = { 0, 0 };
+    uint32_t format[3] = { IMAGE_VERSION, IMAGE_LAYOUT, FLUXB_VERSION };
+    hash_absorb(key, format, sizeof format);
+#ifdef __linux__
+    struct stat self;
+    if (stat("/proc/self/exe", &self) == 0) hash_file_id(key, &self);
+    else
+#endif
+    hash_absorb(key, __DATE__ " " __TIME__, strlen(__DATE__ " " __TIME__));
+    hash_absorb(key, compiler, strlen(compiler));
+    hash_file_id(key, &cst);
+    hash_absorb(key, IMAGE_OPT_FLAG, strlen(IMAGE_OPT_FLAG));
+    size_t size;
+    const char *src = map_file(prog, filepath, &size);
+    hash_absorb(key, src, size);
+    unmap_file(src, size);
+
+    int have_dir = cache_dir(dir, sizeof dir);
+    if (have_dir && snprintf(image, sizeof image, "%s/%016llx%016llx.img", dir,
+                             (unsigned long long)key[0], (unsigned long long)key[1]) >= (int)sizeof image) {
+        have_dir = 0;
+    }
+    uintptr_t base = image_base(key);
+    if (have_dir && image_load(prog, image, base)) return;
+
+    // Miss: compile next to where the image goes, or in the temp directory
+    if (have_dir && !make_dirs(dir)) {
+        fprintf(stderr, "VM Warning: Cannot create the image cache '%s': %s.\n", dir, strerror(errno));
+        have_dir = 0;
+    }
+    const char *tmpdir = getenv("TMPDIR");
+    if (snprintf(fluxb, sizeof fluxb, "%s/%016llx.%ld.%p.fluxb", have_dir ? dir : tmpdir && tmpdir[0] ? tmpdir : "/tmp",
+                 (unsigned long long)key[0], (long)getpid(), (void *)prog) >= (int)sizeof fluxb) {
+        fprintf(stderr, "VM Error: Path too long compiling '%s'.\n", filepath);
+        load_failed(prog);
+    }
+    int compiled = run_compiler(compiler, filepath, fluxb);
+    if (!compiled) {
+        unlink(fluxb);
+        load_failed(prog); // fluxc has said why
+    }
+    // A binary image stays mapped after its file is gone
+    load_bytecode(prog, fluxb);
+    unlink(fluxb);
+    link_program(prog);
+    if (have_dir) image_save(prog, image, base);
+#endif
+}
+
+
+// --- JIT ---
+// On Linux x86-64 a function that gets hot is compiled to native code from
+// per-opcode templates. Hotness is counted on calls and on loop back edges
+// taken by the interpreter. A hot back edge enters the compiled code in the
+// middle of the running function (on-stack replacement), so a long loop in
+// main is compiled too.
+//
+// Compiled code works on the interpreter's own frames: rbx holds the frame's
+// locals and r12 its byte offset in value_stack, so locals can be found again
+// after a call has grown the stack. Each instance compiles for itself, with
+// its own address built into the code, so the shared program is never
+// written to. Integer arithmetic, comparisons, jumps
+// and int/bool stores are inlined, including the tag checks and the error
+// exits of get_long_value(). Calls, returns, output, string and array stores
+// and the array opcodes call the same C code the interpreter runs. A function containing 'read' or an
+// unknown opcode stays interpreted.
+//
+// Native code returns like the interpreter's return path: the pc to continue
+// at in whatever frame is now innermost, or a negative value when that
+// interpreter run has finished (main returned, or the frame was opened from
+// native code).
+//
+// --no-jit turns the tier off; --jit-threshold=N sets how many calls and back
+// edges make a function hot (1 compiles every function on first use).
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(FLUX_NO_JIT)
+#define FLUX_JIT 1
+#endif
+
+#define JIT_DEFAULT_THRESHOLD 1000
+#define JIT_MAX_DEPTH 2000  // nested native activations, bounds C stack use
+// return_pc of a frame opened by native code, whose caller goes on at pc once
+// it returns: always below -1, so the interpreter returns to native code
+#define JIT_RETURN_TO_NATIVE(pc) (-2 - (pc))
+#define JIT_NATIVE_CALLER_PC(return_pc) (-2 - (return_pc))
+
+#ifdef FLUX_JIT
+
+typedef int (*JitFunction)(Value *locals, size_t base_bytes, const void *start);
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} JitBuffer;
+
+typedef struct {
+    size_t at;     // offset of the rel32 to patch
+    int target;    // code[] index, or -1 for a stub
+    int stub;      // index into the stub list
+} JitFixup;
+
+typedef struct {
+    const void *helper;  // noreturn error reporter, called with the instance and arg
+    const void *arg;
+} JitStub;
+
+// An instance's compiler state and compiled code
+typedef struct Jit {
+    FluxVM *vm;
+    JitBuffer buf;
+    JitFixup *fixups;
+    int fixup_count;
+    int fixup_cap;
+    JitStub *stubs;
+    int stub_count;
+    int stub_cap;
+    const void **entry; // code[] index -> native address, NULL if not compiled
+} Jit;
+
+FLUX_INTERNAL void jit_byte(Jit *j, int b) {
+    if (j->buf.len == j->buf.cap) {
+        j->buf.cap = j->buf.cap ? j->buf.cap * 2 : 4096;
+        j->buf.data = realloc(j->buf.data, j->buf.cap);
+        if (!j->buf.data) out_of_memory();
+    }
+    j->buf.data[j->buf.len++] = (unsigned char)b;
+}
+
+FLUX_INTERNAL void jit_bytes(Jit *j, const char *bytes, int n) {
+    for (int i = 0; i < n; i++) jit_byte(j, (unsigned char)bytes[i]);
+}
+
+FLUX_INTERNAL void jit_u32(Jit *j, uint32_t x) {
+    for (int i = 0; i < 4; i++) jit_byte(j, (x >> (8 * i)) & 0xFF);
+}
+
+FLUX_INTERNAL void jit_u64(Jit *j, uint64_t x) {
+    for (int i = 0; i < 8; i++) jit_byte(j, (x >> (8 * i)) & 0xFF);
+}
+
+// rel32 to a code[] index (target >= 0) or to an error stub
+FLUX_INTERNAL void jit_rel32(Jit *j, int target, int stub) {
+    j->fixups = grow_array(j->fixups, &j->fixup_cap, j->fixup_count + 1, sizeof(JitFixup));
+    j->fixups[j->fixup_count].at = j->buf.len;
+    j->fixups[j->fixup_count].target = target;
+    j->fixups[j->fixup_count].stub = stub;
+    j->fixup_count++;
+    jit_u32(j, 0);
+}
+
+FLUX_INTERNAL int jit_stub(Jit *j, const void *helper, const void *arg) {
+    j->stubs = grow_array(j->stubs, &j->stub_cap, j->stub_count + 1, sizeof(JitStub));
+    j->stubs[j->stub_count].helper = helper;
+    j->stubs[j->stub_count].arg = arg;
+    return j->stub_count++;
+}
+
+// Register numbers for the templates
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+
+// mov reg, imm64 (a shorter sign-extended imm32 when it fits)
+FLUX_INTERNAL void jit_mov_imm(Jit *j, int reg, long x) {
+    if (x >= INT32_MIN && x <= INT32_MAX) {
+        jit_byte(j, 0x48); jit_byte(j, 0xC7); jit_byte(j, 0xC0 | reg); jit_u32(j, (uint32_t)x);
+    } else {
+        jit_byte(j, 0x48); jit_byte(j, 0xB8 | reg); jit_u64(j, (uint64_t)x);
+    }
+}
+
+// mov reg, [rbx + disp] (64-bit) and mov reg32, [rbx + disp]
+FLUX_INTERNAL void jit_load_local(Jit *j, int reg, int32_t disp, int wide) {
+    if (wide) jit_byte(j, 0x48);
+    jit_byte(j, 0x8B); jit_byte(j, 0x83 | (reg << 3)); jit_u32(j, (uint32_t)disp);
+}
+
+// Helper call: mov rax, imm64; call rax
+FLUX_INTERNAL void jit_call_helper(Jit *j, const void *fn) {
+    jit_byte(j, 0x48); jit_byte(j, 0xB8); jit_u64(j, (uint64_t)(uintptr_t)fn);
+    jit_byte(j, 0xFF); jit_byte(j, 0xD0);
+}
+
+// mov rdi, vm: the first argument of every helper
+FLUX_INTERNAL void jit_vm_arg(Jit *j) {
+    jit_byte(j, 0x48); jit_byte(j, 0xBF); jit_u64(j, (uint64_t)(uintptr_t)j->vm);
+}
+
+// locals may have moved: rbx = vm->value_stack + r12
+FLUX_INTERNAL void jit_reload_locals(Jit *j) {
+    jit_byte(j, 0x48); jit_byte(j, 0xB8); jit_u64(j, (uint64_t)(uintptr_t)&j->vm->value_stack);
+    jit_bytes(j, "\x48\x8B\x18", 3);     // mov rbx, [rax]
+    jit_bytes(j, "\x4C\x01\xE3", 3);     // add rbx, r12
+}
+
+FLUX_INTERNAL void jit_epilogue(Jit *j) {
+    jit_bytes(j, "\x41\x5D\x41\x5C\x5B\xC3", 6); // pop r13; pop r12; pop rbx; ret
+}
+
+FLUX_INTERNAL NORETURN void jit_operand_error(FluxVM *vm, const Operand *op) {
+    vm_error(vm, "VM Error: Undefined or non-numeric variable '%s'.\n", op->str);
+}
+
+FLUX_INTERNAL NORETURN void jit_division_by_zero(FluxVM *vm, const void *unused) {
+    (void)unused;
+    vm_error(vm, "VM Error: Division by zero.\n");
+}
+
+// get_long_value(op) into reg (rax or rcx)
+FLUX_INTERNAL void jit_load_long(Jit *j, int reg, const Operand *op) {
+    if (op->kind != OPERAND_SLOT) {
+        jit_mov_imm(j, reg, op->value);
+        return;
+    }
+    int32_t disp = op->slot * (int32_t)sizeof(Value);
+    // The tag must be VAL_INT or VAL_BOOL: (tag - 1) <= 1 unsigned
+    jit_load_local(j, RDX, disp + (int32_t)offsetof(Value, tag), 0);
+    jit_bytes(j, "\x83\xEA\x01\x83\xFA\x01", 6);   // sub edx, 1; cmp edx, 1
+    jit_bytes(j, "\x0F\x87", 2);                   // ja stub
+    jit_rel32(j, -1, jit_stub(j, (const void *)jit_operand_error, op));
+    jit_load_local(j, reg, disp + (int32_t)offsetof(Value, as), 1);
+}
+
+// value_set_long(&locals[slot], tag, rax)
+FLUX_INTERNAL void jit_store_long(Jit *j, int slot, ValueTag tag) {
+    int32_t disp = slot * (int32_t)sizeof(Value);
+    // A string or array being overwritten gives up its reference
+    jit_bytes(j, "\x83\xBB", 2); jit_u32(j, (uint32_t)disp); jit_byte(j, VAL_STRING); // cmp dword [rbx+disp], VAL_STRING
+    size_t skip = j->buf.len + 1;
+    jit_bytes(j, "\x72\x00", 2);                   // jb skip
+    jit_bytes(j, "\x49\x89\xC5", 3);               // mov r13, rax
+    jit_bytes(j, "\x48\x8D\xBB", 3); jit_u32(j, (uint32_t)disp); // lea rdi, [rbx+disp]
+    jit_call_helper(j, (const void *)value_unref);
+    jit_bytes(j, "\x4C\x89\xE8", 3);               // mov rax, r13
+    j->buf.data[skip] = (unsigned char)(j->buf.len - skip - 1);
+    jit_bytes(j, "\xC7\x83", 2); jit_u32(j, (uint32_t)disp); jit_u32(j, (uint32_t)tag);  // mov dword [rbx+disp], tag
+    jit_bytes(j, "\x48\x89\x83", 3); jit_u32(j, (uint32_t)(disp + offsetof(Value, as))); // mov [rbx+disp+8], rax
+}
+
+FLUX_INTERNAL void jit_store(FluxVM *vm, Value *locals, const Instruction *instr) {
+    load_operand(vm, &locals[instr->dest_slot], instr->type, locals, &instr->a);
+}
+
+FLUX_INTERNAL void jit_output(FluxVM *vm, Value *locals, const Instruction *instr) {
+    output_operand(vm, instr->opcode == 0x03 ? &vm->out_stdout : &vm->out_stderr, locals, &instr->a);
+}
+
+FLUX_INTERNAL int jit_return(FluxVM *vm, const Instruction *instr) {
+    return return_value(vm, &instr->a);
+}
+
+FLUX_INTERNAL int jit_end(FluxVM *vm, const Instruction *instr) {
+    (void)instr;
+    return end_frame(vm);
+}
+
+FLUX_INTERNAL void jit_call(FluxVM *vm, const Instruction *instr);
+
+// Emits the template for one instruction. Returns 0 if there is none.
+FLUX_INTERNAL int jit_instr(Jit *j, const Instruction *instr) {
+    static const unsigned char setcc[] = { 0x9F, 0x9C, 0x94, 0x95 }; // gt lt eq ne
+    switch (instr->opcode) {
+        case 0x01: // entry
+            return 1;
+        case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D: case 0x0E:
+            jit_load_long(j, RAX, &instr->a);
+            jit_load_long(j, RCX, &instr->b);
+            switch (instr->opcode) {
+                case 0x09: jit_bytes(j, "\x48\x01\xC8", 3); break;           // add rax, rcx
+                case 0x0A: jit_bytes(j, "\x48\x29\xC8", 3); break;           // sub rax, rcx
+                case 0x0B: jit_bytes(j, "\x48\x0F\xAF\xC1", 4); break;       // imul rax, rcx
+                case 0x0C: case 0x0D:
+                    // Like the interpreter: a divisor of -1 negates (wrapping),
+                    // where idiv would trap on LONG_MIN
+                    jit_bytes(j, "\x48\x85\xC9\x0F\x84", 5);                 // test rcx, rcx; jz stub
+                    jit_rel32(j, -1, jit_stub(j, (const void *)jit_division_by_zero, NULL));
+                    jit_bytes(j, "\x48\x83\xF9\xFF\x75\x05", 6);            // cmp rcx, -1; jne idiv
+                    if (instr->opcode == 0x0C) jit_bytes(j, "\x48\xF7\xD8", 3); // neg rax
+                    else jit_bytes(j, "\x48\x31\xC0", 3);                     // xor rax, rax
+                    jit_bytes(j, "\xEB", 1);                                    // jmp done
+                    jit_byte(j, instr->opcode == 0x0C ? 5 : 8);
+                    jit_bytes(j, "\x48\x99\x48\xF7\xF9", 5);                 // idiv: cqo; idiv rcx
+                    if (instr->opcode == 0x0D) jit_bytes(j, "\x48\x89\xD0", 3); // mov rax, rdx
+                    break;                                                      // done:
+                case 0x0E:
+                    jit_bytes(j, "\x48\x89\xC6\x48\x89\xCA", 6);             // mov rsi, rax; mov rdx, rcx
+                    jit_vm_arg(j);
+                    jit_call_helper(j, (const void *)int_pow);
+                    break;
+            }
+            jit_store_long(j, instr->dest_slot, VAL_INT);
+            return 1;
+        case 0x0F: case 0x10: case 0x11: case 0x12:
+            jit_load_long(j, RAX, &instr->a);
+            jit_load_long(j, RCX, &instr->b);
+            jit_bytes(j, "\x48\x39\xC8\x0F", 4);                             // cmp rax, rcx
+            jit_byte(j, setcc[instr->opcode - 0x0F]); jit_byte(j, 0xC0);        // setcc al
+            jit_bytes(j, "\x0F\xB6\xC0", 3);                                 // movzx eax, al
+            jit_store_long(j, instr->dest_slot, VAL_BOOL);
+            return 1;
+        case 0x13: case 0x16:
+            jit_load_long(j, RAX, &instr->a);
+            jit_bytes(j, "\x48\x85\xC0\x0F", 4);                             // test rax, rax
+            jit_byte(j, instr->opcode == 0x13 ? 0x84 : 0x85);                // jz / jnz
+            jit_rel32(j, instr->target, -1);
+            return 1;
+        case 0x14:
+            jit_byte(j, 0xE9);                                               // jmp
+            jit_rel32(j, instr->target, -1);
+            return 1;
+        case 0x07:
+            if (instr->type == VAL_INT || instr->type == VAL_BOOL) {
+                jit_load_long(j, RAX, &instr->a);
+                jit_store_long(j, instr->dest_slot, instr->type);
+            } else {
+                jit_vm_arg(j);
+                jit_bytes(j, "\x48\x89\xDE", 3);                             // mov rsi, rbx
+                jit_mov_imm(j, RDX, (long)(uintptr_t)instr);
+                jit_call_helper(j, (const void *)jit_store);
+            }
+            return 1;
+        case 0x03: case 0x04:
+            jit_vm_arg(j);
+            jit_bytes(j, "\x48\x89\xDE", 3);                                 // mov rsi, rbx
+            jit_mov_imm(j, RDX, (long)(uintptr_t)instr);
+            jit_call_helper(j, (const void *)jit_output);
+            return 1;
+        case 0x17: case 0x18: case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D:
+        case 0x1E: case 0x1F: case 0x20: case 0x21: case 0x22: case 0x23: case 0x24:
+            jit_vm_arg(j);
+            jit_bytes(j, "\x48\x89\xDE", 3);                                 // mov rsi, rbx
+            jit_mov_imm(j, RDX, (long)(uintptr_t)instr);
+            jit_call_helper(j, (const void *)array_op);
+            return 1;
+        case 0x08:
+            jit_vm_arg(j);
+            jit_mov_imm(j, RSI, (long)(uintptr_t)instr);
+            jit_call_helper(j, (const void *)jit_call);
+            jit_reload_locals(j);
+            return 1;
+        case 0x06: case 0x02:
+            jit_vm_arg(j);
+            jit_mov_imm(j, RSI, (long)(uintptr_t)instr);
+            jit_call_helper(j, instr->opcode == 0x06 ? (const void *)jit_return : (const void *)jit_end);
+            jit_epilogue(j);
+            return 1;
+    }
+    return 0;
+}
+
+// Compiles the program's function func for vm. Returns 1 on success.
+FLUX_INTERNAL int jit_compile(FluxVM *vm, int func) {
+    const FluxProgram *prog = vm->program;
+    JitFunctionState *f = &vm->jit_funcs[func];
+    int first = prog->function_map[func].code_index;
+    int last = func + 1 < prog->function_count ? prog->function_map[func + 1].code_index : prog->code_count;
+    if (first < 0 || last < first) { f->failed = 1; return 0; }
+
+    Jit *j = vm->jit;
+    if (!j) {
+        j = vm->jit = calloc(1, sizeof(Jit));
+        if (!j) out_of_memory();
+        j->vm = vm;
+        j->entry = calloc((size_t)prog->code_count + 1, sizeof(void *));
+        if (!j->entry) out_of_memory();
+    }
+    size_t *offset = malloc(((size_t)(last - first) + 1) * sizeof(size_t));
+    if (!offset) out_of_memory();
+    j->buf.len = 0;
+    j->fixup_count = 0;
+    j->stub_count = 0;
+
+    // Prologue: push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi; jmp rdx
+    jit_bytes(j, "\x53\x41\x54\x41\x55\x48\x89\xFB\x49\x89\xF4\xFF\xE2", 13);
+    for (int pc = first; pc < last; pc++) {
+        const Instruction *instr = &prog->code[pc];
+        offset[pc - first] = j->buf.len;
+        int jumps = instr->opcode == 0x13 || instr->opcode == 0x14 || instr->opcode == 0x16;
+        if ((jumps && (instr->target < first || instr->target >= last)) || !jit_instr(j, instr)) {
+            free(offset);
+            f->failed = 1;
+            return 0;
+        }
+    }
+    // Running past the last instruction leaves native code at that pc
+    offset[last - first] = j->buf.len;
+    jit_mov_imm(j, RAX, last);
+    jit_epilogue(j);
+
+    size_t *stub_offset = malloc(((size_t)j->stub_count + 1) * sizeof(size_t));
+    if (!stub_offset) out_of_memory();
+    for (int s = 0; s < j->stub_count; s++) {
+        stub_offset[s] = j->buf.len;
+        jit_vm_arg(j);
+        jit_mov_imm(j, RSI, (long)(uintptr_t)j->stubs[s].arg);
+        jit_call_helper(j, j->stubs[s].helper);
+    }
+    for (int k = 0; k < j->fixup_count; k++) {
+        const JitFixup *fx = &j->fixups[k];
+        size_t to = fx->target >= 0 ? offset[fx->target - first] : stub_offset[fx->stub];
+        int32_t rel = (int32_t)((long)to - (long)(fx->at + 4));
+        memcpy(j->buf.data + fx->at, &rel, 4);
+    }
+    free(stub_offset);
+
+    // Written while writable, then switched to read + execute
+    size_t size = (j->buf.len + 4095) & ~(size_t)4095;
+    unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(offset);
+        f->failed = 1;
+        return 0;
+    }
+    memcpy(mem, j->buf.data, j->buf.len);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        free(offset);
+        f->failed = 1;
+        return 0;
+    }
+
+    for (int pc = first; pc < last; pc++) j->entry[pc] = mem + offset[pc - first];
+    f->code = mem;
+    f->code_size = size;
+    free(offset);
+    return 1;
+}
+
+// Counts a call or back edge into func; true once it has native code
+static inline int jit_hot(FluxVM *vm, int func) {
+    JitFunctionState *f = &vm->jit_funcs[func];
+    if (f->code) return vm->jit_depth < JIT_MAX_DEPTH;
+    if (f->failed || ++f->hotness < vm->jit_threshold) return 0;
+    return jit_compile(vm, func) && vm->jit_depth < JIT_MAX_DEPTH;
+}
+
+// Runs the native code of the innermost frame's function from pc
+FLUX_INTERNAL int jit_run(FluxVM *vm, int pc) {
+    const Frame *frame = &vm->frames[vm->frame_count - 1];
+    JitFunction fn = (JitFunction)vm->jit_funcs[frame->func].code;
+    sig_atomic_t native = vm->sample_native;
+    vm->sample_native = 1;
+    vm->jit_depth++;
+    int next = fn(vm->value_stack + frame->base, frame->base * sizeof(Value), vm->jit->entry[pc]);
+    vm->jit_depth--;
+    vm->sample_native = native;
+    return next;
+}
+
+// call from native code: the callee runs natively when it can, otherwise in a
+// nested interpreter run that ends when its frame returns
+FLUX_INTERNAL void jit_call(FluxVM *vm, const Instruction *instr) {
+    const CallSite *site = instr->call;
+    push_call(vm, site, JIT_RETURN_TO_NATIVE((int)(instr - vm->program->code) + 1));
+    int pc = site->entry_pc;
+    if (jit_hot(vm, site->func)) pc = jit_run(vm, pc);
+    if (pc >= 0) {
+        vm->sample_native = 0;
+        vm->loop(vm, pc);
+        vm->sample_native = 1;
+    }
+}
+
+FLUX_INTERNAL void jit_free(FluxVM *vm) {
+    Jit *j = vm->jit;
+    if (!j) return;
+    for (int i = 0; i < vm->program->function_count; i++) {
+        if (vm->jit_funcs[i].code) munmap(vm->jit_funcs[i].code, vm->jit_funcs[i].code_size);
+    }
+    free(j->buf.data);
+    free(j->fixups);
+    free(j->stubs);
+    free(j->entry);
+    free(j);
+    vm->jit = NULL;
+}
+
+#else
+
+static inline int jit_hot(FluxVM *vm, int func) {
+    (void)vm; (void)func;
+    return 0;
+}
+
+FLUX_INTERNAL int jit_run(FluxVM *vm, int pc) {
+    (void)vm;
+    return pc;
+}
+
+FLUX_INTERNAL void jit_free(FluxVM *vm) {
+    (void)vm;
+}
+
+#endif
+
+// --profile and --sample are fluxvm options; -DFLUXVM_LIBRARY leaves them out.
+#ifndef FLUXVM_LIBRARY
+
+// --- Profiler ---
+// --profile counts every instruction executed and times a sample of them.
+// The counting runs in a second copy of the interpreter loop (see
+// interpret.h), so a run without --profile executes exactly the code it
+// always did. The interpreter is what gets profiled: --profile turns the
+// JIT off.
+//
+// Counts are exact. Time is measured on about one instruction in
+// PROFILE_INTERVAL, chosen at random intervals so loops do not alias with
+// the sampling: the clock is read before the sampled instruction and again
+// at the next dispatch. An instruction's time is its execution count times
+// its mean sampled cost (the mean of its opcode when it was never sampled),
+// scaled so that all instructions together account for the wall time of
+// the run. Time is self time: a call instruction costs the call itself,
+// and the callee's instructions are charged to the callee.
+//
+// At exit a report sorted by time goes to stderr (after the program's own
+// output) and every counter is written as JSON to the --profile= file.
+
+#define PROFILE_INTERVAL 64
+#define PROFILE_TOP 20 // rows per table in the text report
+
+FLUX_INTERNAL int profile_enabled = 0;
+FLUX_INTERNAL const FluxProgram *profile_program = NULL; // the program being profiled
+FLUX_INTERNAL const char *profile_path = "fluxvm-profile.json";
+FLUX_INTERNAL unsigned long long *profile_counts = NULL; // executions per code[] index
+FLUX_INTERNAL unsigned long long *profile_ticks = NULL;  // sampled ticks per code[] index
+FLUX_INTERNAL unsigned long long *profile_samples = NULL;
+FLUX_INTERNAL unsigned long long profile_overhead = 0;   // cost of a sample itself, see profile_init()
+FLUX_INTERNAL unsigned long long profile_start_ticks = 0;
+FLUX_INTERNAL unsigned long long profile_start_ns = 0;
+FLUX_INTERNAL unsigned long long profile_sample_start = 0;
+FLUX_INTERNAL int profile_pending = -1;                  // code[] index being timed
+FLUX_INTERNAL unsigned profile_countdown = 1;
+FLUX_INTERNAL unsigned profile_rng = 2463534242u;
+
+static inline unsigned long long profile_ns(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+// Cheapest clock available: the time-stamp counter on x86, else nanoseconds
+static inline unsigned long long profile_clock(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    return profile_ns();
+#endif
+}
+
+// Called by op_profile when the countdown runs out: finishes the pending
+// measurement, or starts one on instruction pc
+FLUX_INTERNAL void profile_sample(int pc) {
+    unsigned long long now = profile_clock();
+    if (profile_pending >= 0) {
+        unsigned long long t = now - profile_sample_start;
+        profile_ticks[profile_pending] += t > profile_overhead ? t - profile_overhead : 0;
+        profile_samples[profile_pending]++;
+        profile_pending = -1;
+        profile_rng ^= profile_rng << 13;
+        profile_rng ^= profile_rng >> 17;
+        profile_rng ^= profile_rng << 5;
+        profile_countdown = 1 + profile_rng % (2 * PROFILE_INTERVAL);
+        return;
+    }
+    profile_pending = pc;
+    profile_countdown = 1;
+    profile_sample_start = profile_clock();
+}
+
+static inline void profile_step(int pc) {
+    profile_counts[pc]++;
+    if (--profile_countdown == 0) profile_sample(pc);
+}
+
+FLUX_INTERNAL void write_profile(void);
+
+// Sets up the counters once prog's code[] is final
+FLUX_INTERNAL void profile_init(const FluxProgram *prog) {
+    profile_program = prog;
+    size_t n = (size_t)prog->code_count + 1;
+    profile_counts = calloc(n, sizeof(unsigned long long));
+    profile_ticks = calloc(n, sizeof(unsigned long long));
+    profile_samples = calloc(n, sizeof(unsigned long long));
+    if (!profile_counts || !profile_ticks || !profile_samples) out_of_memory();
+    // Cost of a measurement of nothing, taken off every sample
+    unsigned long long overhead = ~0ull;
+    for (int i = 0; i < 1000; i++) {
+        unsigned long long before = profile_ticks[0];
+        profile_sample(0);
+        profile_sample(0);
+        if (profile_ticks[0] - before < overhead) overhead = profile_ticks[0] - before;
+    }
+    profile_overhead = overhead;
+    profile_ticks[0] = profile_samples[0] = 0;
+    profile_start_ns = profile_ns();
+    profile_start_ticks = profile_clock();
+    atexit(write_profile);
+}
+
+// Per-instruction estimates and the tables derived from them
+typedef struct {
+    const char *name;      // opcode, function or label name
+    const char *func;      // enclosing function (labels, call sites)
+    const char *callee;    // call sites
+    int pc;                // code[] index (labels, call sites)
+    unsigned long long count;
+    unsigned long long calls;
+    double ns;
+    int is_loop;
+} ProfileRow;
+
+FLUX_INTERNAL double profile_total_ns = 0;
+
+FLUX_INTERNAL int compare_profile_time(const void *a, const void *b) {
+    const ProfileRow *x = a, *y = b;
+    if (x->ns != y->ns) return x->ns < y->ns ? 1 : -1;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+FLUX_INTERNAL int compare_profile_count(const void *a, const void *b) {
+    const ProfileRow *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+FLUX_INTERNAL void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 32) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+FLUX_INTERNAL void report_rows(const char *title, const char *unit, ProfileRow *rows, int count, int by_time) {
+    qsort(rows, count, sizeof(ProfileRow), by_time ? compare_profile_time : compare_profile_count);
+    fprintf(stderr, "\n%s\n", title);
+    for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+        const ProfileRow *r = &rows[i];
+        if (!r->count) break;
+        double pct = profile_total_ns > 0 ? 100.0 * r->ns / profile_total_ns : 0;
+        fprintf(stderr, "  %-24s %14llu %s %10.3f ms %5.1f%%", r->name, r->count, unit, r->ns / 1e6, pct);
+        if (r->callee) fprintf(stderr, "  -> %s", r->callee);
+        if (r->func) fprintf(stderr, "  in %s", r->func);
+        if (r->callee) fprintf(stderr, " at %d", r->pc);
+        if (r->calls) fprintf(stderr, "  (%llu calls)", r->calls);
+        if (r->is_loop) fprintf(stderr, "  (loop)");
+        fputc('\n', stderr);
+    }
+}
+
+FLUX_INTERNAL void json_rows(FILE *f, const char *key, const ProfileRow *rows, int count, int with_calls) {
+    fprintf(f, ",\n  ");
+    json_string(f, key);
+    fprintf(f, ": [");
+    for (int i = 0; i < count; i++) {
+        const ProfileRow *r = &rows[i];
+        fprintf(f, "%s\n    {\"name\": ", i ? "," : "");
+        json_string(f, r->name);
+        if (r->func) {
+            fprintf(f, ", \"function\": ");
+            json_string(f, r->func);
+            fprintf(f, ", \"pc\": %d", r->pc);
+        }
+        if (r->callee) {
+            fprintf(f, ", \"callee\": ");
+            json_string(f, r->callee);
+        }
+        fprintf(f, ", \"count\": %llu", r->count);
+        if (with_calls) fprintf(f, ", \"calls\": %llu", r->calls);
+        if (r->func && !r->callee) fprintf(f, ", \"loop\": %s", r->is_loop ? "true" : "false");
+        fprintf(f, ", \"time_ns\": %.0f}", r->ns);
+    }
+    fprintf(f, "%s]", count ? "\n  " : "");
+}
+
+FLUX_INTERNAL void write_profile(void) {
+    const FluxProgram *prog = profile_program;
+    size_t n = (size_t)prog->code_count + 1;
+    unsigned long long wall_ns = profile_ns() - profile_start_ns;
+    unsigned long long wall_ticks = profile_clock() - profile_start_ticks;
+    double ns_per_tick = wall_ticks ? (double)wall_ns / (double)wall_ticks : 1.0;
+
+    // Mean sampled cost per opcode, for instructions that were never sampled
+    double op_ticks[256] = { 0 }, op_samples[256] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        int op = prog->code[i].opcode & 0xFF;
+        op_ticks[op] += (double)profile_ticks[i];
+        op_samples[op] += (double)profile_samples[i];
+    }
+    double *ns = malloc(n * sizeof(double));
+    int *func_of = malloc(n * sizeof(int));
+    if (!ns || !func_of) out_of_memory();
+    unsigned long long total_count = 0;
+    profile_total_ns = 0;
+    double estimated = 0;
+    for (size_t i = 0; i < n; i++) {
+        int op = prog->code[i].opcode & 0xFF;
+        double mean = profile_samples[i] ? (double)profile_ticks[i] / (double)profile_samples[i]
+                    : op_samples[op] ? op_ticks[op] / op_samples[op] : 0;
+        ns[i] = mean * ns_per_tick * (double)profile_counts[i];
+        total_count += profile_counts[i];
+        estimated += ns[i];
+        func_of[i] = -1;
+    }
+    // Samples give the shares; the run's wall time gives the total (the
+    // counting itself slows the run, and that cost is spread evenly)
+    for (size_t i = 0; i < n; i++) ns[i] = estimated > 0 ? ns[i] * (double)wall_ns / estimated : 0;
+    profile_total_ns = estimated > 0 ? (double)wall_ns : 0;
+    // Functions are laid out in load order, each up to the next entry
+    for (int f = 0; f < prog->function_count; f++) {
+        int end = f + 1 < prog->function_count ? prog->function_map[f + 1].code_index : (int)n;
+        for (int i = prog->function_map[f].code_index; i < end; i++) func_of[i] = f;
+    }
+
+    // Opcodes
+    ProfileRow op_rows[256];
+    int op_count = 0;
+    int op_row[256];
+    for (int op = 0; op < 256; op++) op_row[op] = -1;
+    for (size_t i = 0; i < n; i++) {
+        int op = prog->code[i].opcode & 0xFF;
+        if (op_row[op] < 0) {
+            op_row[op] = op_count;
+            memset(&op_rows[op_count], 0, sizeof(ProfileRow));
+            op_rows[op_count].name = fluxb_op_name(op);
+            op_rows[op_count].pc = -1;
+            op_count++;
+        }
+        op_rows[op_row[op]].count += profile_counts[i];
+        op_rows[op_row[op]].ns += ns[i];
+    }
+
+    // Functions: instructions executed, self time and calls
+    ProfileRow *func_rows = calloc(prog->function_count + 1, sizeof(ProfileRow));
+    // Labels (loop headers marked) and call sites
+    ProfileRow *label_rows = calloc(prog->instr_count + 1, sizeof(ProfileRow));
+    ProfileRow *call_rows = calloc(n, sizeof(ProfileRow));
+    if (!func_rows || !label_rows || !call_rows) out_of_memory();
+    for (int f = 0; f < prog->function_count; f++) {
+        func_rows[f].name = prog->function_map[f].name;
+        func_rows[f].pc = -1;
+    }
+    if (prog->main_func >= 0) func_rows[prog->main_func].calls = 1;
+    int call_count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (func_of[i] >= 0) {
+            func_rows[func_of[i]].count += profile_counts[i];
+            func_rows[func_of[i]].ns += ns[i];
+        }
+        const CallSite *site = prog->code[i].call;
+        if (!site) continue;
+        func_rows[site->func].calls += profile_counts[i];
+        ProfileRow *r = &call_rows[call_count++];
+        r->name = "call";
+        r->func = func_of[i] >= 0 ? prog->function_map[func_of[i]].name : "<toplevel>";
+        r->callee = site->callee;
+        r->pc = (int)i;
+        r->count = profile_counts[i];
+        r->ns = ns[i];
+    }
+
+    // A label is a loop header when a jump back to it closes a loop; its
+    // time then covers the body up to the last such jump
+    int *loop_end = malloc(n * sizeof(int));
+    double *ns_before = malloc((n + 1) * sizeof(double));
+    if (!loop_end || !ns_before) out_of_memory();
+    ns_before[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        loop_end[i] = -1;
+        ns_before[i + 1] = ns_before[i] + ns[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        int t = prog->code[i].target;
+        if (t >= 0 && t <= (int)i && func_of[t] == func_of[i] && (int)i > loop_end[t]) loop_end[t] = (int)i;
+    }
+    int label_rows_count = 0;
+    for (int i = 0, pc = 0; i < prog->instr_count; i++) {
+        if (prog->instructions[i].opcode != 0x15) {
+            pc++;
+            continue;
+        }
+        ProfileRow *r = &label_rows[label_rows_count++];
+        r->name = prog->instructions[i].dest;
+        r->func = func_of[pc] >= 0 ? prog->function_map[func_of[pc]].name : "<toplevel>";
+        r->pc = pc;
+        r->count = profile_counts[pc];
+        r->is_loop = loop_end[pc] >= 0;
+        r->ns = r->is_loop ? ns_before[loop_end[pc] + 1] - ns_before[pc] : ns[pc];
+    }
+
+    fprintf(stderr, "\n--- fluxvm profile: %llu instructions in %.3f ms ---", total_count, wall_ns / 1e6);
+    report_rows("opcodes by time:", "execs", op_rows, op_count, 1);
+    report_rows("functions by self time:", "instrs", func_rows, prog->function_count, 1);
+    report_rows("labels by time (loops: whole body):", "execs", label_rows, label_rows_count, 1);
+    report_rows("call sites by count:", "calls", call_rows, call_count, 0);
+    fprintf(stderr, "\nfull profile written to %s\n", profile_path);
+
+    FILE *f = fopen(profile_path, "w");
+    if (!f) {
+        fprintf(stderr, "VM Error: Cannot write profile '%s'.\n", profile_path);
+    } else {
+        fprintf(f, "{\n  \"instructions\": %llu,\n  \"wall_ns\": %llu,\n  \"sample_interval\": %d",
+                total_count, wall_ns, PROFILE_INTERVAL);
+        json_rows(f, "opcodes", op_rows, op_count, 0);
+        json_rows(f, "functions", func_rows, prog->function_count, 1);
+        json_rows(f, "labels", label_rows, label_rows_count, 0);
+        json_rows(f, "call_sites", call_rows, call_count, 0);
+        fprintf(f, "\n}\n");
+        fclose(f);
+    }
+    free(ns);
+    free(func_of);
+    free(func_rows);
+    free(label_rows);
+    free(call_rows);
+    free(loop_end);
+    free(ns_before);
+}
+
+// --- Sampler ---
+// --sample records where a run spends its CPU time, cheaply enough to leave
+// on for long-running programs. A SIGPROF interval timer (setitimer with
+// ITIMER_PROF, --sample-rate times per second of CPU time) interrupts the
+// run. When the interpreter was running, the signal handler only points
+// every entry of its dispatch table at op_sample, so the next instruction
+// records the stack with the exact pc in hand and puts the real handlers
+// back (the switch build polls sample_pending instead). The loop doing
+// this is a third copy (see interpret.h), so runs without --sample are
+// unaffected. The JIT stays on; when native code was running, the handler
+// records the stack itself, and that code is attributed to its function only.
+//
+// A stack is read from frames[]: each caller's position is its call site and
+// the innermost one is the sampled pc. Positions are reported as the nearest
+// label before them in their function, as a frame of its own under the
+// function's. The handler cannot allocate, so identical stacks are counted
+// in a table set up by sample_init(). At exit every stack is written as a
+// "folded" line for flamegraph tools:
+//   main;L_while_1;run;L_BODY_0 412
+
+#define SAMPLE_DEFAULT_RATE 997    // Hz; off any round number the program might tick at
+#define SAMPLE_MAX_DEPTH 256       // innermost frames kept per sample
+#define SAMPLE_TABLE_SIZE 16384    // distinct stacks, power of two
+#define SAMPLE_POOL_SIZE (1 << 20) // ints of stack keys, two per frame
+
+typedef struct {
+    unsigned hash;
+    int key;   // offset into sample_pool, -1 if the slot is free
+    int len;   // ints
+    unsigned long long count;
+} SampleStack;
+
+FLUX_INTERNAL int sample_enabled = 0;
+FLUX_INTERNAL FluxVM *sample_vm = NULL;      // the instance being sampled
+FLUX_INTERNAL int sample_rate = SAMPLE_DEFAULT_RATE;
+FLUX_INTERNAL const char *sample_path = "fluxvm.folded";
+FLUX_INTERNAL int *sample_func_of = NULL;    // code[] index -> function_map index, -1 outside functions
+FLUX_INTERNAL int *sample_label_of = NULL;   // code[] index -> instructions[] index of its label, -1 if none
+FLUX_INTERNAL SampleStack *sample_table = NULL;
+FLUX_INTERNAL int *sample_pool = NULL;
+FLUX_INTERNAL int sample_pool_used = 0;
+FLUX_INTERNAL int sample_key[2 * SAMPLE_MAX_DEPTH + 2];
+FLUX_INTERNAL unsigned long long sample_count = 0;
+FLUX_INTERNAL unsigned long long sample_dropped = 0;
+
+// Dispatch table of interpret_sampled(): its handlers, or op_sample in every
+// entry while a sample is due
+FLUX_INTERNAL const void *volatile sample_dispatch[256];
+FLUX_INTERNAL const void *const *sample_handlers = NULL;
+FLUX_INTERNAL const void *sample_trap = NULL;
+FLUX_INTERNAL volatile sig_atomic_t sample_pending = 0; // the same request for the switch build
+
+// Counts the current call stack, with pc (or -1 for unknown) as the
+// position in the innermost frame
+FLUX_INTERNAL void sample_record(int pc) {
+    const FluxVM *vm = sample_vm;
+    const FluxProgram *prog = vm->program;
+    const Frame *frames = vm->frames;
+    int n = vm->frame_count;
+    if (vm->frames_moving || n <= 0) {
+        sample_dropped++;
+        return;
+    }
+    int first = n > SAMPLE_MAX_DEPTH ? n - SAMPLE_MAX_DEPTH : 0;
+    int len = 0;
+    if (first > 0) {
+        sample_key[len++] = -1; // written as [truncated]
+        sample_key[len++] = -1;
+    }
+    for (int i = first; i < n; i++) {
+        int func = frames[i].func;
+        // Native code may be halfway through pushing a frame
+        if (func < 0 || func >= prog->function_count) {
+            sample_dropped++;
+            return;
+        }
+        int at = i + 1 < n ? frames[i + 1].return_pc - 1 : pc;
+        sample_key[len++] = func;
+        sample_key[len++] = at >= 0 && at < prog->code_count && sample_func_of[at] == func ? sample_label_of[at] : -1;
+    }
+
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < len; i++) hash = (hash ^ (unsigned)sample_key[i]) * 16777619u;
+    for (unsigned i = hash;; i++) {
+        SampleStack *s = &sample_table[i & (SAMPLE_TABLE_SIZE - 1)];
+        if (s->key < 0) {
+            if (sample_pool_used + len > SAMPLE_POOL_SIZE || i - hash >= SAMPLE_TABLE_SIZE / 2) {
+                sample_dropped++; // table full
+                return;
+            }
+            memcpy(sample_pool + sample_pool_used, sample_key, len * sizeof(int));
+            s->hash = hash;
+            s->len = len;
+            s->count = 1;
+            s->key = sample_pool_used;
+            sample_pool_used += len;
+            return;
+        }
+        if (s->hash == hash && s->len == len && memcmp(sample_pool + s->key, sample_key, len * sizeof(int)) == 0) {
+            s->count++;
+            return;
+        }
+    }
+}
+
+// op_sample / the switch build's poll: the timer fired while interpreting
+FLUX_INTERNAL void sample_take(int pc) {
+    sample_pending = 0;
+    if (sample_handlers) {
+        for (int i = 0; i < 256; i++) sample_dispatch[i] = sample_handlers[i];
+    }
+    sample_record(pc);
+}
+
+FLUX_INTERNAL void sample_signal(int sig) {
+    (void)sig;
+    sample_count++;
+    if (sample_vm->sample_native) {
+        sample_record(-1);
+    } else {
+        // Recorded by the interpreter at its next instruction
+        if (sample_trap) {
+            for (int i = 0; i < 256; i++) sample_dispatch[i] = sample_trap;
+        }
+        sample_pending = 1;
+    }
+}
+
+FLUX_INTERNAL void write_samples(void);
+
+// Builds the pc tables and starts the timer for vm
+FLUX_INTERNAL void sample_init(FluxVM *vm) {
+#ifdef _WIN32
+    fprintf(stderr, "VM Warning: --sample is not available on this platform; running without it.\n");
+    sample_enabled = 0;
+#else
+    const FluxProgram *prog = vm->program;
+    sample_vm = vm;
+    size_t n = (size_t)prog->code_count + 1;
+    sample_func_of = malloc(n * sizeof(int));
+    sample_label_of = malloc(n * sizeof(int));
+    sample_table = malloc(SAMPLE_TABLE_SIZE * sizeof(SampleStack));
+    sample_pool = malloc(SAMPLE_POOL_SIZE * sizeof(int));
+    if (!sample_func_of || !sample_label_of || !sample_table || !sample_pool) out_of_memory();
+    for (int i = 0; i < SAMPLE_TABLE_SIZE; i++) sample_table[i].key = -1;
+    for (size_t i = 0; i < n; i++) sample_func_of[i] = -1;
+    // Functions are laid out in load order, each up to the next entry
+    for (int f = 0; f < prog->function_count; f++) {
+        int end = f + 1 < prog->function_count ? prog->function_map[f + 1].code_index : prog->code_count;
+        for (int i = prog->function_map[f].code_index; i < end; i++) sample_func_of[i] = f;
+    }
+    int label = -1;
+    for (int i = 0, pc = 0; i < prog->instr_count; i++) {
+        if (prog->instructions[i].opcode == 0x15) {
+            label = i;
+            continue;
+        }
+        if (prog->instructions[i].opcode == 0x01) label = -1;
+        sample_label_of[pc++] = label;
+    }
+    sample_label_of[prog->code_count] = -1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = sample_signal;
+    sa.sa_flags = SA_RESTART; // reads and writes carry on across a sample
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = sample_rate == 1 ? 1 : 0;
+    timer.it_interval.tv_usec = sample_rate == 1 ? 0 : 1000000 / sample_rate;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        fprintf(stderr, "VM Warning: Cannot start the sampling timer; running without --sample.\n");
+        sample_enabled = 0;
+        return;
+    }
+    atexit(write_samples);
+#endif
+}
+
+// One frame of a folded line: the function, then the label of the position in it
+FLUX_INTERNAL void write_sample_frame(FILE *f, int func, int label) {
+    const FluxProgram *prog = sample_vm->program;
+    if (func < 0) {
+        fputs("[truncated]", f);
+        return;
+    }
+    fputs(prog->function_map[func].name, f);
+    if (label >= 0) fprintf(f, ";%s", prog->instructions[label].dest);
+}
+
+FLUX_INTERNAL void write_samples(void) {
+#ifndef _WIN32
+    struct itimerval off;
+    memset(&off, 0, sizeof off);
+    setitimer(ITIMER_PROF, &off, NULL);
+#endif
+    FILE *f = fopen(sample_path, "w");
+    if (!f) {
+        fprintf(stderr, "VM Error: Cannot write samples '%s'.\n", sample_path);
+        return;
+    }
+    for (int i = 0; i < SAMPLE_TABLE_SIZE; i++) {
+        const SampleStack *s = &sample_table[i];
+        if (s->key < 0) continue;
+        const int *key = sample_pool + s->key;
+        for (int j = 0; j < s->len; j += 2) {
+            if (j > 0) fputc(';', f);
+            write_sample_frame(f, key[j], key[j + 1]);
+        }
+        fprintf(f, " %llu\n", s->count);
+    }
+    fclose(f);
+    if (sample_dropped > 0) {
+        fprintf(stderr, "VM Warning: %llu of %llu samples dropped (call stack changing or too many distinct stacks).\n",
+                sample_dropped, sample_count);
+    }
+}
+#endif // FLUXVM_LIBRARY
+
+// --- Snapshots ---
+// A run with a snapshot requested stops at its first read of input and
+// writes the whole VM state to a file: every frame, every value on the value
+// stack (strings and arrays included), the pc of the read and the output printed so
+// far. A later run restored from the file starts right at that read, so
+// whatever the program does before it first looks at its input (building
+// tables, arrays, strings, counters) is paid for once, when the snapshot is taken.
+// Restoring costs a read of the file, whatever the prefix cost to run.
+// Arrays are written once however many variables refer to them, so a
+// restored run shares them the same way.
+//
+// The first read is the one point a snapshot can be taken without having to
+// trust the program: Flux has no clock, randomness or files, so everything
+// before it is the same in every run. The snapshot run itself carries on
+// past the read as usual. Its output up to the read is held back (and
+// recorded) until the snapshot is written: every write that would have
+// reached stdout or stderr, in order, plus what was still buffered at the
+// read. A restored run replays it the same way before going on, so the two
+// streams interleave as they do in a plain run.
+//
+// A snapshot only fits the program it was taken from: it records a hash of
+// the linked program (instructions, operands, frame layouts and literals)
+// and restoring into anything else is an error. The file is native-endian,
+// like the image cache, and meant to be made and used on one machine.
+
+#define SNAPSHOT_MAGIC "FLXS"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char magic[4];          // "FLXS"
+    uint32_t version;       // SNAPSHOT_VERSION
+    uint64_t program[2];    // program_fingerprint() of the program
+    uint64_t check[2];      // hash of everything after the header
+    uint64_t size;          // bytes in the file
+    int32_t pc;             // the read the run resumes at
+    int32_t frame_count;
+    uint64_t value_count;
+    uint64_t frames;        // offsets of the SnapshotFrame and SnapshotValue arrays
+    uint64_t values;
+    uint64_t writes;        // offset and count of the SnapshotWrite records of
+    uint64_t write_count;   // the output before the read
+    uint64_t output;        // offset and length of their bytes, one after another
+    uint64_t output_len;
+} SnapshotHeader;
+
+typedef struct {
+    int32_t func;
+    int32_t return_pc;
+    uint64_t base;
+} SnapshotFrame;
+
+typedef struct {
+    int32_t tag;            // ValueTag
+    int32_t unused;
+    int64_t value;          // VAL_INT / VAL_BOOL: the number; VAL_STRING / VAL_ARRAY:
+} SnapshotValue;            // offset of a SnapshotString / SnapshotArray
+
+typedef struct {
+    uint64_t len;
+    char data[];            // NUL-terminated
+} SnapshotString;
+
+typedef struct {
+    uint64_t len;
+    int64_t data[];
+} SnapshotArray;
+
+// Arrays already written (address to offset) or read back (offset to
+// address), by open addressing; 0 is never a key
+typedef struct {
+    uintptr_t *keys;
+    uintptr_t *values;
+    size_t count, cap;
+} RefMap;
+
+// The entry for key, added holding 0 if it is new
+FLUX_INTERNAL uintptr_t *ref_map_at(RefMap *map, uintptr_t key) {
+    if (2 * (map->count + 1) > map->cap) {
+        RefMap grown = { NULL, NULL, map->count, map->cap ? map->cap * 2 : 64 };
+        grown.keys = calloc(grown.cap, sizeof(uintptr_t));
+        grown.values = malloc(grown.cap * sizeof(uintptr_t));
+        if (!grown.keys || !grown.values) out_of_memory();
+        for (size_t i = 0; i < map->cap; i++) {
+            if (!map->keys[i]) continue;
+            size_t h = (map->keys[i] * 0x9E3779B97F4A7C15ull >> 16) & (grown.cap - 1);
+            while (grown.keys[h]) h = (h + 1) & (grown.cap - 1);
+            grown.keys[h] = map->keys[i];
+            grown.values[h] = map->values[i];
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+    size_t h = (key * 0x9E3779B97F4A7C15ull >> 16) & (map->cap - 1);
+    while (map->keys[h] && map->keys[h] != key) h = (h + 1) & (map->cap - 1);
+    if (!map->keys[h]) {
+        map->keys[h] = key;
+        map->values[h] = 0;
+        map->count++;
+    }
+    return &map->values[h];
+}
+
+FLUX_INTERNAL void ref_map_free(RefMap *map) {
+    free(map->keys);
+    free(map->values);
+}
+
+FLUX_INTERNAL void fingerprint_operand(uint64_t key[2], const Operand *op) {
+    int64_t fields[3] = { op->kind, op->slot, op->value };
+    hash_absorb(key, fields, sizeof fields);
+    if (op->kind == OPERAND_STRING) hash_absorb(key, op->sval->data, op->sval->len);
+}
+
+// A hash of everything in a linked program that the meaning of a snapshot's
+// frames and values depends on
+FLUX_INTERNAL void program_fingerprint(const FluxProgram *prog, uint64_t key[2]) {
+    key[0] = key[1] = 0;
+    int32_t counts[3] = { prog->code_count, prog->function_count, prog->main_func };
+    hash_absorb(key, counts, sizeof counts);
+    for (int f = 0; f < prog->function_count; f++) {
+        const FunctionMapEntry *func = &prog->function_map[f];
+        int32_t layout[4] = { func->code_index, func->param_count, func->local_count, func->ret_slot };
+        hash_absorb(key, layout, sizeof layout);
+    }
+    for (int pc = 0; pc <= prog->code_count; pc++) {
+        const Instruction *instr = &prog->code[pc];
+        int32_t fields[4] = { instr->opcode, instr->dest_slot, instr->target, instr->type };
+        hash_absorb(key, fields, sizeof fields);
+        fingerprint_operand(key, &instr->a);
+        fingerprint_operand(key, &instr->b);
+        if (instr->call) {
+            const CallSite *site = instr->call;
+            int32_t call[3] = { site->func, site->arg_count, site->entry_pc };
+            hash_absorb(key, call, sizeof call);
+            for (int i = 0; i < site->arg_count; i++) fingerprint_operand(key, &site->args[i]);
+        }
+    }
+}
+
+// At the start of a run with a snapshot requested: holds its output back
+FLUX_INTERNAL void snapshot_arm(FluxVM *vm) {
+    OutputBuffer *out[2] = { &vm->out_stdout, &vm->out_stderr };
+    for (int i = 0; i < 2; i++) {
+        output_flush(out[i]); // the output of earlier runs is not part of this one
+        vm->snapshot_start[i] = out[i]->len;
+        out[i]->hold = vm;
+    }
+    output_init(&vm->snapshot_output, -1, 0, 1);
+    vm->snapshot_output.len = 0;
+    vm->snapshot_write_count = 0;
+    vm->snapshot_armed = 1;
+}
+
+// The run wrote len bytes at p out of buf (see output_send())
+FLUX_INTERNAL void snapshot_hold(FluxVM *vm, const OutputBuffer *buf, const char *p, size_t len) {
+    int stream = buf == &vm->out_stderr ? FLUXVM_STDERR : FLUXVM_STDOUT;
+    size_t n = vm->snapshot_write_count;
+    if (n == 0 || vm->snapshot_writes[n - 1].stream != stream) {
+        if (n == vm->snapshot_write_cap) {
+            vm->snapshot_write_cap = n ? n * 2 : 64;
+            vm->snapshot_writes = realloc(vm->snapshot_writes, vm->snapshot_write_cap * sizeof(SnapshotWrite));
+            if (!vm->snapshot_writes) out_of_memory();
+        }
+        SnapshotWrite w = { stream, 1, 0 };
+        vm->snapshot_writes[vm->snapshot_write_count++] = w;
+    }
+    vm->snapshot_writes[vm->snapshot_write_count - 1].len += len;
+    output_write(&vm->snapshot_output, p, len);
+}
+
+// Lets the held back output go, in the order the run wrote it
+FLUX_INTERNAL void snapshot_disarm(FluxVM *vm) {
+    OutputBuffer *out[2] = { &vm->out_stdout, &vm->out_stderr };
+    out[0]->hold = out[1]->hold = NULL;
+    const char *p = vm->snapshot_output.data;
+    for (size_t i = 0; i < vm->snapshot_write_count; i++) {
+        const SnapshotWrite *w = &vm->snapshot_writes[i];
+        write_all(out[w->stream]->fd, p, (size_t)w->len);
+        p += w->len;
+    }
+    free(vm->snapshot_output.data);
+    vm->snapshot_output.data = NULL;
+    vm->snapshot_armed = 0;
+    vm->snapshot_path = NULL;
+}
+
+// The read at pc is about to run: writes the snapshot. Failing to write it
+// is reported but does not stop the run.
+FLUX_INTERNAL void snapshot_take(FluxVM *vm, int pc) {
+    const char *path = vm->snapshot_path;
+    ImageWriter w;
+    memset(&w, 0, sizeof w);
+    SnapshotHeader h;
+    memset(&h, 0, sizeof h);
+    image_reserve(&w, sizeof h);
+    memcpy(h.magic, SNAPSHOT_MAGIC, 4);
+    h.version = SNAPSHOT_VERSION;
+    program_fingerprint(vm->program, h.program);
+    h.pc = pc;
+    h.frame_count = vm->frame_count;
+    h.value_count = vm->value_stack_top;
+
+    h.frames = image_reserve(&w, (size_t)vm->frame_count * sizeof(SnapshotFrame));
+    for (int i = 0; i < vm->frame_count; i++) {
+        const Frame *frame = &vm->frames[i];
+        SnapshotFrame out;
+        out.func = frame->func;
+        // Native callers go on where they called from, interpreted
+        out.return_pc = frame->return_pc < -1 ? JIT_NATIVE_CALLER_PC(frame->return_pc) : frame->return_pc;
+        out.base = frame->base;
+        memcpy(w.data + h.frames + i * sizeof out, &out, sizeof out);
+    }
+    h.values = image_reserve(&w, vm->value_stack_top * sizeof(SnapshotValue));
+    RefMap written = { NULL, NULL, 0, 0 };
+    for (size_t i = 0; i < vm->value_stack_top; i++) {
+        const Value *v = &vm->value_stack[i];
+        SnapshotValue out;
+        memset(&out, 0, sizeof out);
+        out.tag = v->tag;
+        if (v->tag == VAL_STRING) {
+            size_t at = image_reserve(&w, sizeof(SnapshotString) + v->as.s->len + 1);
+            SnapshotString str = { v->as.s->len };
+            memcpy(w.data + at, &str, sizeof str);
+            memcpy(w.data + at + sizeof str, v->as.s->data, v->as.s->len + 1);
+            out.value = (int64_t)at;
+        } else if (v->tag == VAL_ARRAY) {
+            uintptr_t *at = ref_map_at(&written, (uintptr_t)v->as.arr);
+            if (!*at) {
+                *at = image_reserve(&w, sizeof(SnapshotArray) + v->as.arr->len * sizeof(int64_t));
+                SnapshotArray arr = { v->as.arr->len };
+                memcpy(w.data + *at, &arr, sizeof arr);
+                memcpy(w.data + *at + sizeof arr, v->as.arr->data, v->as.arr->len * sizeof(int64_t));
+            }
+            out.value = (int64_t)*at;
+        } else if (v->tag != VAL_NONE) {
+            out.value = v->as.i;
+        }
+        memcpy(w.data + h.values + i * sizeof out, &out, sizeof out);
+    }
+    ref_map_free(&written);
+    // What was written out, then what stdout and stderr still buffer
+    const OutputBuffer *outputs[2] = { &vm->out_stdout, &vm->out_stderr };
+    h.write_count = vm->snapshot_write_count + 2;
+    h.writes = image_reserve(&w, h.write_count * sizeof(SnapshotWrite));
+    if (vm->snapshot_write_count) memcpy(w.data + h.writes, vm->snapshot_writes, vm->snapshot_write_count * sizeof(SnapshotWrite));
+    h.output_len = vm->snapshot_output.len;
+    for (int i = 0; i < 2; i++) {
+        SnapshotWrite rest = { i, 0, outputs[i]->len - vm->snapshot_start[i] };
+        memcpy(w.data + h.writes + (vm->snapshot_write_count + i) * sizeof rest, &rest, sizeof rest);
+        h.output_len += rest.len;
+    }
+    h.output = image_reserve(&w, h.output_len);
+    memcpy(w.data + h.output, vm->snapshot_output.data, vm->snapshot_output.len);
+    size_t at = h.output + vm->snapshot_output.len;
+    for (int i = 0; i < 2; i++) {
+        size_t len = outputs[i]->len - vm->snapshot_start[i];
+        memcpy(w.data + at, outputs[i]->data + vm->snapshot_start[i], len);
+        at += len;
+    }
+    h.size = w.len;
+    hash_absorb(h.check, w.data + sizeof h, w.len - sizeof h);
+    memcpy(w.data, &h, sizeof h);
+    if (!write_file_atomic(path, w.data, w.len)) {
+        vm_message(vm, "VM Warning: Cannot write the snapshot '%s': %s.\n", path, strerror(errno));
+    }
+    free(w.data);
+    snapshot_disarm(vm);
+}
+
+// Reads a whole file into memory. Returns NULL if it cannot.
+FLUX_INTERNAL char *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    char *data = NULL;
+    size_t len = 0, cap = 0;
+    for (;;) {
+        if (len == cap) {
+            cap = cap ? cap * 2 : 64 * 1024;
+            char *grown = realloc(data, cap);
+            if (!grown) out_of_memory();
+            data = grown;
+        }
+        size_t n = fread(data + len, 1, cap - len, f);
+        len += n;
+        if (n == 0) break;
+    }
+    int ok = !ferror(f);
+    fclose(f);
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+    *size = len;
+    return data;
+}
+
+// Checks a snapshot's frames and values against the program before any of
+// it is used
+FLUX_INTERNAL int snapshot_valid(const FluxProgram *prog, const char *data, size_t size) {
+    const SnapshotHeader *h = (const SnapshotHeader *)data;
+    uint64_t program[2];
+    program_fingerprint(prog, program);
+    if (h->program[0] != program[0] || h->program[1] != program[1]) return 0;
+    if (h->pc < 0 || h->pc >= prog->code_count || prog->code[h->pc].opcode != 0x05) return 0;
+    if ((h->frames | h->values | h->writes) % 8) return 0;
+    if (h->frame_count < 1 || h->frames > size || (uint64_t)h->frame_count > (size - h->frames) / sizeof(SnapshotFrame)) return 0;
+    if (h->values > size || h->value_count > (size - h->values) / sizeof(SnapshotValue)) return 0;
+    if (h->writes > size || h->write_count > (size - h->writes) / sizeof(SnapshotWrite)) return 0;
+    if (h->output > size || h->output_len > size - h->output) return 0;
+    const SnapshotWrite *writes = (const SnapshotWrite *)(data + h->writes);
+    uint64_t output_len = 0;
+    for (uint64_t i = 0; i < h->write_count; i++) {
+        if (writes[i].stream < 0 || writes[i].stream > 1 || writes[i].written < 0 || writes[i].written > 1) return 0;
+        if (writes[i].len > h->output_len - output_len) return 0;
+        output_len += writes[i].len;
+    }
+    const SnapshotFrame *frames = (const SnapshotFrame *)(data + h->frames);
+    for (int i = 0; i < h->frame_count; i++) {
+        const SnapshotFrame *frame = &frames[i];
+        uint64_t end = i + 1 < h->frame_count ? frames[i + 1].base : h->value_count;
+        if (frame->func < 0 || frame->func >= prog->function_count) return 0;
+        if (frame->base > end || end - frame->base != (uint64_t)prog->function_map[frame->func].local_count) return 0;
+        if (i == 0 ? frame->base != 0 || frame->return_pc != -1
+                   : frame->return_pc < 0 || frame->return_pc > prog->code_count) return 0;
+    }
+    const SnapshotValue *values = (const SnapshotValue *)(data + h->values);
+    for (uint64_t i = 0; i < h->value_count; i++) {
+        if (values[i].tag < VAL_NONE || values[i].tag > VAL_ARRAY) return 0;
+        if (values[i].tag < VAL_STRING) continue;
+        uint64_t at = (uint64_t)values[i].value;
+        if (at % 8 || at > size || size - at < sizeof(uint64_t)) return 0;
+        uint64_t len = *(const uint64_t *)(data + at);
+        if (values[i].tag == VAL_STRING ? len >= size - at - sizeof(SnapshotString)
+                                        : len > (size - at - sizeof(SnapshotArray)) / sizeof(int64_t)) return 0;
+    }
+    return 1;
+}
+
+// Loads the snapshot at path into vm, whose next run resumes from it.
+// Returns 0 after reporting why it cannot.
+FLUX_INTERNAL int snapshot_restore(FluxVM *vm, const char *path) {
+    size_t size;
+    char *data = read_file(path, &size);
+    if (!data) {
+        vm_message(vm, "VM Error: Cannot read the snapshot '%s': %s.\n", path, strerror(errno));
+        return 0;
+    }
+    const SnapshotHeader *h = (const SnapshotHeader *)data;
+    uint64_t check[2] = { 0, 0 };
+    if (size >= sizeof *h) hash_absorb(check, data + sizeof *h, size - sizeof *h);
+    if (size < sizeof *h || memcmp(h->magic, SNAPSHOT_MAGIC, 4) != 0 || h->version != SNAPSHOT_VERSION ||
+        h->size != size || h->check[0] != check[0] || h->check[1] != check[1]) {
+        vm_message(vm, "VM Error: '%s' is not a snapshot fluxvm can use.\n", path);
+        free(data);
+        return 0;
+    }
+    if (!snapshot_valid(vm->program, data, size)) {
+        vm_message(vm, "VM Error: The snapshot '%s' was not taken from this program.\n", path);
+        free(data);
+        return 0;
+    }
+    if ((size_t)h->frame_count * sizeof(Frame) + h->value_count * sizeof(Value) > vm->stack_limit) {
+        vm_message(vm, "VM Error: The snapshot '%s' needs more than the stack limit of %zu bytes.\n", path, vm->stack_limit);
+        free(data);
+        return 0;
+    }
+
+    while (vm->frame_count > 0) pop_frame(vm);
+    if ((size_t)vm->frame_cap < (size_t)h->frame_count) {
+        free(vm->frames);
+        vm->frames = malloc((size_t)h->frame_count * sizeof(Frame));
+        if (!vm->frames) out_of_memory();
+        vm->frame_cap = h->frame_count;
+    }
+    if (vm->value_stack_cap < h->value_count) {
+        free(vm->value_stack);
+        vm->value_stack = malloc(h->value_count * sizeof(Value));
+        if (!vm->value_stack) out_of_memory();
+        vm->value_stack_cap = h->value_count;
+    }
+    const SnapshotFrame *frames = (const SnapshotFrame *)(data + h->frames);
+    for (int i = 0; i < h->frame_count; i++) {
+        vm->frames[i].func = frames[i].func;
+        vm->frames[i].return_pc = frames[i].return_pc;
+        vm->frames[i].base = (size_t)frames[i].base;
+    }
+    vm->frame_count = h->frame_count;
+    const SnapshotValue *values = (const SnapshotValue *)(data + h->values);
+    RefMap read = { NULL, NULL, 0, 0 };
+    for (uint64_t i = 0; i < h->value_count; i++) {
+        Value *v = &vm->value_stack[i];
+        v->tag = (ValueTag)values[i].tag;
+        if (v->tag == VAL_STRING) {
+            const SnapshotString *str = (const SnapshotString *)(data + values[i].value);
+            v->as.s = string_new(str->data, (size_t)str->len);
+        } else if (v->tag == VAL_ARRAY) {
+            uintptr_t *arr = ref_map_at(&read, (uintptr_t)values[i].value);
+            if (*arr) {
+                array_retain((FluxArray *)*arr);
+            } else {
+                const SnapshotArray *saved = (const SnapshotArray *)(data + values[i].value);
+                FluxArray *copy = malloc(sizeof(FluxArray) + (size_t)saved->len * sizeof(long));
+                if (!copy) out_of_memory();
+                copy->refcount = 1;
+                copy->len = (size_t)saved->len;
+                memcpy(copy->data, saved->data, copy->len * sizeof(long));
+                *arr = (uintptr_t)copy;
+            }
+            v->as.arr = (FluxArray *)*arr;
+        } else {
+            v->as.i = (long)values[i].value;
+        }
+    }
+    ref_map_free(&read);
+    vm->value_stack_top = (size_t)h->value_count;
+    OutputBuffer *out[2] = { &vm->out_stdout, &vm->out_stderr };
+    const SnapshotWrite *writes = (const SnapshotWrite *)(data + h->writes);
+    const char *p = data + h->output;
+    for (uint64_t i = 0; i < h->write_count; i++) {
+        output_write(out[writes[i].stream], p, (size_t)writes[i].len);
+        if (writes[i].written) output_flush(out[writes[i].stream]);
+        p += writes[i].len;
+    }
+    vm->resume_pc = h->pc;
+    free(data);
+    return 1;
+}
+
+
+// --- VM Execution ---
+// interpret() runs code[] with direct-threaded dispatch when the compiler
+// supports labels-as-values (GCC, Clang): each instruction carries the address
+// of its handler and every handler jumps straight to the next one, giving each
+// opcode its own indirect branch. Other compilers, or -DFLUX_NO_THREADED, use
+// the portable switch. The handler bodies are shared between both forms.
+
+#if defined(__GNUC__) && !defined(FLUX_NO_THREADED)
+#define FLUX_THREADED 1
+#endif
+
+// Quickening: under threaded dispatch the arithmetic and comparison opcodes
+// (add, sub, mul, gt, lt, eq, ne) get a handler specialized for the kinds
+// of their operands when the program is linked: slot and slot, slot and
+// literal, or literal and slot. The literal is read straight from the
+// instruction, and a slot only needs a guard that it holds an int or bool;
+// anything else runs the generic handler, which reports the error. A
+// comparison whose result the next instruction (jz or jnz) tests also does
+// the branch. The flag is still stored, so a jump to that jz or jnz, or the
+// JIT resuming there, finds it as usual. Operand kinds never change after
+// linking, so code[] stays shared and read-only during runs. Only the plain
+// interpret() is quickened; -DFLUX_NO_QUICKEN leaves it generic.
+#if defined(FLUX_THREADED) && !defined(FLUX_NO_QUICKEN)
+#define FLUX_QUICKEN 1
+
+// Operand shapes and following branches of a quickened instruction
+enum { QUICK_SS, QUICK_SI, QUICK_IS, QUICK_SHAPES };
+enum { QUICK_PLAIN, QUICK_JZ, QUICK_JNZ };
+
+// The form code[pc] is quickened to, shape + QUICK_SHAPES * branch, or -1
+// to keep the generic handler
+FLUX_INTERNAL int quick_form(const Instruction *code, int pc) {
+    const Instruction *instr = &code[pc];
+    int op = instr->opcode;
+    if (op != 0x09 && op != 0x0A && op != 0x0B && (op < 0x0F || op > 0x12)) return -1;
+    int shape;
+    if (instr->a.kind == OPERAND_SLOT && instr->b.kind == OPERAND_SLOT) shape = QUICK_SS;
+    else if (instr->a.kind == OPERAND_SLOT && instr->b.kind == OPERAND_INT) shape = QUICK_SI;
+    else if (instr->a.kind == OPERAND_INT && instr->b.kind == OPERAND_SLOT) shape = QUICK_IS;
+    else return -1;
+    // code[code_count] is the final end, so code[pc + 1] always exists
+    const Instruction *next = &code[pc + 1];
+    int branch = QUICK_PLAIN;
+    if (op >= 0x0F && (next->opcode == 0x13 || next->opcode == 0x16) &&
+        next->a.kind == OPERAND_SLOT && next->a.slot == instr->dest_slot) {
+        branch = next->opcode == 0x13 ? QUICK_JZ : QUICK_JNZ;
+    }
+    return shape + QUICK_SHAPES * branch;
+}
+#endif
+
+#ifdef FLUX_THREADED
+#define TARGET(code, name) op_##name:
+#define DISPATCH() do { instr = &code[pc]; goto *instr->handler; } while (0)
+#define PROFILED_DISPATCH() do { instr = &code[pc]; PROFILE_STEP(pc); goto *handlers[instr->opcode & 0xFF]; } while (0)
+#else
+#define TARGET(code, name) case code:
+#define DISPATCH() goto dispatch
+#endif
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+#define JUMP(to) do { pc = (to); DISPATCH(); } while (0)
+
+// A jmp or jnz going backwards: counts toward the function getting hot and,
+// once it has native code, continues the loop there
+#define JUMP_BACK(to) do { \
+        if (vm->jit_enabled && (to) <= pc && jit_hot(vm, vm->frames[vm->frame_count - 1].func)) { \
+            pc = jit_run(vm, to); \
+            if (pc < 0) return pc; \
+            locals = frame_locals(vm); \
+            DISPATCH(); \
+        } \
+        JUMP(to); \
+    } while (0)
+
+#define INTERPRET interpret
+#define INTERPRET_PROFILED 0
+#define INTERPRET_SAMPLED 0
+#define PROFILE_STEP(pc)
+#include "interpret.h"
+#undef INTERPRET
+#undef INTERPRET_PROFILED
+#undef INTERPRET_SAMPLED
+#undef PROFILE_STEP
+
+#ifndef FLUXVM_LIBRARY
+// The same loop for --profile
+#ifdef FLUX_THREADED
+#undef DISPATCH
+#define DISPATCH() PROFILED_DISPATCH()
+#endif
+#define INTERPRET interpret_profiled
+#define INTERPRET_PROFILED 1
+#define INTERPRET_SAMPLED 0
+#define PROFILE_STEP(pc) profile_step(pc)
+#include "interpret.h"
+#undef INTERPRET
+#undef INTERPRET_PROFILED
+#undef INTERPRET_SAMPLED
+#undef PROFILE_STEP
+
+// And for --sample, which can redirect the loop's dispatch to op_sample
+#ifdef FLUX_THREADED
+#undef DISPATCH
+#define DISPATCH() do { instr = &code[pc]; goto *sample_dispatch[instr->opcode & 0xFF]; } while (0)
+#endif
+#define INTERPRET interpret_sampled
+#define INTERPRET_PROFILED 1
+#define INTERPRET_SAMPLED 1
+#define PROFILE_STEP(pc) do { if (sample_pending) sample_take(pc); } while (0)
+#include "interpret.h"
+#endif // FLUXVM_LIBRARY
+
+// --- Embedding API ---
+// See fluxvm.h. fluxvm's own command line below is one user of it.
+
+FLUX_INTERNAL FluxProgram *program_new(void) {
+    FluxProgram *prog = calloc(1, sizeof(FluxProgram));
+    if (!prog) out_of_memory();
+    prog->main_code_entry = prog->main_entry_point = prog->main_func = -1;
+    prog->toplevel.name = "<toplevel>";
+    prog->toplevel.instr_index = prog->toplevel.code_index = -1;
+    prog->toplevel.params = "";
+    prog->toplevel.ret_slot = -1;
+    return prog;
+}
+
+// Loading and linking return 1 after printing the error, 0 otherwise
+FLUX_INTERNAL int program_load(FluxProgram *prog, const char *path) {
+    if (setjmp(prog->error)) return 1;
+    load_bytecode(prog, path);
+    return 0;
+}
+
+FLUX_INTERNAL int program_link(FluxProgram *prog) {
+    if (setjmp(prog->error)) return 1;
+    link_program(prog);
+    return 0;
+}
+
+FluxProgram *fluxvm_load(const char *path) {
+    FluxProgram *prog = program_new();
+    if (program_load(prog, path) || program_link(prog)) {
+        fluxvm_program_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+FLUX_INTERNAL void free_function_layout(FunctionMapEntry *func) {
+    free(func->local_names);
+    free(func->local_index.entries);
+}
+
+void fluxvm_program_free(FluxProgram *prog) {
+    if (!prog) return;
+    if (prog->cached) { // every table is inside the image
+        unmap_file(prog->image, prog->image_size);
+        free(prog);
+        return;
+    }
+    free(prog->instructions);
+    free(prog->code);
+    free(prog->label_map);
+    free(prog->label_index.entries);
+    for (int f = 0; f < prog->function_count; f++) free_function_layout(&prog->function_map[f]);
+    free_function_layout(&prog->toplevel);
+    free(prog->function_map);
+    free(prog->function_index.entries);
+    free(prog->literals);
+    free(prog->literal_index.entries);
+    while (prog->arena) {
+        ArenaBlock *prev = prog->arena->prev;
+        free(prog->arena);
+        prog->arena = prev;
+    }
+    if (prog->image) unmap_file(prog->image, prog->image_size);
+    free(prog);
+}
+
+FluxVM *fluxvm_new(const FluxProgram *prog) {
+    FluxVM *vm = calloc(1, sizeof(FluxVM));
+    if (!vm) out_of_memory();
+    vm->program = prog;
+    vm->stack_limit = DEFAULT_STACK_LIMIT;
+    vm->flush_policy = FLUXVM_FLUSH_EXIT;
+    output_init(&vm->out_stdout, -1, 0, 1);
+    output_init(&vm->out_stderr, -1, 0, 1);
+    input_use_memory(&vm->in_stdin, "", 0);
+    vm->loop = interpret;
+#ifdef FLUX_JIT
+    vm->jit_enabled = 1;
+#endif
+    vm->jit_threshold = JIT_DEFAULT_THRESHOLD;
+    vm->resume_pc = -1;
+    vm->kernels = array_kernels();
+    vm->jit_funcs = calloc((size_t)prog->function_count + 1, sizeof(JitFunctionState));
+    if (!vm->jit_funcs) out_of_memory();
+    return vm;
+}
+
+void fluxvm_free(FluxVM *vm) {
+    if (!vm) return;
+    while (vm->frame_count > 0) pop_frame(vm);
+    free(vm->frames);
+    free(vm->value_stack);
+    free(vm->out_stdout.data);
+    free(vm->out_stderr.data);
+    free(vm->snapshot_output.data);
+    free(vm->snapshot_writes);
+    input_release(&vm->in_stdin);
+    jit_free(vm);
+    free(vm->jit_funcs);
+    free(vm);
+}
+
+void fluxvm_set_input(FluxVM *vm, const char *data, size_t len) {
+    input_use_memory(&vm->in_stdin, data, len);
+}
+
+void fluxvm_set_input_fd(FluxVM *vm, int fd) {
+    input_use_fd(&vm->in_stdin, fd);
+}
+
+void fluxvm_set_output_fds(FluxVM *vm, int out_fd, int err_fd, FluxFlush flush) {
+    output_flush_all(vm);
+    vm->flush_policy = flush;
+    output_init(&vm->out_stdout, out_fd, flush == FLUXVM_FLUSH_LINE, flush == FLUXVM_FLUSH_EXIT);
+    output_init(&vm->out_stderr, err_fd, flush != FLUXVM_FLUSH_EXIT, flush == FLUXVM_FLUSH_EXIT);
+}
+
+void fluxvm_set_stack_limit(FluxVM *vm, size_t bytes) {
+    vm->stack_limit = bytes;
+}
+
+void fluxvm_set_jit(FluxVM *vm, int enabled, int threshold) {
+#ifdef FLUX_JIT
+    vm->jit_enabled = enabled != 0;
+#else
+    (void)enabled;
+#endif
+    if (threshold > 0) vm->jit_threshold = threshold;
+}
+
+// Runs main; returns 1 when a VM error ended it
+FLUX_INTERNAL int run_main(FluxVM *vm) {
+    const FluxProgram *prog = vm->program;
+    jmp_buf error;
+    vm->error = &error;
+    if (setjmp(error)) {
+        // Native code and nested interpreters were unwound with the error
+        vm->jit_depth = 0;
+        vm->sample_native = 0;
+        return 1;
+    }
+    if (vm->snapshot_path) snapshot_arm(vm);
+    if (vm->resume_pc >= 0) {
+        // The frames were restored from a snapshot
+        int pc = vm->resume_pc;
+        vm->resume_pc = -1;
+        vm->loop(vm, pc);
+        return 0;
+    }
+    if (prog->main_func < 0) {
+        vm_message(vm, "VM Error: Program does not contain an 'int main()' entry point.\n");
+        return 0;
+    }
+    // main runs in the outermost frame, starting after its 'entry'
+    push_frame(vm, prog->main_func, -1);
+    vm->loop(vm, prog->main_code_entry + 1);
+    return 0;
+}
+
+int fluxvm_run(FluxVM *vm) {
+    int status = run_main(vm);
+    if (vm->snapshot_armed) {
+        const char *path = vm->snapshot_path;
+        snapshot_disarm(vm);
+        vm_message(vm, "VM Warning: The program ended without reading input; no snapshot was written to '%s'.\n", path);
+    }
+    // Clean up allocated strings
+    while (vm->frame_count > 0) pop_frame(vm);
+    vm->error = NULL;
+    output_flush_all(vm);
+    return status;
+}
+
+void fluxvm_set_snapshot(FluxVM *vm, const char *path) {
+    vm->snapshot_path = path;
+}
+
+int fluxvm_restore(FluxVM *vm, const char *path) {
+    return snapshot_restore(vm, path) ? 0 : 1;
+}
+
+const char *fluxvm_output(const FluxVM *vm, int stream, size_t *len) {
+    const OutputBuffer *buf = stream == FLUXVM_STDERR ? &vm->out_stderr : &vm->out_stdout;
+    *len = buf->fd < 0 ? buf->len : 0;
+    return buf->data;
+}
+
+void fluxvm_clear_output(FluxVM *vm) {
+    if (vm->out_stdout.fd < 0) vm->out_stdout.len = 0;
+    if (vm->out_stderr.fd < 0) vm->out_stderr.len = 0;
+}
+
+// --- Command line ---
+// Everything from here on is fluxvm itself; -DFLUXVM_LIBRARY leaves it out.
+
+#ifndef FLUXVM_LIBRARY
+
+// Parses a byte count with an optional K/M/G suffix (e.g. "64M")
+size_t parse_size(const char *s) {
+    char *end;
+    double n = strtod(s, &end);
+    if (*end == 'K' || *end == 'k') n *= 1024.0, end++;
+    else if (*end == 'M' || *end == 'm') n *= 1024.0 * 1024.0, end++;
+    else if (*end == 'G' || *end == 'g') n *= 1024.0 * 1024.0 * 1024.0, end++;
+    if (end == s || *end != '\0' || n < 1) {
+        fprintf(stderr, "VM Error: Invalid size '%s'.\n", s);
+        exit(1);
+    }
+    return (size_t)n;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--disasm] [--stack-limit=SIZE] [--flush=line|block|exit]\n"
+                    "          [--jit|--no-jit] [--jit-threshold=N] [--profile[=FILE]] [--timings]\n"
+                    "          [--sample[=FILE]] [--sample-rate=HZ] [--snapshot=FILE] [--restore=FILE]\n"
+                    "          [--cache-dir=DIR] program.fluxb|program.flux\n"
+                    "       %s --serve=SOCKET [--workers=N] [--cache-dir=DIR] [run options]\n"
+                    "       %s --connect=SOCKET [run options] program.fluxb\n", prog, prog, prog);
+}
+
+// Peak resident set size in KB for --timings, 0 where it is not known.
+// Read from /proc rather than getrusage(), whose maxrss also counts the
+// memory of the process that forked us before the exec.
+long peak_rss_kb(void) {
+    long kb = 0;
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    if (!f) return 0;
+    while (fgets(line, sizeof line, f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kb = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+#endif
+    return kb;
+}
+
+// Run options, shared by the command line and --connect requests. Returns
+// 0 if arg is not one of them.
+size_t stack_limit = DEFAULT_STACK_LIMIT;
+FluxFlush flush_policy = FLUXVM_FLUSH_BLOCK;
+int flush_set = 0; // --flush= given; otherwise it depends on whether stdout is a terminal
+#ifdef FLUX_JIT
+int jit_enabled = 1;
+#else
+int jit_enabled = 0;
+#endif
+int jit_threshold = JIT_DEFAULT_THRESHOLD;
+int timings_enabled = 0;
+const char *snapshot_path = NULL; // --snapshot
+const char *restore_path = NULL;  // --restore
+
+int run_option(const char *arg) {
+    if (strncmp(arg, "--stack-limit=", 14) == 0) {
+        stack_limit = parse_size(arg + 14);
+    } else if (strcmp(arg, "--flush=line") == 0) {
+        flush_policy = FLUXVM_FLUSH_LINE;
+        flush_set = 1;
+    } else if (strcmp(arg, "--flush=block") == 0) {
+        flush_policy = FLUXVM_FLUSH_BLOCK;
+        flush_set = 1;
+    } else if (strcmp(arg, "--flush=exit") == 0) {
+        flush_policy = FLUXVM_FLUSH_EXIT;
+        flush_set = 1;
+    } else if (strcmp(arg, "--jit") == 0) {
+#ifdef FLUX_JIT
+        jit_enabled = 1;
+#else
+        fprintf(stderr, "VM Warning: The JIT is not available on this platform; interpreting.\n");
+#endif
+    } else if (strcmp(arg, "--no-jit") == 0) {
+        jit_enabled = 0;
+    } else if (strncmp(arg, "--jit-threshold=", 16) == 0) {
+        char *end;
+        long n = strtol(arg + 16, &end, 10);
+        if (end == arg + 16 || *end != '\0' || n < 1 || n > INT_MAX) {
+            fprintf(stderr, "VM Error: Invalid JIT threshold '%s'.\n", arg + 16);
+            exit(1);
+        }
+        jit_threshold = (int)n;
+    } else if (strcmp(arg, "--timings") == 0) {
+        timings_enabled = 1;
+    } else if (strcmp(arg, "--profile") == 0) {
+        profile_enabled = 1;
+    } else if (strncmp(arg, "--profile=", 10) == 0 && arg[10]) {
+        profile_enabled = 1;
+        profile_path = arg + 10;
+    } else if (strcmp(arg, "--sample") == 0) {
+        sample_enabled = 1;
+    } else if (strncmp(arg, "--sample=", 9) == 0 && arg[9]) {
+        sample_enabled = 1;
+        sample_path = arg + 9;
+    } else if (strncmp(arg, "--snapshot=", 11) == 0 && arg[11]) {
+        snapshot_path = arg + 11;
+    } else if (strncmp(arg, "--restore=", 10) == 0 && arg[10]) {
+        restore_path = arg + 10;
+    } else if (strncmp(arg, "--sample-rate=", 14) == 0) {
+        char *end;
+        long n = strtol(arg + 14, &end, 10);
+        if (end == arg + 14 || *end != '\0' || n < 1 || n > 100000) {
+            fprintf(stderr, "VM Error: Invalid sample rate '%s'.\n", arg + 14);
+            exit(1);
+        }
+        sample_rate = (int)n;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Runs prog on stdin, stdout and stderr with the run options in effect and
+// returns the exit status. load_ns and link_ns are only reported by --timings.
+int run_program(const FluxProgram *prog, unsigned long long load_ns, unsigned long long link_ns) {
+    if (profile_enabled && sample_enabled) {
+        fprintf(stderr, "VM Error: --profile and --sample cannot be used together.\n");
+        return 1;
+    }
+    unsigned long long t_start = profile_ns();
+    FluxVM *vm = fluxvm_new(prog);
+    fluxvm_set_output_fds(vm, 1, 2, flush_policy);
+    fluxvm_set_input_fd(vm, 0);
+    fluxvm_set_stack_limit(vm, stack_limit);
+    fluxvm_set_jit(vm, jit_enabled, jit_threshold);
+    fluxvm_set_snapshot(vm, snapshot_path);
+    if (restore_path && fluxvm_restore(vm, restore_path)) {
+        fluxvm_free(vm);
+        return 1;
+    }
+    if (profile_enabled) {
+        vm->loop = interpret_profiled;
+        vm->jit_enabled = 0; // the profile is of the interpreter
+        profile_init(prog);  // the report is written at exit, after the output
+    }
+    if (sample_enabled) {
+        vm->loop = interpret_sampled;
+        sample_init(vm);
+    }
+    int status = fluxvm_run(vm);
+
+    if (timings_enabled) {
+        // One line on stderr after the program's own output, for bench/run.py
+        unsigned long long t_done = profile_ns();
+        fprintf(stderr, "fluxvm timings: load %.3f ms, link %.3f ms, run %.3f ms, peak rss %ld KB\n",
+                load_ns / 1e6, link_ns / 1e6, (t_done - t_start) / 1e6, peak_rss_kb());
+    }
+    // The sampler may still look at the instance until the timer stops at exit
+    if (!sample_enabled) fluxvm_free(vm);
+    return status;
+}
+
+// --- Server ---
+// fluxvm --serve=SOCKET keeps programs loaded and runs them on request, and
+// fluxvm --connect=SOCKET [options] program.fluxb is the client: it behaves
+// like running the program locally, without paying for loading it.
+//
+// The server accepts requests on a Unix domain socket. A request is one
+// message (a 4-byte length, then the program's path and the run options,
+// each NUL-terminated) with the client's stdin, stdout and stderr attached
+// as SCM_RIGHTS. For each program, keyed by path, inode, size and mtime,
+// the server forks a zygote that loads and links it once. The zygote keeps
+// --workers=N idle workers forked off, sharing the loaded program
+// copy-on-write. A request goes to an idle worker, which takes over the
+// client's descriptors, runs the program once and exits; the zygote forks a
+// replacement, reaps the worker and sends its exit status (128 + signal if
+// it was killed) back to the client as a 4-byte int. A run therefore ends
+// exactly as it would locally, VM errors and all, and every run starts from
+// the same freshly linked state.
+//
+// A program whose file changed gets a new zygote; the old one lets its
+// running requests finish and exits. At most SERVE_MAX_PROGRAMS stay cached,
+// the least recently used going first.
+
+#define SERVE_DEFAULT_WORKERS 2
+#define SERVE_MAX_PROGRAMS 32
+#define SERVE_MAX_MESSAGE 65536
+#define SERVE_MAX_FDS 4
+
+int serve_workers = SERVE_DEFAULT_WORKERS;
+
+#ifndef _WIN32
+
+typedef struct {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    pid_t zygote;
+    int channel; // server's end of the zygote's socketpair
+    unsigned long long last_used;
+} ServedProgram;
+
+typedef struct {
+    pid_t pid;
+    int sock; // zygote's end of the worker's socketpair, -1 once it has a request
+    int conn; // client connection of its request, -1 while idle
+} ServeWorker;
+
+ServedProgram served[SERVE_MAX_PROGRAMS];
+int served_count = 0;
+unsigned long long serve_clock = 0;
+int serve_listener = -1;
+const char *serve_socket_path = NULL;
+FluxProgram *zygote_program = NULL; // a zygote's loaded program
+
+// Reads exactly n bytes; returns 0 at end of file or on error
+int read_full(int fd, void *p, size_t n) {
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        p = (char *)p + r;
+        n -= (size_t)r;
+    }
+    return 1;
+}
+
+// Sends a length-prefixed message with nfds descriptors attached
+int send_message(int sock, const char *data, uint32_t len, const int *fds, int nfds) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+    } control;
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    iov[0].iov_base = &len;
+    iov[0].iov_len = sizeof len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (nfds > 0) {
+        memset(&control, 0, sizeof control);
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    ssize_t n;
+    do n = sendmsg(sock, &msg, 0); while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+    // A stream socket may take only part; the descriptors went with it
+    size_t sent = (size_t)n, total = sizeof len + len;
+    while (sent < total) {
+        const char *p = sent < sizeof len ? (const char *)&len + sent : data + (sent - sizeof len);
+        size_t chunk = sent < sizeof len ? sizeof len - sent : total - sent;
+        ssize_t w = write(sock, p, chunk);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        sent += (size_t)w;
+    }
+    return 0;
+}
+
+// Receives a message into buf (NUL-terminated) and up to *nfds descriptors.
+// Returns its length, or -1 at end of file or on a malformed message.
+int recv_message(int sock, char *buf, uint32_t cap, int *fds, int *nfds) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+    } control;
+    uint32_t len;
+    struct iovec iov;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base = &len;
+    iov.iov_len = sizeof len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    ssize_t n;
+    do n = recvmsg(sock, &msg, 0); while (n < 0 && errno == EINTR);
+    int max_fds = *nfds;
+    *nfds = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof fd);
+            if (*nfds < max_fds) fds[(*nfds)++] = fd;
+            else close(fd);
+        }
+    }
+    if (n > 0 && (size_t)n < sizeof len && !read_full(sock, (char *)&len + n, sizeof len - (size_t)n)) n = 0;
+    if (n <= 0 || len >= cap || !read_full(sock, buf, len)) {
+        for (int i = 0; i < *nfds; i++) close(fds[i]);
+        *nfds = 0;
+        return -1;
+    }
+    buf[len] = '\0';
+    return (int)len;
+}
+
+void send_status(int conn, int status) {
+    int32_t s = status;
+    write_all(conn, (const char *)&s, sizeof s);
+}
+
+void close_fds(const int *fds, int n) {
+    for (int i = 0; i < n; i++) close(fds[i]);
+}
+
+// --- Server: worker ---
+
+// Runs one request in a freshly forked worker and exits
+void serve_worker(int sock) {
+    static char buf[SERVE_MAX_MESSAGE];
+    int fds[3], nfds = 3;
+    int len = recv_message(sock, buf, sizeof buf, fds, &nfds);
+    if (len < 0 || nfds != 3) _exit(0); // the zygote is retiring
+    close(sock);
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        if (fds[i] > 2) close(fds[i]);
+    }
+    if (!flush_set) flush_policy = isatty(1) ? FLUXVM_FLUSH_LINE : FLUXVM_FLUSH_BLOCK;
+    // buf holds the path, then the request's run options
+    for (const char *opt = buf + strlen(buf) + 1; opt < buf + len; opt += strlen(opt) + 1) {
+        if (!run_option(opt)) {
+            fprintf(stderr, "VM Error: Option '%s' cannot be used with --connect.\n", opt);
+            exit(1);
+        }
+    }
+    exit(run_program(zygote_program, 0, 0));
+}
+
+// --- Server: zygote ---
+
+ServeWorker *zygote_workers = NULL;
+int zygote_worker_count = 0;
+int zygote_worker_cap = 0;
+int zygote_wakeup[2]; // SIGCHLD self-pipe
+
+void zygote_sigchld(int sig) {
+    (void)sig;
+    int saved = errno;
+    char c = 0;
+    if (write(zygote_wakeup[1], &c, 1) < 0) { /* already has a byte waiting */ }
+    errno = saved;
+}
+
+void zygote_spawn(int channel) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        close(channel);
+        close(zygote_wakeup[0]);
+        close(zygote_wakeup[1]);
+        for (int i = 0; i < zygote_worker_count; i++) {
+            if (zygote_workers[i].sock >= 0) close(zygote_workers[i].sock);
+            if (zygote_workers[i].conn >= 0) close(zygote_workers[i].conn);
+        }
+        close(sv[0]);
+        serve_worker(sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return;
+    }
+    zygote_workers = grow_array(zygote_workers, &zygote_worker_cap, zygote_worker_count + 1, sizeof(ServeWorker));
+    ServeWorker *w = &zygote_workers[zygote_worker_count++];
+    w->pid = pid;
+    w->sock = sv[0];
+    w->conn = -1;
+}
+
+int zygote_idle_count(void) {
+    int idle = 0;
+    for (int i = 0; i < zygote_worker_count; i++) idle += zygote_workers[i].sock >= 0;
+    return idle;
+}
+
+// Loads and links path, then hands requests from channel to workers forked
+// from the result. Load errors go to err_fd, the first client's stderr.
+void zygote(const char *path, int channel, int err_fd) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    int saved_err = dup(2);
+    dup2(err_fd, 2);
+    close(err_fd);
+    zygote_program = program_new();
+    if (program_load(zygote_program, path) || program_link(zygote_program)) exit(1);
+    dup2(saved_err, 2);
+    close(saved_err);
+
+    if (pipe(zygote_wakeup) != 0) exit(1);
+    fcntl(zygote_wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(zygote_wakeup[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = zygote_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    char ready = 1;
+    write_all(channel, &ready, 1);
+    static char buf[SERVE_MAX_MESSAGE];
+    for (;;) {
+        while (channel >= 0 && zygote_idle_count() < serve_workers) {
+            int before = zygote_worker_count;
+            zygote_spawn(channel);
+            if (zygote_worker_count == before) break; // out of processes; try again later
+        }
+        if (channel < 0 && zygote_worker_count == 0) exit(0);
+
+        struct pollfd pfd[2] = { { zygote_wakeup[0], POLLIN, 0 }, { channel, POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) exit(1);
+
+        if (pfd[0].revents) {
+            char drain[64];
+            while (read(zygote_wakeup[0], drain, sizeof drain) > 0) {}
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < zygote_worker_count; i++) {
+                    ServeWorker *w = &zygote_workers[i];
+                    if (w->pid != pid) continue;
+                    if (w->conn >= 0) {
+                        send_status(w->conn, WIFEXITED(status) ? WEXITSTATUS(status)
+                                             : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1);
+                        close(w->conn);
+                    }
+                    if (w->sock >= 0) close(w->sock);
+                    *w = zygote_workers[--zygote_worker_count];
+                    break;
+                }
+            }
+        }
+
+        if (pfd[1].revents) {
+            int fds[4], nfds = 4;
+            int len = recv_message(channel, buf, sizeof buf, fds, &nfds);
+            if (len < 0) {
+                // The server dropped this program: idle workers see end of
+                // file and exit, busy ones finish their request
+                close(channel);
+                channel = -1;
+                for (int i = 0; i < zygote_worker_count; i++) {
+                    if (zygote_workers[i].sock >= 0) {
+                        close(zygote_workers[i].sock);
+                        zygote_workers[i].sock = -1;
+                    }
+                }
+                continue;
+            }
+            if (nfds != 4) {
+                close_fds(fds, nfds);
+                continue;
+            }
+            if (zygote_idle_count() == 0) zygote_spawn(channel);
+            ServeWorker *w = NULL;
+            for (int i = 0; i < zygote_worker_count && !w; i++) {
+                if (zygote_workers[i].sock >= 0) w = &zygote_workers[i];
+            }
+            if (!w || send_message(w->sock, buf, (uint32_t)len, fds + 1, 3) != 0) {
+                send_status(fds[0], 1);
+                close_fds(fds, 4);
+                continue;
+            }
+            close(w->sock);
+            w->sock = -1;
+            w->conn = fds[0];
+            close_fds(fds + 1, 3);
+        }
+    }
+}
+
+// --- Server: main process ---
+
+void serve_drop(int i) {
+    close(served[i].channel);
+    free(served[i].path);
+    served[i] = served[--served_count];
+}
+
+// Returns the cached program for path, starting a zygote for it if there is
+// none or the file changed. NULL if it does not load.
+ServedProgram *serve_program(const char *path, const int *client_fds) {
+    struct stat st;
+    if (stat(path, &st) != 0) memset(&st, 0, sizeof st); // the zygote reports the error
+    for (int i = 0; i < served_count; i++) {
+        ServedProgram *p = &served[i];
+        if (strcmp(p->path, path) != 0) continue;
+        if (p->dev == st.st_dev && p->ino == st.st_ino && p->size == st.st_size && p->mtime == st.st_mtime) {
+            p->last_used = ++serve_clock;
+            return p;
+        }
+        serve_drop(i);
+        break;
+    }
+    if (served_count == SERVE_MAX_PROGRAMS) {
+        int lru = 0;
+        for (int i = 1; i < served_count; i++) {
+            if (served[i].last_used < served[lru].last_used) lru = i;
+        }
+        serve_drop(lru);
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return NULL;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(serve_listener);
+        for (int i = 0; i < served_count; i++) close(served[i].channel);
+        close(client_fds[0]);
+        close(client_fds[1]);
+        close(client_fds[3]);
+        close(sv[0]);
+        zygote(path, sv[1], client_fds[2]);
+    }
+    close(sv[1]);
+    char ready;
+    if (pid < 0 || !read_full(sv[0], &ready, 1)) {
+        // Failed to load; its error went to the client
+        close(sv[0]);
+        if (pid > 0) waitpid(pid, NULL, 0);
+        return NULL;
+    }
+    ServedProgram *p = &served[served_count++];
+    p->path = strdup(path);
+    if (!p->path) out_of_memory();
+    p->dev = st.st_dev;
+    p->ino = st.st_ino;
+    p->size = st.st_size;
+    p->mtime = st.st_mtime;
+    p->zygote = pid;
+    p->channel = sv[0];
+    p->last_used = ++serve_clock;
+    return p;
+}
+
+void serve_request(int conn) {
+    static char buf[SERVE_MAX_MESSAGE];
+    int fds[4], nfds = 3;
+    int len = recv_message(conn, buf, sizeof buf, fds, &nfds);
+    if (len < 0 || nfds != 3 || buf[0] == '\0') {
+        close_fds(fds, nfds);
+        return;
+    }
+    // fds[3] is the connection itself, handed on with the client's three
+    fds[3] = conn;
+    int job[4] = { conn, fds[0], fds[1], fds[2] };
+    for (int attempt = 0; attempt < 2; attempt++) {
+        ServedProgram *p = serve_program(buf, fds);
+        if (!p) {
+            send_status(conn, 1);
+            break;
+        }
+        if (send_message(p->channel, buf, (uint32_t)len, job, 4) == 0) break;
+        // The zygote died: start over with a new one
+        serve_drop((int)(p - served));
+        if (attempt == 1) send_status(conn, 1);
+    }
+    close_fds(fds, 3);
+}
+
+void serve_stop(int sig) {
+    if (serve_socket_path) unlink(serve_socket_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int serve(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "VM Error: Socket path '%s' is too long.\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    serve_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (serve_listener < 0 || bind(serve_listener, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+        listen(serve_listener, 128) != 0) {
+        fprintf(stderr, "VM Error: Cannot listen on '%s': %s.\n", socket_path, strerror(errno));
+        return 1;
+    }
+    serve_socket_path = socket_path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+    fprintf(stderr, "fluxvm: serving on %s\n", socket_path);
+
+    for (;;) {
+        int conn = accept(serve_listener, NULL, NULL);
+        // Zygotes exit once dropped and idle; a crashed one is dropped here
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (int i = 0; i < served_count; i++) {
+                if (served[i].zygote == pid) {
+                    serve_drop(i);
+                    break;
+                }
+            }
+        }
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+            fprintf(stderr, "VM Error: accept failed: %s.\n", strerror(errno));
+            return 1;
+        }
+        // A client that connects and sends nothing must not hold up the rest
+        struct timeval timeout = { 1, 0 };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        serve_request(conn);
+        close(conn);
+    }
+}
+
+// --connect: sends the request and exits with the program's status
+int serve_connect(const char *socket_path, const char *program, char **args, int arg_count) {
+    static char buf[SERVE_MAX_MESSAGE];
+    char path[PATH_MAX];
+    // The server has its own working directory
+    if (!realpath(program, path)) {
+        if (strlen(program) >= sizeof path) {
+            fprintf(stderr, "VM Error: Path '%s' is too long.\n", program);
+            return 1;
+        }
+        strcpy(path, program);
+    }
+    size_t len = strlen(path) + 1;
+    memcpy(buf, path, len);
+    for (int i = 0; i < arg_count; i++) {
+        if (strncmp(args[i], "--connect=", 10) == 0 || strncmp(args[i], "--workers=", 10) == 0) continue;
+        size_t n = strlen(args[i]) + 1;
+        if (len + n >= sizeof buf) {
+            fprintf(stderr, "VM Error: Too many options.\n");
+            return 1;
+        }
+        memcpy(buf + len, args[i], n);
+        len += n;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "VM Error: Socket path '%s' is too long.\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        fprintf(stderr, "VM Error: Cannot connect to '%s': %s.\n", socket_path, strerror(errno));
+        return 1;
+    }
+    int fds[3] = { 0, 1, 2 };
+    int32_t status;
+    if (send_message(sock, buf, (uint32_t)len, fds, 3) != 0 || !read_full(sock, &status, sizeof status)) {
+        fprintf(stderr, "VM Error: The server at '%s' did not run the program.\n", socket_path);
+        return 1;
+    }
+    return status;
+}
+
+#else
+
+int serve(const char *socket_path) {
+    (void)socket_path;
+    fprintf(stderr, "VM Error: --serve is not available on this platform.\n");
+    return 1;
+}
+
+int serve_connect(const char *socket_path, const char *program, char **args, int arg_count) {
+    (void)socket_path; (void)program; (void)args; (void)arg_count;
+    fprintf(stderr, "VM Error: --connect is not available on this platform.\n");
+    return 1;
+}
+
+#endif
+
+// Main VM execution logic
+int main(int argc, char **argv) {
+    int disasm = 0;
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    int argi = 1;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+        if (strcmp(argv[argi], "--disasm") == 0) {
+            disasm = 1;
+        } else if (strncmp(argv[argi], "--serve=", 8) == 0 && argv[argi][8]) {
+            serve_path = argv[argi] + 8;
+        } else if (strncmp(argv[argi], "--connect=", 10) == 0 && argv[argi][10]) {
+            connect_path = argv[argi] + 10;
+        } else if (strncmp(argv[argi], "--cache-dir=", 12) == 0 && argv[argi][12]) {
+            image_cache_dir = argv[argi] + 12;
+        } else if (strncmp(argv[argi], "--workers=", 10) == 0) {
+            char *end;
+            long n = strtol(argv[argi] + 10, &end, 10);
+            if (end == argv[argi] + 10 || *end != '\0' || n < 0 || n > 1000) {
+                fprintf(stderr, "VM Error: Invalid worker count '%s'.\n", argv[argi] + 10);
+                return 1;
+            }
+            serve_workers = (int)n;
+        } else if (!run_option(argv[argi])) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (serve_path) {
+        if (argi != argc || disasm || connect_path) {
+            usage(argv[0]);
+            return 1;
+        }
+        return serve(serve_path);
+    }
+    if (argi >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (connect_path) {
+        if (disasm) {
+            usage(argv[0]);
+            return 1;
+        }
+        // Run options go to the server as given; parsing them above has
+        // already rejected bad ones
+        return serve_connect(connect_path, argv[argi], argv + 1, argi - 1);
+    }
+    if (!flush_set) flush_policy = isatty(1) ? FLUXVM_FLUSH_LINE : FLUXVM_FLUSH_BLOCK;
+
+    unsigned long long t_start = profile_ns();
+    FluxProgram *prog = program_new();
+    if (program_load(prog, argv[argi])) return 1;
+    if (disasm) {
+        disassemble(prog, stdout);
+        return 0;
+    }
+    unsigned long long t_loaded = profile_ns();
+    if (program_link(prog)) return 1;
+    unsigned long long t_linked = profile_ns();
+    return run_program(prog, t_loaded - t_start, t_linked - t_loaded);
+}
+
+#endif // FLUXVM_LIBRARY